@@ -35,13 +35,17 @@
 #include <string>
 #include <iostream>
 #include <vector>
+#include <functional>
 
 #include <oriutil/debug.h>
 #include <oriutil/orinet.h>
 #include <oriutil/oriutil.h>
+#include <oriutil/stream.h>
 #include <ori/httpclient.h>
 #include <ori/httprepo.h>
 
+#include "tuneables.h"
+
 #define D_READ 0
 #define D_WRITE 1
 
@@ -51,6 +55,7 @@ using namespace std;
  * HttpClient
  */
 HttpClient::HttpClient(const std::string &remotePath)
+    : base(NULL), dnsBase(NULL), outstanding(0)
 {
     string tmp;
     size_t portPos, pathPos;
@@ -102,11 +107,19 @@ HttpClient::connect()
 
     // Can't get evdns to work, using Util_ResolveHost
     std::string remoteIP = OriNet_ResolveHost(remoteHost);
-    con = evhttp_connection_base_new(base, dnsBase, remoteIP.c_str(), port);
-    if (con == NULL) {
-        WARNING("HTTP client couldn't set up connection!");
-        return -1;
+    for (int i = 0; i < HTTPCLIENT_CONNECTIONS; i++) {
+        struct evhttp_connection *con;
+
+        con = evhttp_connection_base_new(base, dnsBase, remoteIP.c_str(),
+                                         port);
+        if (con == NULL) {
+            WARNING("HTTP client couldn't set up connection!");
+            return -1;
+        }
+        cons.push_back(con);
+        pending.push_back(0);
     }
+    outstanding = 0;
 
     return 0;
 }
@@ -115,13 +128,14 @@ HttpClient::connect()
 void
 HttpClient::disconnect()
 {
-    if (con)
-        evhttp_connection_free(con);
+    for (size_t i = 0; i < cons.size(); i++)
+        evhttp_connection_free(cons[i]);
     if (dnsBase)
         evdns_base_free(dnsBase, 0);
     if (base)
         event_base_free(base);
-    con = NULL;
+    cons.clear();
+    pending.clear();
     dnsBase = NULL;
     base = NULL;
 }
@@ -132,92 +146,320 @@ HttpClient::connected()
     return false;
 }
 
+/*
+ * Requests queued on a busy connection are sent as soon as the response
+ * before them completed, so the connection with the fewest pending requests
+ * gets the next one.
+ */
+size_t
+HttpClient::pickConnection()
+{
+    size_t best = 0;
+
+    for (size_t i = 1; i < cons.size(); i++) {
+        if (pending[i] < pending[best])
+            best = i;
+    }
+
+    return best;
+}
+
 struct RequestCB
 {
     HttpClient *client;
-    string *response;
+    size_t con;
+    HttpClientCB cb;
 };
 
 void
 HttpClient_requestDoneCB(struct evhttp_request *req, void *r)
 {
-    int status;
     RequestCB *cb = (RequestCB *)r;
     HttpClient *client = cb->client;
-    //struct evkeyvalq *headers;
-    struct evbuffer *bufIn;
+    int status = -1;
+    string response;
+
+    client->pending[cb->con]--;
+    client->outstanding--;
 
     if (!req) {
         WARNING("req is NULL!");
-        event_base_loopexit(client->base, NULL);
-        return;
-    }
-
-    status = evhttp_request_get_response_code(req);
-    if (status != HTTP_OK) {
+    } else if (evhttp_request_get_response_code(req) != HTTP_OK) {
+        status = evhttp_request_get_response_code(req);
         WARNING("HTTP request failed!");
-        event_base_loopexit(client->base, NULL);
-        return;
-    }
-
-    //headers = evhttp_request_get_input_headers(req);
-    bufIn = evhttp_request_get_input_buffer(req);
-
-    /*
-     * XXX: This is a hack to prevent the corruption we were seeing. Not sure 
-     * why this works, but the data needs to be read out here into a string and 
-     * we should signal the client to wakeup or register a callback.
-     */
-    int len = evbuffer_get_length(bufIn);
-    char *data = (char *)evbuffer_pullup(bufIn, len);
-    if (data == NULL) {
-        WARNING("Error running evbuffer_pullup");
-        event_base_loopexit(client->base, NULL);
-        return;
+    } else {
+        struct evbuffer *bufIn = evhttp_request_get_input_buffer(req);
+        size_t len = evbuffer_get_length(bufIn);
+
+        status = HTTP_OK;
+        response.resize(len);
+        if (len > 0 && evbuffer_remove(bufIn, &response[0], len) != (int)len) {
+            WARNING("Error reading HTTP response");
+            status = -1;
+            response.clear();
+        }
     }
 
-    cb->response->assign(data, len);
-
-    event_base_loopexit(client->base, NULL);
+    cb->cb(status, response);
+    delete cb;
 }
 
 int
-HttpClient::getRequest(const string &command, string &response)
+HttpClient::request(enum evhttp_cmd_type type, const string &url,
+                    const string *payload, HttpClientCB cb)
 {
-    int status;
-    RequestCB cb;
-    struct evhttp_request *req;
+    RequestCB *rcb = new RequestCB();
+
+    rcb->client = this;
+    rcb->con = pickConnection();
+    rcb->cb = cb;
 
-    cb.client = this;
-    cb.response = &response;
-    req = evhttp_request_new(HttpClient_requestDoneCB, (void *)&cb);
+    struct evhttp_request *req = evhttp_request_new(
+            HttpClient_requestDoneCB, rcb);
 
     struct evkeyvalq *headers = evhttp_request_get_output_headers(req);
     evhttp_add_header(headers, "Connection", "keep-alive");
 
-    status = evhttp_make_request(con, req, EVHTTP_REQ_GET, command.c_str());
+    if (payload) {
+        struct evbuffer *outbuf = evhttp_request_get_output_buffer(req);
+        evbuffer_add(outbuf, payload->data(), payload->size());
+    }
+
+    int status = evhttp_make_request(cons[rcb->con], req, type, url.c_str());
     if (status < 0) {
         WARNING("HTTP request failure!");
+        delete rcb;
         return -1;
     }
 
-    // XXX: Create dedicated event loop
-    event_base_dispatch(base);
+    pending[rcb->con]++;
+    outstanding++;
 
     return 0;
 }
 
+int
+HttpClient::getAsync(const string &url, HttpClientCB cb)
+{
+    return request(EVHTTP_REQ_GET, url, NULL, cb);
+}
+
+int
+HttpClient::postAsync(const string &url, const string &payload,
+                      HttpClientCB cb)
+{
+    return request(EVHTTP_REQ_POST, url, &payload, cb);
+}
+
+void
+HttpClient::wait()
+{
+    while (outstanding > 0) {
+        if (event_base_loop(base, EVLOOP_ONCE) != 0) {
+            WARNING("HTTP client has no pending events!");
+            break;
+        }
+    }
+}
+
+struct SyncRequest
+{
+    bool done;
+    int status;
+    string *response;
+};
+
+static void
+HttpClient_syncDoneCB(SyncRequest *r, int status, const string &response)
+{
+    r->done = true;
+    r->status = status;
+    if (status == HTTP_OK)
+        *r->response = response;
+}
+
+/*
+ * Runs the event loop until one request completed, requests queued earlier
+ * may complete in the meantime.
+ */
+int
+HttpClient::waitRequest(SyncRequest *r)
+{
+    while (!r->done) {
+        if (event_base_loop(base, EVLOOP_ONCE) != 0) {
+            WARNING("HTTP client has no pending events!");
+            return -1;
+        }
+    }
+
+    return (r->status == HTTP_OK) ? 0 : -1;
+}
+
+int
+HttpClient::getRequest(const string &command, string &response)
+{
+    SyncRequest r = { false, -1, &response };
+
+    if (getAsync(command, std::bind(HttpClient_syncDoneCB, &r,
+                                    std::placeholders::_1,
+                                    std::placeholders::_2)) < 0)
+        return -1;
+
+    return waitRequest(&r);
+}
+
 int
 HttpClient::postRequest(const string &url,
                         const string &payload,
                         string &response)
 {
-    RequestCB cb;
-    cb.client = this;
-    cb.response = &response;
+    SyncRequest r = { false, -1, &response };
 
+    if (postAsync(url, payload, std::bind(HttpClient_syncDoneCB, &r,
+                                          std::placeholders::_1,
+                                          std::placeholders::_2)) < 0)
+        return -1;
+
+    return waitRequest(&r);
+}
+
+/*
+ * Response body of a streamed request.  Reads run the client's event loop
+ * until the next piece of the body arrives, so the body is never held in
+ * memory as a whole and the caller can consume the start of a large
+ * response while the rest is still in flight.
+ */
+class HttpClientStream : public bytestream
+{
+public:
+    explicit HttpClientStream(HttpClient *client);
+    ~HttpClientStream();
+    bool ended();
+    size_t read(uint8_t *buf, size_t n);
+    size_t sizeHint() const;
+    static int headerCB(struct evhttp_request *req, void *arg);
+    static void chunkCB(struct evhttp_request *req, void *arg);
+    static void doneCB(struct evhttp_request *req, void *arg);
+private:
+    void fill();
+    HttpClient *client;
+    size_t con;
+    struct evbuffer *buf;
+    int status; // response code once the headers arrived
+    bool done;
+    friend class HttpClient;
+};
+
+HttpClientStream::HttpClientStream(HttpClient *client)
+    : client(client), con(0), status(0), done(false)
+{
+    buf = evbuffer_new();
+    if (buf == NULL)
+        throw std::bad_alloc();
+}
+
+HttpClientStream::~HttpClientStream()
+{
+    // Finish the request so the connection can be reused
+    while (!done) {
+        evbuffer_drain(buf, evbuffer_get_length(buf));
+        if (event_base_loop(client->base, EVLOOP_ONCE) != 0)
+            break;
+    }
+
+    evbuffer_free(buf);
+}
+
+bool
+HttpClientStream::ended()
+{
+    fill();
+    return evbuffer_get_length(buf) == 0;
+}
+
+size_t
+HttpClientStream::read(uint8_t *out, size_t n)
+{
+    int status;
+
+    fill();
+    status = evbuffer_remove(buf, out, n);
+    if (status < 0)
+        return 0;
+
+    return status;
+}
+
+size_t
+HttpClientStream::sizeHint() const
+{
+    return 0;
+}
+
+// Waits for more of the body or the end of the request
+void
+HttpClientStream::fill()
+{
+    while (evbuffer_get_length(buf) == 0 && !done) {
+        if (event_base_loop(client->base, EVLOOP_ONCE) != 0) {
+            WARNING("HTTP client has no pending events!");
+            done = true;
+        }
+    }
+}
+
+int
+HttpClientStream::headerCB(struct evhttp_request *req, void *arg)
+{
+    HttpClientStream *s = (HttpClientStream *)arg;
+
+    s->status = evhttp_request_get_response_code(req);
+
+    return 0;
+}
+
+void
+HttpClientStream::chunkCB(struct evhttp_request *req, void *arg)
+{
+    HttpClientStream *s = (HttpClientStream *)arg;
+
+    // Error pages are not part of the stream
+    if (evhttp_request_get_response_code(req) != HTTP_OK)
+        return;
+
+    evbuffer_add_buffer(s->buf, evhttp_request_get_input_buffer(req));
+}
+
+/*
+ * A failed request ends the stream early and readers see a short stream.
+ */
+void
+HttpClientStream::doneCB(struct evhttp_request *req, void *arg)
+{
+    HttpClientStream *s = (HttpClientStream *)arg;
+
+    s->done = true;
+    s->client->pending[s->con]--;
+    if (!req || evhttp_request_get_response_code(req) != HTTP_OK) {
+        // postStream returns NULL for error replies
+        if (!req || s->status == HTTP_OK)
+            WARNING("HTTP request failed!");
+        return;
+    }
+
+    evbuffer_add_buffer(s->buf, evhttp_request_get_input_buffer(req));
+}
+
+bytestream *
+HttpClient::postStream(const string &url, const string &payload)
+{
+    HttpClientStream *s = new HttpClientStream(this);
+
+    s->con = pickConnection();
     struct evhttp_request *req = evhttp_request_new(
-            HttpClient_requestDoneCB, &cb);
+            HttpClientStream::doneCB, s);
+    evhttp_request_set_header_cb(req, HttpClientStream::headerCB);
+    evhttp_request_set_chunked_cb(req, HttpClientStream::chunkCB);
 
     struct evkeyvalq *headers = evhttp_request_get_output_headers(req);
     evhttp_add_header(headers, "Connection", "keep-alive");
@@ -225,16 +467,27 @@ HttpClient::postRequest(const string &url,
     struct evbuffer *outbuf = evhttp_request_get_output_buffer(req);
     evbuffer_add(outbuf, payload.data(), payload.size());
 
-    int status = evhttp_make_request(con, req, EVHTTP_REQ_POST, url.c_str());
+    int status = evhttp_make_request(cons[s->con], req, EVHTTP_REQ_POST,
+                                     url.c_str());
     if (status < 0) {
         WARNING("HTTP request failure!");
-        return -1;
+        s->done = true;
+        delete s;
+        return NULL;
     }
+    pending[s->con]++;
 
-    // XXX: Create dedicated event loop
-    event_base_dispatch(base);
+    // Errors are reported before returning so callers can fall back
+    while (s->status == 0 && !s->done) {
+        if (event_base_loop(base, EVLOOP_ONCE) != 0)
+            break;
+    }
+    if (s->status != HTTP_OK) {
+        delete s;
+        return NULL;
+    }
 
-    return 0;
+    return s;
 }
 
 int
@@ -26,6 +26,10 @@
 #define ORIHTTP_PATH_CONTAINS   "/contains"
 #define ORIHTTP_PATH_GETOBJS    "/getobjs"
 #define ORIHTTP_PATH_OBJINFO    "/objinfo/"
+#define ORIHTTP_PATH_FILTER     "/filter"
+#define ORIHTTP_PATH_FETCH      "/fetch"
+#define ORIHTTP_PATH_INDEXSINCE "/indexsince"
+#define ORIHTTP_PATH_COMMITSSINCE "/commitssince"
 
 #endif /* __HTTPDEFS_H__ */
 
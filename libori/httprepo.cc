@@ -26,7 +26,9 @@
 #include <sys/socket.h>
 #include <arpa/inet.h>
 
+#include <algorithm>
 #include <iostream>
+#include <functional>
 
 #include <openssl/sha.h>
 
@@ -39,6 +41,7 @@
 #include <ori/packfile.h>
 
 #include "httpdefs.h"
+#include "tuneables.h"
 
 using namespace std;
 
@@ -47,7 +50,7 @@ using namespace std;
  */
 
 HttpRepo::HttpRepo(HttpClient *client)
-    : client(client), containedObjs(NULL)
+    : client(client), containedObjs(NULL), filterFetched(false)
 {
 }
 
@@ -85,7 +88,14 @@ HttpRepo::getHead()
         return ObjectHash();
     }
 
-    return ObjectHash::fromHex(headId);
+    // New commits arrived, the filter no longer covers all of the objects
+    ObjectHash head = ObjectHash::fromHex(headId);
+    if (head != filterHead) {
+        filterHead = head;
+        filterFetched = false;
+    }
+
+    return head;
 }
 
 int
@@ -131,13 +141,13 @@ HttpRepo::getObject(const ObjectHash &id)
             case ObjectInfo::ZIPALGO_NONE:
                 payloads[info.hash] = payload;
                 break;
-            case ObjectInfo::ZIPALGO_FASTLZ:
+            default:
+                ZipCodec_Check(info.getAlgo());
                 payloads[info.hash] = zipstream(new strstream(payload),
                                                 DECOMPRESS,
-                                                info.payload_size).readAll();
-            case ObjectInfo::ZIPALGO_LZMA:
-            case ObjectInfo::ZIPALGO_UNKNOWN:
-                NOT_IMPLEMENTED(false);
+                                                info.payload_size,
+                                                info.getAlgo()).readAll();
+                break;
         }
         return Object::sp(new HttpObject(this, info));
     }
@@ -167,6 +177,10 @@ HttpRepo::hasObject(const ObjectHash &id) {
 
     // XXX: Implement cache
 
+    refreshFilter();
+    if (!remoteFilter.mayContain(id))
+        return false;
+
     vec.push_back(id);
     result = hasObjects(vec);
     if (result.size() != 1)
@@ -174,39 +188,128 @@ HttpRepo::hasObject(const ObjectHash &id) {
     return result[0];
 }
 
-vector<bool>
-HttpRepo::hasObjects(const ObjectHashVec &vec) {
-    strwstream ss;
-    string resp;
-    vector<bool> rval;
-
-    ss.writeUInt32(vec.size());
-    for (size_t i = 0; i < vec.size(); i++) {
-        ss.writeHash(vec[i]);
-    }
-
-    int status = client->postRequest(ORIHTTP_PATH_CONTAINS, ss.str(), resp);
-    if (status < 0) {
-        return rval;
-    }
-    if (resp.size() != vec.size()) {
-        return rval;
+/*
+ * Objects of one contains request, the reply has a character per object.
+ */
+struct HttpContainsBatch {
+    vector<bool> *rval;
+    vector<size_t> objs; // indexes into rval
+    bool *failed;
+};
+
+static void
+HttpRepo_containsDoneCB(HttpContainsBatch *b, int status, const string &resp)
+{
+    if (status != HTTP_OK || resp.size() != b->objs.size()) {
+        *b->failed = true;
+        delete b;
+        return;
     }
 
     for (size_t i = 0; i < resp.size(); i++) {
         if (resp[i] == 'P') {
-            rval.push_back(true);
+            (*b->rval)[b->objs[i]] = true;
         } else if (resp[i] == 'N') {
-            rval.push_back(false);
+            (*b->rval)[b->objs[i]] = false;
         } else {
             WARNING("Unknown status for hasObjects query!");
-            rval.push_back(false);
         }
     }
+    delete b;
+}
+
+/*
+ * Only objects the server's filter may contain are queried, the others are
+ * known to be absent.  Large queries are split into batches that are sent
+ * over all of the client's connections at once.
+ */
+vector<bool>
+HttpRepo::hasObjects(const ObjectHashVec &vec) {
+    vector<bool> rval(vec.size(), false);
+    vector<size_t> query;
+    bool failed = false;
+
+    refreshFilter();
+    for (size_t i = 0; i < vec.size(); i++) {
+        if (remoteFilter.mayContain(vec[i]))
+            query.push_back(i);
+    }
+
+    for (size_t i = 0; i < query.size(); i += HTTPCLIENT_CONTAINS_BATCH) {
+        HttpContainsBatch *b = new HttpContainsBatch();
+        size_t end = std::min(query.size(), i + HTTPCLIENT_CONTAINS_BATCH);
+        strwstream ss;
+
+        b->rval = &rval;
+        b->objs.assign(query.begin() + i, query.begin() + end);
+        b->failed = &failed;
+
+        ss.writeUInt32(b->objs.size());
+        for (size_t j = 0; j < b->objs.size(); j++) {
+            ss.writeHash(vec[b->objs[j]]);
+        }
+
+        if (client->postAsync(ORIHTTP_PATH_CONTAINS, ss.str(),
+                              std::bind(HttpRepo_containsDoneCB, b,
+                                        std::placeholders::_1,
+                                        std::placeholders::_2)) < 0) {
+            delete b;
+            failed = true;
+            break;
+        }
+    }
+    client->wait();
+
+    if (failed) {
+        return vector<bool>();
+    }
 
     return rval;
 }
 
+/*
+ * The filter is a snapshot of the server's objects.  It is fetched again
+ * once it is older than HTTPCLIENT_FILTER_TTL or when getHead sees a new
+ * head, so objects the server received since are not reported as absent
+ * for long.
+ */
+bool
+HttpRepo::getObjectFilter(BloomFilter &filter)
+{
+    refreshFilter();
+
+    filter = remoteFilter;
+    return !remoteFilter.isEmpty();
+}
+
+/// Fetches the server's filter if there is none or it is stale
+void
+HttpRepo::refreshFilter()
+{
+    int status;
+    string blob;
+
+    if (filterFetched && filterAge.getElapsedTime() < HTTPCLIENT_FILTER_TTL)
+        return;
+    filterFetched = true;
+    filterAge.reset();
+    filterAge.start();
+
+    // An empty filter may contain anything, every query goes to the server
+    remoteFilter = BloomFilter();
+
+    status = client->getRequest(ORIHTTP_PATH_FILTER, blob);
+    if (status < 0 || blob.size() == 0)
+        return;
+
+    try {
+        remoteFilter.fromBlob(blob);
+    } catch (SerializationException &e) {
+        WARNING("Server sent a corrupt object filter");
+        remoteFilter = BloomFilter();
+    }
+}
+
 bytestream *
 HttpRepo::getObjects(const ObjectHashVec &vec) {
     strwstream ss;
@@ -215,14 +318,28 @@ HttpRepo::getObjects(const ObjectHashVec &vec) {
         ss.writeHash(vec[i]);
     }
 
-    string resp;
-    int status = client->postRequest(ORIHTTP_PATH_GETOBJS, ss.str(), resp);
-    bytestream::ap bs(new strstream(resp));
+    // Objects are received as the server sends them
+    return client->postStream(ORIHTTP_PATH_GETOBJS, ss.str());
+}
 
-    if (status == 0) {
-        return bs.release();
+/*
+ * Servers predating the fetch request answer it with an error.
+ */
+bytestream *
+HttpRepo::getMissingObjects(const ObjectHashVec &wants,
+                            const ObjectHashVec &haves)
+{
+    strwstream ss;
+    ss.writeUInt32(wants.size());
+    for (size_t i = 0; i < wants.size(); i++) {
+        ss.writeHash(wants[i]);
+    }
+    ss.writeUInt32(haves.size());
+    for (size_t i = 0; i < haves.size(); i++) {
+        ss.writeHash(haves[i]);
     }
-    return NULL;
+
+    return client->postStream(ORIHTTP_PATH_FETCH, ss.str());
 }
 
 std::set<ObjectInfo>
@@ -284,6 +401,60 @@ HttpRepo::listCommits()
 }
 
 
+/*
+ * Servers predating cursors answer with an error and everything is listed
+ * through the older requests.
+ */
+bool
+HttpRepo::listObjectsSince(const string &cursor, set<ObjectInfo> &objs,
+                           string &next)
+{
+    strwstream ss;
+    string index;
+
+    ss.writePStr(cursor);
+    if (client->postRequest(ORIHTTP_PATH_INDEXSINCE, ss.str(), index) < 0)
+        return Repo::listObjectsSince(cursor, objs, next);
+
+    strstream rs(index);
+    bool since = rs.readUInt8() != 0;
+    rs.readPStr(next);
+    uint64_t num = rs.readUInt64();
+    for (uint64_t i = 0; i < num; i++) {
+        ObjectInfo info;
+        rs.readInfo(info);
+        objs.insert(info);
+    }
+
+    return since;
+}
+
+bool
+HttpRepo::listCommitsSince(const string &cursor, vector<Commit> &commits,
+                           string &next)
+{
+    strwstream ss;
+    string index;
+
+    ss.writePStr(cursor);
+    if (client->postRequest(ORIHTTP_PATH_COMMITSSINCE, ss.str(), index) < 0)
+        return Repo::listCommitsSince(cursor, commits, next);
+
+    strstream rs(index);
+    bool since = rs.readUInt8() != 0;
+    rs.readPStr(next);
+    uint32_t num = rs.readUInt32();
+    for (uint32_t i = 0; i < num; i++) {
+        string commit_str;
+        rs.readPStr(commit_str);
+        Commit c;
+        c.fromBlob(commit_str);
+        commits.push_back(c);
+    }
+
+    return since;
+}
+
 std::string &
 HttpRepo::_payload(const ObjectHash &id)
 {
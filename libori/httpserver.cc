@@ -17,6 +17,8 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <errno.h>
+#include <pthread.h>
 
 #include <unistd.h>
 #include <fcntl.h>
@@ -30,6 +32,10 @@
 
 #include <string>
 #include <iostream>
+#include <exception>
+#include <deque>
+#include <map>
+#include <vector>
 
 #include <event2/event.h>
 #include <event2/http.h>
@@ -40,6 +46,7 @@
 
 #include <oriutil/debug.h>
 #include <oriutil/oristr.h>
+#include <oriutil/thread.h>
 #include <oriutil/zeroconf.h>
 #include <ori/version.h>
 #include <ori/localrepo.h>
@@ -47,6 +54,7 @@
 
 #include "evbufstream.h"
 #include "httpdefs.h"
+#include "tuneables.h"
 
 using namespace std;
 
@@ -71,8 +79,262 @@ HTTPServerReqHandlerCB(struct evhttp_request *req, void *arg)
     return;
 }
 
+/*
+ * A request served by the workers.  Only the event loop touches the request
+ * and its connection, a worker reads the request body from in and writes
+ * the reply to out.
+ */
+struct HTTPJob {
+    HTTPJob();
+    ~HTTPJob();
+    HTTPServer *httpd;
+    struct evhttp_request *req; // NULL once the client went away
+    string client;
+    string url;
+    void (HTTPServer::*handler)(HTTPJob *);
+    struct evbuffer *in;
+    struct evbuffer *out;
+    int status;
+    bool running; // queued or held by a worker
+    // Streamed replies
+    bool more; // parts are left after the one in out
+    bool started; // the reply was started
+    bool sending; // a part is being written to the client
+    bool ready; // the next part waits in out
+    TransmitState state;
+};
+
+HTTPJob::HTTPJob()
+    : httpd(NULL), req(NULL), handler(NULL), in(evbuffer_new()),
+      out(evbuffer_new()), status(HTTP_OK), running(false), more(false),
+      started(false), sending(false), ready(false)
+{
+}
+
+HTTPJob::~HTTPJob()
+{
+    evbuffer_free(out);
+    evbuffer_free(in);
+}
+
+/*
+ * Jobs waiting for a worker are taken round robin between clients, so a
+ * client sending many requests does not starve the others.  Every part of a
+ * streamed reply is queued as a job of its own and a large transfer never
+ * holds on to a worker.  Finished jobs are handed back to the event loop,
+ * which is woken up through a pipe.
+ */
+struct HTTPJobQueue
+{
+    HTTPJobQueue();
+    ~HTTPJobQueue();
+    /// @returns false if a new request is refused
+    bool push(HTTPJob *j, bool admit);
+    /// @returns NULL once the queue is closed
+    HTTPJob *pop();
+    void done(HTTPJob *j);
+    void takeDone(deque<HTTPJob *> &jobs);
+    void close();
+
+    pthread_mutex_t lock;
+    pthread_cond_t notEmpty;
+    deque<string> clients;
+    map<string, deque<HTTPJob *> > queued;
+    size_t numQueued;
+    deque<HTTPJob *> finished;
+    int notifyFds[2];
+    bool closed;
+};
+
+HTTPJobQueue::HTTPJobQueue()
+    : numQueued(0), closed(false)
+{
+    notifyFds[0] = -1;
+    notifyFds[1] = -1;
+    pthread_mutex_init(&lock, NULL);
+    pthread_cond_init(&notEmpty, NULL);
+}
+
+// Jobs still queued belong to a stopped server
+HTTPJobQueue::~HTTPJobQueue()
+{
+    map<string, deque<HTTPJob *> >::iterator it;
+
+    for (it = queued.begin(); it != queued.end(); it++) {
+        for (size_t i = 0; i < it->second.size(); i++)
+            delete it->second[i];
+    }
+    for (size_t i = 0; i < finished.size(); i++)
+        delete finished[i];
+
+    if (notifyFds[0] != -1) {
+        ::close(notifyFds[0]);
+        ::close(notifyFds[1]);
+    }
+    pthread_cond_destroy(&notEmpty);
+    pthread_mutex_destroy(&lock);
+}
+
+/*
+ * New requests are admitted while fewer than HTTPD_MAXQUEUED requests and
+ * fewer than HTTPD_CLIENT_MAXQUEUED requests of the same client wait.  The
+ * parts of replies already started are always queued.
+ */
+bool
+HTTPJobQueue::push(HTTPJob *j, bool admit)
+{
+    pthread_mutex_lock(&lock);
+    deque<HTTPJob *> &q = queued[j->client];
+    if (admit && (numQueued >= HTTPD_MAXQUEUED ||
+                  q.size() >= HTTPD_CLIENT_MAXQUEUED)) {
+        if (q.empty())
+            queued.erase(j->client);
+        pthread_mutex_unlock(&lock);
+        return false;
+    }
+    if (q.empty())
+        clients.push_back(j->client);
+    q.push_back(j);
+    numQueued++;
+    pthread_cond_signal(&notEmpty);
+    pthread_mutex_unlock(&lock);
+
+    return true;
+}
+
+HTTPJob *
+HTTPJobQueue::pop()
+{
+    HTTPJob *j = NULL;
+
+    pthread_mutex_lock(&lock);
+    while (clients.empty() && !closed) {
+        pthread_cond_wait(&notEmpty, &lock);
+    }
+    if (!closed) {
+        string client = clients.front();
+        deque<HTTPJob *> &q = queued[client];
+
+        clients.pop_front();
+        j = q.front();
+        q.pop_front();
+        numQueued--;
+        if (q.empty())
+            queued.erase(client);
+        else
+            clients.push_back(client);
+    }
+    pthread_mutex_unlock(&lock);
+
+    return j;
+}
+
+void
+HTTPJobQueue::done(HTTPJob *j)
+{
+    pthread_mutex_lock(&lock);
+    finished.push_back(j);
+    if (finished.size() == 1) {
+        char c = 0;
+        if (write(notifyFds[1], &c, 1) < 0)
+            WARNING("httpd: cannot wake up the event loop: %s",
+                    strerror(errno));
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+void
+HTTPJobQueue::takeDone(deque<HTTPJob *> &jobs)
+{
+    pthread_mutex_lock(&lock);
+    jobs.swap(finished);
+    pthread_mutex_unlock(&lock);
+}
+
+void
+HTTPJobQueue::close()
+{
+    pthread_mutex_lock(&lock);
+    closed = true;
+    pthread_cond_broadcast(&notEmpty);
+    pthread_mutex_unlock(&lock);
+}
+
+class HTTPWorker : public Thread
+{
+public:
+    HTTPWorker(HTTPServer *httpd)
+        : Thread("httpd"), httpd(httpd) { }
+    void run();
+private:
+    HTTPServer *httpd;
+};
+
+/*
+ * The repository is only read by the server, reads are safe from several
+ * threads at once.
+ */
+void
+HTTPWorker::run()
+{
+    HTTPJob *j;
+
+    while ((j = httpd->jobs->pop()) != NULL) {
+        try {
+            (httpd->*j->handler)(j);
+        } catch (exception &e) {
+            WARNING("httpd: %s failed: %s", j->url.c_str(), e.what());
+            j->status = HTTP_INTERNAL;
+            j->more = false;
+        }
+        httpd->jobs->done(j);
+    }
+}
+
+void
+HTTPServerDoneCB(evutil_socket_t fd, short what, void *arg)
+{
+    HTTPServer *httpd = (HTTPServer *)arg;
+    deque<HTTPJob *> done;
+    char buf[64];
+
+    while (read(fd, buf, sizeof(buf)) > 0) {
+    }
+
+    httpd->jobs->takeDone(done);
+    for (size_t i = 0; i < done.size(); i++) {
+        done[i]->running = false;
+        httpd->reply(done[i]);
+    }
+}
+
+// The client went away, the job is dropped once no worker holds it
+void
+HTTPServerCloseCB(struct evhttp_connection *evcon, void *arg)
+{
+    HTTPJob *j = (HTTPJob *)arg;
+
+    j->req = NULL;
+    if (!j->running)
+        delete j;
+}
+
+// A part of a streamed reply was written to the socket
+void
+HTTPServerObjsChunkCB(struct evhttp_connection *evcon, void *arg)
+{
+    HTTPJob *j = (HTTPJob *)arg;
+
+    j->sending = false;
+    if (j->ready) {
+        j->ready = false;
+        j->httpd->sendPart(j);
+    }
+}
+
 HTTPServer::HTTPServer(LocalRepo &repository, uint16_t port)
-    : repo(repository), port(port), httpd(NULL), base(NULL)
+    : repo(repository), port(port), httpd(NULL), base(NULL),
+      threads(HTTPD_WORKERS), jobs(NULL), doneEvent(NULL)
 {
     base = event_base_new();
     event_set_log_callback(HTTPServerLogCB);
@@ -83,15 +345,45 @@ HTTPServer::HTTPServer(LocalRepo &repository, uint16_t port)
     evhttp_set_gencb(httpd, HTTPServerReqHandlerCB, this);
 }
 
+/*
+ * Freeing the server closes the connections, which drops their jobs.  Jobs
+ * the workers still held are freed with the queue.
+ */
 HTTPServer::~HTTPServer()
 {
     evhttp_free(httpd);
+    if (doneEvent)
+        event_free(doneEvent);
+    delete jobs;
     event_base_free(base);
 }
 
+void
+HTTPServer::setThreads(int threads)
+{
+    this->threads = threads > 0 ? threads : 1;
+}
+
 void
 HTTPServer::start(bool mDNSEnable)
 {
+    vector<HTTPWorker *> workers;
+
+    jobs = new HTTPJobQueue();
+    if (pipe(jobs->notifyFds) < 0) {
+        WARNING("httpd: cannot create pipe: %s", strerror(errno));
+        return;
+    }
+    evutil_make_socket_nonblocking(jobs->notifyFds[0]);
+    doneEvent = event_new(base, jobs->notifyFds[0], EV_READ | EV_PERSIST,
+                          HTTPServerDoneCB, this);
+    event_add(doneEvent, NULL);
+
+    for (int i = 0; i < threads; i++) {
+        workers.push_back(new HTTPWorker(this));
+        workers.back()->start();
+    }
+
 #if !defined(WITHOUT_MDNS)
     // mDNS
     if (mDNSEnable)
@@ -99,6 +391,12 @@ HTTPServer::start(bool mDNSEnable)
 #endif
 
     event_base_dispatch(base);
+
+    jobs->close();
+    for (size_t i = 0; i < workers.size(); i++) {
+        workers[i]->wait();
+        delete workers[i];
+    }
 }
 
 void
@@ -120,8 +418,12 @@ HTTPServer::entry(struct evhttp_request *req)
      * /HEAD - HEAD revision
      * /index
      * /commits
+     * /indexsince
+     * /commitssince
      * /contains
+     * /filter
      * /getobjs
+     * /fetch
      * /objs/...
      * /objinfo/...
      */
@@ -138,18 +440,26 @@ HTTPServer::entry(struct evhttp_request *req)
     } else if (url == ORIHTTP_PATH_HEAD) {
         head(req);
     } else if (url == ORIHTTP_PATH_INDEX) {
-        getIndex(req);
+        queue(req, &HTTPServer::getIndex);
     } else if (url == ORIHTTP_PATH_COMMITS) {
-        getCommits(req);
+        queue(req, &HTTPServer::getCommits);
+    } else if (url == ORIHTTP_PATH_INDEXSINCE) {
+        queue(req, &HTTPServer::getIndexSince);
+    } else if (url == ORIHTTP_PATH_COMMITSSINCE) {
+        queue(req, &HTTPServer::getCommitsSince);
     } else if (url == ORIHTTP_PATH_CONTAINS) {
-        contains(req);
+        queue(req, &HTTPServer::contains);
+    } else if (url == ORIHTTP_PATH_FILTER) {
+        getFilter(req);
     } else if (url == ORIHTTP_PATH_GETOBJS) {
-        getObjs(req);
+        queue(req, &HTTPServer::getObjs);
+    } else if (url == ORIHTTP_PATH_FETCH) {
+        queue(req, &HTTPServer::fetch);
     } else if (OriStr_StartsWith(url, "/objs/")) {
         evhttp_send_error(req, HTTP_NOTFOUND, "File Not Found");
         return;
     } else if (OriStr_StartsWith(url, ORIHTTP_PATH_OBJINFO)) {
-        getObjInfo(req);
+        queue(req, &HTTPServer::getObjInfo);
     } else {
         evhttp_send_error(req, HTTP_NOTFOUND, "File Not Found");
         return;
@@ -265,11 +575,137 @@ HTTPServer::head(struct evhttp_request *req)
 }
 
 void
-HTTPServer::getIndex(struct evhttp_request *req)
+HTTPServer::getFilter(struct evhttp_request *req)
+{
+    BloomFilter filter;
+    evbufwstream out;
+
+    DLOG("httpd: getFilter");
+
+    if (!repo.getObjectFilter(filter)) {
+        evhttp_send_error(req, HTTP_NOTFOUND, "File Not Found");
+        return;
+    }
+
+    string blob = filter.getBlob();
+    out.write(blob.data(), blob.size());
+
+    evhttp_add_header(req->output_headers, "Content-Type",
+            "application/octet-stream");
+    evhttp_send_reply(req, HTTP_OK, "OK", out.buf());
+}
+
+/*
+ * Worker Pool
+ */
+
+/*
+ * Hands a request to the workers, or refuses it while too many requests
+ * wait for them.
+ */
+void
+HTTPServer::queue(struct evhttp_request *req,
+                  void (HTTPServer::*handler)(HTTPJob *))
+{
+    struct evhttp_connection *evcon = evhttp_request_get_connection(req);
+    HTTPJob *j = new HTTPJob();
+    char *addr;
+    uint16_t peerPort;
+
+    evhttp_connection_get_peer(evcon, &addr, &peerPort);
+    j->httpd = this;
+    j->req = req;
+    j->client = addr;
+    j->url = evhttp_request_get_uri(req);
+    j->handler = handler;
+    evbuffer_add_buffer(j->in, evhttp_request_get_input_buffer(req));
+
+    j->running = true;
+    if (!jobs->push(j, true)) {
+        DLOG("httpd: refusing %s from %s", j->url.c_str(), addr);
+        delete j;
+        evhttp_send_error(req, HTTP_SERVUNAVAIL, "Service Unavailable");
+        return;
+    }
+    evhttp_connection_set_closecb(evcon, HTTPServerCloseCB, j);
+}
+
+/*
+ * Sends the reply a worker produced.  Replies with more parts are streamed
+ * and the workers produce the next part while one is being written.
+ */
+void
+HTTPServer::reply(HTTPJob *j)
+{
+    struct evhttp_connection *evcon;
+
+    if (j->req == NULL) {
+        delete j;
+        return;
+    }
+
+    if (j->started) {
+        if (j->sending)
+            j->ready = true;
+        else
+            sendPart(j);
+        return;
+    }
+
+    evcon = evhttp_request_get_connection(j->req);
+    if (j->status != HTTP_OK) {
+        evhttp_connection_set_closecb(evcon, NULL, NULL);
+        evhttp_send_error(j->req, j->status, NULL);
+        delete j;
+        return;
+    }
+
+    evhttp_add_header(j->req->output_headers, "Content-Type",
+            "application/octet-stream");
+    if (!j->more) {
+        evhttp_connection_set_closecb(evcon, NULL, NULL);
+        evhttp_send_reply(j->req, HTTP_OK, "OK", j->out);
+        delete j;
+        return;
+    }
+
+    evhttp_send_reply_start(j->req, HTTP_OK, "OK");
+    j->started = true;
+    sendPart(j);
+}
+
+/*
+ * Writes the part in out and queues the job for the next one.  An error
+ * ends the reply early and the client fails on the short stream.
+ */
+void
+HTTPServer::sendPart(HTTPJob *j)
+{
+    if (!j->more) {
+        evhttp_send_reply_chunk(j->req, j->out);
+        evhttp_connection_set_closecb(evhttp_request_get_connection(j->req),
+                                      NULL, NULL);
+        evhttp_send_reply_end(j->req);
+        delete j;
+        return;
+    }
+
+    j->sending = true;
+    evhttp_send_reply_chunk_with_cb(j->req, j->out, HTTPServerObjsChunkCB, j);
+    j->running = true;
+    jobs->push(j, false);
+}
+
+/*
+ * Worker Handlers
+ */
+
+void
+HTTPServer::getIndex(HTTPJob *j)
 {
     DLOG("httpd: getindex");
 
-    evbufwstream es;
+    evbufwstream es(j->out);
 
     std::set<ObjectInfo> objects = repo.listObjects();
     es.writeUInt64(objects.size());
@@ -279,22 +715,18 @@ HTTPServer::getIndex(struct evhttp_request *req)
         int status = es.writeInfo(*it);
         if (status < 0) {
             LOG("couldn't write info to evbuffer!");
-            evhttp_send_error(req, HTTP_INTERNAL, "Internal Error");
+            j->status = HTTP_INTERNAL;
             return;
         }
     }
-
-    evhttp_add_header(req->output_headers, "Content-Type",
-            "application/octet-stream");
-    evhttp_send_reply(req, HTTP_OK, "OK", es.buf());
 }
 
 void
-HTTPServer::getCommits(struct evhttp_request *req)
+HTTPServer::getCommits(HTTPJob *j)
 {
     DLOG("httpd: getCommits");
 
-    evbufwstream es;
+    evbufwstream es(j->out);
 
     vector<Commit> commits = repo.listCommits();
     es.writeUInt32(commits.size());
@@ -302,23 +734,75 @@ HTTPServer::getCommits(struct evhttp_request *req)
         std::string blob = commits[i].getBlob();
         if (es.writePStr(blob) < 0) {
             LOG("couldn't write pstr to evbuffer");
-            evhttp_send_error(req, HTTP_INTERNAL, "Internal Error");
+            j->status = HTTP_INTERNAL;
             return;
         }
     }
+}
 
-    evhttp_add_header(req->output_headers, "Content-Type",
-            "application/octet-stream");
-    evhttp_send_reply(req, HTTP_OK, "OK", es.buf());
+/*
+ * The request holds a cursor from an earlier reply or an empty one.  The
+ * reply tells whether only objects added since the cursor are listed,
+ * followed by the next cursor and the objects as in getIndex.
+ */
+void
+HTTPServer::getIndexSince(HTTPJob *j)
+{
+    evbufstream in(j->in);
+    evbufwstream es(j->out);
+    string cursor, next;
+    set<ObjectInfo> objects;
+
+    in.readPStr(cursor);
+    bool since = repo.listObjectsSince(cursor, objects, next);
+
+    DLOG("httpd: getIndexSince %lu objects", objects.size());
+
+    es.writeUInt8(since ? 1 : 0);
+    es.writePStr(next);
+    es.writeUInt64(objects.size());
+    for (set<ObjectInfo>::iterator it = objects.begin();
+            it != objects.end();
+            it++) {
+        if (es.writeInfo(*it) < 0) {
+            LOG("couldn't write info to evbuffer!");
+            j->status = HTTP_INTERNAL;
+            return;
+        }
+    }
 }
 
 void
-HTTPServer::contains(struct evhttp_request *req)
+HTTPServer::getCommitsSince(HTTPJob *j)
+{
+    evbufstream in(j->in);
+    evbufwstream es(j->out);
+    string cursor, next;
+    vector<Commit> commits;
+
+    in.readPStr(cursor);
+    bool since = repo.listCommitsSince(cursor, commits, next);
+
+    DLOG("httpd: getCommitsSince %lu commits", commits.size());
+
+    es.writeUInt8(since ? 1 : 0);
+    es.writePStr(next);
+    es.writeUInt32(commits.size());
+    for (size_t i = 0; i < commits.size(); i++) {
+        if (es.writePStr(commits[i].getBlob()) < 0) {
+            LOG("couldn't write pstr to evbuffer");
+            j->status = HTTP_INTERNAL;
+            return;
+        }
+    }
+}
+
+void
+HTTPServer::contains(HTTPJob *j)
 {
     // Get object hashes
-    evbuffer *buf = evhttp_request_get_input_buffer(req);
-    evbufstream in(buf);
-    evbufwstream out;
+    evbufstream in(j->in);
+    evbufwstream out(j->out);
 
     DLOG("httpd: contains");
 
@@ -338,18 +822,13 @@ HTTPServer::contains(struct evhttp_request *req)
     }
 
     out.write(rval.data(), rval.size());
-
-    evhttp_add_header(req->output_headers, "Content-Type",
-            "application/octet-stream");
-    evhttp_send_reply(req, HTTP_OK, "OK", out.buf());
 }
 
 void
-HTTPServer::getObjs(struct evhttp_request *req)
+HTTPServer::getObjs(HTTPJob *j)
 {
     // Get object hashes
-    evbuffer *buf = evhttp_request_get_input_buffer(req);
-    evbufstream in(buf);
+    evbufstream in(j->in);
 
     DLOG("httpd: getObjs");
 
@@ -364,26 +843,81 @@ HTTPServer::getObjs(struct evhttp_request *req)
                 hash.hex().c_str());
     }
 
+    sendObjsStart(j, objs, "");
+}
 
-    // Transmit
-    evbufwstream out;
-    repo.transmit(&out, objs);
+/*
+ * Sends the commits and objects a client lacks.  The request lists the
+ * commits wanted, or none for all commits, followed by the commits the
+ * client has.  See LocalRepo::listMissing.
+ */
+void
+HTTPServer::fetch(HTTPJob *j)
+{
+    evbufstream in(j->in);
+    ObjectHashVec wants, haves, commits, objs;
+    strwstream header;
 
-    evhttp_add_header(req->output_headers, "Content-Type",
-            "application/octet-stream");
-    evhttp_send_reply(req, HTTP_OK, "OK", out.buf());
+    uint32_t numWants = in.readUInt32();
+    for (uint32_t i = 0; i < numWants; i++) {
+        ObjectHash hash;
+        in.readHash(hash);
+        wants.push_back(hash);
+    }
+    uint32_t numHaves = in.readUInt32();
+    for (uint32_t i = 0; i < numHaves; i++) {
+        ObjectHash hash;
+        in.readHash(hash);
+        haves.push_back(hash);
+    }
+
+    DLOG("httpd: fetch %u wants %u haves", numWants, numHaves);
+
+    objs = repo.listMissing(wants, haves, commits);
+
+    header.writeUInt32(commits.size());
+    for (size_t i = 0; i < commits.size(); i++) {
+        header.writeHash(commits[i]);
+    }
+
+    sendObjsStart(j, objs, header.str());
+}
+
+/*
+ * Produces the header and the first part of a getObjs or fetch reply.
+ * Objects are sent in parts of about TRANSMIT_PARTSIZE bytes so large
+ * transfers use constant memory, small transfers fit in a single reply.
+ */
+void
+HTTPServer::sendObjsStart(HTTPJob *j,
+                          const ObjectHashVec &objs,
+                          const string &header)
+{
+    evbufwstream out(j->out);
+
+    out.write(header.data(), header.size());
+    repo.transmitBegin(&j->state, objs);
+    j->more = repo.transmitPart(&out, &j->state, TRANSMIT_PARTSIZE);
+    j->handler = &HTTPServer::sendObjs;
 }
 
 void
-HTTPServer::getObjInfo(struct evhttp_request *req)
+HTTPServer::sendObjs(HTTPJob *j)
+{
+    evbufwstream out(j->out);
+
+    j->more = repo.transmitPart(&out, &j->state, TRANSMIT_PARTSIZE);
+}
+
+void
+HTTPServer::getObjInfo(HTTPJob *j)
 {
-    string url = evhttp_request_get_uri(req);
     string sObjId;
-    ASSERT(url.substr(0, 9) == "/objinfo/");
+    ASSERT(j->url.substr(0, 9) == "/objinfo/");
     
-    sObjId = url.substr(9);
+    sObjId = j->url.substr(9);
     if (sObjId.size() != 64) {
-        evhttp_send_error(req, HTTP_BADREQUEST, "Bad Request");
+        j->status = HTTP_BADREQUEST;
         return;
     }
     
@@ -391,19 +925,15 @@ HTTPServer::getObjInfo(struct evhttp_request *req)
 
     Object::sp obj = repo.getObject(ObjectHash::fromHex(sObjId));
     if (obj == NULL) {
-        evhttp_send_reply(req, HTTP_NOTFOUND, "Object Not Found", evbuffer_new());
+        j->status = HTTP_NOTFOUND;
         return;
     }
 
     ObjectInfo objInfo = obj->getInfo();
 
     // Transmit
-    evbufwstream es;
+    evbufwstream es(j->out);
     es.writeInfo(objInfo);
-
-    evhttp_add_header(req->output_headers, "Content-Type",
-            "application/octet-stream");
-    evhttp_send_reply(req, HTTP_OK, "OK", es.buf());
 }
 
 // void
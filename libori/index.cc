@@ -21,29 +21,88 @@
 #include <sys/param.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <unistd.h>
 
 #include <string>
 #include <set>
+#include <vector>
+#include <algorithm>
 #include <iostream>
 #include <unordered_map>
+#include <unordered_set>
 
 #include <oriutil/debug.h>
 #include <oriutil/runtimeexception.h>
 #include <oriutil/systemexception.h>
 #include <oriutil/orifile.h>
+#include <oriutil/oriutil.h>
 #include <oriutil/oricrypt.h>
+#include <oriutil/monitor.h>
 #include <ori/object.h>
 #include <ori/index.h>
 
+#include "tuneables.h"
+
 using namespace std;
 
 /// Adds a checksum
 #define TOTAL_ENTRYSIZE (IndexEntry::SIZE + 16)
+/// Version 1 entries store 32-bit offsets, sizes and packfile ids
+#define TOTAL_ENTRYSIZE_V1 (ObjectInfo::SIZE + 3 * 4 + 16)
+/// Offset of the object hash within a serialized entry (after the type)
+#define ENTRY_HASHOFF 4
+
+static void
+_encodeEntry(strwstream &ss, const IndexEntry &e)
+{
+    string info_str = e.info.toString();
+    ss.write(info_str.data(), info_str.size());
+
+    ss.writeUInt64(e.offset);
+    ss.writeUInt64(e.packed_size);
+    ss.writeUInt64(e.packfile);
+}
+
+static void
+_decodeEntry(const uint8_t *buf, IndexEntry &e)
+{
+    string entry_str((const char *)buf, IndexEntry::SIZE);
+
+    e.info.fromString(entry_str.substr(0, ObjectInfo::SIZE));
+
+    strstream ss(entry_str, ObjectInfo::SIZE);
+    e.offset = ss.readUInt64();
+    e.packed_size = ss.readUInt64();
+    e.packfile = ss.readUInt64();
+}
+
+/*
+ * A new journal starts at an unpredictable generation so cursors into a
+ * deleted and rebuilt index are not taken for its own.
+ */
+static uint64_t
+_newGeneration()
+{
+    ObjectHash h = OriCrypt_HashString(Util_NewUUID());
+    uint64_t gen;
+
+    memcpy(&gen, h.hash, sizeof(gen));
+    return gen;
+}
+
+static bool
+_entryCmp(const IndexEntry &e1, const IndexEntry &e2)
+{
+    return e1.info.hash < e2.info.hash;
+}
 
 Index::Index()
+    : fd(-1), version(INDEX_VERSION), generation(0), written(0),
+      deadKnown(false), deadDirty(false),
+      sorted(NULL), sortedLength(0), sortedCount(0),
+      sortedVersion(INDEX_SORTED_VERSION)
 {
-    fd = -1;
 }
 
 Index::~Index()
@@ -56,9 +115,13 @@ Index::open(const string &indexFile)
 {
     int i, entries;
     struct stat sb;
+    size_t hdrSize, entrySize;
 
     fileName = indexFile;
 
+    _openSorted();
+    _loadDead();
+
     // Read index
     fd = ::open(indexFile.c_str(), O_RDWR | O_CREAT,
               S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
@@ -76,7 +139,48 @@ Index::open(const string &indexFile)
         throw SystemException(errcode);
     }
 
-    if (sb.st_size % TOTAL_ENTRYSIZE != 0) {
+    // Indices without a header predate versioning
+    version = INDEX_VERSION;
+    hdrSize = INDEX_HDRSIZE;
+    entrySize = TOTAL_ENTRYSIZE;
+    if (sb.st_size == 0) {
+        generation = _newGeneration();
+        _writeHeader();
+        // Nothing is dead yet in a new (or rebuilt) index
+        if (sortedCount == 0) {
+            deadBytes.clear();
+            deadKnown = true;
+            deadDirty = true;
+        }
+    } else {
+        char magic[4] = { 0, 0, 0, 0 };
+        int status UNUSED = read(fd, magic, 4);
+        if (memcmp(magic, INDEX_MAGIC, 4) == 0) {
+            fdstream fs(fd, 4, 12);
+            version = fs.readUInt32();
+            if (version > INDEX_VERSION) {
+                WARNING("Index has an unsupported version %u!", version);
+                ::close(fd);
+                fd = -1;
+                throw RuntimeException(ORIEC_UNSUPPORTEDVERSION,
+                                       "Unsupported index version");
+            }
+            if (version >= INDEX_VERSION_3) {
+                generation = fs.readUInt64();
+            } else {
+                hdrSize = INDEX_HDRSIZE_V2;
+                generation = _newGeneration();
+            }
+        } else {
+            generation = _newGeneration();
+            version = INDEX_VERSION_1;
+            hdrSize = 0;
+            entrySize = TOTAL_ENTRYSIZE_V1;
+        }
+    }
+
+    off_t dataSize = (sb.st_size == 0) ? 0 : sb.st_size - hdrSize;
+    if (dataSize % entrySize != 0) {
         // XXX: Attempt truncating last entries
         WARNING("Index seems dirty please rebuild it!");
         ::close(fd);
@@ -84,12 +188,16 @@ Index::open(const string &indexFile)
         throw RuntimeException(ORIEC_INDEXDIRTY, "Index dirty");
     }
 
-    entries = sb.st_size / TOTAL_ENTRYSIZE;
-    for (i = 0; i < entries; i++) {
-        std::string entry_str(TOTAL_ENTRYSIZE, '\0');
+    // Read the whole journal at once
+    string journal_str(dataSize, '\0');
+    if (dataSize > 0) {
+        fdstream fs(fd, hdrSize, dataSize);
+        fs.readExact((uint8_t *)&journal_str[0], dataSize);
+    }
 
-        int status UNUSED = read(fd, &entry_str[0], TOTAL_ENTRYSIZE);
-        ASSERT(status == TOTAL_ENTRYSIZE);
+    entries = dataSize / entrySize;
+    for (i = 0; i < entries; i++) {
+        std::string entry_str = journal_str.substr(i * entrySize, entrySize);
 
         IndexEntry entry;
 
@@ -97,15 +205,20 @@ Index::open(const string &indexFile)
         entry.info.fromString(info_str);
 
         strstream ss(entry_str, ObjectInfo::SIZE);
-        entry.offset = ss.readUInt32();
-        entry.packed_size = ss.readUInt32();
-        entry.packfile = ss.readUInt32();
-
+        if (version >= INDEX_VERSION_2) {
+            entry.offset = ss.readUInt64();
+            entry.packed_size = ss.readUInt64();
+            entry.packfile = ss.readUInt64();
+        } else {
+            entry.offset = ss.readUInt32();
+            entry.packed_size = ss.readUInt32();
+            entry.packfile = ss.readUInt32();
+        }
 
         std::vector<uint8_t> storedChecksum(16);
         ss.read(&storedChecksum[0], 16);
         ObjectHash computedChecksum =
-            OriCrypt_HashString(entry_str.substr(0, IndexEntry::SIZE));
+            OriCrypt_HashString(entry_str.substr(0, entrySize - 16));
         if (memcmp(&storedChecksum[0], computedChecksum.hash, 16) != 0) {
             // XXX: Attempt truncating last entries
             WARNING("Index has corrupt entries please rebuild it!");
@@ -114,73 +227,122 @@ Index::open(const string &indexFile)
             throw RuntimeException(ORIEC_INDEXCORRUPT, "Index corrupt");
         }
 
-        index[entry.info.hash] = entry;
+        journal[entry.info.hash] = entry;
+        order.push_back(entry.info.hash);
     }
+    written = order.size();
     ::close(fd);
 
     // Reopen append only
     fd = ::open(indexFile.c_str(), O_WRONLY | O_APPEND);
     ASSERT(fd >= 0); // Assume that the repository lock protects the index
 
-    // Delete temporary index if present
+    // Delete temporary indices if present
     if (OriFile_Exists(indexFile + ".tmp")) {
         OriFile_Delete(indexFile + ".tmp");
     }
+    if (OriFile_Exists(indexFile + INDEX_SORTED_EXT ".tmp")) {
+        OriFile_Delete(indexFile + INDEX_SORTED_EXT ".tmp");
+    }
+
+    // Upgrade old indices and fold large journals into the sorted index
+    if (version < INDEX_VERSION || sortedVersion < INDEX_SORTED_VERSION ||
+        journal.size() >= INDEX_JOURNAL_MAXENTRIES) {
+        rewrite();
+    }
 }
 
 void
 Index::close()
 {
     if (fd != -1) {
-        ::fsync(fd);
+        sync();
         ::close(fd);
         fd = -1;
     }
+    _closeSorted();
+    journal.clear();
+    unsynced.clear();
+    order.clear();
+    written = 0;
+    deadBytes.clear();
+    deadKnown = false;
 }
 
 void
 Index::sync()
 {
-    ::fsync(fd);
+    Monitor m(lock);
+
+    _flushJournal(order.size());
+    if (journal.size() >= INDEX_JOURNAL_MAXENTRIES) {
+        _merge();
+    }
+    if (deadDirty)
+        _saveDead();
 }
 
 void
-Index::rewrite()
+Index::getSyncMark(uint64_t &gen, uint64_t &pos) const
 {
-    int fdNew;
-    string newIndex = fileName + ".tmp";
+    Monitor m(lock);
 
-    fdNew = ::open(newIndex.c_str(), O_RDWR | O_CREAT,
-                   S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
-    if (fdNew < 0) {
-        perror("open");
-        WARNING("Could not open a temporary index file!");
-        return;
-    };
+    gen = generation;
+    pos = order.size();
+}
 
-    int tmpFd = fd;
-    fd = fdNew;
-    ::close(tmpFd);
+/*
+ * Entries buffered after the mark may refer to packfile data that is not
+ * durable yet.  They stay buffered and the journal is only merged once
+ * nothing is left buffered.  A merge since the mark already made its
+ * entries durable.
+ */
+void
+Index::sync(uint64_t gen, uint64_t pos)
+{
+    Monitor m(lock);
 
-    // Write new index
-    for (unordered_map<ObjectHash, IndexEntry>::iterator it = index.begin();
-            it != index.end();
-            it++)
-    {
-        _writeEntry((*it).second);
+    if (gen == generation) {
+        _flushJournal(pos);
+        if (journal.size() >= INDEX_JOURNAL_MAXENTRIES &&
+            written == order.size()) {
+            _merge();
+        }
     }
+    if (deadDirty)
+        _saveDead();
+}
+
+void
+Index::rewrite()
+{
+    Monitor m(lock);
 
-    OriFile_Rename(newIndex, fileName);
+    _merge();
 }
 
 void
 Index::dump()
 {
+    Monitor m(lock);
     unordered_map<ObjectHash, IndexEntry>::iterator it;
 
     cout << "***** BEGIN REPOSITORY INDEX *****" << endl;
-    for (it = index.begin(); it != index.end(); it++)
+    for (uint64_t i = 0; i < sortedCount; i++)
+    {
+        IndexEntry e;
+        _decodeEntry(sorted + INDEX_SORTED_HDRSIZE + i * IndexEntry::SIZE, e);
+        if (journal.find(e.info.hash) != journal.end())
+            continue;
+        cout << e.info.hash.hex() << " packfile: " <<
+            e.packfile << "," <<
+            e.offset << "," <<
+            e.packed_size << endl;
+    }
+    for (it = journal.begin(); it != journal.end(); it++)
     {
+        if ((*it).second.packfile == INDEX_PACKFILE_REMOVED)
+            continue;
         cout << (*it).first.hex() << " packfile: " <<
             (*it).second.packfile << "," <<
             (*it).second.offset << "," <<
@@ -194,26 +356,54 @@ Index::updateEntry(const ObjectHash &objId, const IndexEntry &entry)
 {
     ASSERT(!objId.isEmpty());
 
+    Monitor m(lock);
+
     _writeEntry(entry);
 
-    if (index.find(objId) != index.end()) {
-        fprintf(stderr, "WARNING: duplicate updateEntry\n");
+    // Entries legitimately move between packfiles when repacking
+    IndexEntry old;
+    if (_lookup(objId, &old)) {
+        if (old.packfile == entry.packfile)
+            fprintf(stderr, "WARNING: duplicate updateEntry\n");
+        if (old.packfile != entry.packfile || old.offset != entry.offset)
+            _addDead(old);
     }
 
-    // Add to in-memory index
-    index[objId] = entry;
+    // Add to in-memory journal
+    journal[objId] = entry;
+}
+
+void
+Index::removeEntry(const ObjectHash &objId)
+{
+    Monitor m(lock);
+    IndexEntry entry;
+
+    if (!_lookup(objId, &entry))
+        return;
+
+    _addDead(entry);
+    entry.offset = 0;
+    entry.packed_size = 0;
+    entry.packfile = INDEX_PACKFILE_REMOVED;
+
+    _writeEntry(entry);
+    journal[objId] = entry;
 }
 
-const IndexEntry &
+IndexEntry
 Index::getEntry(const ObjectHash &objId) const
 {
-    unordered_map<ObjectHash, IndexEntry>::const_iterator it = index.find(objId);
-    ASSERT(it != index.end());
+    Monitor m(lock);
+    IndexEntry entry;
+
+    bool found UNUSED = _lookup(objId, &entry);
+    ASSERT(found);
 
-    return (*it).second;
+    return entry;
 }
 
-const ObjectInfo &
+ObjectInfo
 Index::getInfo(const ObjectHash &objId) const
 {
     return getEntry(objId).info;
@@ -222,45 +412,574 @@ Index::getInfo(const ObjectHash &objId) const
 bool
 Index::hasObject(const ObjectHash &objId) const
 {
+    Monitor m(lock);
+
+    return _lookup(objId, NULL);
+}
+
+BloomFilter
+Index::getFilter() const
+{
+    Monitor m(lock);
+    BloomFilter f;
     unordered_map<ObjectHash, IndexEntry>::const_iterator it;
 
-    it = index.find(objId);
+    // Extending the sorted index filter only raises its false positive rate
+    f = filter;
+    if (f.isEmpty()) {
+        // Sorted indices without a filter are only scanned when asked
+        f.reset(sortedCount + journal.size());
+        for (uint64_t i = 0; i < sortedCount; i++) {
+            const uint8_t *rec = sorted + INDEX_SORTED_HDRSIZE +
+                                 i * IndexEntry::SIZE;
+            ObjectHash hash;
+
+            memcpy(hash.hash, rec + ENTRY_HASHOFF, ObjectHash::SIZE);
+            f.add(hash);
+        }
+    }
+    for (it = journal.begin(); it != journal.end(); it++) {
+        if ((*it).second.packfile != INDEX_PACKFILE_REMOVED)
+            f.add((*it).first);
+    }
 
-    return it != index.end();
+    return f;
 }
 
 set<ObjectInfo>
 Index::getList()
 {
+    Monitor m(lock);
     set<ObjectInfo> lst;
     unordered_map<ObjectHash, IndexEntry>::iterator it;
 
-    for (it = index.begin(); it != index.end(); it++)
+    for (uint64_t i = 0; i < sortedCount; i++)
+    {
+        IndexEntry e;
+        _decodeEntry(sorted + INDEX_SORTED_HDRSIZE + i * IndexEntry::SIZE, e);
+        if (journal.find(e.info.hash) == journal.end())
+            lst.insert(e.info);
+    }
+    for (it = journal.begin(); it != journal.end(); it++)
+    {
+        if ((*it).second.packfile != INDEX_PACKFILE_REMOVED)
+            lst.insert((*it).second.info);
+    }
+
+    return lst;
+}
+
+/*
+ * Objects with entries that are not written yet are listed as of their
+ * last written entry, so the list never includes what a crash could lose.
+ */
+set<ObjectInfo>
+Index::getSyncedList(uint64_t &gen, uint64_t &pos) const
+{
+    Monitor m(lock);
+    set<ObjectInfo> lst;
+    unordered_map<ObjectHash, IndexEntry>::const_iterator it;
+
+    for (uint64_t i = 0; i < sortedCount; i++)
+    {
+        IndexEntry e;
+        _decodeEntry(sorted + INDEX_SORTED_HDRSIZE + i * IndexEntry::SIZE, e);
+        if (journal.find(e.info.hash) == journal.end() &&
+            unsynced.find(e.info.hash) == unsynced.end())
+            lst.insert(e.info);
+    }
+    for (it = journal.begin(); it != journal.end(); it++)
     {
-        lst.insert((*it).second.info);
+        if ((*it).second.packfile != INDEX_PACKFILE_REMOVED &&
+            unsynced.find((*it).first) == unsynced.end())
+            lst.insert((*it).second.info);
+    }
+    for (it = unsynced.begin(); it != unsynced.end(); it++)
+    {
+        if ((*it).second.packfile != INDEX_PACKFILE_REMOVED)
+            lst.insert((*it).second.info);
     }
 
+    gen = generation;
+    pos = written;
+
     return lst;
 }
 
+/*
+ * Only written entries are listed, a cursor never points past entries that
+ * a crash could lose.  Entries of objects moved or removed since they were
+ * added are skipped.
+ */
+bool
+Index::getAddedSince(uint64_t &gen, uint64_t &pos,
+                     set<ObjectInfo> &added) const
+{
+    Monitor m(lock);
+    unordered_set<ObjectHash> seen;
+
+    if (gen != generation || pos > written) {
+        gen = generation;
+        pos = written;
+        return false;
+    }
+
+    for (uint64_t i = pos; i < written; i++) {
+        IndexEntry e;
+
+        if (!seen.insert(order[i]).second)
+            continue;
+        if (_lookup(order[i], &e))
+            added.insert(e.info);
+    }
+    pos = written;
+
+    return true;
+}
+
+bool
+Index::getDeadBytes(map<packid_t, uint64_t> &dead) const
+{
+    Monitor m(lock);
+
+    dead = deadBytes;
+    return deadKnown;
+}
 
 void
-Index::_writeEntry(const IndexEntry &e)
+Index::setDeadBytes(const map<packid_t, uint64_t> &dead)
 {
+    Monitor m(lock);
+
+    deadBytes = dead;
+    deadKnown = true;
+    deadDirty = true;
+}
+
+void
+Index::clearDeadBytes(packid_t id)
+{
+    Monitor m(lock);
+
+    if (deadBytes.erase(id) != 0)
+        deadDirty = true;
+}
+
+/// Caller must hold the lock
+void
+Index::_addDead(const IndexEntry &old)
+{
+    deadBytes[old.packfile] += old.packed_size;
+    deadDirty = true;
+}
+
+void
+Index::_loadDead()
+{
+    string deadFile = fileName + INDEX_DEAD_EXT;
+
+    deadBytes.clear();
+    deadKnown = false;
+    deadDirty = false;
+    if (!OriFile_Exists(deadFile))
+        return;
+
+    try {
+        strstream ss(OriFile_ReadFile(deadFile));
+        uint64_t num = ss.readUInt64();
+
+        for (uint64_t i = 0; i < num; i++) {
+            packid_t id = ss.readUInt64();
+            deadBytes[id] = ss.readUInt64();
+        }
+        deadKnown = true;
+    } catch (std::ios_base::failure &e) {
+        WARNING("Dead byte counts are truncated, they will be recomputed");
+        deadBytes.clear();
+    }
+}
+
+/*
+ * The counts are only a hint for repacking so they are replaced without
+ * waiting for them to reach the disk.  Caller must hold the lock.
+ */
+void
+Index::_saveDead()
+{
+    string deadFile = fileName + INDEX_DEAD_EXT;
+    string tmpFile = deadFile + ".tmp";
     strwstream ss;
 
-    string info_str = e.info.toString();
-    ss.write(info_str.data(), info_str.size());
+    ss.writeUInt64(deadBytes.size());
+    for (map<packid_t, uint64_t>::iterator it = deadBytes.begin();
+            it != deadBytes.end();
+            it++) {
+        ss.writeUInt64((*it).first);
+        ss.writeUInt64((*it).second);
+    }
+
+    if (!OriFile_WriteFile(ss.str(), tmpFile) ||
+            OriFile_Rename(tmpFile, deadFile) < 0) {
+        WARNING("Could not save the dead byte counts");
+        return;
+    }
+    deadDirty = false;
+}
+
+/*
+ * Maps the sorted index if present.
+ */
+void
+Index::_openSorted()
+{
+    string sortedFile = fileName + INDEX_SORTED_EXT;
+    struct stat sb;
+
+    _closeSorted();
+
+    int sfd = ::open(sortedFile.c_str(), O_RDONLY);
+    if (sfd < 0) {
+        if (errno == ENOENT)
+            return;
+        WARNING("Could not open the sorted index!");
+        throw SystemException();
+    }
+
+    if (::fstat(sfd, &sb) < 0) {
+        int errcode = errno;
+        ::close(sfd);
+        WARNING("Could not fstat the sorted index!");
+        throw SystemException(errcode);
+    }
+
+    if (sb.st_size < INDEX_SORTED_HDRSIZE) {
+        ::close(sfd);
+        WARNING("Sorted index is truncated please rebuild it!");
+        throw RuntimeException(ORIEC_INDEXCORRUPT, "Index corrupt");
+    }
+
+    void *addr = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, sfd, 0);
+    ::close(sfd);
+    if (addr == MAP_FAILED) {
+        WARNING("Could not map the sorted index!");
+        throw SystemException();
+    }
+
+    sorted = (const uint8_t *)addr;
+    sortedLength = sb.st_size;
+
+    strstream ss(string((const char *)sorted, 16));
+    char magic[4];
+    ss.readExact((uint8_t *)magic, 4);
+    sortedVersion = ss.readUInt32();
+    sortedCount = ss.readUInt64();
+
+    size_t entriesEnd = INDEX_SORTED_HDRSIZE + sortedCount * IndexEntry::SIZE;
+    if (memcmp(magic, INDEX_SORTED_MAGIC, 4) != 0 ||
+            sortedVersion < INDEX_SORTED_VERSION_1 ||
+            sortedVersion > INDEX_SORTED_VERSION ||
+            sortedLength < entriesEnd ||
+            (sortedVersion == INDEX_SORTED_VERSION_1 &&
+             sortedLength != entriesEnd)) {
+        _closeSorted();
+        WARNING("Sorted index is corrupt please rebuild it!");
+        throw RuntimeException(ORIEC_INDEXCORRUPT, "Index corrupt");
+    }
+
+    // The filter is probed in place, version 1 indices go without one
+    // until they are merged
+    if (sortedVersion >= INDEX_SORTED_VERSION_2) {
+        try {
+            filter.attach(sorted + entriesEnd, sortedLength - entriesEnd);
+        } catch (SerializationException &e) {
+            WARNING("Sorted index filter is corrupt, ignoring it");
+        }
+    }
+}
+
+void
+Index::_closeSorted()
+{
+    filter = BloomFilter();
+    if (sorted != NULL) {
+        munmap((void *)sorted, sortedLength);
+        sorted = NULL;
+        sortedLength = 0;
+        sortedCount = 0;
+    }
+}
+
+/*
+ * Binary search the sorted index within the range given by the fanout table.
+ */
+const uint8_t *
+Index::_findSorted(const ObjectHash &objId) const
+{
+    if (sortedCount == 0)
+        return NULL;
+
+    const uint8_t *fanout = sorted + 16;
+    uint8_t first = objId.hash[0];
+    uint64_t lo = 0, hi;
+
+    if (first > 0)
+        lo = be64toh(*(const uint64_t *)(fanout + (first - 1) * 8));
+    hi = be64toh(*(const uint64_t *)(fanout + first * 8));
+
+    while (lo < hi) {
+        uint64_t mid = lo + (hi - lo) / 2;
+        const uint8_t *rec = sorted + INDEX_SORTED_HDRSIZE +
+                             mid * IndexEntry::SIZE;
+        int cmp = memcmp(rec + ENTRY_HASHOFF, objId.hash, ObjectHash::SIZE);
+
+        if (cmp == 0)
+            return rec;
+        if (cmp < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return NULL;
+}
+
+/// Caller must hold the lock
+bool
+Index::_lookup(const ObjectHash &objId, IndexEntry *entry) const
+{
+    unordered_map<ObjectHash, IndexEntry>::const_iterator it;
+
+    it = journal.find(objId);
+    if (it != journal.end()) {
+        if ((*it).second.packfile == INDEX_PACKFILE_REMOVED)
+            return false;
+        if (entry)
+            *entry = (*it).second;
+        return true;
+    }
 
-    ss.writeUInt32(e.offset);
-    ss.writeUInt32(e.packed_size);
-    ss.writeUInt32(e.packfile);
+    if (!filter.mayContain(objId))
+        return false;
+
+    const uint8_t *rec = _findSorted(objId);
+    if (rec == NULL)
+        return false;
+
+    if (entry)
+        _decodeEntry(rec, *entry);
+    return true;
+}
+
+/*
+ * Merge the journal with the current sorted index into a new sorted index,
+ * then truncate the journal.  The new index is renamed into place before
+ * the journal is truncated, so a crash in between only leaves duplicate
+ * journal entries behind.  Caller must hold the write lock.
+ */
+void
+Index::_merge()
+{
+    string sortedFile = fileName + INDEX_SORTED_EXT;
+    string tmpFile = sortedFile + ".tmp";
+
+    vector<IndexEntry> delta;
+    delta.reserve(journal.size());
+    for (unordered_map<ObjectHash, IndexEntry>::iterator it = journal.begin();
+            it != journal.end();
+            it++)
+    {
+        delta.push_back((*it).second);
+    }
+    sort(delta.begin(), delta.end(), _entryCmp);
+
+    int tmpFd = ::open(tmpFile.c_str(), O_WRONLY | O_CREAT | O_TRUNC,
+                       S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    if (tmpFd < 0) {
+        perror("open");
+        WARNING("Could not open a temporary index file!");
+        return;
+    }
+
+    fdwstream out(tmpFd);
+    vector<uint64_t> fanout(256, 0);
+    uint64_t count = 0;
+    BloomFilter newFilter(sortedCount + delta.size());
+
+    // Header and fanout are filled in once the count is known
+    string placeholder(INDEX_SORTED_HDRSIZE, '\0');
+    out.write(placeholder.data(), placeholder.size());
+
+    strwstream buf(INDEX_MERGE_BUFSZ);
+    uint64_t i = 0;
+    size_t j = 0;
+    while (i < sortedCount || j < delta.size()) {
+        const uint8_t *rec = NULL;
+        int cmp = 1;
+
+        if (i < sortedCount) {
+            rec = sorted + INDEX_SORTED_HDRSIZE + i * IndexEntry::SIZE;
+            cmp = (j < delta.size()) ?
+                memcmp(rec + ENTRY_HASHOFF, delta[j].info.hash.hash,
+                       ObjectHash::SIZE) : -1;
+        }
+
+        uint8_t first;
+        if (cmp < 0) {
+            ObjectHash hash;
+
+            buf.write(rec, IndexEntry::SIZE);
+            memcpy(hash.hash, rec + ENTRY_HASHOFF, ObjectHash::SIZE);
+            newFilter.add(hash);
+            first = rec[ENTRY_HASHOFF];
+            i++;
+        } else {
+            // Journal entries replace sorted entries
+            if (cmp == 0)
+                i++;
+            if (delta[j].packfile == INDEX_PACKFILE_REMOVED) {
+                j++;
+                continue;
+            }
+            _encodeEntry(buf, delta[j]);
+            newFilter.add(delta[j].info.hash);
+            first = delta[j].info.hash.hash[0];
+            j++;
+        }
+        fanout[first]++;
+        count++;
+
+        if (buf.str().size() >= INDEX_MERGE_BUFSZ) {
+            out.write(buf.str().data(), buf.str().size());
+            buf = strwstream(INDEX_MERGE_BUFSZ);
+        }
+    }
+    out.write(buf.str().data(), buf.str().size());
+
+    string filterBlob = newFilter.getBlob();
+    out.write(filterBlob.data(), filterBlob.size());
+
+    strwstream hdr;
+    hdr.write(INDEX_SORTED_MAGIC, 4);
+    hdr.writeUInt32(INDEX_SORTED_VERSION);
+    hdr.writeUInt64(count);
+    uint64_t total = 0;
+    for (size_t b = 0; b < 256; b++) {
+        total += fanout[b];
+        hdr.writeUInt64(total);
+    }
+    ASSERT(hdr.str().size() == INDEX_SORTED_HDRSIZE);
+
+    if (out.error() ||
+        pwrite(tmpFd, hdr.str().data(), hdr.str().size(), 0) < 0 ||
+        ::fsync(tmpFd) < 0) {
+        perror("write");
+        WARNING("Could not write the sorted index!");
+        ::close(tmpFd);
+        OriFile_Delete(tmpFile);
+        return;
+    }
+    ::close(tmpFd);
+
+    _closeSorted();
+    OriFile_Rename(tmpFile, sortedFile);
+    _openSorted();
+
+    // Truncate the journal
+    if (ftruncate(fd, 0) < 0) {
+        perror("ftruncate");
+        WARNING("Could not truncate the index journal!");
+    }
+    generation++;
+    _writeHeader();
+    ::fsync(fd);
+    journal.clear();
+    // Buffered entries are part of the sorted index now
+    pending.clear();
+    unsynced.clear();
+    order.clear();
+    written = 0;
+}
+
+void
+Index::_writeHeader()
+{
+    strwstream ss;
+
+    ss.write(INDEX_MAGIC, 4);
+    ss.writeUInt32(INDEX_VERSION);
+    ss.writeUInt64(generation);
+
+    const string &final = ss.str();
+    ASSERT(final.size() == INDEX_HDRSIZE);
+    write(fd, final.data(), final.size());
+    version = INDEX_VERSION;
+}
+
+void
+Index::_writeEntry(const IndexEntry &e)
+{
+    strwstream ss;
+
+    _encodeEntry(ss, e);
 
     ObjectHash checksum = OriCrypt_HashString(ss.str());
     ss.write(checksum.hash, 16);
 
     const string &final = ss.str();
     ASSERT(final.size() == TOTAL_ENTRYSIZE);
-    write(fd, final.data(), final.size());
+
+    // Remember the written state, the journal is updated after this
+    if (unsynced.find(e.info.hash) == unsynced.end()) {
+        IndexEntry prev;
+
+        if (!_lookup(e.info.hash, &prev))
+            prev.packfile = INDEX_PACKFILE_REMOVED;
+        unsynced[e.info.hash] = prev;
+    }
+
+    pending.append(final);
+    order.push_back(e.info.hash);
+}
+
+/*
+ * Appends the buffered journal entries before entry upto of order.  Caller
+ * must hold the lock.
+ */
+void
+Index::_flushJournal(uint64_t upto)
+{
+    if (upto <= written)
+        return;
+
+    ASSERT(upto <= order.size());
+    size_t bytes = (upto - written) * TOTAL_ENTRYSIZE;
+    ssize_t len = write(fd, pending.data(), bytes);
+    if (len < 0 || (size_t)len != bytes ||
+        OriFile_DataSync(fd) < 0) {
+        perror("write");
+        WARNING("Could not write the index journal!");
+        throw SystemException();
+    }
+
+    // Written entries are the written state until later ones are written
+    if (upto == order.size()) {
+        unsynced.clear();
+    } else {
+        unordered_set<ObjectHash> later(order.begin() + upto, order.end());
+
+        for (uint64_t i = 0; i < upto - written; i++) {
+            IndexEntry e;
+
+            _decodeEntry((const uint8_t *)pending.data() +
+                         i * TOTAL_ENTRYSIZE, e);
+            if (later.find(e.info.hash) != later.end())
+                unsynced[e.info.hash] = e;
+            else
+                unsynced.erase(e.info.hash);
+        }
+    }
+
+    pending.erase(0, bytes);
+    written = upto;
 }
 
@@ -39,8 +39,11 @@
 
 #include <oriutil/debug.h>
 #include <oriutil/oricrypt.h>
+#include <oriutil/systemexception.h>
 #include <ori/largeblob.h>
 
+#include "tuneables.h"
+
 #ifdef ORI_USE_RK
 #include "rkchunker.h"
 #endif /* ORI_USE_RK */
@@ -90,14 +93,92 @@ LargeBlob::~LargeBlob()
 {
 }
 
+/*
+ * Computes the contents hash of a large file and saves its state at every
+ * multiple of LARGEFILE_HASHMARK.  The interval is a multiple of the SHA-256
+ * block size, so a saved state is just the chaining value.
+ */
+class LBlobHasher
+{
+public:
+    LBlobHasher(map<uint64_t, string> *m)
+        : marks(m), off(0)
+    {
+        SHA256_Init(&state);
+    }
+    /*
+     * Continues from the last saved state at or before limit and drops the
+     * later ones.  Returns the offset to hash from.
+     */
+    uint64_t resume(uint64_t limit)
+    {
+        map<uint64_t, string>::iterator it = marks->upper_bound(limit);
+
+        marks->erase(it, marks->end());
+        if (marks->empty())
+            return 0;
+
+        it = marks->end();
+        it--;
+        off = (*it).first;
+        const uint8_t *h = (const uint8_t *)(*it).second.data();
+        for (int i = 0; i < 8; i++) {
+            state.h[i] = ((uint32_t)h[4 * i] << 24) |
+                         ((uint32_t)h[4 * i + 1] << 16) |
+                         ((uint32_t)h[4 * i + 2] << 8) |
+                         (uint32_t)h[4 * i + 3];
+        }
+        state.Nl = (uint32_t)(off << 3);
+        state.Nh = (uint32_t)(off >> 29);
+        state.num = 0;
+
+        return off;
+    }
+    void update(const uint8_t *b, uint64_t len)
+    {
+        while (len > 0) {
+            uint64_t n = MIN(len, LARGEFILE_HASHMARK - off % LARGEFILE_HASHMARK);
+
+            SHA256_Update(&state, b, n);
+            b += n;
+            len -= n;
+            off += n;
+            if (off % LARGEFILE_HASHMARK == 0)
+                save();
+        }
+    }
+    void finish(ObjectHash &hash)
+    {
+        SHA256_Final(hash.hash, &state);
+    }
+private:
+    void save()
+    {
+        string h(32, '\0');
+
+        ASSERT(state.num == 0);
+        for (int i = 0; i < 8; i++) {
+            h[4 * i] = (char)(state.h[i] >> 24);
+            h[4 * i + 1] = (char)(state.h[i] >> 16);
+            h[4 * i + 2] = (char)(state.h[i] >> 8);
+            h[4 * i + 3] = (char)state.h[i];
+        }
+        (*marks)[off] = h;
+    }
+    map<uint64_t, string> *marks;
+    uint64_t off;
+    SHA256_CTX state;
+};
+
 class FileChunkerCB : public ChunkerCB
 {
 public:
-    FileChunkerCB(LargeBlob *l)
+    FileChunkerCB(LargeBlob *l, LBlobHasher *h)
     {
         lb = l;
         lbOff = 0;
         buf = NULL;
+        hasher = h;
     }
     ~FileChunkerCB()
     {
@@ -110,7 +191,7 @@ public:
     {
         struct stat sb;
 
-        bufLen = 8 * 1024 * 1024;
+        bufLen = LARGEFILE_CHUNKBUF;
         buf = new uint8_t[bufLen];
         if (buf == NULL)
             return -ENOMEM;
@@ -171,6 +252,7 @@ public:
             return -1;
         }
         ASSERT(status == (int)toRead);
+        hasher->update(buf + *l, status);
 
         fileOff += status;
         *l += status;
@@ -189,13 +271,16 @@ private:
     // RK buffer
     uint8_t *buf;
     uint64_t bufLen;
+    // Contents hash
+    LBlobHasher *hasher;
 };
 
 void
 LargeBlob::chunkFile(const string &path)
 {
     int status;
-    FileChunkerCB cb = FileChunkerCB(this);
+    LBlobHasher hasher = LBlobHasher(&hashMarks);
+    FileChunkerCB cb = FileChunkerCB(this, &hasher);
 #ifdef ORI_USE_RK
     RKChunker<4096, 2048, 8192> c = RKChunker<4096, 2048, 8192>();
 #endif /* ORI_USE_RK */
@@ -212,11 +297,270 @@ LargeBlob::chunkFile(const string &path)
         return;
     }
 
-    totalHash = OriCrypt_HashFile(path);
+    hashMarks.clear();
+    c.chunk(&cb);
+    hasher.finish(totalHash);
+}
+
+/*
+ * Chunks [off, off + len) of a modified file, reading it a piece at a time
+ * (see LargeBlob::readModified).
+ */
+class ModifiedChunkerCB : public ChunkerCB
+{
+public:
+    ModifiedChunkerCB(LargeBlob *l, int fd, const ExtentMap &dirty,
+                      const map<uint64_t, LBlobEntry> &oldParts,
+                      uint64_t off, uint64_t len)
+        : lb(l), lbOff(off), fd(fd), dirty(dirty), oldParts(oldParts),
+          srcOff(off), srcEnd(off + len), buf(LARGEFILE_CHUNKBUF)
+    {
+    }
+    virtual void match(const uint8_t *b, uint32_t l)
+    {
+        string blob = string((const char *)b, l);
+        ObjectHash hash = OriCrypt_HashString(blob);
+        lb->repo->addObject(ObjectInfo::Blob, hash, blob);
+
+        lb->parts.insert(make_pair(lbOff, LBlobEntry(hash, l)));
+        lbOff += l;
+    }
+    virtual int load(uint8_t **b, uint64_t *l, uint64_t *o)
+    {
+        if (*b == NULL)
+            *b = &buf[0];
+
+        if (srcOff == srcEnd)
+            return 0;
+
+        // Keep the rolling hash window in front of the unmatched bytes
+        if (*l != 0) {
+            ASSERT(*o > 32);
+            memmove(&buf[0], &buf[*o - 32], *l - *o + 32);
+            *l = *l - *o + 32;
+            *o = 32;
+        }
+
+        uint64_t toRead = MIN(buf.size() - *l, srcEnd - srcOff);
+
+        lb->readModified(fd, dirty, oldParts, srcOff, toRead, &buf[*l]);
+        srcOff += toRead;
+        *l += toRead;
+
+        return 1;
+    }
+private:
+    // Output large blob
+    LargeBlob *lb;
+    uint64_t lbOff;
+    // Input file
+    int fd;
+    const ExtentMap &dirty;
+    const map<uint64_t, LBlobEntry> &oldParts;
+    uint64_t srcOff;
+    uint64_t srcEnd;
+    // RK buffer
+    vector<uint8_t> buf;
+};
+
+void
+LargeBlob::chunkModified(int fd, const ExtentMap &dirty,
+                         const map<uint64_t, LBlobEntry> &oldParts,
+                         uint64_t off, uint64_t len)
+{
+    ModifiedChunkerCB cb = ModifiedChunkerCB(this, fd, dirty, oldParts,
+                                             off, len);
+#ifdef ORI_USE_RK
+    RKChunker<4096, 2048, 8192> c = RKChunker<4096, 2048, 8192>();
+#endif /* ORI_USE_RK */
+
+#ifdef ORI_USE_FIXED
+    FChunker<32*1024> c = FChunker<32*1024>();
+#endif /* ORI_USE_FIXED */
+
+    // The rolling hash needs a full window of input
+    if (len <= 32) {
+        uint8_t buf[32];
+
+        readModified(fd, dirty, oldParts, off, len, buf);
+        cb.match(buf, len);
+        return;
+    }
 
     c.chunk(&cb);
 }
 
+/*
+ * Reads [off, off + len) of a modified file into out: bytes in dirty are
+ * read from fd and all others from the chunks of the original version.
+ */
+void
+LargeBlob::readModified(int fd, const ExtentMap &dirty,
+                        const map<uint64_t, LBlobEntry> &oldParts,
+                        uint64_t off, uint64_t len, uint8_t *out)
+{
+    uint64_t pos = off;
+    uint64_t end = off + len;
+
+    while (pos < end) {
+        uint64_t start, stop;
+        bool found = dirty.find(pos, &start, &stop);
+
+        if (found && start <= pos) {
+            uint64_t n = MIN(stop, end) - pos;
+            ssize_t status = pread(fd, out + (pos - off), n, pos);
+
+            if (status < 0) {
+                int errcode = errno;
+                perror("Cannot read modified large file");
+                throw SystemException(errcode);
+            }
+            if ((uint64_t)status != n) {
+                WARNING("Modified large file is shorter than expected");
+                throw SystemException(EIO);
+            }
+            pos += n;
+        } else {
+            uint64_t runEnd = (found && start < end) ? start : end;
+            map<uint64_t, LBlobEntry>::const_iterator it;
+
+            it = oldParts.upper_bound(pos);
+            ASSERT(it != oldParts.begin());
+            it--;
+
+            string payload = repo->getObject((*it).second.hash)->getPayload();
+            ASSERT(payload.size() == (*it).second.length);
+            uint64_t chunkEnd = (*it).first + (*it).second.length;
+            uint64_t n = MIN(runEnd, chunkEnd) - pos;
+
+            memcpy(out + (pos - off), payload.data() + (pos - (*it).first), n);
+            pos += n;
+        }
+    }
+}
+
+/*
+ * Updates this LargeBlob to a modified version of the file.  The file at path
+ * holds the new contents of every byte in dirty; all other bytes below its
+ * size are unchanged from the current parts, so a sparse copy-on-write file
+ * is acceptable.  Each dirty extent is widened to the chunks around it and
+ * only those windows are chunked again, other chunks are reused as is.
+ *
+ * The contents hash covers the whole file since tree entries record it as
+ * the file hash.  It is resumed from the saved state before the first
+ * change, so appending only hashes the new bytes, while a change in the
+ * middle still hashes the rest of the file.
+ */
+void
+LargeBlob::updateFile(const string &path, const ExtentMap &dirty)
+{
+    map<uint64_t, LBlobEntry> oldParts = parts;
+    map<uint64_t, LBlobEntry>::const_iterator it;
+    ExtentMap modified = dirty;
+    ExtentMap windows;
+    ExtentMap::iterator e;
+    uint64_t oldSize = totalSize();
+    uint64_t size;
+    struct stat sb;
+    int fd;
+
+    fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        int errcode = errno;
+        perror("Cannot open large file for rechunking");
+        throw SystemException(errcode);
+    }
+    if (fstat(fd, &sb) < 0) {
+        int errcode = errno;
+        perror("Cannot stat large file for rechunking");
+        ::close(fd);
+        throw SystemException(errcode);
+    }
+    size = sb.st_size;
+
+    // Bytes past the old end only exist in the file
+    if (size > oldSize)
+        modified.add(oldSize, size - oldSize);
+    modified.truncate(size);
+
+    // A chunk that now extends past the end must be cut
+    if (size < oldSize && size > 0) {
+        it = oldParts.upper_bound(size - 1);
+        it--;
+        if ((*it).first + (*it).second.length > size)
+            windows.add((*it).first, size - (*it).first);
+    }
+
+    // Widen dirty extents to the boundaries of the chunks they touch
+    for (e = modified.begin(); e != modified.end(); e++) {
+        uint64_t wStart = (*e).first;
+        uint64_t wEnd = (*e).second;
+
+        if (!oldParts.empty()) {
+            it = oldParts.upper_bound(MIN(wStart, oldSize - 1));
+            it--;
+            wStart = (*it).first;
+        }
+        if (wEnd < MIN(oldSize, size)) {
+            it = oldParts.upper_bound(wEnd - 1);
+            it--;
+            wEnd = MIN((*it).first + (*it).second.length, size);
+        } else {
+            wEnd = size;
+        }
+
+        windows.add(wStart, wEnd - wStart);
+    }
+
+    if (windows.empty() && size == oldSize) {
+        ::close(fd);
+        return;
+    }
+
+    // Reuse untouched chunks and rechunk each window
+    parts.clear();
+    for (it = oldParts.begin(); it != oldParts.end(); it++) {
+        uint64_t start, stop;
+        uint64_t chunkEnd = (*it).first + (*it).second.length;
+
+        if (chunkEnd > size)
+            break;
+        if (windows.find((*it).first, &start, &stop) && start < chunkEnd)
+            continue;
+
+        parts.insert(*it);
+    }
+
+    try {
+        for (e = windows.begin(); e != windows.end(); e++) {
+            chunkModified(fd, modified, oldParts, (*e).first,
+                          (*e).second - (*e).first);
+        }
+        ASSERT(totalSize() == size);
+
+        // Hash from the saved state before the first change
+        LBlobHasher hasher = LBlobHasher(&hashMarks);
+        uint64_t first = windows.empty() ? size :
+                         MIN((*windows.begin()).first, size);
+        uint64_t off = hasher.resume(first);
+        vector<uint8_t> buf(MIN(size - off, (uint64_t)LARGEFILE_CHUNKBUF));
+
+        while (off < size) {
+            uint64_t n = MIN(size - off, (uint64_t)buf.size());
+
+            readModified(fd, modified, oldParts, off, n, &buf[0]);
+            hasher.update(&buf[0], n);
+            off += n;
+        }
+        hasher.finish(totalHash);
+    } catch (...) {
+        ::close(fd);
+        throw;
+    }
+
+    ::close(fd);
+}
+
 void
 LargeBlob::extractFile(const string &path)
 {
@@ -315,6 +659,13 @@ LargeBlob::getBlob()
         ss.writeUInt16(it.second.length);
     }
 
+    // Older versions stop reading after the parts
+    ss.writeUInt64(hashMarks.size());
+    for (auto &it : hashMarks) {
+        ss.writeUInt64(it.first);
+        ss.write(it.second.data(), it.second.size());
+    }
+
     return ss.str();
 }
 
@@ -336,6 +687,19 @@ LargeBlob::fromBlob(const string &blob)
 
         off += length;
     }
+
+    hashMarks.clear();
+    if (!ss.ended()) {
+        size_t marks = ss.readUInt64();
+
+        for (size_t i = 0; i < marks; i++) {
+            uint64_t markOff = ss.readUInt64();
+            string state(32, '\0');
+
+            ss.readExact((uint8_t *)&state[0], 32);
+            hashMarks[markOff] = state;
+        }
+    }
 }
 
 size_t
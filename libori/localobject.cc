@@ -62,11 +62,17 @@ LocalObject::LocalObject(Packfile::sp packfile, const IndexEntry &entry)
 {
 }
 
+LocalObject::LocalObject(const ObjectInfo &info, const string &payload)
+    : Object(info), transaction(), ix_tr(0), packfile(), payload(payload)
+{
+}
+
 LocalObject::~LocalObject()
 {
 }
 
 // XXX: Eliminate duplicate compression code!
+// Packfile objects are read in place from the packfile mapping.
 bytestream *LocalObject::getPayloadStream() {
     if (packfile.get()) {
         return packfile->getPayload(entry);
@@ -75,15 +81,14 @@ bytestream *LocalObject::getPayloadStream() {
         switch(info.getAlgo()) {
             case ObjectInfo::ZIPALGO_NONE:
                 return new strstream(transaction->payloads[ix_tr]);
-            case ObjectInfo::ZIPALGO_FASTLZ:
+            default:
+                ZipCodec_Check(info.getAlgo());
                 return new zipstream(new strstream(transaction->payloads[ix_tr]),
-                                     DECOMPRESS, info.payload_size);
-            case ObjectInfo::ZIPALGO_LZMA:
-            case ObjectInfo::ZIPALGO_UNKNOWN:
-                NOT_IMPLEMENTED(false);
+                                     DECOMPRESS, info.payload_size,
+                                     info.getAlgo());
         }
     }
-    return NULL;
+    return new strstream(payload);
 }
 
 /*
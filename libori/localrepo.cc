@@ -15,6 +15,7 @@
  */
 
 #include <stdint.h>
+#include <cinttypes>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
@@ -45,12 +46,24 @@
 #include <oriutil/oristr.h>
 #include <oriutil/oricrypt.h>
 #include <oriutil/scan.h>
+#include <oriutil/stopwatch.h>
+#include <oriutil/thread.h>
 #include <oriutil/zeroconf.h>
 #include <ori/largeblob.h>
 #include <ori/localrepo.h>
 #include <ori/sshrepo.h>
 #include <ori/remoterepo.h>
 
+#include "tuneables.h"
+
+extern "C" {
+#include <libdiffmerge/delta.h>
+};
+
+#if DELTA_MAXDEPTH > ORI_FLAG_DELTAMAXDEPTH
+#error "DELTA_MAXDEPTH does not fit in the object flags"
+#endif
+
 using namespace std;
 
 #define ORI_DIR_MASK        0755
@@ -195,8 +208,22 @@ LocalRepoLock::~LocalRepoLock()
  *
  ********************************************************************/
 
+void
+LocalRepo_FlushCb(void *arg)
+{
+    LocalRepo *repo = (LocalRepo *)arg;
+
+    repo->flush();
+}
+
 LocalRepo::LocalRepo(const string &root)
     : opened(false),
+      zipAlgo(ZipCodec_Default()),
+      syncer(LocalRepo_FlushCb, this, GROUPCOMMIT_MAXLATENCY),
+      objCache(OBJCACHE_SIZE),
+      purgedDirty(false),
+      repacker(NULL),
+      repackStop(false),
       remoteRepo(NULL)
 {
     rootPath = (root == "") ? findRootPath() : root;
@@ -252,6 +279,22 @@ LocalRepo::open(const string &root)
         throw SystemException();
     }
 
+    // Read the compression codec (optional)
+    zipAlgo = ZipCodec_Default();
+    string zipPath = rootPath + ORI_PATH_COMPRESSION;
+    if (OriFile_Exists(zipPath)) {
+        string name = OriFile_ReadFile(zipPath);
+        name = name.substr(0, name.find_first_of(" \t\r\n"));
+
+        ObjectInfo::ZipAlgo algo = ZipCodec_AlgoFromName(name);
+        if (ZipCodec_IsSupported(algo)) {
+            zipAlgo = algo;
+        } else {
+            WARNING("LocalRepo::open: Unsupported compression '%s', using %s",
+                    name.c_str(), ZipCodec_AlgoName(zipAlgo));
+        }
+    }
+
     // XXX: Check and rebuild index on error
     index.open(rootPath + ORI_PATH_INDEX); // throws SystemException or RuntimeException
 
@@ -273,6 +316,8 @@ LocalRepo::open(const string &root)
         throw e;
     }
     packfiles.reset(new PackfileManager(getRootPath() + ORI_PATH_OBJS));
+    loadPurged();
+    repackStop = false;
 
     // Scan for peers
     string peer_path = rootPath + ORI_PATH_REMOTES;
@@ -301,12 +346,25 @@ LocalRepo::close()
     if (!opened)
         return;
 
+    // A background repack stops after the packfile it is working on
+    {
+        Monitor lock(repackLock);
+        repackStop = true;
+    }
+    waitRepack();
+
     sync();
 
-    currTransaction.reset();
+    {
+        Monitor lock(txnLock);
+        currTransaction.reset();
+        currPackfile.reset();
+    }
     index.close();
     snapshots.close();
     packfiles.reset();
+    objCache.clear();
+    purged.clear();
     opened = false;
 }
 
@@ -421,30 +479,218 @@ Object::sp LocalRepo::getObject(const ObjectHash &objId)
     return Object::sp(o);
 }
 
+/*
+ * Reads the stored objects into the object cache ahead of their use and
+ * returns those that are not stored, see fetchRemoteObjects.  Only reads
+ * the repository.
+ */
+ObjectHashVec
+LocalRepo::prefetchObjects(const ObjectHashVec &objs)
+{
+    ObjectHashVec missing;
+
+    for (size_t i = 0; i < objs.size(); i++) {
+        if (isObjectStored(objs[i]))
+            getLocalObject(objs[i]);
+        else
+            missing.push_back(objs[i]);
+    }
+
+    return missing;
+}
+
+/*
+ * Fetches objects from the instaclone remote with a single request and
+ * returns them in memory, or NULL if they are not cached locally.  Nothing
+ * is written so the caller can pass the stream to receive() once it holds
+ * whatever lock excludes its readers.
+ */
+bytestream *
+LocalRepo::fetchRemoteObjects(const ObjectHashVec &objs)
+{
+    Monitor lock(remoteLock);
+
+    if (objs.empty() || remoteRepo == NULL || !cacheRemoteObjects)
+        return NULL;
+
+    LOG("Instaclone prefetching %lu objects", objs.size());
+    bytestream::ap bs(remoteRepo->getObjects(objs));
+    if (!bs.get())
+        return NULL;
+
+    return new strstream(bs->readAll());
+}
+
 // XXX: Verify and recover from corrupt objects!!!
 // XXX: Why do we check compression in Packfile::getPayload
 // XXX: LocalObject::getStream and transactions multiple places.
-LocalObject::sp LocalRepo::getLocalObject(const ObjectHash &objId)
+LocalObject::sp LocalRepo::getLocalObject(const ObjectHash &objId, bool cache)
 {
     ASSERT(opened);
 
-    if (currTransaction.get()) {
-        if (currTransaction->has(objId)) {
-            return LocalObject::sp(new LocalObject(currTransaction,
-                        currTransaction->hashToIx[objId]));
+    LocalObject::sp o;
+    {
+        /*
+         * Objects in the current transaction are copied out under txnLock,
+         * other threads may add to the transaction once it is released.
+         */
+        Monitor lock(txnLock);
+        if (currTransaction.get() && currTransaction->has(objId)) {
+            size_t ix = currTransaction->hashToIx[objId];
+            LocalObject tobj(currTransaction, ix);
+            ObjectInfo info = tobj.getInfo();
+            string payload = tobj.getPayload();
+
+            info.setAlgo(ObjectInfo::ZIPALGO_NONE);
+            o.reset(new LocalObject(info, payload));
         }
     }
 
+    if (o) {
+        if (o->getInfo().isDelta())
+            return resolveDelta(o);
+        return o;
+    }
+
+    return getPackedObject(objId, cache);
+}
+
+/*
+ * Looks up the packfile holding an object.  The lookup and opening the
+ * packfile happen under packLock so a repack cannot delete the packfile in
+ * between.  Once opened the packfile stays readable even if it is deleted.
+ */
+Packfile::sp
+LocalRepo::getPackfile(const ObjectHash &objId, IndexEntry *ie)
+{
+    RWKey::sp key = packLock.readLock();
+
+    if (!index.hasObject(objId))
+        return Packfile::sp();
+
+    *ie = index.getEntry(objId);
+    return packfiles->getPackfile(ie->packfile);
+}
+
+/*
+ * Reads an object from the packfiles, ignoring the current transaction.
+ * This is safe to call while another thread writes to the repository.
+ * Callers that read an object once, such as checkouts and transfers, pass
+ * cache false so they do not evict the working set of the cache.
+ */
+LocalObject::sp
+LocalRepo::getPackedObject(const ObjectHash &objId, bool cache)
+{
+    IndexEntry ie;
+
     /*
      * The object may not be present locally as is the case with
      * instacloning.
      */
-    if (!index.hasObject(objId))
+    Packfile::sp packfile = getPackfile(objId, &ie);
+    if (!packfile)
 	return LocalObject::sp();
 
-    const IndexEntry &ie = index.getEntry(objId);
-    Packfile::sp packfile = packfiles->getPackfile(ie.packfile);
-    return LocalObject::sp(new LocalObject(packfile, ie));
+    /*
+     * Small objects are returned from the cache fully decompressed and with
+     * any delta chain already applied.  The cached copy is an in-memory
+     * object so its info no longer describes a compressed or delta payload.
+     */
+    ObjectInfo info = ie.info;
+    string payload;
+    if (objCache.get(objId, payload)) {
+        info.setAlgo(ObjectInfo::ZIPALGO_NONE);
+        info.setDeltaDepth(0);
+        return LocalObject::sp(new LocalObject(info, payload));
+    }
+
+    LocalObject::sp o(new LocalObject(packfile, ie));
+    if (info.isDelta())
+        o = resolveDelta(o, true);
+    if (!o || !cache || info.payload_size > OBJCACHE_MAXOBJSIZE)
+        return o;
+
+    payload = o->getPayload();
+    objCache.put(objId, payload);
+
+    info.setAlgo(ObjectInfo::ZIPALGO_NONE);
+    info.setDeltaDepth(0);
+    return LocalObject::sp(new LocalObject(info, payload));
+}
+
+/// Reports a delta object that cannot be resolved and throws
+static void
+deltaCorrupt(const ObjectHash &hash, const string &why)
+{
+    string msg = "Delta object " + hash.hex() + " " + why;
+
+    SYSERROR("%s", msg.c_str());
+    throw RuntimeException(ORIEC_OBJECTCORRUPT, msg);
+}
+
+/*
+ * Reconstructs a delta object in memory by applying its delta to the base
+ * payload.  The base is looked up through getLocalObject so delta chains
+ * (at most DELTA_MAXDEPTH long) resolve recursively.  The base of a packed
+ * delta is always packed and is looked up only in the packfiles.
+ *
+ * A delta that cannot be resolved is corrupt rather than missing, bases are
+ * never purged while a delta refers to them, so this throws a
+ * RuntimeException(ORIEC_OBJECTCORRUPT) instead of returning NULL.
+ */
+LocalObject::sp
+LocalRepo::resolveDelta(LocalObject::sp o, bool packed)
+{
+    ObjectInfo info = o->getInfo();
+    string stored = o->getPayload();
+    ObjectHash base;
+
+    if (stored.size() < ObjectHash::SIZE)
+        deltaCorrupt(info.hash, "is truncated");
+    memcpy(base.hash, stored.data(), ObjectHash::SIZE);
+
+    LocalObject::sp baseObj = packed ? getPackedObject(base)
+                                     : getLocalObject(base);
+    if (!baseObj)
+        deltaCorrupt(info.hash, "refers to missing base " + base.hex());
+
+    string basePayload = baseObj->getPayload();
+    const char *delta = stored.data() + ObjectHash::SIZE;
+    int deltaLen = stored.size() - ObjectHash::SIZE;
+    int len = delta_output_size(delta, deltaLen);
+    if (len < 0 || (uint32_t)len != info.payload_size)
+        deltaCorrupt(info.hash, "has a bad header");
+
+    // delta_apply writes a NUL terminator past the end of the output
+    string payload(len + 1, '\0');
+    if (delta_apply(basePayload.data(), basePayload.size(),
+                    delta, deltaLen, &payload[0]) != len)
+        deltaCorrupt(info.hash, "does not apply to its base");
+    payload.resize(len);
+
+    info.setAlgo(ObjectInfo::ZIPALGO_NONE);
+    info.setDeltaDepth(0);
+    return LocalObject::sp(new LocalObject(info, payload));
+}
+
+/*
+ * Returns the hash of the base object a stored delta refers to, or an empty
+ * hash if the object is not stored as a delta.
+ */
+ObjectHash
+LocalRepo::getDeltaBase(const ObjectHash &objId)
+{
+    IndexEntry ie;
+    ObjectHash base;
+
+    Packfile::sp packfile = getPackfile(objId, &ie);
+    if (!packfile || !ie.info.isDelta())
+        return base;
+
+    bytestream::ap bs(packfile->getStoredPayload(ie.offset, ObjectHash::SIZE));
+    bs->readHash(base);
+
+    return base;
 }
 
 void
@@ -489,35 +735,47 @@ LocalRepo::objIdToPath(const ObjectHash &objId)
 int
 LocalRepo::addObject(ObjectType type, const ObjectHash &hash,
         const std::string &payload)
+{
+    return addObject(type, hash, payload, ObjectHash());
+}
+
+int
+LocalRepo::addObject(ObjectType type, const ObjectHash &hash,
+        const std::string &payload, const ObjectHash &deltaBase)
 {
     ASSERT(opened);
     ASSERT(!hash.isEmpty());
 
-    purged.erase(hash);
-
-    if (isObjectStored(hash)) return 0;
-
-    if (!currPackfile.get()) {
-        currPackfile = packfiles->newPackfile();
-        currTransaction = currPackfile->begin(&index);
-    }
-
-    if (!currTransaction.get()) {
-        currTransaction = currPackfile->begin(&index);
-    }
-
-    if (currTransaction->full()) {
-        currTransaction->commit();
-        currTransaction.reset();
-        currPackfile = packfiles->newPackfile();
-        currTransaction = currPackfile->begin(&index);
+    {
+        // A repack drops purged objects unless they are added again first
+        Monitor lock(purgeLock);
+        if (purged.erase(hash) != 0)
+            purgedDirty = true;
     }
+    if (isObjectStored(hash))
+        return 0;
 
     ObjectInfo info(hash);
     info.type = type;
     info.payload_size = payload.size();
 
-    currTransaction->addPayload(info, payload);
+    // Computed before taking txnLock, it reads the base object
+    string stored;
+    bool isDelta = !deltaBase.isEmpty() &&
+                   makeDelta(info, payload, deltaBase, &stored);
+
+    Monitor lock(txnLock);
+
+    // Another thread may have added the object in the meantime
+    if ((currTransaction.get() && currTransaction->has(hash)) ||
+        index.hasObject(hash))
+        return 0;
+
+    beginTransaction();
+    if (isDelta)
+        currTransaction->addStored(info, stored);
+    else
+        currTransaction->addPayload(info, payload);
 
 
     /*string objPath = objIdToPath(hash);
@@ -537,11 +795,98 @@ LocalRepo::addObject(ObjectType type, const ObjectHash &hash,
     return 0;
 }
 
+/*
+ * Encodes the object as a delta against deltaBase, filling in the stored
+ * form and updating info to match.  Returns false if the base is not
+ * stored locally, the delta chain would grow beyond DELTA_MAXDEPTH or the
+ * delta is not much smaller than the payload.
+ */
+bool
+LocalRepo::makeDelta(ObjectInfo &info, const std::string &payload,
+                     const ObjectHash &deltaBase, std::string *stored)
+{
+    ObjectInfo baseInfo;
+
+    if (info.type != ObjectInfo::Blob && info.type != ObjectInfo::Tree)
+        return false;
+    if (payload.size() < DELTA_MINIMUM_SIZE || deltaBase == info.hash)
+        return false;
+
+    {
+        // Purged objects are about to be dropped
+        Monitor lock(purgeLock);
+        if (purged.find(deltaBase) != purged.end())
+            return false;
+    }
+
+    {
+        Monitor lock(txnLock);
+        if (currTransaction.get() && currTransaction->has(deltaBase)) {
+            size_t ix = currTransaction->hashToIx[deltaBase];
+            baseInfo = currTransaction->infos[ix];
+        } else if (index.hasObject(deltaBase)) {
+            baseInfo = index.getInfo(deltaBase);
+        } else {
+            return false;
+        }
+    }
+
+    if (baseInfo.type != info.type ||
+        baseInfo.getDeltaDepth() + 1 > DELTA_MAXDEPTH)
+        return false;
+
+    LocalObject::sp baseObj = getLocalObject(deltaBase);
+    if (!baseObj)
+        return false;
+    string basePayload = baseObj->getPayload();
+
+    // delta_create needs 60 bytes of slack beyond the payload size
+    string delta(payload.size() + 60, '\0');
+    int len = delta_create(basePayload.data(), basePayload.size(),
+                           payload.data(), payload.size(), &delta[0]);
+    if (len < 0 || len > payload.size() * DELTA_MAXRATIO)
+        return false;
+    delta.resize(len);
+
+    info.setAlgo(ObjectInfo::ZIPALGO_NONE);
+    info.setDeltaDepth(baseInfo.getDeltaDepth() + 1);
+    *stored = deltaBase.bin() + delta;
+
+    return true;
+}
+
+/*
+ * Makes sure there is an open packfile transaction with room for an object.
+ * The caller holds txnLock.
+ */
+void
+LocalRepo::beginTransaction()
+{
+    if (!currPackfile.get()) {
+        currPackfile = packfiles->newPackfile();
+        currTransaction = currPackfile->begin(&index, zipAlgo);
+    }
+
+    if (!currTransaction.get()) {
+        currTransaction = currPackfile->begin(&index, zipAlgo);
+    }
+
+    if (currTransaction->full()) {
+        currTransaction->commit();
+        currTransaction.reset();
+        // Bound the amount of unsynced data
+        syncer.sync();
+        if (currPackfile->full())
+            currPackfile = packfiles->newPackfile();
+        currTransaction = currPackfile->begin(&index, zipAlgo);
+    }
+}
+
 /*
  * Add a tree to the repository.
  */
 ObjectHash
-LocalRepo::addTree(const Tree &tree)
+LocalRepo::addTree(const Tree &tree, const ObjectHash &deltaBase)
 {
     string blob = tree.getBlob();
     ObjectHash hash = OriCrypt_HashString(blob);
@@ -560,7 +905,7 @@ LocalRepo::addTree(const Tree &tree)
         //o.close();
     }*/
 
-    return addBlob(ObjectInfo::Tree, blob);
+    return addBlob(ObjectInfo::Tree, blob, deltaBase);
 }
 
 /*
@@ -655,23 +1000,39 @@ string
 LocalRepo::verifyObject(const ObjectHash &objId)
 {
     LocalObject::sp o;
-    ObjectType type;
 
     if (!hasObject(objId))
 	return "Object not found!";
 
+    // Read the payload back from the packfile rather than the cache
+    objCache.invalidate(objId);
+
     // XXX: Add better error handling
-    o = getLocalObject(objId);
+    try {
+        o = getLocalObject(objId, false);
+    } catch (RuntimeException &e) {
+        return e.what();
+    }
     if (!o)
 	return "Cannot open object!";
 
-    type = o->getInfo().type;
+    return verifyPayload(o->getInfo(), o->getPayload());
+}
+
+/*
+ * Checks an object's payload against its hash and type.
+ */
+string
+LocalRepo::verifyPayload(const ObjectInfo &info, const string &payload)
+{
+    ObjectType type = info.type;
+
     if (type == ObjectInfo::Null)
         return "Object with Null type!";
 
     if (type != ObjectInfo::Purged) {
-        ObjectHash computedHash = OriCrypt_HashString(o->getPayload());
-        if (computedHash != objId) {
+        ObjectHash computedHash = OriCrypt_HashString(payload);
+        if (computedHash != info.hash) {
             stringstream ss;
             ss << "Object hash mismatch! (computed hash "
                << computedHash.hex()
@@ -683,13 +1044,13 @@ LocalRepo::verifyObject(const ObjectHash &objId)
     switch(type) {
 	case ObjectInfo::Commit:
 	{
-	    // XXX: Verify tree and parents exist
+	    // Verifier checks that the tree and parents exist
 	    break;
 	}
 	case ObjectInfo::Tree:
 	{
             Tree t;
-            t.fromBlob(o->getPayload());
+            t.fromBlob(payload);
             for (map<string, TreeEntry>::iterator it = t.tree.begin();
                     it != t.tree.end();
                     it++) {
@@ -697,7 +1058,7 @@ LocalRepo::verifyObject(const ObjectHash &objId)
                     return string("TreeEntry ") + (*it).first + " missing basic attrs";
             }
 
-	    // XXX: Verify subtrees and blobs exist
+	    // Verifier checks that subtrees and blobs exist
 	    break;
 	}
 	case ObjectInfo::Blob:
@@ -707,7 +1068,7 @@ LocalRepo::verifyObject(const ObjectHash &objId)
         case ObjectInfo::LargeBlob:
         {
             LargeBlob lb(this);
-            lb.fromBlob(o->getPayload());
+            lb.fromBlob(payload);
             for (map<uint64_t, LBlobEntry>::iterator it = lb.parts.begin();
                  it != lb.parts.end(); it++)
             {
@@ -715,7 +1076,7 @@ LocalRepo::verifyObject(const ObjectHash &objId)
                     return "LargeBlob contains an empty hash!";
                 }
             }
-            // XXX: Verify fragments
+            // Verifier checks that the fragments exist
             // XXX: Verify file hash matches largeObject's file hash
             break;
         }
@@ -725,7 +1086,7 @@ LocalRepo::verifyObject(const ObjectHash &objId)
 	    return "Object with unknown type!";
     }
 
-    if (!o->getInfo().hasAllFields()) {
+    if (!info.hasAllFields()) {
         return "Object info missing some fileds!";
     }
 
@@ -740,7 +1101,9 @@ LocalRepo::verifyObject(const ObjectHash &objId)
 bool
 LocalRepo::copyObject(const ObjectHash &objId, const string &path)
 {
-    Object::sp o = getObject(objId);
+    Object::sp o = getLocalObject(objId, false);
+    if (!o)
+        o = getObject(objId);
 
     // XXX: Add better error handling
     if (!o) {
@@ -767,22 +1130,126 @@ LocalRepo::listObjects()
 }
 
 /*
- * This gu
+ * Commits the current transaction and makes everything written so far
+ * durable.  Concurrent callers share a single flush (see GroupCommit).
+ *
+ * After a crash the repository contains at least the objects and metadata
+ * written before the last completed sync().  Packfiles are flushed before
+ * the index journal is written, so an index entry never refers to an
+ * object that is not on disk.
  */
 void
 LocalRepo::sync()
 {
-    bool full = false;
-    if (currTransaction.get()) {
-        full = currTransaction->full();
-        currTransaction->commit();
-        currTransaction.reset();
-        index.sync();
-        metadata.sync();
+    {
+        Monitor lock(txnLock);
+        bool full = false;
+        if (currTransaction.get()) {
+            currTransaction->commit();
+            full = currPackfile->full();
+            currTransaction.reset();
+        }
+        if (full) {
+            currPackfile = packfiles->newPackfile();
+            currTransaction = currPackfile->begin(&index, zipAlgo);
+        }
     }
-    if (full) {
-        currPackfile = packfiles->newPackfile();
-        currTransaction = currPackfile->begin(&index);
+
+    syncer.sync();
+}
+
+void
+LocalRepo::setSyncLatency(uint64_t usecs)
+{
+    syncer.setMaxLatency(usecs);
+}
+
+void
+LocalRepo::setCacheSize(uint64_t bytes)
+{
+    objCache.setBudget(bytes);
+}
+
+ObjectCacheStats
+LocalRepo::getCacheStats()
+{
+    return objCache.getStats();
+}
+
+/*
+ * Writes back packfiles, then the index and finally the metadata log.  The
+ * purge set is captured before the index is written, so an object a repack
+ * removed from the index is only forgotten once its removal is durable.
+ * Transactions may commit while packfiles are synced, only the index
+ * entries buffered before they were synced are written.
+ */
+void
+LocalRepo::flush()
+{
+    bool savePurged = false;
+    strwstream ss;
+    uint64_t idxGen, idxPos;
+
+    {
+        Monitor lock(purgeLock);
+        if (purgedDirty) {
+            ss.writeUInt64(purged.size());
+            for (set<ObjectHash>::iterator it = purged.begin();
+                    it != purged.end();
+                    it++) {
+                ss.writeHash(*it);
+            }
+            purgedDirty = false;
+            savePurged = true;
+        }
+    }
+
+    index.getSyncMark(idxGen, idxPos);
+    if (packfiles.get())
+        packfiles->sync();
+    index.sync(idxGen, idxPos);
+    metadata.sync();
+
+    if (savePurged) {
+        string path = rootPath + ORI_PATH_PURGED;
+        if (!OriFile_WriteFile(ss.str(), path + ".tmp") ||
+                OriFile_Rename(path + ".tmp", path) < 0) {
+            WARNING("Could not save the purged objects");
+            Monitor lock(purgeLock);
+            purgedDirty = true;
+        }
+    }
+}
+
+/*
+ * Reads the objects that were purged but not yet repacked.  Objects that
+ * were dropped or referenced again since are left out.
+ */
+void
+LocalRepo::loadPurged()
+{
+    string path = rootPath + ORI_PATH_PURGED;
+
+    purged.clear();
+    purgedDirty = false;
+    if (!OriFile_Exists(path))
+        return;
+
+    try {
+        strstream ss(OriFile_ReadFile(path));
+        uint64_t num = ss.readUInt64();
+
+        for (uint64_t i = 0; i < num; i++) {
+            ObjectHash hash;
+            ss.readHash(hash);
+            if (index.hasObject(hash) && metadata.getRefCount(hash) == 0)
+                purged.insert(hash);
+            else
+                purgedDirty = true;
+        }
+    } catch (std::ios_base::failure &e) {
+        WARNING("The purged objects are truncated, some space may leak");
+        purgedDirty = true;
     }
 }
 
@@ -793,14 +1260,14 @@ struct RebuildIndexStruct
 };
 
 void
-rebuildIndexCb(const ObjectInfo &info, offset_t off, void *arg)
+rebuildIndexCb(const ObjectInfo &info, offset_t off, uint64_t size, void *arg)
 {
     RebuildIndexStruct *ris = (RebuildIndexStruct *)arg;
     struct IndexEntry entry;
 
     entry.info = info;
     entry.offset = off;
-    entry.packed_size = info.payload_size;
+    entry.packed_size = size;
     entry.packfile = ris->id;
 
     ris->idx->updateEntry(info.hash, entry);
@@ -813,6 +1280,8 @@ LocalRepo::rebuildIndex()
     index.close();
 
     OriFile_Delete(indexPath);
+    if (OriFile_Exists(indexPath + INDEX_SORTED_EXT))
+        OriFile_Delete(indexPath + INDEX_SORTED_EXT);
 
     index.open(indexPath);
 
@@ -828,7 +1297,10 @@ LocalRepo::rebuildIndex()
         ris.id = *it;
         pf->readEntries(rebuildIndexCb, (void *)&ris);
     }
-    
+
+    // Write the sorted index and its filter
+    index.rewrite();
+
     return true;
 }
 
@@ -839,21 +1311,22 @@ LocalRepo::dumpIndex()
 }
 
 void
-packfileDumper(const ObjectInfo &info, offset_t off, void *arg)
+packfileDumper(const ObjectInfo &info, offset_t off, uint64_t size, void *arg)
 {
     info.print();
-    printf("  packfile: offset = 0x%x\n", off);
+    printf("  packfile: offset = 0x%" PRIx64 ", size = %" PRIu64 "\n",
+           off, size);
 }
 
 void
 LocalRepo::dumpPackfile(packid_t id)
 {
     if (!packfiles->hasPackfile(id)) {
-        printf("Packfile %d does not exist!\n", id);
+        printf("Packfile %" PRIu64 " does not exist!\n", id);
         return;
     }
 
-    printf("Dumping Packfile %d\n", id);
+    printf("Dumping Packfile %" PRIu64 "\n", id);
     Packfile::sp packfile = packfiles->getPackfile(id);
     packfile->readEntries(packfileDumper, NULL);
 }
@@ -883,6 +1356,53 @@ LocalRepo::listCommits()
     return rval;
 }
 
+/*
+ * Cursors name a position in the index journal, objects are listed once
+ * the index entries naming them were synced.  Cursors from before the
+ * journal was last merged list every object.
+ */
+bool
+LocalRepo::listObjectsSince(const string &cursor, set<ObjectInfo> &objs,
+                            string &next)
+{
+    uint64_t gen, pos;
+    bool since = false;
+    strwstream ss;
+
+    if (cursor.size() == 2 * sizeof(uint64_t)) {
+        strstream cs(cursor);
+        gen = cs.readUInt64();
+        pos = cs.readUInt64();
+        since = index.getAddedSince(gen, pos, objs);
+    }
+    if (!since)
+        objs = index.getSyncedList(gen, pos);
+
+    ss.writeUInt64(gen);
+    ss.writeUInt64(pos);
+    next = ss.str();
+
+    return since;
+}
+
+bool
+LocalRepo::listCommitsSince(const string &cursor, vector<Commit> &commits,
+                            string &next)
+{
+    set<ObjectInfo> objs;
+    bool since = listObjectsSince(cursor, objs, next);
+
+    for (set<ObjectInfo>::iterator it = objs.begin();
+            it != objs.end();
+            it++) {
+        if ((*it).type == ObjectInfo::Commit)
+            commits.push_back(getCommit((*it).hash));
+    }
+
+    sort(commits.begin(), commits.end(), _timeCompare);
+    return since;
+}
+
 map<string, ObjectHash>
 LocalRepo::listSnapshots()
 {
@@ -905,32 +1425,79 @@ LocalRepo::lookupSnapshot(const string &name)
  * High Level Operations
  */
 
+/*
+ * Receives everything we lack from the commits of r in a single request and
+ * returns the new commits in toPull, or false if r does not support it.
+ */
+bool
+LocalRepo::pullMissing(Repo *r, deque<ObjectHash> &toPull)
+{
+    ObjectHashVec haves;
+
+    /*
+     * The remote leaves out everything a have refers to, so only commits
+     * whose contents are complete are haves.  Purged commits lost their
+     * trees and commits of an interrupted pull have no status yet.
+     */
+    set<ObjectInfo> objs = listObjects();
+    for (set<ObjectInfo>::iterator it = objs.begin();
+            it != objs.end();
+            it++) {
+        if ((*it).type != ObjectInfo::Commit)
+            continue;
+
+        string status = metadata.getMeta((*it).hash, "status");
+        if (status == "normal" || status == "fuse" || status == "graft")
+            haves.push_back((*it).hash);
+    }
+
+    bytestream::ap bs(r->getMissingObjects(ObjectHashVec(), haves));
+    if (!bs.get())
+        return false;
+
+    // Commits held already, such as purged ones, keep their status
+    uint32_t numCommits = bs->readUInt32();
+    for (uint32_t i = 0; i < numCommits; i++) {
+        ObjectHash hash;
+        bs->readHash(hash);
+        if (!hasObject(hash))
+            toPull.push_back(hash);
+    }
+    receive(bs.get());
+
+    return true;
+}
+
 /*
  * Pull changes from the source repository.
  */
 void
 LocalRepo::pull(Repo *r)
 {
-    vector<Commit> remoteCommits = r->listCommits();
     deque<ObjectHash> toPull;
 
     deque<Commit> newCommits;
 
-    for (size_t i = 0; i < remoteCommits.size(); i++) {
-        ObjectHash hash = remoteCommits[i].hash();
-        if (!hasObject(hash)) {
-            toPull.push_back(hash);
+    //LocalRepoLock::sp _lock(lock());
 
-            // TODO: partial pull
-        }
-    }
+    if (!pullMissing(r, toPull)) {
+        // The remote cannot compute what we lack, walk its commits instead
+        vector<Commit> remoteCommits = r->listCommits();
 
-    //LocalRepoLock::sp _lock(lock());
+        for (size_t i = 0; i < remoteCommits.size(); i++) {
+            ObjectHash hash = remoteCommits[i].hash();
+            if (!hasObject(hash)) {
+                toPull.push_back(hash);
+
+                // TODO: partial pull
+            }
+        }
 
-    bytestream::ap objs(r->getObjects(toPull));
-    receive(objs.get());
+        bytestream::ap objs(r->getObjects(toPull));
+        receive(objs.get());
+    }
 
-    // Perform the pull
+    // Perform the pull, only objects still missing are requested
     while (!toPull.empty()) {
         ObjectHash hash = toPull.front();
         toPull.pop_front();
@@ -985,7 +1552,7 @@ LocalRepo::pull(Repo *r)
         }
 
         if (newObjs.size() > 0) {
-            objs.reset(r->getObjects(newObjs));
+            bytestream::ap objs(r->getObjects(newObjs));
             receive(objs.get());
         }
     }
@@ -1093,17 +1660,22 @@ LocalRepo::multiPull(RemoteRepo::sp defaultRemote)
     event_base_loop(evbase, EVLOOP_NONBLOCK);
 
 
-    // Commits to pull
-    vector<Commit> remoteCommits = defaultRemote->get()->listCommits();
-    for (size_t i = 0; i < remoteCommits.size(); i++) {
-        ObjectHash hash = remoteCommits[i].hash();
-        mpo.enqueue(hash);
-        fprintf(stderr, "Adding %s (commit)\n", hash.hex().c_str());
-        // TODO: partial pull
+    LocalRepoLock::sp _lock(lock());
+
+    // Commits to pull, without closer peers all comes in a single request
+    deque<ObjectHash> received;
+    if (mpo.remotes.size() > 1 ||
+        !pullMissing(defaultRemote->get(), received)) {
+        vector<Commit> remoteCommits = defaultRemote->get()->listCommits();
+        for (size_t i = 0; i < remoteCommits.size(); i++) {
+            ObjectHash hash = remoteCommits[i].hash();
+            mpo.enqueue(hash);
+            fprintf(stderr, "Adding %s (commit)\n", hash.hex().c_str());
+            // TODO: partial pull
+        }
     }
 
     size_t totalObjs = 0, closerObjs = 0;
-    LocalRepoLock::sp _lock(lock());
 
     while (!mpo.toPull.empty()) {
         // Consolidate pulls from remote repos
@@ -1111,31 +1683,47 @@ LocalRepo::multiPull(RemoteRepo::sp defaultRemote)
             // Look for new peers
             event_base_loop(evbase, EVLOOP_NONBLOCK);
 
-            ObjectHash hash = mpo.toPull.front();
-            mpo.toPull.pop_front();
+            ObjectHashVec hashes(mpo.toPull.begin(), mpo.toPull.end());
+            vector<bool> found(hashes.size(), false);
+            mpo.toPull.clear();
 
-            // Find a source for this object
-            bool found = false;
+            // Find a source for the objects, closest remotes first
             for (size_t i = 0; i < mpo.distances.size(); i++) {
                 const RemoteRepo::sp &remote = mpo.remotes[i];
-                if (remote->get()->hasObject(hash)) {
-                    mpo.toMultiPull[i].push_back(hash);
-                    found = true;
+                ObjectHashVec query;
+                vector<size_t> queryIx;
+
+                for (size_t j = 0; j < hashes.size(); j++) {
+                    if (!found[j]) {
+                        query.push_back(hashes[j]);
+                        queryIx.push_back(j);
+                    }
+                }
+                if (query.empty())
+                    break;
+
+                vector<bool> present = remote->get()->hasObjects(query);
+                for (size_t j = 0; j < present.size(); j++) {
+                    if (!present[j])
+                        continue;
+                    found[queryIx[j]] = true;
+                    mpo.toMultiPull[i].push_back(query[j]);
                     if (remote.get() != defaultRemote.get())
                         closerObjs++;
-                    break;
+                    totalObjs++;
                 }
             }
-            if (!found) {
-                fprintf(stderr, "No source for %s\n",
-                        hash.hex().c_str());
-                // TODO: keep retrying?
-                mpo.toPull.push_back(hash);
-                sleep(1);
-                continue;
-            }
 
-            totalObjs++;
+            for (size_t j = 0; j < hashes.size(); j++) {
+                if (!found[j]) {
+                    fprintf(stderr, "No source for %s\n",
+                            hashes[j].hex().c_str());
+                    // TODO: keep retrying?
+                    mpo.toPull.push_back(hashes[j]);
+                }
+            }
+            if (!mpo.toPull.empty())
+                sleep(1);
         }
 
         assert(mpo.toPull.size() == 0);
@@ -1153,7 +1741,7 @@ LocalRepo::multiPull(RemoteRepo::sp defaultRemote)
 
             // Load more objects
             for (size_t ix_h = 0; ix_h < hashes.size(); ix_h++) {
-                LocalObject::sp obj(getLocalObject(hashes[ix_h]));
+                LocalObject::sp obj(getLocalObject(hashes[ix_h], false));
                 ObjectType t = obj->getInfo().type;
 
                 if (t == ObjectInfo::Commit) {
@@ -1184,62 +1772,430 @@ LocalRepo::multiPull(RemoteRepo::sp defaultRemote)
                 }
             }
 
-            hashes.clear();
+            hashes.clear();
+        }
+    }
+
+    printf("Speed-up: %lu of %lu objects\n", closerObjs, totalObjs);
+}
+
+/*
+ * Objects are sent in the order given.  Deltas are sent as is when their
+ * base is sent before them, otherwise they are expanded because the
+ * receiver may not have the base.  Objects stored with an optional codec
+ * such as LZMA are recompressed with one every build supports.
+ */
+void
+LocalRepo::transmit(bytewstream *bs, const ObjectHashVec &objs)
+{
+    TransmitState state;
+
+    transmitBegin(&state, objs);
+    while (transmitPart(bs, &state, SIZE_MAX)) {
+    }
+}
+
+/*
+ * Prepares a transmit that is produced in parts.
+ */
+void
+LocalRepo::transmitBegin(TransmitState *state, const ObjectHashVec &objs)
+{
+    unordered_map<ObjectHash, size_t> pos;
+
+    state->objs.clear();
+    state->basePos.clear();
+    state->next = 0;
+
+    for (size_t i = 0; i < objs.size(); i++) {
+        if (pos.find(objs[i]) != pos.end()) {
+            DLOG("duplicate object in LocalRepo::transmit");
+            continue;
+        }
+
+        ObjectHash base = getDeltaBase(objs[i]);
+        if (!base.isEmpty()) {
+            unordered_map<ObjectHash, size_t>::iterator it = pos.find(base);
+
+            if (it != pos.end())
+                state->basePos[objs[i]] = it->second;
+        }
+        pos[objs[i]] = state->objs.size();
+        state->objs.push_back(objs[i]);
+    }
+}
+
+/*
+ * Deltas without a base sent before them are expanded, as are objects
+ * compressed with a codec the receiver may not have compiled in.
+ */
+static bool
+_transmitExpands(const TransmitState *state, const IndexEntry &ie)
+{
+    if (!ZipCodec_IsPortable(ie.info.getAlgo()))
+        return true;
+    return ie.info.isDelta() &&
+           state->basePos.find(ie.info.hash) == state->basePos.end();
+}
+
+/*
+ * Compresses an expanded object for transmit with the repository codec if
+ * every build has it or FastLZ otherwise.  Payloads that do not compress
+ * are sent as is.
+ */
+static void
+_transmitCompress(ObjectInfo::ZipAlgo algo, ObjectInfo &info, string &payload)
+{
+    if (!ZipCodec_IsPortable(algo))
+        algo = ObjectInfo::ZIPALGO_FASTLZ;
+
+    ZipCodec *codec = ZipCodec_Get(algo);
+    string compressed;
+
+    info.setAlgo(ObjectInfo::ZIPALGO_NONE);
+    if (codec == NULL || payload.size() <= ZIP_MINIMUM_SIZE ||
+        !codec->compress(payload, compressed) ||
+        compressed.size() > payload.size() * COMPCHECK_RATIO)
+        return;
+
+    info.setAlgo(algo);
+    payload.swap(compressed);
+}
+
+/*
+ * Writes the next objects of a transmit, stopping once about maxSize packed
+ * bytes went out, and the terminating empty group after the last ones.
+ * Each group holds consecutive objects, so the receiver stores them in the
+ * order they were listed.
+ *
+ * @returns true if objects are left for another part
+ */
+bool
+LocalRepo::transmitPart(bytewstream *bs, TransmitState *state, size_t maxSize)
+{
+    size_t start = state->next;
+    size_t size = 0;
+    vector<IndexEntry> entries;
+
+    // Every part carries at least one object
+    while (state->next < state->objs.size() &&
+           (state->next == start || size < maxSize)) {
+        entries.push_back(index.getEntry(state->objs[state->next]));
+        size += entries.back().packed_size;
+        state->next++;
+    }
+
+    size_t i = 0;
+    while (i < entries.size()) {
+        if (_transmitExpands(state, entries[i])) {
+            vector<ObjectInfo> infos;
+            vector<string> payloads;
+
+            size = 0;
+            while (i < entries.size() &&
+                   _transmitExpands(state, entries[i]) &&
+                   size < PFTRANSACTION_MAXSIZE &&
+                   infos.size() < PFTRANSACTION_MAXOBJS) {
+                LocalObject::sp o = getLocalObject(entries[i].info.hash,
+                                                   false);
+                if (!o)
+                    throw runtime_error("Unable to resolve delta object");
+
+                infos.push_back(o->getInfo());
+                payloads.push_back(o->getPayload());
+                _transmitCompress(zipAlgo, infos.back(), payloads.back());
+                size += payloads.back().size();
+                i++;
+            }
+            Packfile::transmitPayloads(bs, infos, payloads);
+            continue;
+        }
+
+        // A repack may not delete the packfile while it is looked up
+        RWKey::sp packKey = packLock.readLock();
+        Packfile::sp pf = packfiles->getPackfile(entries[i].packfile);
+        packKey.reset();
+
+        vector<IndexEntry> run;
+        run.push_back(entries[i++]);
+        while (i < entries.size() &&
+               entries[i].packfile == run.front().packfile &&
+               !_transmitExpands(state, entries[i])) {
+            run.push_back(entries[i++]);
+        }
+        pf->transmit(bs, run);
+    }
+
+    if (state->next < state->objs.size())
+        return true;
+
+    /* Write (numobjs_t)0 */
+    bs->writeUInt32(0);
+
+    return false;
+}
+
+/*
+ * Stores the objects of a transmit stream.  Holds txnLock for the whole
+ * stream so other writers wait rather than share the packfile.
+ */
+void
+LocalRepo::receive(bytestream *bs)
+{
+    Monitor lock(txnLock);
+    bool cont = true;
+    while (cont) {
+        if (!currPackfile.get() || currPackfile->full()) {
+            currPackfile = packfiles->newPackfile();
+        }
+        cont = currPackfile->receive(bs, &index);
+    }
+}
+
+/*
+ * Produces the transmit stream of a set of objects a part at a time as it is
+ * read, optionally preceded by a header.
+ */
+class LocalRepoTransmitStream : public bytestream
+{
+public:
+    LocalRepoTransmitStream(LocalRepo *repo, const ObjectHashVec &objs,
+                            const string &header = "");
+    bool ended();
+    size_t read(uint8_t *out, size_t n);
+    size_t sizeHint() const;
+private:
+    void fill();
+    LocalRepo *repo;
+    TransmitState state;
+    string buf;
+    size_t off;
+    bool more;
+};
+
+LocalRepoTransmitStream::LocalRepoTransmitStream(LocalRepo *repo,
+                                                 const ObjectHashVec &objs,
+                                                 const string &header)
+    : repo(repo), buf(header), off(0), more(true)
+{
+    repo->transmitBegin(&state, objs);
+}
+
+bool
+LocalRepoTransmitStream::ended()
+{
+    fill();
+    return off == buf.size();
+}
+
+size_t
+LocalRepoTransmitStream::read(uint8_t *out, size_t n)
+{
+    fill();
+    n = MIN(n, buf.size() - off);
+    memcpy(out, buf.data() + off, n);
+    off += n;
+
+    return n;
+}
+
+size_t
+LocalRepoTransmitStream::sizeHint() const
+{
+    return 0;
+}
+
+void
+LocalRepoTransmitStream::fill()
+{
+    if (off < buf.size() || !more)
+        return;
+
+    strwstream ss;
+    more = repo->transmitPart(&ss, &state, TRANSMIT_PARTSIZE);
+    buf = ss.str();
+    off = 0;
+}
+
+bytestream *
+LocalRepo::getObjects(const ObjectHashVec &objs)
+{
+    return new LocalRepoTransmitStream(this, objs);
+}
+
+bytestream *
+LocalRepo::getMissingObjects(const ObjectHashVec &wants,
+                             const ObjectHashVec &haves)
+{
+    ObjectHashVec commits;
+    ObjectHashVec objs = listMissing(wants, haves, commits);
+    strwstream header;
+
+    header.writeUInt32(commits.size());
+    for (size_t i = 0; i < commits.size(); i++) {
+        header.writeHash(commits[i]);
+    }
+
+    return new LocalRepoTransmitStream(this, objs, header.str());
+}
+
+struct MissingObjectsOp {
+    MissingObjectsOp(LocalRepo &r)
+        : repo(r), peerLBsExpanded(false)
+    {
+    }
+    LocalRepo &repo;
+
+    // Objects sent or assumed present on the peer
+    unordered_set<ObjectHash> seen;
+    // Large blobs of the peer whose parts have not been marked yet
+    ObjectHashVec peerLBs;
+    bool peerLBsExpanded;
+    ObjectHashVec objs;
+
+    void markPeerTree(const ObjectHash &hash) {
+        if (!seen.insert(hash).second || !repo.isObjectStored(hash))
+            return;
+
+        Tree t = repo.getTree(hash);
+        for (map<string, TreeEntry>::iterator it = t.tree.begin();
+                it != t.tree.end();
+                it++) {
+            const TreeEntry &te = (*it).second;
+            if (te.type == TreeEntry::Tree) {
+                markPeerTree(te.hash);
+            } else if (seen.insert(te.hash).second &&
+                       te.type == TreeEntry::LargeBlob) {
+                peerLBs.push_back(te.hash);
+            }
+        }
+    }
+
+    // Only needed once a new large blob may share parts with the peer's
+    void markPeerLBs() {
+        if (peerLBsExpanded)
+            return;
+        peerLBsExpanded = true;
+
+        for (size_t i = 0; i < peerLBs.size(); i++) {
+            if (!repo.isObjectStored(peerLBs[i]))
+                continue;
+
+            LargeBlob lb = repo.getLargeBlob(peerLBs[i]);
+            for (map<uint64_t, LBlobEntry>::iterator pit = lb.parts.begin();
+                    pit != lb.parts.end();
+                    pit++) {
+                seen.insert((*pit).second.hash);
+            }
+        }
+    }
+
+    void add(const ObjectHash &hash) {
+        if (seen.insert(hash).second && repo.isObjectStored(hash))
+            objs.push_back(hash);
+    }
+
+    void addLargeBlob(const ObjectHash &hash) {
+        if (!seen.insert(hash).second || !repo.isObjectStored(hash))
+            return;
+
+        markPeerLBs();
+        LargeBlob lb = repo.getLargeBlob(hash);
+        for (map<uint64_t, LBlobEntry>::iterator pit = lb.parts.begin();
+                pit != lb.parts.end();
+                pit++) {
+            add((*pit).second.hash);
+        }
+        objs.push_back(hash);
+    }
+
+    void addTree(const ObjectHash &hash) {
+        if (!seen.insert(hash).second || !repo.isObjectStored(hash))
+            return;
+
+        Tree t = repo.getTree(hash);
+        for (map<string, TreeEntry>::iterator it = t.tree.begin();
+                it != t.tree.end();
+                it++) {
+            const TreeEntry &te = (*it).second;
+            if (te.type == TreeEntry::Tree)
+                addTree(te.hash);
+            else if (te.type == TreeEntry::LargeBlob)
+                addLargeBlob(te.hash);
+            else
+                add(te.hash);
+        }
+        objs.push_back(hash);
+    }
+};
+
+/*
+ * Lists the objects a peer holding the commits haves lacks to have the
+ * commits wants, or all commits if wants is empty.  Objects are listed before
+ * the trees, large blobs and commits referring to them, and transmit keeps
+ * that order, so an interrupted transfer never leaves a commit without its
+ * contents.  The trees of the
+ * peer's commits that the new ones build on are assumed present on the peer.
+ */
+ObjectHashVec
+LocalRepo::listMissing(const ObjectHashVec &wants, const ObjectHashVec &haves,
+                       ObjectHashVec &commits)
+{
+    unordered_set<ObjectHash> peerCommits(haves.begin(), haves.end());
+    MissingObjectsOp mop(*this);
+    deque<ObjectHash> toWalk(wants.begin(), wants.end());
+    vector<Commit> newCommits;
+    ObjectHashVec bases;
+
+    if (wants.empty()) {
+        set<ObjectInfo> objs = listObjects();
+        for (set<ObjectInfo>::iterator it = objs.begin();
+                it != objs.end();
+                it++) {
+            if ((*it).type == ObjectInfo::Commit)
+                toWalk.push_back((*it).hash);
         }
     }
 
-    printf("Speed-up: %lu of %lu objects\n", closerObjs, totalObjs);
-}
+    while (!toWalk.empty()) {
+        ObjectHash hash = toWalk.front();
+        toWalk.pop_front();
 
-void
-LocalRepo::transmit(bytewstream *bs, const ObjectHashVec &objs)
-{
-    unordered_set<ObjectHash> includedHashes;
+        if (peerCommits.find(hash) != peerCommits.end())
+            continue;
+        if (!mop.seen.insert(hash).second || !isObjectStored(hash))
+            continue;
 
-    typedef std::vector<IndexEntry> IndexEntryVec;
-    std::map<Packfile::sp, IndexEntryVec> packs;
-    for (size_t i = 0; i < objs.size(); i++) {
-        if (includedHashes.find(objs[i]) == includedHashes.end()) {
-            const IndexEntry &ie = index.getEntry(objs[i]);
-            Packfile::sp pf = packfiles->getPackfile(ie.packfile);
-            packs[pf].push_back(ie);
-            includedHashes.insert(objs[i]);
-        } else {
-            DLOG("duplicate object in LocalRepo::transmit");
-        }
+        Commit c = getCommit(hash);
+        pair<ObjectHash, ObjectHash> p = c.getParents();
+        newCommits.push_back(c);
+        if (peerCommits.find(p.first) != peerCommits.end())
+            bases.push_back(p.first);
+        else if (!p.first.isEmpty())
+            toWalk.push_back(p.first);
+        if (peerCommits.find(p.second) != peerCommits.end())
+            bases.push_back(p.second);
+        else if (!p.second.isEmpty())
+            toWalk.push_back(p.second);
     }
 
-    for (std::map<Packfile::sp, IndexEntryVec>::iterator it = packs.begin();
-            it != packs.end();
-            it++) {
-        const Packfile::sp &pf = (*it).first;
-        //fprintf(stderr, "Transmitting %lu objects from %p\n",
-        //        (*it).second.size(), pf.get());
-        pf->transmit(bs, (*it).second);
+    for (size_t i = 0; i < bases.size(); i++) {
+        if (isObjectStored(bases[i]))
+            mop.markPeerTree(getCommit(bases[i]).getTree());
     }
 
-    /* Write (numobjs_t)0 */
-    bs->writeUInt32(0);
-}
-
-void
-LocalRepo::receive(bytestream *bs)
-{
-    bool cont = true;
-    while (cont) {
-        if (!currPackfile.get() || currPackfile->full()) {
-            currPackfile = packfiles->newPackfile();
-        }
-        cont = currPackfile->receive(bs, &index);
+    sort(newCommits.begin(), newCommits.end(), _timeCompare);
+    commits.clear();
+    for (size_t i = 0; i < newCommits.size(); i++) {
+        mop.addTree(newCommits[i].getTree());
+        commits.push_back(newCommits[i].hash());
     }
-}
+    mop.objs.insert(mop.objs.end(), commits.begin(), commits.end());
 
-bytestream *
-LocalRepo::getObjects(const ObjectHashVec &objs)
-{
-    strwstream ss;
-    transmit(&ss, objs);
-    return new strstream(ss.str());
+    DLOG("listMissing: %lu commits, %lu objects", commits.size(),
+         mop.objs.size());
+
+    return mop.objs;
 }
 
 /*
@@ -1434,42 +2390,475 @@ LocalRepo::commitFromObjects(const ObjectHash &treeHash, Repo *objects,
     return commitFromTree(treeHash, c, status);
 }
 
+/*
+ * Repacks in the background for gc.  Requests made while a repack runs are
+ * handled by another pass once it is done.
+ */
+class RepackThread : public Thread
+{
+public:
+    RepackThread(LocalRepo *repo)
+        : Thread("repack"), again(true), done(false), repo(repo) { }
+    void run();
+
+    // Protected by the repository's repackLock
+    bool again;
+    bool done;
+private:
+    LocalRepo *repo;
+};
+
+void
+RepackThread::run()
+{
+    while (true) {
+        {
+            Monitor lock(repo->repackLock);
+            if (!again || repo->repackStop) {
+                done = true;
+                return;
+            }
+            again = false;
+        }
+
+        try {
+            repo->repack(REPACK_MAXRATE);
+        } catch (exception &e) {
+            WARNING("Background repack failed: %s", e.what());
+        }
+    }
+}
+
 /*
  * Garbage Collect. Attempt to reduce wasted space from deleted objects and 
  * metadata.
  */
 void
-LocalRepo::gc()
+LocalRepo::gc(bool wait)
 {
-    // Commit all ongoing transactions
-    if (currTransaction.get()) {
-        currTransaction->commit();
-        currTransaction.reset();
+    // Compact the metadata log once it is mostly superseded entries
+    if (metadata.needsRewrite()) {
+        // The log is swapped underneath the syncs a repack issues
+        waitRepack();
+        metadata.rewrite();
     }
 
-    // Compact the index
-    index.rewrite();
+    // Purged objects in the packfile being written become reclaimable
+    sealPackfile();
 
-    // Compact the metadata log
-    metadata.rewrite();
+    // Drop purged objects and compact sparse packfiles
+    if (wait) {
+        repack();
+    } else {
+        startRepack();
+    }
 
-    // Do purges
-    std::set<packid_t> purgePacks;
-    for (std::set<ObjectHash>::iterator it = purged.begin();
-            it != purged.end();
-            it++) {
-        const IndexEntry &ie = index.getEntry((*it));
-        purgePacks.insert(ie.packfile);
+    // The index journal is merged once it grows large enough
+    syncer.sync();
+}
+
+/*
+ * Commits the current transaction and leaves its packfile, so that later
+ * writes start a new packfile and a repack may take in everything so far.
+ */
+void
+LocalRepo::sealPackfile()
+{
+    {
+        Monitor lock(txnLock);
+        if (currTransaction.get()) {
+            currTransaction->commit();
+            currTransaction.reset();
+        }
+        currPackfile.reset();
+    }
+
+    // Releases the packfile once it is durable (see PackfileManager::sync)
+    syncer.sync();
+}
+
+void
+LocalRepo::startRepack()
+{
+    Monitor lock(repackLock);
+
+    if (repacker != NULL) {
+        if (!repacker->done) {
+            repacker->again = true;
+            return;
+        }
+        repacker->wait();
+        delete repacker;
+    }
+
+    repacker = new RepackThread(this);
+    repacker->start();
+}
+
+void
+LocalRepo::waitRepack()
+{
+    RepackThread *t;
+
+    {
+        Monitor lock(repackLock);
+        t = repacker;
+        repacker = NULL;
+    }
+
+    if (t != NULL) {
+        t->wait();
+        delete t;
+    }
+}
+
+bool
+LocalRepo::repackStopped()
+{
+    Monitor lock(repackLock);
+
+    return repackStop;
+}
+
+/// A copy of a purged object found while repacking
+struct RepackDead
+{
+    ObjectInfo info;
+    offset_t off;
+    uint64_t size;
+};
+
+struct RepackStruct
+{
+    Index *idx;
+    PackfileManager *packfiles;
+    const std::set<ObjectHash> *purged;
+    ObjectInfo::ZipAlgo zipAlgo;
+    bool recompress; // objects stored with another codec are recompressed
+    packid_t id;
+    Packfile::sp src;
+
+    // Scan results
+    uint64_t totalBytes;
+    uint64_t liveBytes;
+    size_t otherCodec;
+
+    // Copy state
+    Packfile::sp dst;
+    PfTransaction::sp tr;
+    std::vector<RepackDead> dead;
+    uint64_t copied;
+    uint64_t maxRate;
+    Stopwatch sw;
+};
+
+/*
+ * Returns true if the index refers to this copy of the object.  Copies that
+ * were superseded by a later write or a previous repack are dead.
+ */
+static bool
+repackIsLive(RepackStruct *rs, const ObjectInfo &info, offset_t off)
+{
+    IndexEntry ie;
+
+    if (!rs->idx->hasObject(info.hash))
+        return false;
+
+    ie = rs->idx->getEntry(info.hash);
+    return ie.packfile == rs->id && ie.offset == off;
+}
+
+/// Makes sure there is an output transaction
+static void
+repackBegin(RepackStruct *rs)
+{
+    if (rs->tr)
+        return;
+
+    if (!rs->dst || rs->dst->full())
+        rs->dst = rs->packfiles->newPackfile();
+    rs->tr = rs->dst->begin(rs->idx, rs->zipAlgo);
+}
+
+/// Accounts for size bytes added to the output transaction
+static void
+repackEnd(RepackStruct *rs, uint64_t size)
+{
+    rs->copied += size;
+
+    if (rs->tr->full()) {
+        rs->tr->commit();
+        rs->tr.reset();
+
+        // Throttle to maxRate bytes per second
+        if (rs->maxRate != 0) {
+            uint64_t target = rs->copied * 1000000 / rs->maxRate;
+            uint64_t elapsed = rs->sw.getElapsedTime();
+            if (target > elapsed)
+                usleep(target - elapsed);
+        }
+    }
+}
+
+/*
+ * Returns true if recompressing would store the object with another codec.
+ * Deltas are kept as they are and small objects are never compressed.
+ */
+static bool
+repackOtherCodec(RepackStruct *rs, const ObjectInfo &info)
+{
+    if (!rs->recompress || info.isDelta() || info.getAlgo() == rs->zipAlgo)
+        return false;
+
+    return info.getAlgo() != ObjectInfo::ZIPALGO_NONE ||
+           info.payload_size > ZIP_MINIMUM_SIZE;
+}
+
+/*
+ * Copies the stored payload without decompressing it, unless the object is
+ * recompressed.
+ */
+static void
+repackCopy(RepackStruct *rs, const ObjectInfo &info, offset_t off,
+           uint64_t size)
+{
+    repackBegin(rs);
+    if (repackOtherCodec(rs, info)) {
+        IndexEntry ie = { info, off, size, rs->id };
+        bytestream::ap bs(rs->src->getPayload(ie));
+        rs->tr->addPayload(info, bs->readAll());
+    } else {
+        bytestream::ap bs(rs->src->getStoredPayload(off, size));
+        rs->tr->addStored(info, bs->readAll());
+    }
+    repackEnd(rs, size);
+}
+
+void
+repackScanCb(const ObjectInfo &info, offset_t off, uint64_t size, void *arg)
+{
+    RepackStruct *rs = (RepackStruct *)arg;
+
+    rs->totalBytes += size;
+    if (!repackIsLive(rs, info, off))
+        return;
+
+    rs->liveBytes += size;
+    if (repackOtherCodec(rs, info))
+        rs->otherCodec++;
+}
+
+void
+repackCopyCb(const ObjectInfo &info, offset_t off, uint64_t size, void *arg)
+{
+    RepackStruct *rs = (RepackStruct *)arg;
+
+    if (!repackIsLive(rs, info, off))
+        return;
+
+    if (rs->purged->find(info.hash) != rs->purged->end()) {
+        RepackDead d;
+        d.info = info;
+        d.off = off;
+        d.size = size;
+        rs->dead.push_back(d);
+        return;
+    }
+
+    repackCopy(rs, info, off, size);
+}
+
+/*
+ * Rewrites live deltas whose base is purged as full objects.  This runs
+ * before any purged object is dropped so that every delta chain still
+ * resolves while the deltas are expanded.  No new delta is made against a
+ * purged base (see makeDelta).
+ */
+void
+LocalRepo::expandDeltas(RepackStruct *rs)
+{
+    set<ObjectInfo> objs = index.getList();
+    vector<ObjectHash> expand;
+
+    for (set<ObjectInfo>::iterator it = objs.begin(); it != objs.end(); it++) {
+        if (!(*it).isDelta() || rs->purged->find((*it).hash) != rs->purged->end())
+            continue;
+
+        ObjectHash base = getDeltaBase((*it).hash);
+        if (rs->purged->find(base) != rs->purged->end())
+            expand.push_back((*it).hash);
+    }
+
+    for (size_t i = 0; i < expand.size(); i++) {
+        LocalObject::sp o;
+        string payload;
+        try {
+            o = getPackedObject(expand[i], false);
+            if (o)
+                payload = o->getPayload();
+        } catch (RuntimeException &e) {
+            // Already reported, a corrupt delta must not stop the repack
+            o.reset();
+        }
+        if (!o) {
+            WARNING("Unable to expand delta object %s",
+                    expand[i].hex().c_str());
+            continue;
+        }
+
+        repackBegin(rs);
+        rs->tr->addPayload(o->getInfo(), payload);
+        repackEnd(rs, payload.size());
+    }
+
+    if (rs->tr) {
+        rs->tr->commit();
+        rs->tr.reset();
+    }
+}
+
+/*
+ * Streams live objects out of sparse packfiles into new dense packfiles.
+ * Only one repack runs at a time and it may run while other threads use
+ * the repository.  Packfiles that are still written to are left alone, gc
+ * leaves the current packfile first.
+ *
+ * Packfiles are selected when they contain purged objects or when at least
+ * REPACK_MIN_DEADRATIO of their bytes are dead according to the counts the
+ * index keeps, so only the selected packfiles are read.  Each source
+ * packfile is handled independently: its live objects are copied, purged
+ * objects are removed from the index, both are made durable and only then
+ * is the packfile deleted.  An interrupted repack leaves the index pointing
+ * at valid copies and the remaining purged objects are picked up by the
+ * next one.  Memory use is bounded by the size of a packfile transaction.
+ *
+ * To recompress, every packfile is scanned and those holding objects
+ * stored with another codec are repacked as well.
+ */
+size_t
+LocalRepo::repack(uint64_t maxRate, ObjectInfo::ZipAlgo algo)
+{
+    Monitor repackGuard(repackMutex);
+    size_t repacked = 0;
+    set<ObjectHash> toPurge;
+    map<packid_t, uint64_t> dead;
+    set<packid_t> selected;
+
+    {
+        Monitor lock(purgeLock);
+        toPurge = purged;
+    }
+
+    RepackStruct rs;
+    rs.idx = &index;
+    rs.packfiles = packfiles.get();
+    rs.purged = &toPurge;
+    rs.zipAlgo = (algo == ObjectInfo::ZIPALGO_UNKNOWN) ? zipAlgo : algo;
+    rs.recompress = (algo != ObjectInfo::ZIPALGO_UNKNOWN);
+    rs.copied = 0;
+    rs.maxRate = maxRate;
+    rs.sw.start();
+
+    // Deltas must not outlive their base objects
+    if (!toPurge.empty())
+        expandDeltas(&rs);
+
+    vector<packid_t> pfIds = packfiles->getPackfileList();
+    sort(pfIds.begin(), pfIds.end());
+
+    // Count the dead bytes once, the index keeps them up to date after
+    bool scan = !index.getDeadBytes(dead);
+    if (scan || rs.recompress) {
+        for (size_t i = 0; i < pfIds.size(); i++) {
+            if (packfiles->isWriting(pfIds[i]))
+                continue;
+            rs.id = pfIds[i];
+            rs.src = packfiles->getPackfile(pfIds[i]);
+            rs.totalBytes = 0;
+            rs.liveBytes = 0;
+            rs.otherCodec = 0;
+            rs.src->readEntries(repackScanCb, (void *)&rs);
+            if (scan)
+                dead[pfIds[i]] = rs.totalBytes - rs.liveBytes;
+            if (rs.otherCodec != 0)
+                selected.insert(pfIds[i]);
+        }
+        rs.src.reset();
+        if (scan)
+            index.setDeadBytes(dead);
     }
 
-    for (std::set<packid_t>::iterator it = purgePacks.begin();
-            it != purgePacks.end();
+    for (set<ObjectHash>::iterator it = toPurge.begin();
+            it != toPurge.end();
             it++) {
-        Packfile::sp pack = packfiles->getPackfile((*it));
-        pack->purge(purged, &index);
+        if (index.hasObject(*it))
+            selected.insert(index.getEntry(*it).packfile);
     }
 
-    purged.clear();
+    for (size_t i = 0; i < pfIds.size(); i++) {
+        packid_t id = pfIds[i];
+
+        if (repackStopped())
+            break;
+        if (packfiles->isWriting(id))
+            continue;
+
+        rs.id = id;
+        rs.src = packfiles->getPackfile(id);
+        if (selected.find(id) == selected.end() &&
+            dead[id] < rs.src->getSize() * REPACK_MIN_DEADRATIO)
+            continue;
+
+        DLOG("Repacking packfile %" PRIu64 " (%" PRIu64 " of %" PRIu64
+             " bytes dead)", id, dead[id], rs.src->getSize());
+
+        rs.dead.clear();
+        rs.src->readEntries(repackCopyCb, (void *)&rs);
+
+        /*
+         * Purged objects are dropped unless they were added again since the
+         * repack started, such objects are copied like the others.
+         */
+        vector<RepackDead> keep;
+        {
+            Monitor lock(purgeLock);
+            for (size_t j = 0; j < rs.dead.size(); j++) {
+                const ObjectHash &hash = rs.dead[j].info.hash;
+
+                if (purged.find(hash) == purged.end()) {
+                    keep.push_back(rs.dead[j]);
+                    continue;
+                }
+                index.removeEntry(hash);
+                purged.erase(hash);
+                purgedDirty = true;
+            }
+        }
+        for (size_t j = 0; j < keep.size(); j++) {
+            repackCopy(&rs, keep[j].info, keep[j].off, keep[j].size);
+        }
+        if (rs.tr) {
+            rs.tr->commit();
+            rs.tr.reset();
+        }
+
+        // The copies and removals must be durable before the source goes
+        syncer.sync();
+
+        rs.src.reset();
+        {
+            RWKey::sp key = packLock.writeLock();
+            packfiles->removePackfile(id);
+        }
+        index.clearDeadBytes(id);
+        repacked++;
+    }
+    rs.dst.reset();
+
+    // Forget the purged objects that were dropped
+    syncer.sync();
+
+    return repacked;
 }
 
 /*
@@ -1478,13 +2867,31 @@ LocalRepo::gc()
 bool
 LocalRepo::isObjectStored(const ObjectHash &objId)
 {
-    if (currTransaction.get() && currTransaction->has(objId)) {
-        return true;
+    {
+        Monitor lock(txnLock);
+        if (currTransaction.get() && currTransaction->has(objId)) {
+            return true;
+        }
     }
 
     return index.hasObject(objId);
 }
 
+bool
+LocalRepo::getObjectFilter(BloomFilter &filter)
+{
+    filter = index.getFilter();
+
+    Monitor lock(txnLock);
+    if (currTransaction.get()) {
+        for (size_t i = 0; i < currTransaction->infos.size(); i++) {
+            filter.add(currTransaction->infos[i].hash);
+        }
+    }
+
+    return true;
+}
+
 bool
 LocalRepo::hasObject(const ObjectHash &objId)
 {
@@ -1615,14 +3022,23 @@ LocalRepo::purgeObject(const ObjectHash &objId)
 {
     ASSERT(metadata.getRefCount(objId) == 0);
 
-    if (currTransaction.get())
-        currTransaction.reset();
+    {
+        Monitor lock(txnLock);
+        if (currTransaction.get())
+            currTransaction.reset();
+    }
 
     /*const IndexEntry &ie = index.getEntry(objId);
     Packfile::sp packfile = packfiles->getPackfile(ie.packfile);
     packfile->purge(objId);*/
 
-    purged.insert(objId);
+    {
+        // Dropped by the next repack, saved by the next sync until then
+        Monitor lock(purgeLock);
+        purged.insert(objId);
+        purgedDirty = true;
+    }
+    objCache.invalidate(objId);
 
     return true;
 }
@@ -2306,6 +3722,33 @@ LocalRepo::getVersion()
     return version;
 }
 
+ObjectInfo::ZipAlgo
+LocalRepo::getZipAlgo()
+{
+    return zipAlgo;
+}
+
+bool
+LocalRepo::setZipAlgo(ObjectInfo::ZipAlgo algo)
+{
+    if (!ZipCodec_IsSupported(algo))
+        return false;
+
+    if (!OriFile_WriteFile(string(ZipCodec_AlgoName(algo)) + "\n",
+                           rootPath + ORI_PATH_COMPRESSION))
+        return false;
+
+    // The current transaction was started with the previous codec
+    Monitor lock(txnLock);
+    zipAlgo = algo;
+    if (currTransaction.get()) {
+        currTransaction->commit();
+        currTransaction.reset();
+    }
+
+    return true;
+}
+
 string
 LocalRepo::getRootPath()
 {
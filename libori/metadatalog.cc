@@ -34,6 +34,8 @@
 #include <oriutil/systemexception.h>
 #include <ori/metadatalog.h>
 
+#include "tuneables.h"
+
 using namespace std;
 
 MdTransaction::MdTransaction(MetadataLog *log)
@@ -72,7 +74,7 @@ void MdTransaction::setMeta(const ObjectHash &hash, const string &key,
  */
 
 MetadataLog::MetadataLog()
-    : fd(-1)
+    : fd(-1), dirty(false), logSize(0)
 {
 }
 
@@ -100,6 +102,7 @@ MetadataLog::open(const string &filename)
         WARNING("MetadataLog fstat failed!");
         throw SystemException();
     }
+    logSize = sb.st_size;
 
     size_t readSoFar = 0;
     while (true) {
@@ -159,7 +162,15 @@ MetadataLog::open(const string &filename)
 void
 MetadataLog::sync()
 {
-    ::fsync(fd);
+    if (!dirty)
+        return;
+
+    // The log stays dirty so that the next sync retries
+    if (OriFile_DataSync(fd) < 0) {
+        perror("MetadataLog::sync");
+        throw SystemException();
+    }
+    dirty = false;
 }
 
 void
@@ -179,6 +190,7 @@ MetadataLog::rewrite(const RefcountMap *refs, const MetadataMap *data)
 
     int oldFd = fd;
     fd = newFd;
+    logSize = 0;
 
     ftruncate(fd, 0);
     lseek(fd, 0, SEEK_SET);
@@ -193,6 +205,31 @@ MetadataLog::rewrite(const RefcountMap *refs, const MetadataMap *data)
     ::close(oldFd);
 }
 
+/*
+ * Compares the log to the size of a rewritten log holding only the current
+ * counts and metadata.
+ */
+bool
+MetadataLog::needsRewrite() const
+{
+    uint64_t liveSize = 3 * sizeof(uint32_t);
+
+    liveSize += refcounts.size() * (ObjectHash::SIZE + sizeof(int32_t));
+    for (MetadataMap::const_iterator it = metadata.begin();
+            it != metadata.end();
+            it++) {
+        liveSize += ObjectHash::SIZE + sizeof(uint32_t);
+        for (ObjMetadata::const_iterator mit = (*it).second.begin();
+                mit != (*it).second.end();
+                mit++) {
+            liveSize += (*mit).first.size() + (*mit).second.size() + 4;
+        }
+    }
+
+    return logSize > METADATA_REWRITE_MINSIZE &&
+           logSize > liveSize * METADATA_REWRITE_RATIO;
+}
+
 void
 MetadataLog::addRef(const ObjectHash &hash, MdTransaction::sp trs)
 {
@@ -286,6 +323,8 @@ MetadataLog::commit(MdTransaction *tr)
     uint32_t nbytes = str.size();
     write(fd, &nbytes, sizeof(uint32_t));
     write(fd, str.data(), str.size());
+    logSize += sizeof(uint32_t) + str.size();
+    dirty = true;
 
     tr->counts.clear();
     tr->metadata.clear();
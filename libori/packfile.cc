@@ -15,9 +15,12 @@
  */
 
 
+#include <stdint.h>
+#include <string.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <fcntl.h>
 #include <errno.h>
 
@@ -30,21 +33,25 @@
 #include <algorithm>
 #include <iostream>
 #include <unordered_set>
+#include <cinttypes>
 
 #include "tuneables.h"
 
 #include <oriutil/debug.h>
 #include <oriutil/oriutil.h>
 #include <oriutil/orifile.h>
+#include <oriutil/monitor.h>
 #include <oriutil/scan.h>
+#include <oriutil/runtimeexception.h>
 #include <oriutil/systemexception.h>
 #include <ori/packfile.h>
 #include <ori/index.h>
 
 using namespace std;
 
-PfTransaction::PfTransaction(Packfile *pf, Index *idx)
-    : totalSize(0), committed(false), pf(pf), idx(idx)
+PfTransaction::PfTransaction(Packfile *pf, Index *idx,
+                             ObjectInfo::ZipAlgo algo)
+    : totalSize(0), committed(false), pf(pf), idx(idx), zipAlgo(algo)
 {
 }
 
@@ -56,14 +63,27 @@ PfTransaction::~PfTransaction()
 
 bool PfTransaction::full() const
 {
-    return infos.size() >= PACKFILE_MAXOBJS ||
-        totalSize >= PACKFILE_MAXSIZE;
+    return infos.size() >= PFTRANSACTION_MAXOBJS ||
+        totalSize >= PFTRANSACTION_MAXSIZE;
 }
 
+/*
+ * Estimates the compression ratio from a prefix of the payload so that
+ * incompressible data is not compressed in full.
+ */
 float
-PfTransaction::_checkCompressionRatio(const string &payload)
+PfTransaction::_checkCompressionRatio(ZipCodec *codec, const string &payload)
 {
-    return 1.5f;
+    string sample, compressed;
+
+    if (payload.size() <= 4 * COMPCHECK_BYTES)
+        return 0.0f;
+
+    sample = payload.substr(0, COMPCHECK_BYTES);
+    if (!codec->compress(sample, compressed))
+        return 1.0f;
+
+    return (float)compressed.size() / (float)sample.size();
 }
 
 void
@@ -83,52 +103,42 @@ PfTransaction::addPayload(ObjectInfo info, const string &payload)
     }
 #endif
 
-    ObjectInfo::ZipAlgo defaultAlgo = ObjectInfo::ZIPALGO_FASTLZ;
-    switch (defaultAlgo) {
-        case ObjectInfo::ZIPALGO_NONE:
-        {
-            info.setAlgo(defaultAlgo);
-            payloads.push_back(payload);
-            totalSize += payload.size();
-            break;
-        }
-        case ObjectInfo::ZIPALGO_FASTLZ:
-        {
-            zipstream ls(new strstream(payload), COMPRESS);
-            uint8_t buf[COMPCHECK_BYTES];
-            size_t compSize = 0;
-            bool compress = false;
-
-            if (payload.size() > ZIP_MINIMUM_SIZE) {
-                compSize = ls.read(buf, COMPCHECK_BYTES);
-                float ratio = (float)compSize / (float)ls.inputConsumed();
-
-                if (ratio <= COMPCHECK_RATIO) {
-                    compress = true;
-                }
-            }
+    ZipCodec *codec = ZipCodec_Get(zipAlgo);
+    string compressed;
+    bool compress = false;
 
-            if (compress) {
-                // Okay to compress
-                info.setAlgo(defaultAlgo);
-                // Reuse compression test data
-                strwstream ss(string((char*)buf, compSize));
-                ss.copyFrom(&ls);
-
-                payloads.push_back(ss.str());
-                totalSize += ss.str().size();
-            } else {
-                info.setAlgo(ObjectInfo::ZIPALGO_NONE);
-                payloads.push_back(payload);
-                totalSize += payload.size();
-            }
-            break;
-        }
-        case ObjectInfo::ZIPALGO_LZMA:
-        case ObjectInfo::ZIPALGO_UNKNOWN:
-            NOT_IMPLEMENTED(false);
+    if (codec != NULL && payload.size() > ZIP_MINIMUM_SIZE &&
+        _checkCompressionRatio(codec, payload) <= COMPCHECK_RATIO &&
+        codec->compress(payload, compressed)) {
+        float ratio = (float)compressed.size() / (float)payload.size();
+        compress = ratio <= COMPCHECK_RATIO;
+    }
+
+    if (compress) {
+        // Okay to compress
+        info.setAlgo(zipAlgo);
+        payloads.push_back(compressed);
+        totalSize += compressed.size();
+    } else {
+        info.setAlgo(ObjectInfo::ZIPALGO_NONE);
+        payloads.push_back(payload);
+        totalSize += payload.size();
+    }
+
+    infos.push_back(info);
+    hashToIx[info.hash] = infos.size()-1;
+}
+
+void
+PfTransaction::addStored(const ObjectInfo &info, const string &stored)
+{
+    if (committed) {
+        throw runtime_error("Adding payload to already-committed transaction!");
     }
 
+    payloads.push_back(stored);
+    totalSize += stored.size();
+
     infos.push_back(info);
     hashToIx[info.hash] = infos.size()-1;
 }
@@ -147,11 +157,27 @@ void PfTransaction::commit()
 }
 
 
+/*
+ * PackfileMap
+ */
+
+PackfileMap::PackfileMap(const uint8_t *data, offset_t offset, size_t length)
+    : data(data), offset(offset), length(length)
+{
+}
+
+PackfileMap::~PackfileMap()
+{
+    munmap((void *)data, length);
+}
+
 // stored length + offset
-#define ENTRYSIZE (ObjectInfo::SIZE + 4 + 4)
+#define ENTRYSIZE_V1 (ObjectInfo::SIZE + 4 + 4)
+#define ENTRYSIZE_V2 (ObjectInfo::SIZE + 8 + 8)
 
 Packfile::Packfile(const string &filename, packid_t id)
-    : fd(-1), filename(filename), packid(id), numObjects(0), fileSize(0)
+    : fd(-1), filename(filename), packid(id), version(PACKFILE_VERSION),
+      numObjects(0), fileSize(0), dirty(false), mapEnd(0)
 {
     fd = ::open(filename.c_str(), O_RDWR | O_CREAT, 0644);
     if (fd < 0) {
@@ -166,14 +192,50 @@ Packfile::Packfile(const string &filename, packid_t id)
     }
 
     fileSize = sb.st_size;
-    
+
+    // Packfiles without a header predate versioning
+    if (fileSize > 0) {
+        version = PACKFILE_VERSION_1;
+    }
+    if (fileSize >= PACKFILE_HDRSIZE) {
+        char magic[4];
+        preadstream fs(fd, 0, PACKFILE_HDRSIZE);
+        fs.readExact((uint8_t *)magic, 4);
+        if (memcmp(magic, PACKFILE_MAGIC, 4) == 0) {
+            version = fs.readUInt32();
+            if (version > PACKFILE_VERSION) {
+                ::close(fd);
+                fd = -1;
+                WARNING("Packfile %s has unsupported version %u",
+                        filename.c_str(), version);
+                throw RuntimeException(ORIEC_UNSUPPORTEDVERSION,
+                                       "Unsupported packfile version");
+            }
+        }
+    }
+
     // TODO: check for corruption?
 }
 
 Packfile::~Packfile()
 {
-    if (fd > 0)
+    if (fd > 0) {
+        if (dirty)
+            OriFile_DataSync(fd);
         close(fd);
+    }
+}
+
+packid_t
+Packfile::getPackfileID() const
+{
+    return packid;
+}
+
+uint32_t
+Packfile::getVersion() const
+{
+    return version;
 }
 
 bool Packfile::full() const
@@ -183,9 +245,9 @@ bool Packfile::full() const
 }
 
 PfTransaction::sp
-Packfile::begin(Index *idx)
+Packfile::begin(Index *idx, ObjectInfo::ZipAlgo algo)
 {
-    return PfTransaction::sp(new PfTransaction(this, idx));
+    return PfTransaction::sp(new PfTransaction(this, idx, algo));
 }
 
 void
@@ -195,19 +257,20 @@ Packfile::commit(PfTransaction *t, Index *idx)
         throw runtime_error("PfTransaction infos.size() != payloads.size())");
     }
 
+    if (fileSize == 0)
+        _writeHeader();
+
     lseek(fd, 0, SEEK_END);
+    offset_t start = fileSize;
     vector<offset_t> offsets;
-    size_t headers_size = t->infos.size() * ENTRYSIZE;
+    size_t headers_size = t->infos.size() * _entrySize();
     offset_t off = fileSize + sizeof(numobjs_t) + headers_size;
     
     strwstream headers_ss;
     ASSERT(sizeof(numobjs_t) == sizeof(uint32_t));
     headers_ss.writeUInt32(t->infos.size());
     for (size_t i = 0; i < t->infos.size(); i++) {
-        headers_ss.write(t->infos[i].toString().data(), ObjectInfo::SIZE);
-        headers_ss.writeUInt32(t->payloads[i].size());
-        ASSERT(sizeof(uint32_t) == sizeof(offset_t));
-        headers_ss.writeUInt32(off);
+        _writeEntry(headers_ss, t->infos[i], t->payloads[i].size(), off);
 
         offsets.push_back(off);
         off += t->payloads[i].size();
@@ -220,7 +283,17 @@ Packfile::commit(PfTransaction *t, Index *idx)
         write(fd, t->payloads[i].data(), t->payloads[i].size());
         fileSize += t->payloads[i].size();
         numObjects++;
+    }
+
+    /*
+     * The index buffers the new entries until the next durability point,
+     * which syncs this packfile before writing them.  Start writeback now
+     * so that the sync is short.
+     */
+    OriFile_StartWriteback(fd, start, fileSize - start);
+    dirty = true;
 
+    for (size_t i = 0; i < t->payloads.size(); i++) {
         IndexEntry ie;
         ie.info = t->infos[i];
         ie.offset = offsets[i];
@@ -230,120 +303,61 @@ Packfile::commit(PfTransaction *t, Index *idx)
         idx->updateEntry(ie.info.hash, ie);
     }
 
-    ::fsync(fd);
     t->committed = true;
 }
 
 bytestream *Packfile::getPayload(const IndexEntry &entry)
 {
     ASSERT(entry.packfile == packid);
-    bytestream *stored = new fdstream(fd, entry.offset, entry.packed_size);
+    bytestream *stored = _getStored(entry.offset, entry.packed_size);
    
     switch (entry.info.getAlgo()) {
         case ObjectInfo::ZIPALGO_NONE:
             return stored;
-        case ObjectInfo::ZIPALGO_FASTLZ:
-            return new zipstream(stored, DECOMPRESS, entry.info.payload_size);
-        case ObjectInfo::ZIPALGO_LZMA:
-        case ObjectInfo::ZIPALGO_UNKNOWN:
-            NOT_IMPLEMENTED(false);
+        default:
+            ZipCodec_Check(entry.info.getAlgo());
+            return new zipstream(stored, DECOMPRESS, entry.info.payload_size,
+                                 entry.info.getAlgo());
     }
-    return 0;
 }
 
-bool Packfile::purge(const set<ObjectHash> &hset, Index *idx)
+bytestream *
+Packfile::getStoredPayload(offset_t off, uint64_t size)
 {
-    PfTransaction::sp tr = begin(idx);
-    
-    // Read the current contents
-    lseek(fd, 0, SEEK_SET);
-    vector<uint32_t> storedSizes;
-
-    fdstream fs(fd, 0);
-    while (!fs.ended()) {
-        string payload;
-        set<size_t> skip;
-
-        numobjs_t num;
-        try {
-            num = fs.readUInt32();
-        }
-        catch (ios_base::failure &e) {
-            break;
-        }
-
-        storedSizes.resize(num);
-
-        // Read headers
-        for (size_t i = 0; i < num; i++) {
-            ObjectInfo info;
-            fs.readInfo(info);
-            uint32_t ssize = fs.readUInt32();
-            offset_t off = fs.readUInt32();
-            (void)off;
-
-            storedSizes[i] = ssize;
-
-            if (hset.find(info.hash) != hset.end()) {
-                skip.insert(i);
-            }
-            else {
-                tr->infos.push_back(info);
-            }
-        }
-
-        // Read payloads
-        for (size_t i = 0; i < num; i++) {
-            payload.resize(storedSizes[i]);
-            fs.read((uint8_t*)&payload[0], storedSizes[i]);
-
-            if (skip.find(i) != skip.end()) {
-                continue;
-            }
-
-            tr->payloads.push_back(payload);
-        }
-    }
-
-    // Make a tempfile
-    string tmpFilename = filename + ".tmp";
-    int oldFd = fd;
-    fd = ::open(tmpFilename.c_str(), O_RDWR | O_CREAT, 0644);
-    if (fd < 0) {
-        perror("Packfile::purge open");
-        throw SystemException();
-    }
-
-    ::close(oldFd);
-    OriFile_Rename(tmpFilename, filename);
+    return _getStored(off, size);
+}
 
-    // Commit the transaction
-    bool empty = tr->payloads.size() == 0;
-    tr.reset();
+/*
+ * A packfile opened for reading may have been appended to since, the file
+ * is checked for its current size.
+ */
+offset_t
+Packfile::getSize() const
+{
+    struct stat sb;
 
-    return empty;
+    if (fstat(fd, &sb) < 0 || (offset_t)sb.st_size < fileSize)
+        return fileSize;
+    return sb.st_size;
 }
 
 void
 Packfile::readEntries(ReadEntryCb cb, void *arg)
 {
-    offset_t groupOffset = 0;
+    offset_t groupOffset = _dataStart();
+    offset_t end = getSize();
     
-    while (groupOffset < fileSize) {
-        fdstream readStream(fd, groupOffset);
+    while (groupOffset < end) {
+        preadstream readStream(fd, groupOffset);
         numobjs_t objs = readStream.readUInt32();
 
         for (size_t i = 0; i < objs; i++) {
             ObjectInfo info;
-            uint32_t size;
+            uint64_t size;
             offset_t off;
 
-            ASSERT(sizeof(offset_t) == sizeof(uint32_t));
-
-            readStream.readInfo(info);
-            size = readStream.readUInt32();
-            off = readStream.readUInt32();
-            cb(info, off, arg);
+            _readEntry(&readStream, info, size, off);
+            cb(info, off, size, arg);
 
             ASSERT(groupOffset <= size + off);
             groupOffset = size + off;
@@ -414,6 +428,8 @@ Packfile::transmit(bytewstream *bs, vector<IndexEntry> objects)
         includedHashes.insert(objects[i].info.hash);
         totalObjs++;
 
+        // The wire format carries 32-bit sizes (objects are < 4 GiB)
+        ASSERT(objects[i].packed_size <= UINT32_MAX);
         string info_str = objects[i].info.toString();
         infos_ss.write(info_str.data(), info_str.size());
         infos_ss.writeUInt32(objects[i].packed_size);
@@ -430,11 +446,27 @@ Packfile::transmit(bytewstream *bs, vector<IndexEntry> objects)
     for (map<offset_t, offset_t>::iterator it = blocks.begin();
             it != blocks.end();
             it++) {
-        lseek(fd, (*it).first, SEEK_SET);
 	ASSERT((*it).second >= (*it).first);
         ssize_t len = (*it).second - (*it).first;
+
+        // Write the block window by window straight out of the mappings
+        offset_t pos = (*it).first;
+        while (pos < (*it).second) {
+            offset_t winEnd = pos - pos % PACKFILE_MAPWINDOW +
+                              PACKFILE_MAPWINDOW;
+            offset_t end = MIN((*it).second, winEnd);
+            PackfileMap::sp m = _getMap(pos, end - pos);
+            if (!m)
+                break;
+            bs->write(m->data + (pos - m->offset), end - pos);
+            pos = end;
+        }
+        if (pos == (*it).second)
+            continue;
+        len = (*it).second - pos;
+
         buf.resize(len);
-        ssize_t n = read(fd, &buf[0], len);
+        ssize_t n = pread(fd, &buf[0], len, pos);
         if (n < 0 || n != len) {
             throw SystemException();
         }
@@ -446,6 +478,30 @@ Packfile::transmit(bytewstream *bs, vector<IndexEntry> objects)
     ASSERT(!bs->error());
 }
 
+/*
+ * Sends a group of objects held in memory (e.g. expanded deltas) using the
+ * same wire format as transmit.
+ */
+void
+Packfile::transmitPayloads(bytewstream *bs, const vector<ObjectInfo> &infos,
+                           const vector<string> &payloads)
+{
+    ASSERT(infos.size() == payloads.size());
+    ASSERT(sizeof(numobjs_t) == sizeof(uint32_t));
+
+    bs->writeUInt32(infos.size());
+    for (size_t i = 0; i < infos.size(); i++) {
+        ASSERT(payloads[i].size() <= UINT32_MAX);
+        string info_str = infos[i].toString();
+        bs->write(info_str.data(), info_str.size());
+        bs->writeUInt32(payloads[i].size());
+    }
+
+    for (size_t i = 0; i < payloads.size(); i++) {
+        bs->write(payloads[i].data(), payloads[i].size());
+    }
+    ASSERT(!bs->error());
+}
 
 bool
 Packfile::receive(bytestream *bs, Index *idx)
@@ -454,13 +510,15 @@ Packfile::receive(bytestream *bs, Index *idx)
     numobjs_t num = bs->readUInt32();
     if (num == 0) return false;
 
+    if (fileSize == 0)
+        _writeHeader();
+
     lseek(fd, 0, SEEK_END);
-    size_t headers_size = num * ENTRYSIZE;
+    size_t headers_size = num * _entrySize();
     offset_t off = fileSize + sizeof(numobjs_t) + headers_size;
     vector<size_t> obj_sizes;
     
     strwstream headers_ss;
-    ASSERT(sizeof(offset_t) == sizeof(numobjs_t));
     headers_ss.writeUInt32(num);
     for (size_t i = 0; i < num; i++) {
         string info_str(ObjectInfo::SIZE, '\0');
@@ -472,10 +530,7 @@ Packfile::receive(bytestream *bs, Index *idx)
         uint32_t obj_size = bs->readUInt32();
         obj_sizes.push_back(obj_size);
 
-        headers_ss.write(info_str.data(), ObjectInfo::SIZE);
-        headers_ss.writeUInt32(obj_size);
-        ASSERT(sizeof(offset_t) == sizeof(uint32_t));
-        headers_ss.writeUInt32(off);
+        _writeEntry(headers_ss, info, obj_size, off);
 
         IndexEntry ie = {info, off, obj_size, packid};
         idx->updateEntry(info.hash, ie);
@@ -496,10 +551,147 @@ Packfile::receive(bytestream *bs, Index *idx)
         fileSize += obj_sizes[i];
         numObjects++;
     }
+    dirty = true;
 
     return true;
 }
 
+/*
+ * Makes objects written since the last sync durable.
+ */
+void
+Packfile::sync()
+{
+    if (!dirty)
+        return;
+
+    if (OriFile_DataSync(fd) < 0) {
+        WARNING("Packfile %s sync failed", filename.c_str());
+        throw SystemException();
+    }
+    dirty = false;
+}
+
+/*
+ * Returns a mapping that holds [off, off + len).  Packfiles are mapped in
+ * fixed windows that extend past the end of the file, pages become readable
+ * through the existing mapping as the file grows so a window is never
+ * remapped.  Ranges that straddle two windows get a mapping of their own.
+ * Returns NULL if the range is not in the file or mmap is unavailable in
+ * which case callers fall back to pread.
+ */
+PackfileMap::sp
+Packfile::_getMap(offset_t off, uint64_t len)
+{
+    offset_t winOff = off - off % PACKFILE_MAPWINDOW;
+    offset_t mapOff = winOff;
+    uint64_t mapLen = PACKFILE_MAPWINDOW;
+    Monitor lock(mapLock);
+
+    // Never touch pages past the end of the file (SIGBUS)
+    if (off + len > mapEnd) {
+        struct stat sb;
+        if (fstat(fd, &sb) < 0)
+            return PackfileMap::sp();
+        mapEnd = sb.st_size;
+        if (off + len > mapEnd)
+            return PackfileMap::sp();
+    }
+
+    if (off + len > winOff + PACKFILE_MAPWINDOW) {
+        mapOff = off - off % sysconf(_SC_PAGESIZE);
+        mapLen = off + len - mapOff;
+    } else {
+        map<offset_t, PackfileMap::sp>::iterator it = windows.find(winOff);
+        if (it != windows.end())
+            return it->second;
+    }
+    if (mapLen > SIZE_MAX)
+        return PackfileMap::sp();
+
+    void *addr = mmap(NULL, mapLen, PROT_READ, MAP_SHARED, fd, mapOff);
+    if (addr == MAP_FAILED) {
+        DLOG("Packfile mmap failed: %s", strerror(errno));
+        return PackfileMap::sp();
+    }
+
+    PackfileMap::sp m(new PackfileMap((const uint8_t *)addr, mapOff, mapLen));
+    if (mapOff == winOff && mapLen == PACKFILE_MAPWINDOW) {
+        // Readers hold on to evicted windows until they are done
+        if (windows.size() >= PACKFILE_MAPWINDOWS)
+            windows.erase(windows.begin());
+        windows[winOff] = m;
+    }
+    return m;
+}
+
+bytestream *
+Packfile::_getStored(offset_t off, uint64_t len)
+{
+    PackfileMap::sp m = _getMap(off, len);
+    if (m) {
+        return new memstream(m->data + (off - m->offset), len, m);
+    }
+
+    return new preadstream(fd, off, len);
+}
+
+offset_t
+Packfile::_dataStart() const
+{
+    return (version >= PACKFILE_VERSION_2) ? PACKFILE_HDRSIZE : 0;
+}
+
+size_t
+Packfile::_entrySize() const
+{
+    return (version >= PACKFILE_VERSION_2) ? ENTRYSIZE_V2 : ENTRYSIZE_V1;
+}
+
+void
+Packfile::_writeHeader()
+{
+    ASSERT(fileSize == 0);
+
+    strwstream ss;
+    ss.write(PACKFILE_MAGIC, 4);
+    ss.writeUInt32(PACKFILE_VERSION);
+
+    lseek(fd, 0, SEEK_SET);
+    write(fd, ss.str().data(), ss.str().size());
+    fileSize = ss.str().size();
+    version = PACKFILE_VERSION;
+}
+
+void
+Packfile::_writeEntry(strwstream &ss, const ObjectInfo &info,
+                      uint64_t size, offset_t off) const
+{
+    ss.write(info.toString().data(), ObjectInfo::SIZE);
+    if (version >= PACKFILE_VERSION_2) {
+        ss.writeUInt64(size);
+        ss.writeUInt64(off);
+    } else {
+        ASSERT(size <= UINT32_MAX && off <= UINT32_MAX);
+        ss.writeUInt32(size);
+        ss.writeUInt32(off);
+    }
+}
+
+void
+Packfile::_readEntry(bytestream *bs, ObjectInfo &info,
+                     uint64_t &size, offset_t &off) const
+{
+    bs->readInfo(info);
+    if (version >= PACKFILE_VERSION_2) {
+        size = bs->readUInt64();
+        off = bs->readUInt64();
+    } else {
+        size = bs->readUInt32();
+        off = bs->readUInt32();
+    }
+}
+
 
 
 
@@ -524,22 +716,26 @@ PackfileManager::~PackfileManager()
 Packfile::sp
 PackfileManager::getPackfile(packid_t id)
 {
-    if (!_packfileCache.hasKey(id)) {
-        Packfile::sp pf(new Packfile(_getPackfileName(id), id));
+    Packfile::sp pf;
+
+    if (!_packfileCache.get(id, pf)) {
+        pf.reset(new Packfile(_getPackfileName(id), id));
 
         _packfileCache.put(id, pf);
-        return pf;
     }
 
-    return _packfileCache.get(id);
+    return pf;
 }
 
 Packfile::sp
 PackfileManager::newPackfile()
 {
+    Monitor m(lock);
+
     ASSERT(freeList.size() > 0);
     packid_t id = freeList[0];
     Packfile::sp pf(new Packfile(_getPackfileName(id), id));
+    writers[id] = pf;
     if (freeList.size() == 1) {
         freeList[0] += 1;
     }
@@ -555,11 +751,68 @@ PackfileManager::hasPackfile(packid_t id)
     return OriFile_Exists(_getPackfileName(id));
 }
 
+bool
+PackfileManager::isWriting(packid_t id)
+{
+    Monitor m(lock);
+
+    return writers.find(id) != writers.end();
+}
+
+/*
+ * Syncs every packfile created since the last call.  Packfiles that nobody
+ * else holds can no longer be written and are forgotten once synced.
+ */
+void
+PackfileManager::sync()
+{
+    vector<Packfile::sp> toSync;
+    map<packid_t, Packfile::sp>::iterator it;
+
+    // Packfiles are synced without the lock so writers are not held up
+    lock.lock();
+    for (it = writers.begin(); it != writers.end(); it++)
+        toSync.push_back((*it).second);
+    lock.unlock();
+
+    for (size_t i = 0; i < toSync.size(); i++)
+        toSync[i]->sync();
+    toSync.clear();
+
+    Monitor m(lock);
+    it = writers.begin();
+    while (it != writers.end()) {
+        if ((*it).second.use_count() == 1) {
+            writers.erase(it++);
+        } else {
+            it++;
+        }
+    }
+}
+
+void
+PackfileManager::removePackfile(packid_t id)
+{
+    Monitor m(lock);
+
+    // Outstanding readers keep the packfile open until they are done
+    _packfileCache.invalidate(id);
+    writers.erase(id);
+    OriFile_Delete(_getPackfileName(id));
+
+    ASSERT(freeList.size() > 0);
+    deque<packid_t>::iterator it =
+        lower_bound(freeList.begin(), freeList.end() - 1, id);
+    if (it == freeList.end() - 1 || *it != id)
+        freeList.insert(it, id);
+    _writeFreeList();
+}
+
 static int _freeListCB(vector<packid_t> *existing, const string &cpath)
 {
     string path = OriFile_Basename(cpath);
     packid_t id = 0;
-    if (sscanf(path.c_str(), "pack%u.pak", &id) != 1) {
+    if (sscanf(path.c_str(), "pack%" SCNu64 ".pak", &id) != 1) {
         return 0;
     }
     existing->push_back(id);
@@ -615,13 +868,32 @@ PackfileManager::_loadFreeList()
 
     freeList.clear();
 
+    struct stat sb;
+    if (fstat(fd, &sb) < 0 || sb.st_size < (off_t)sizeof(uint32_t)) {
+        close(fd);
+        return false;
+    }
+
     fdstream fs(fd, 0);
     uint32_t numEntries = fs.readUInt32();
-    if (fs.error()) return false;
+    if (fs.error()) {
+        close(fd);
+        return false;
+    }
+
+    // Free lists written with 32-bit packfile ids are simply recomputed
+    if ((size_t)sb.st_size !=
+            sizeof(uint32_t) + numEntries * sizeof(packid_t)) {
+        close(fd);
+        return false;
+    }
+
     for (size_t i = 0; i < numEntries; i++) {
-        ASSERT(sizeof(packid_t) == sizeof(uint32_t));
-        packid_t id = fs.readUInt32();
-        if (fs.error()) return false;
+        packid_t id = fs.readUInt64();
+        if (fs.error()) {
+            close(fd);
+            return false;
+        }
         freeList.push_back(id);
     }
 
@@ -637,8 +909,7 @@ PackfileManager::_writeFreeList()
     ss.writeUInt32(freeList.size());
     for (size_t i = 0; i < freeList.size(); i++) {
         packid_t id = freeList[i];
-        ASSERT(sizeof(uint32_t) == sizeof(packid_t));
-        ss.writeUInt32(id);
+        ss.writeUInt64(id);
     }
 
     string freeListPath = rootPath + PFMGR_FREELIST;
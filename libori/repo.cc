@@ -32,6 +32,7 @@
 
 #include <ori/object.h>
 #include <ori/largeblob.h>
+#include <ori/packfile.h>
 #include <ori/repo.h>
 
 using namespace std;
@@ -75,6 +76,43 @@ Repo::hasObjects(const ObjectHashVec &ids)
     return rval;
 }
 
+bool
+Repo::getObjectFilter(BloomFilter &filter)
+{
+    return false;
+}
+
+/*
+ * The stream lists the commits sent followed by the objects in the transmit
+ * format.  An empty wants asks for every commit.
+ */
+bytestream *
+Repo::getMissingObjects(const ObjectHashVec &wants, const ObjectHashVec &haves)
+{
+    return NULL;
+}
+
+/*
+ * Repositories without cursors always list everything.
+ */
+bool
+Repo::listObjectsSince(const string &cursor, set<ObjectInfo> &objs,
+                       string &next)
+{
+    objs = listObjects();
+    next = "";
+    return false;
+}
+
+bool
+Repo::listCommitsSince(const string &cursor, vector<Commit> &commits,
+                       string &next)
+{
+    commits = listCommits();
+    next = "";
+    return false;
+}
+
 /*
  * High-level operations
  */
@@ -85,14 +123,28 @@ Repo::copyFrom(Object *other)
     addObject(other->getInfo().type, other->getInfo().hash, other->getPayload());
 }
 
+/*
+ * Repositories that do not support deltas store the full payload.
+ */
+int
+Repo::addObject(ObjectType type, const ObjectHash &hash,
+                const string &payload, const ObjectHash &deltaBase)
+{
+    return addObject(type, hash, payload);
+}
+
 /*
  * Add a blob to the repository. This is a low-level interface.
  */
 ObjectHash
-Repo::addBlob(ObjectType type, const string &blob)
+Repo::addBlob(ObjectType type, const string &blob,
+              const ObjectHash &deltaBase)
 {
     ObjectHash hash = OriCrypt_HashString(blob);
-    addObject(type, hash, blob);
+    if (deltaBase.isEmpty())
+        addObject(type, hash, blob);
+    else
+        addObject(type, hash, blob, deltaBase);
     return hash;
 }
 
@@ -112,10 +164,10 @@ Repo::getObjects(const std::deque<ObjectHash> &objs)
  * Add a file to the repository. This is a low-level interface.
  */
 ObjectHash
-Repo::addSmallFile(const string &path)
+Repo::addSmallFile(const string &path, const ObjectHash &deltaBase)
 {
     diskstream ds(path);
-    return addBlob(ObjectInfo::Blob, ds.readAll());
+    return addBlob(ObjectInfo::Blob, ds.readAll(), deltaBase);
 }
 
 /*
@@ -144,19 +196,49 @@ Repo::addLargeFile(const string &path)
     return make_pair(addBlob(ObjectInfo::LargeBlob, blob), lb.totalHash);
 }
 
+/*
+ * Add a modified version of a LargeBlob.  Only the bytes in dirty need to be
+ * present in the file at path; the rest are taken from lbBase, so the file
+ * may be sparse.  Unmodified chunks are reused without rechunking.
+ */
+pair<ObjectHash, ObjectHash>
+Repo::addModifiedFile(const string &path, const ObjectHash &lbBase,
+                      const ExtentMap &dirty)
+{
+    LargeBlob lb = LargeBlob(this);
+
+    lb.fromBlob(getObject(lbBase)->getPayload());
+    lb.updateFile(path, dirty);
+
+    // The result may have shrunk below the large file threshold
+    if (lb.totalSize() <= LARGEFILE_MINIMUM) {
+        string payload;
+        map<uint64_t, LBlobEntry>::iterator it;
+
+        for (it = lb.parts.begin(); it != lb.parts.end(); it++)
+            payload += getObject((*it).second.hash)->getPayload();
+
+        return make_pair(addBlob(ObjectInfo::Blob, payload), ObjectHash());
+    }
+
+    return make_pair(addBlob(ObjectInfo::LargeBlob, lb.getBlob()),
+                     lb.totalHash);
+}
+
 /*
  * Add a file to the repository. This is an internal interface that pusheds the
- * work to addLargeFile or addSmallFile based on our size threshold.
+ * work to addLargeFile or addSmallFile based on our size threshold.  The
+ * deltaBase hint (usually the previous version) only applies to small files.
  */
 pair<ObjectHash, ObjectHash>
-Repo::addFile(const string &path)
+Repo::addFile(const string &path, const ObjectHash &deltaBase)
 {
     size_t sz = OriFile_GetSize(path);
 
     if (sz > LARGEFILE_MINIMUM)
         return addLargeFile(path);
     else
-        return make_pair(addSmallFile(path), ObjectHash());
+        return make_pair(addSmallFile(path, deltaBase), ObjectHash());
 }
 
 
@@ -279,6 +361,48 @@ Repo::receive(bytestream *bs)
     NOT_IMPLEMENTED(false);
 }
 
+/*
+ * Copies a transmit stream up to and including its terminating empty group,
+ * for streams that continue past it.
+ */
+void
+Repo::copyObjects(bytestream *in, bytewstream *out)
+{
+    numobjs_t num;
+    vector<size_t> objSizes;
+    string data;
+
+    num = in->readUInt32();
+    out->writeUInt32(num);
+    while (num != 0) {
+        objSizes.resize(num);
+
+        for (numobjs_t i = 0; i < num; i++) {
+            uint32_t objSize;
+            string infoStr(ObjectInfo::SIZE, '\0');
+
+            // Object info
+            in->readExact((uint8_t *)&infoStr[0], ObjectInfo::SIZE);
+            out->write((uint8_t *)&infoStr[0], ObjectInfo::SIZE);
+
+            // Object size
+            objSize = in->readUInt32();
+            out->writeUInt32(objSize);
+            objSizes[i] = objSize;
+        }
+
+        for (numobjs_t i = 0; i < num; i++) {
+            uint32_t objSize = objSizes[i];
+            data.resize(objSize);
+            in->readExact((uint8_t *)&data[0], objSize);
+            out->write((uint8_t *)&data[0], objSize);
+        }
+
+        num = in->readUInt32();
+        out->writeUInt32(num);
+    }
+}
+
 set<string>
 Repo::listExt()
 {
@@ -127,14 +127,13 @@ Object::sp SshRepo::getObject(const ObjectHash &id)
             case ObjectInfo::ZIPALGO_NONE:
                 payloads[info.hash] = payload;
                 break;
-            case ObjectInfo::ZIPALGO_FASTLZ:
+            default:
+                ZipCodec_Check(info.getAlgo());
                 payloads[info.hash] = zipstream(new strstream(payload),
                                                 DECOMPRESS,
-                                                info.payload_size).readAll();
+                                                info.payload_size,
+                                                info.getAlgo()).readAll();
                 break;
-            case ObjectInfo::ZIPALGO_LZMA:
-            case ObjectInfo::ZIPALGO_UNKNOWN:
-                NOT_IMPLEMENTED(false);
         }
         return Object::sp(new SshObject(this, info));
     }
@@ -162,6 +161,54 @@ SshRepo::getObjects(const ObjectHashVec &objs)
     return NULL;
 }
 
+/*
+ * Commands added to the protocol are only sent to servers whose version
+ * includes them, fetch needs 1.1 and the cursor listings 1.2.
+ */
+bool
+SshRepo::hasProto(const std::string &version)
+{
+    if (protoVersion == "") {
+        client->sendCommand("hello");
+        bool ok = client->respIsOK();
+        bytestream::ap bs(client->getStream());
+        if (ok) {
+            bs->readPStr(protoVersion);
+        }
+    }
+
+    return Util_CompareVersion(protoVersion, version) >= 0;
+}
+
+bytestream *
+SshRepo::getMissingObjects(const ObjectHashVec &wants,
+                           const ObjectHashVec &haves)
+{
+    if (!hasProto("1.1"))
+        return NULL;
+
+    client->sendCommand("fetch");
+
+    strwstream ss;
+    ss.writeUInt32(wants.size());
+    for (size_t i = 0; i < wants.size(); i++) {
+        ss.writeHash(wants[i]);
+    }
+    ss.writeUInt32(haves.size());
+    for (size_t i = 0; i < haves.size(); i++) {
+        ss.writeHash(haves[i]);
+    }
+    client->sendData(ss.str());
+    DLOG("Fetching %lu wants %lu haves", wants.size(), haves.size());
+
+    bool ok = client->respIsOK();
+    bytestream::ap bs(client->getStream());
+    if (ok) {
+        return bs.release();
+    }
+    return NULL;
+}
+
 ObjectInfo
 SshRepo::getObjectInfo(const ObjectHash &id)
 {
@@ -224,6 +271,68 @@ SshRepo::addObject(ObjectType type, const ObjectHash &hash,
     return -1;
 }
 
+bool
+SshRepo::listObjectsSince(const std::string &cursor, std::set<ObjectInfo> &objs,
+                     std::string &next)
+{
+    if (!hasProto("1.2"))
+        return Repo::listObjectsSince(cursor, objs, next);
+
+    client->sendCommand("list objs since");
+
+    strwstream ss;
+    ss.writePStr(cursor);
+    client->sendData(ss.str());
+
+    bool ok = client->respIsOK();
+    bytestream::ap bs(client->getStream());
+    if (!ok)
+        return Repo::listObjectsSince(cursor, objs, next);
+
+    bool since = bs->readUInt8() != 0;
+    bs->readPStr(next);
+    uint64_t num = bs->readUInt64();
+    for (size_t i = 0; i < num; i++) {
+        ObjectInfo info;
+        bs->readInfo(info);
+        objs.insert(info);
+    }
+
+    return since;
+}
+
+bool
+SshRepo::listCommitsSince(const std::string &cursor, std::vector<Commit> &commits,
+                     std::string &next)
+{
+    if (!hasProto("1.2"))
+        return Repo::listCommitsSince(cursor, commits, next);
+
+    client->sendCommand("list commits since");
+
+    strwstream ss;
+    ss.writePStr(cursor);
+    client->sendData(ss.str());
+
+    bool ok = client->respIsOK();
+    bytestream::ap bs(client->getStream());
+    if (!ok)
+        return Repo::listCommitsSince(cursor, commits, next);
+
+    bool since = bs->readUInt8() != 0;
+    bs->readPStr(next);
+    uint32_t num = bs->readUInt32();
+    for (size_t i = 0; i < num; i++) {
+        std::string commit_str;
+        bs->readPStr(commit_str);
+        Commit c;
+        c.fromBlob(commit_str);
+        commits.push_back(c);
+    }
+
+    return since;
+}
+
 std::vector<Commit> SshRepo::listCommits()
 {
     client->sendCommand("list commits");
@@ -799,7 +799,11 @@ TreeDiff::applyTo(Tree::Flat flat, Repo *dest_repo)
         else if (tde.type == TreeDiffEntry::Modified) {
             TreeEntry te = flat[tde.filepath];
             if (tde.newFilename != "") {
-                pair<ObjectHash, ObjectHash> hashes = dest_repo->addFile(tde.newFilename);
+                // The previous version is a good delta base
+                ObjectHash base = (te.type == TreeEntry::Blob) ? te.hash :
+                    ObjectHash();
+                pair<ObjectHash, ObjectHash> hashes =
+                    dest_repo->addFile(tde.newFilename, base);
                 te.hash = hashes.first;
                 te.largeHash = hashes.second;
                 te.type = (!hashes.second.isEmpty()) ? TreeEntry::LargeBlob :
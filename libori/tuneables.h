@@ -20,6 +20,10 @@
 #define COPYFILE_BUFSZ	(256 * 1024)
 
 #define LARGEFILE_MINIMUM (1024 * 1024)
+// Bytes of a large file read at a time while chunking (8 MB)
+#define LARGEFILE_CHUNKBUF (8*1024*1024)
+// Interval of the saved contents hash states of a large file (1 MB)
+#define LARGEFILE_HASHMARK (1024*1024)
 
 // Minimum compressable object (FastLZ requires 66 bytes)
 #define ZIP_MINIMUM_SIZE 512
@@ -27,11 +31,60 @@
 #define COMPCHECK_BYTES 1024
 // Maximum compression ratio (0.8 means compressed file is 80% size of original)
 #define COMPCHECK_RATIO 0.95
+// Smallest blob or tree considered for delta encoding against a base
+#define DELTA_MINIMUM_SIZE 1024
+// Maximum delta size relative to the object (0.5 means half the size)
+#define DELTA_MAXRATIO 0.5
+// Longest chain of deltas read to reconstruct an object (at most 15)
+#define DELTA_MAXDEPTH 8
 
 // These are soft maximums ("heuristics")
-// 64 MB
-#define PACKFILE_MAXSIZE (1024*1024*64)
-#define PACKFILE_MAXOBJS (2048)
+// 8 GB (packfiles use 64-bit offsets)
+#define PACKFILE_MAXSIZE (8ULL*1024*1024*1024)
+#define PACKFILE_MAXOBJS (1024*1024)
+// Packfiles are read through mappings of this size (32 MB)
+#define PACKFILE_MAPWINDOW (32ULL*1024*1024)
+// Mapped windows kept per packfile
+#define PACKFILE_MAPWINDOWS 8
+// Pending transactions are buffered in memory (64 MB)
+#define PFTRANSACTION_MAXSIZE (1024*1024*64)
+#define PFTRANSACTION_MAXOBJS (2048)
+// Journal entries before folding them into the sorted index
+#define INDEX_JOURNAL_MAXENTRIES (64*1024)
+// Write buffer used while merging the index (1 MB)
+#define INDEX_MERGE_BUFSZ (1024*1024)
+// Repack packfiles once this fraction of their bytes is dead
+#define REPACK_MIN_DEADRATIO 0.3
+// Rate limit for background repacking in bytes per second (32 MB/s)
+#define REPACK_MAXRATE (32*1024*1024)
+// Compact the metadata log once it is this many times its live size
+#define METADATA_REWRITE_RATIO 2
+// Smaller metadata logs are never compacted (1 MB)
+#define METADATA_REWRITE_MINSIZE (1024*1024)
+// Stored payloads queued for the verifier workers (64 MB)
+#define VERIFY_QUEUE_MAXBYTES (64*1024*1024)
+// Interval between verifier progress reports (microseconds)
+#define VERIFY_PROGRESS_INTERVAL (1000000)
+// Time a sync waits for concurrent syncs to join it (microseconds)
+#define GROUPCOMMIT_MAXLATENCY 0
+// Decompressed object payloads cached per repository (64 MB)
+#define OBJCACHE_SIZE (64*1024*1024)
+// Larger objects are streamed from the packfile instead of cached (1 MB)
+#define OBJCACHE_MAXOBJSIZE (1024*1024)
+// Object bytes produced at a time when streaming a transfer (1 MB)
+#define TRANSMIT_PARTSIZE (1024*1024)
+// Persistent connections an HTTP client keeps to a server
+#define HTTPCLIENT_CONNECTIONS 4
+// Objects queried per request when checking many objects over HTTP
+#define HTTPCLIENT_CONTAINS_BATCH 4096
+// Age at which a server's object filter is fetched again (microseconds)
+#define HTTPCLIENT_FILTER_TTL (10*1000000)
+// Worker threads serving HTTP requests that read the repository
+#define HTTPD_WORKERS 4
+// Requests an HTTP server queues before refusing more
+#define HTTPD_MAXQUEUED 1024
+// Requests queued per client before its further requests are refused
+#define HTTPD_CLIENT_MAXQUEUED 64
 
 // Choose the hash algorithm (choose one)
 //#define ORI_USE_SHA256
@@ -40,12 +93,11 @@
 #error "Please select one hash algorithm."
 #endif
 
-// Choose the compression algorithm (choose one)
+// Compression codecs (any combination, see zipcodec.h)
 //#define ORI_USE_LZMA
 //#define ORI_USE_FASTLZ
-#if defined(ORI_USE_COMPRESISON) && !defined(ORI_USE_LZMA) && !defined(ORI_USE_FASTLZ)
-#error "Please select one compression algorithm."
-#endif
+//#define ORI_USE_SNAPPY
+//#define ORI_DEFAULT_ZIPALGO ZIPALGO_FASTLZ
 
 #endif /* __TUNEABLES_H__ */
 
@@ -141,14 +141,13 @@ Object::sp UDSRepo::getObject(const ObjectHash &id)
             case ObjectInfo::ZIPALGO_NONE:
                 payloads[info.hash] = payload;
                 break;
-            case ObjectInfo::ZIPALGO_FASTLZ:
+            default:
+                ZipCodec_Check(info.getAlgo());
                 payloads[info.hash] = zipstream(new strstream(payload),
                                                 DECOMPRESS,
-                                                info.payload_size).readAll();
+                                                info.payload_size,
+                                                info.getAlgo()).readAll();
                 break;
-            case ObjectInfo::ZIPALGO_LZMA:
-            case ObjectInfo::ZIPALGO_UNKNOWN:
-                NOT_IMPLEMENTED(false);
         }
         return Object::sp(new UDSObject(this, info));
     }
@@ -176,6 +175,54 @@ UDSRepo::getObjects(const ObjectHashVec &objs)
     return NULL;
 }
 
+/*
+ * Commands added to the protocol are only sent to servers whose version
+ * includes them, fetch needs 1.1 and the cursor listings 1.2.
+ */
+bool
+UDSRepo::hasProto(const std::string &version)
+{
+    if (protoVersion == "") {
+        client->sendCommand("hello");
+        bool ok = client->respIsOK();
+        bytestream::ap bs(client->getStream());
+        if (ok) {
+            bs->readPStr(protoVersion);
+        }
+    }
+
+    return Util_CompareVersion(protoVersion, version) >= 0;
+}
+
+bytestream *
+UDSRepo::getMissingObjects(const ObjectHashVec &wants,
+                           const ObjectHashVec &haves)
+{
+    if (!hasProto("1.1"))
+        return NULL;
+
+    client->sendCommand("fetch");
+
+    strwstream ss;
+    ss.writeUInt32(wants.size());
+    for (size_t i = 0; i < wants.size(); i++) {
+        ss.writeHash(wants[i]);
+    }
+    ss.writeUInt32(haves.size());
+    for (size_t i = 0; i < haves.size(); i++) {
+        ss.writeHash(haves[i]);
+    }
+    client->sendData(ss.str());
+    DLOG("Fetching %lu wants %lu haves", wants.size(), haves.size());
+
+    bool ok = client->respIsOK();
+    bytestream::ap bs(client->getStream());
+    if (ok) {
+        return bs.release();
+    }
+    return NULL;
+}
+
 ObjectInfo
 UDSRepo::getObjectInfo(const ObjectHash &id)
 {
@@ -238,6 +285,68 @@ UDSRepo::addObject(ObjectType type, const ObjectHash &hash,
     return -1;
 }
 
+bool
+UDSRepo::listObjectsSince(const std::string &cursor, std::set<ObjectInfo> &objs,
+                     std::string &next)
+{
+    if (!hasProto("1.2"))
+        return Repo::listObjectsSince(cursor, objs, next);
+
+    client->sendCommand("list objs since");
+
+    strwstream ss;
+    ss.writePStr(cursor);
+    client->sendData(ss.str());
+
+    bool ok = client->respIsOK();
+    bytestream::ap bs(client->getStream());
+    if (!ok)
+        return Repo::listObjectsSince(cursor, objs, next);
+
+    bool since = bs->readUInt8() != 0;
+    bs->readPStr(next);
+    uint64_t num = bs->readUInt64();
+    for (size_t i = 0; i < num; i++) {
+        ObjectInfo info;
+        bs->readInfo(info);
+        objs.insert(info);
+    }
+
+    return since;
+}
+
+bool
+UDSRepo::listCommitsSince(const std::string &cursor, std::vector<Commit> &commits,
+                     std::string &next)
+{
+    if (!hasProto("1.2"))
+        return Repo::listCommitsSince(cursor, commits, next);
+
+    client->sendCommand("list commits since");
+
+    strwstream ss;
+    ss.writePStr(cursor);
+    client->sendData(ss.str());
+
+    bool ok = client->respIsOK();
+    bytestream::ap bs(client->getStream());
+    if (!ok)
+        return Repo::listCommitsSince(cursor, commits, next);
+
+    bool since = bs->readUInt8() != 0;
+    bs->readPStr(next);
+    uint32_t num = bs->readUInt32();
+    for (size_t i = 0; i < num; i++) {
+        std::string commit_str;
+        bs->readPStr(commit_str);
+        Commit c;
+        c.fromBlob(commit_str);
+        commits.push_back(c);
+    }
+
+    return since;
+}
+
 std::vector<Commit> UDSRepo::listCommits()
 {
     client->sendCommand("list commits");
@@ -262,42 +371,9 @@ std::vector<Commit> UDSRepo::listCommits()
 void
 UDSRepo::transmit(bytewstream *out, const ObjectHashVec &objs)
 {
-    numobjs_t num;
-    bytestream *in = getObjects(objs);
-    vector<size_t> objSizes;
-    string data;
-
-    num = in->readUInt32();
-    out->writeUInt32(num);
-    while (num != 0) {
-        objSizes.resize(num);
-
-        for (numobjs_t i = 0; i < num; i++) {
-            uint32_t objSize;
-            string infoStr(ObjectInfo::SIZE, '\0');
-
-            // Object info
-            in->readExact((uint8_t *)&infoStr[0], ObjectInfo::SIZE);
-            out->write((uint8_t *)&infoStr[0], ObjectInfo::SIZE);
-
-            // Object size
-            objSize = in->readUInt32();
-            out->writeUInt32(objSize);
-            objSizes[i] = objSize;
-        }
-
-        for (numobjs_t i = 0; i < num; i++) {
-            uint32_t objSize = objSizes[i];
-            data.resize(objSize);
-            in->readExact((uint8_t *)&data[0], objSize);
-            out->write((uint8_t *)&data[0], objSize);
-        }
-
-        num = in->readUInt32();
-        out->writeUInt32(num);
-    }
+    bytestream::ap in(getObjects(objs));
 
-    return;
+    copyObjects(in.get(), out);
 }
 
 set<string>
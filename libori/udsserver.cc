@@ -248,9 +248,18 @@ UDSSession::serve() {
         else if (command == "list commits") {
             cmd_listCommits();
         }
+        else if (command == "list objs since") {
+            cmd_listObjsSince();
+        }
+        else if (command == "list commits since") {
+            cmd_listCommitsSince();
+        }
         else if (command == "readobjs") {
             cmd_readObjs();
         }
+        else if (command == "fetch") {
+            cmd_fetch();
+        }
         else if (command == "getobjinfo") {
             cmd_getObjInfo();
         }
@@ -313,6 +322,50 @@ void UDSSession::cmd_listCommits()
     }
 }
 
+/*
+ * Lists the objects added since a cursor, see Repo::listObjectsSince.
+ */
+void UDSSession::cmd_listObjsSince()
+{
+    fdstream in(fd, -1);
+    std::string cursor, next;
+    std::set<ObjectInfo> objects;
+
+    in.readPStr(cursor);
+    bool since = repo->listObjectsSince(cursor, objects, next);
+    DLOG("listObjsSince: %lu objects", objects.size());
+
+    fdwstream fs(fd);
+    fs.writeUInt8(OK);
+    fs.writeUInt8(since ? 1 : 0);
+    fs.writePStr(next);
+    fs.writeUInt64(objects.size());
+    for (auto &it : objects) {
+        fs.writeInfo(it);
+    }
+}
+
+void UDSSession::cmd_listCommitsSince()
+{
+    fdstream in(fd, -1);
+    std::string cursor, next;
+    std::vector<Commit> commits;
+
+    in.readPStr(cursor);
+    bool since = repo->listCommitsSince(cursor, commits, next);
+    DLOG("listCommitsSince: %lu commits", commits.size());
+
+    fdwstream fs(fd);
+    fs.writeUInt8(OK);
+    fs.writeUInt8(since ? 1 : 0);
+    fs.writePStr(next);
+    fs.writeUInt32(commits.size());
+    for (size_t i = 0; i < commits.size(); i++) {
+        std::string blob = commits[i].getBlob();
+        fs.writePStr(blob);
+    }
+}
+
 void UDSSession::cmd_readObjs()
 {
     // Read object ids
@@ -333,6 +386,39 @@ void UDSSession::cmd_readObjs()
     repo->transmit(&fs, objs);
 }
 
+/*
+ * Sends the commits listed by LocalRepo::listMissing followed by the objects.
+ */
+void UDSSession::cmd_fetch()
+{
+    fdstream in(fd, -1);
+    ObjectHashVec wants, haves, commits, objs;
+
+    uint32_t numWants = in.readUInt32();
+    for (uint32_t i = 0; i < numWants; i++) {
+        ObjectHash hash;
+        in.readHash(hash);
+        wants.push_back(hash);
+    }
+    uint32_t numHaves = in.readUInt32();
+    for (uint32_t i = 0; i < numHaves; i++) {
+        ObjectHash hash;
+        in.readHash(hash);
+        haves.push_back(hash);
+    }
+    DLOG("fetch: %u wants %u haves", numWants, numHaves);
+
+    objs = repo->listMissing(wants, haves, commits);
+
+    fdwstream fs(fd);
+    fs.writeUInt8(OK);
+    fs.writeUInt32(commits.size());
+    for (size_t i = 0; i < commits.size(); i++) {
+        fs.writeHash(commits[i]);
+    }
+    repo->transmit(&fs, objs);
+}
+
 void UDSSession::cmd_getObjInfo()
 {
     fdstream in(fd, -1);
@@ -0,0 +1,575 @@
+/*
+ * Copyright (c) 2012-2013 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <string>
+#include <sstream>
+#include <vector>
+#include <algorithm>
+#include <deque>
+#include <iostream>
+#include <unordered_set>
+
+#include <oriutil/debug.h>
+#include <oriutil/runtimeexception.h>
+#include <oriutil/stopwatch.h>
+#include <oriutil/thread.h>
+#include <oriutil/zipcodec.h>
+#include <ori/localrepo.h>
+#include <ori/largeblob.h>
+#include <ori/verifier.h>
+
+#include "tuneables.h"
+
+using namespace std;
+
+VerifierStats::VerifierStats()
+    : packfile(0), objects(0), deadObjects(0), bytes(0), errors(0),
+      elapsed(0)
+{
+}
+
+/*
+ * Work queue shared by the scanner and the workers.  The scanner blocks
+ * once VERIFY_QUEUE_MAXBYTES of stored payloads are queued.
+ */
+struct VerifierItem
+{
+    ObjectInfo info;
+    string stored;
+};
+
+struct VerifierQueue
+{
+    VerifierQueue(Verifier *v);
+    ~VerifierQueue();
+    void push(VerifierItem *item);
+    /// @returns NULL once the queue is closed and empty
+    VerifierItem *pop();
+    void done(VerifierItem *item, const string &msg);
+    /// Waits for all queued items to be verified
+    void drain();
+    void close();
+
+    Verifier *v;
+    VerifierStats *pack;
+
+    pthread_mutex_t lock;
+    pthread_cond_t notEmpty;
+    pthread_cond_t notFull;
+    pthread_cond_t idle;
+    deque<VerifierItem *> items;
+    uint64_t queuedBytes;
+    size_t pending;
+    bool closed;
+};
+
+VerifierQueue::VerifierQueue(Verifier *v)
+    : v(v), pack(NULL), queuedBytes(0), pending(0), closed(false)
+{
+    pthread_mutex_init(&lock, NULL);
+    pthread_cond_init(&notEmpty, NULL);
+    pthread_cond_init(&notFull, NULL);
+    pthread_cond_init(&idle, NULL);
+}
+
+VerifierQueue::~VerifierQueue()
+{
+    pthread_cond_destroy(&idle);
+    pthread_cond_destroy(&notFull);
+    pthread_cond_destroy(&notEmpty);
+    pthread_mutex_destroy(&lock);
+}
+
+void
+VerifierQueue::push(VerifierItem *item)
+{
+    pthread_mutex_lock(&lock);
+    // A single large object may exceed the limit on an empty queue
+    while (queuedBytes != 0 &&
+           queuedBytes + item->stored.size() > VERIFY_QUEUE_MAXBYTES) {
+        pthread_cond_wait(&notFull, &lock);
+    }
+    items.push_back(item);
+    queuedBytes += item->stored.size();
+    pending++;
+    pthread_cond_signal(&notEmpty);
+    pthread_mutex_unlock(&lock);
+}
+
+VerifierItem *
+VerifierQueue::pop()
+{
+    VerifierItem *item = NULL;
+
+    pthread_mutex_lock(&lock);
+    while (items.empty() && !closed) {
+        pthread_cond_wait(&notEmpty, &lock);
+    }
+    if (!items.empty()) {
+        item = items.front();
+        items.pop_front();
+        queuedBytes -= item->stored.size();
+        pthread_cond_signal(&notFull);
+    }
+    pthread_mutex_unlock(&lock);
+
+    return item;
+}
+
+void
+VerifierQueue::done(VerifierItem *item, const string &msg)
+{
+    pthread_mutex_lock(&lock);
+    if (msg != "") {
+        pack->errors++;
+        v->error(item->info.hash, msg);
+    }
+    pending--;
+    if (pending == 0)
+        pthread_cond_broadcast(&idle);
+    pthread_mutex_unlock(&lock);
+
+    delete item;
+}
+
+void
+VerifierQueue::drain()
+{
+    pthread_mutex_lock(&lock);
+    while (pending != 0) {
+        pthread_cond_wait(&idle, &lock);
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+void
+VerifierQueue::close()
+{
+    pthread_mutex_lock(&lock);
+    closed = true;
+    pthread_cond_broadcast(&notEmpty);
+    pthread_mutex_unlock(&lock);
+}
+
+class VerifierWorker : public Thread
+{
+public:
+    VerifierWorker(LocalRepo *repo, VerifierQueue *q)
+        : Thread("verifier"), repo(repo), q(q) { }
+    void run();
+private:
+    LocalRepo *repo;
+    VerifierQueue *q;
+    string check(const ObjectInfo &info, const string &stored);
+};
+
+void
+VerifierWorker::run()
+{
+    VerifierItem *item;
+
+    while ((item = q->pop()) != NULL) {
+        string msg;
+
+        try {
+            msg = check(item->info, item->stored);
+        } catch (exception &e) {
+            msg = string("Exception: ") + e.what();
+        }
+        q->done(item, msg);
+    }
+}
+
+/*
+ * Decompresses or resolves a stored payload and checks it.
+ */
+string
+VerifierWorker::check(const ObjectInfo &info, const string &stored)
+{
+    ObjectInfo::ZipAlgo algo = info.getAlgo();
+    string payload;
+
+    if (info.isDelta()) {
+        LocalObject::sp o(new LocalObject(info, stored));
+        try {
+            o = q->v->resolveDelta(o);
+        } catch (RuntimeException &e) {
+            return e.what();
+        }
+        return repo->verifyPayload(o->getInfo(), o->getPayload());
+    }
+
+    if (algo == ObjectInfo::ZIPALGO_NONE) {
+        payload = stored;
+    } else {
+        ZipCodec *codec = ZipCodec_Get(algo);
+        if (codec == NULL)
+            return string("Unsupported compression ") +
+                   ZipCodec_AlgoName(algo);
+        if (!codec->decompress(stored, info.payload_size, payload))
+            return "Cannot decompress object!";
+    }
+
+    if (info.type != ObjectInfo::Purged && payload.size() != info.payload_size)
+        return "Object size mismatch!";
+
+    return repo->verifyPayload(info, payload);
+}
+
+/*
+ * Verifier
+ */
+
+Verifier::Verifier(LocalRepo *repo)
+    : repo(repo), threads(0), maxRate(0), errorCb(NULL), errorArg(NULL),
+      progressCb(NULL), progressArg(NULL)
+{
+}
+
+Verifier::~Verifier()
+{
+}
+
+void
+Verifier::setThreads(int threads)
+{
+    this->threads = threads;
+}
+
+void
+Verifier::setMaxRate(uint64_t maxRate)
+{
+    this->maxRate = maxRate;
+}
+
+void
+Verifier::setErrorCb(ErrorCb cb, void *arg)
+{
+    errorCb = cb;
+    errorArg = arg;
+}
+
+void
+Verifier::setProgressCb(ProgressCb cb, void *arg)
+{
+    progressCb = cb;
+    progressArg = arg;
+}
+
+const vector<VerifierStats> &
+Verifier::getPackStats() const
+{
+    return packStats;
+}
+
+const VerifierStats &
+Verifier::getTotals() const
+{
+    return totals;
+}
+
+LocalObject::sp
+Verifier::resolveDelta(LocalObject::sp o)
+{
+    return repo->resolveDelta(o);
+}
+
+void
+Verifier::error(const ObjectHash &hash, const string &msg)
+{
+    if (errorCb)
+        errorCb(hash, msg, errorArg);
+}
+
+struct VerifierEntry
+{
+    ObjectInfo info;
+    offset_t off;
+    uint64_t size;
+};
+
+static void
+verifierEntryCb(const ObjectInfo &info, offset_t off, uint64_t size, void *arg)
+{
+    vector<VerifierEntry> *entries = (vector<VerifierEntry> *)arg;
+    VerifierEntry e;
+
+    e.info = info;
+    e.off = off;
+    e.size = size;
+    entries->push_back(e);
+}
+
+uint64_t
+Verifier::verifyPackfiles()
+{
+    VerifierQueue q(this);
+    vector<VerifierWorker *> workers;
+    unordered_set<ObjectHash> live;
+    Stopwatch sw, progressSw;
+    uint64_t readBytes = 0;
+    uint64_t errors = 0;
+
+    int n = threads;
+    if (n <= 0)
+        n = sysconf(_SC_NPROCESSORS_ONLN);
+    if (n <= 0)
+        n = 1;
+
+    // Verify everything written so far, packfiles must not go away
+    repo->waitRepack();
+    repo->sync();
+
+    for (int i = 0; i < n; i++) {
+        workers.push_back(new VerifierWorker(repo, &q));
+        workers.back()->start();
+    }
+
+    sw.start();
+    progressSw.start();
+    packStats.clear();
+    totals = VerifierStats();
+
+    vector<packid_t> pfIds = repo->packfiles->getPackfileList();
+    sort(pfIds.begin(), pfIds.end());
+    for (size_t i = 0; i < pfIds.size(); i++) {
+        Packfile::sp pf = repo->packfiles->getPackfile(pfIds[i]);
+        vector<VerifierEntry> entries;
+        VerifierStats ps;
+        Stopwatch packSw;
+
+        packSw.start();
+        ps.packfile = pfIds[i];
+        q.pack = &ps;
+
+        try {
+            pf->readEntries(verifierEntryCb, (void *)&entries);
+        } catch (exception &e) {
+            // No workers are busy after the previous drain
+            stringstream ss;
+            ss << "Cannot read packfile " << pfIds[i] << ": " << e.what();
+            ps.errors++;
+            error(ObjectHash(), ss.str());
+        }
+
+        // Entries are returned in offset order
+        for (size_t j = 0; j < entries.size(); j++) {
+            const VerifierEntry &e = entries[j];
+
+            ps.objects++;
+            ps.bytes += e.size;
+
+            // Superseded copies are garbage and are not checked
+            if (!repo->index.hasObject(e.info.hash)) {
+                ps.deadObjects++;
+                continue;
+            }
+            IndexEntry ie = repo->index.getEntry(e.info.hash);
+            if (ie.packfile != pfIds[i] || ie.offset != e.off) {
+                ps.deadObjects++;
+                continue;
+            }
+            live.insert(e.info.hash);
+
+            VerifierItem *item = new VerifierItem();
+            item->info = e.info;
+            bytestream::ap bs(pf->getStoredPayload(e.off, e.size));
+            item->stored = bs->readAll();
+            q.push(item);
+            readBytes += e.size;
+
+            // Throttle to maxRate bytes per second
+            if (maxRate != 0) {
+                uint64_t target = readBytes * 1000000 / maxRate;
+                uint64_t elapsed = sw.getElapsedTime();
+                if (target > elapsed)
+                    usleep(target - elapsed);
+            }
+
+            if (progressCb &&
+                progressSw.getElapsedTime() >= VERIFY_PROGRESS_INTERVAL) {
+                progressSw.reset();
+                progressSw.start();
+
+                pthread_mutex_lock(&q.lock);
+                VerifierStats snapshot = ps;
+                pthread_mutex_unlock(&q.lock);
+                snapshot.elapsed = packSw.getElapsedTime();
+                totals.elapsed = sw.getElapsedTime();
+                progressCb(snapshot, totals, progressArg);
+            }
+        }
+
+        q.drain();
+        ps.elapsed = packSw.getElapsedTime();
+
+        totals.objects += ps.objects;
+        totals.deadObjects += ps.deadObjects;
+        totals.bytes += ps.bytes;
+        totals.errors += ps.errors;
+        totals.elapsed = sw.getElapsedTime();
+        packStats.push_back(ps);
+        errors += ps.errors;
+
+        if (progressCb)
+            progressCb(ps, totals, progressArg);
+    }
+
+    q.close();
+    for (size_t i = 0; i < workers.size(); i++) {
+        workers[i]->wait();
+        delete workers[i];
+    }
+
+    // Every index entry must refer to an object found in a packfile
+    set<ObjectInfo> objs = repo->index.getList();
+    for (set<ObjectInfo>::iterator it = objs.begin(); it != objs.end(); it++) {
+        if (live.find((*it).hash) == live.end()) {
+            error((*it).hash, "Index refers to a missing object!");
+            errors++;
+        }
+    }
+    totals.errors = errors;
+
+    return errors;
+}
+
+/*
+ * Walks every commit and checks that the objects it refers to exist.
+ * Objects of thin clones are looked up through the remote repository.
+ */
+uint64_t
+Verifier::verifyReachability()
+{
+    unordered_set<ObjectHash> visited;
+    vector<ObjectHash> trees;
+    uint64_t missing = 0;
+
+    set<ObjectInfo> objs = repo->index.getList();
+    for (set<ObjectInfo>::iterator it = objs.begin(); it != objs.end(); it++) {
+        ObjectHash hash = (*it).hash;
+        Commit c;
+
+        if ((*it).type != ObjectInfo::Commit)
+            continue;
+        try {
+            c = repo->getCommit(hash);
+        } catch (exception &e) {
+            error(hash, string("Cannot read commit: ") + e.what());
+            missing++;
+            continue;
+        }
+
+        string status = repo->getMetadata().getMeta(hash, "status");
+
+        pair<ObjectHash, ObjectHash> parents = c.getParents();
+        if (!parents.first.isEmpty() && parents.first != EMPTY_COMMIT &&
+            !repo->hasObject(parents.first)) {
+            error(hash, "Parent commit " + parents.first.hex() + " missing!");
+            missing++;
+        }
+        if (!parents.second.isEmpty() && parents.second != EMPTY_COMMIT &&
+            !repo->hasObject(parents.second)) {
+            error(hash, "Parent commit " + parents.second.hex() + " missing!");
+            missing++;
+        }
+
+        // Trees of purged commits are gone
+        if (status == "purged" || status == "purging")
+            continue;
+        trees.push_back(c.getTree());
+    }
+
+    while (!trees.empty()) {
+        ObjectHash thash = trees.back();
+        trees.pop_back();
+
+        if (!visited.insert(thash).second)
+            continue;
+        if (!repo->hasObject(thash)) {
+            error(thash, "Tree missing!");
+            missing++;
+            continue;
+        }
+
+        Tree t;
+        try {
+            t = repo->getTree(thash);
+        } catch (exception &e) {
+            error(thash, string("Cannot read tree: ") + e.what());
+            missing++;
+            continue;
+        }
+        for (map<string, TreeEntry>::iterator it = t.tree.begin();
+             it != t.tree.end();
+             it++) {
+            const TreeEntry &te = (*it).second;
+
+            if (te.type == TreeEntry::Tree) {
+                trees.push_back(te.hash);
+                continue;
+            }
+            if (!visited.insert(te.hash).second)
+                continue;
+            if (!repo->hasObject(te.hash)) {
+                error(te.hash, "Object " + (*it).first + " of tree " +
+                      thash.hex() + " missing!");
+                missing++;
+                continue;
+            }
+            if (te.type != TreeEntry::LargeBlob)
+                continue;
+
+            LargeBlob lb(repo);
+            try {
+                lb.fromBlob(repo->getPayload(te.hash));
+            } catch (exception &e) {
+                error(te.hash, string("Cannot read large blob: ") + e.what());
+                missing++;
+                continue;
+            }
+            for (map<uint64_t, LBlobEntry>::iterator lit = lb.parts.begin();
+                 lit != lb.parts.end();
+                 lit++) {
+                const ObjectHash &fhash = (*lit).second.hash;
+                if (!visited.insert(fhash).second)
+                    continue;
+                if (!repo->hasObject(fhash)) {
+                    error(te.hash, "Fragment " + fhash.hex() + " missing!");
+                    missing++;
+                }
+            }
+        }
+    }
+
+    return missing;
+}
+
+uint64_t
+Verifier::verify()
+{
+    uint64_t errors = verifyPackfiles();
+
+    errors += verifyReachability();
+    totals.errors = errors;
+
+    return errors;
+}
+
@@ -0,0 +1,252 @@
+/*
+ * Copyright (c) 2012-2013 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <string>
+#include <vector>
+#include <iostream>
+
+#include <oriutil/debug.h>
+#include <oriutil/oricrypt.h>
+#include <oriutil/stream.h>
+#include <oriutil/bloomfilter.h>
+
+using namespace std;
+
+#define BLOOMFILTER_MAXPROBES   30
+
+BloomFilter::BloomFilter()
+    : numProbes(0), numBits(0), extBits(NULL)
+{
+}
+
+BloomFilter::BloomFilter(uint64_t keys, uint32_t bitsPerKey)
+    : extBits(NULL)
+{
+    reset(keys, bitsPerKey);
+}
+
+BloomFilter::BloomFilter(const BloomFilter &other)
+    : extBits(NULL)
+{
+    *this = other;
+}
+
+BloomFilter &
+BloomFilter::operator=(const BloomFilter &other)
+{
+    if (this == &other)
+        return *this;
+
+    numProbes = other.numProbes;
+    numBits = other.numBits;
+    if (other.extBits != NULL)
+        bits.assign(other.extBits, other.extBits + numBits / 8);
+    else
+        bits = other.bits;
+    extBits = NULL;
+
+    return *this;
+}
+
+void
+BloomFilter::reset(uint64_t keys, uint32_t bitsPerKey)
+{
+    // k = ln(2) * m/n minimizes the false positive rate
+    numProbes = (uint32_t)(bitsPerKey * 0.69);
+    if (numProbes < 1)
+        numProbes = 1;
+    if (numProbes > BLOOMFILTER_MAXPROBES)
+        numProbes = BLOOMFILTER_MAXPROBES;
+
+    // Round up to whole bytes and keep small filters useful
+    numBits = keys * bitsPerKey;
+    if (numBits < 64)
+        numBits = 64;
+    numBits = (numBits + 7) & ~7ULL;
+
+    bits.assign(numBits / 8, 0);
+    extBits = NULL;
+}
+
+const uint8_t *
+BloomFilter::_bits() const
+{
+    return extBits ? extBits : &bits[0];
+}
+
+/*
+ * Double hashing (Kirsch and Mitzenmacher) using two independent words of
+ * the object hash.
+ */
+#define PROBE_INIT(_hash, _h1, _h2) \
+    uint64_t _h1, _h2; \
+    memcpy(&_h1, (_hash).hash, sizeof(uint64_t)); \
+    memcpy(&_h2, (_hash).hash + sizeof(uint64_t), sizeof(uint64_t)); \
+    _h2 |= 1
+
+void
+BloomFilter::add(const ObjectHash &hash)
+{
+    ASSERT(numBits != 0);
+    PROBE_INIT(hash, h1, h2);
+
+    if (extBits != NULL) {
+        bits.assign(extBits, extBits + numBits / 8);
+        extBits = NULL;
+    }
+
+    for (uint32_t i = 0; i < numProbes; i++) {
+        uint64_t bit = (h1 + i * h2) % numBits;
+        bits[bit / 8] |= (1 << (bit % 8));
+    }
+}
+
+bool
+BloomFilter::mayContain(const ObjectHash &hash) const
+{
+    if (numBits == 0)
+        return true;
+
+    PROBE_INIT(hash, h1, h2);
+    const uint8_t *b = _bits();
+
+    for (uint32_t i = 0; i < numProbes; i++) {
+        uint64_t bit = (h1 + i * h2) % numBits;
+        if ((b[bit / 8] & (1 << (bit % 8))) == 0)
+            return false;
+    }
+
+    return true;
+}
+
+bool
+BloomFilter::isEmpty() const
+{
+    return numBits == 0;
+}
+
+void
+BloomFilter::fromBlob(const string &blob)
+{
+    attach((const uint8_t *)blob.data(), blob.size());
+    bits.assign(extBits, extBits + numBits / 8);
+    extBits = NULL;
+}
+
+void
+BloomFilter::attach(const uint8_t *blob, size_t len)
+{
+    uint32_t probes;
+    uint64_t nbits;
+
+    if (len < 12)
+        throw SerializationException("Bloom filter is truncated");
+
+    memstream ss(blob, 12);
+    probes = ss.readUInt32();
+    nbits = ss.readUInt64();
+    if (probes > BLOOMFILTER_MAXPROBES || nbits % 8 != 0 ||
+        len - 12 != nbits / 8)
+        throw SerializationException("Bloom filter is corrupt");
+
+    numProbes = probes;
+    numBits = nbits;
+    bits.clear();
+    extBits = blob + 12;
+}
+
+string
+BloomFilter::getBlob() const
+{
+    strwstream ss(12 + bits.size());
+
+    ss.writeUInt32(numProbes);
+    ss.writeUInt64(numBits);
+    if (numBits != 0)
+        ss.write(_bits(), numBits / 8);
+
+    return ss.str();
+}
+
+static ObjectHash
+BloomFilterTestKey(const char *prefix, int i)
+{
+    char buf[32];
+
+    snprintf(buf, sizeof(buf), "%s%d", prefix, i);
+    return OriCrypt_HashString(buf);
+}
+
+int
+BloomFilter_selfTest(void)
+{
+    const int keys = 10000;
+    BloomFilter filter(keys);
+    BloomFilter copy;
+    int falsePositives = 0;
+
+    cout << "Testing BloomFilter ..." << endl;
+
+    if (!copy.mayContain(OriCrypt_HashString("empty"))) {
+        cout << "Error empty filter rejected a hash!" << endl;
+        return -1;
+    }
+
+    for (int i = 0; i < keys; i++) {
+        filter.add(BloomFilterTestKey("key", i));
+    }
+
+    copy.fromBlob(filter.getBlob());
+    string blob = filter.getBlob();
+    BloomFilter attached;
+    attached.attach((const uint8_t *)blob.data(), blob.size());
+    for (int i = 0; i < keys; i++) {
+        ObjectHash hash = BloomFilterTestKey("key", i);
+        if (!filter.mayContain(hash) || !copy.mayContain(hash) ||
+            !attached.mayContain(hash)) {
+            cout << "Error false negative!" << endl;
+            return -1;
+        }
+    }
+
+    // Adding to a copy of an attached filter leaves the blob alone
+    BloomFilter extended(attached);
+    extended.add(BloomFilterTestKey("extra", 0));
+    if (attached.getBlob() != blob ||
+        !extended.mayContain(BloomFilterTestKey("extra", 0))) {
+        cout << "Error attached filter was modified!" << endl;
+        return -1;
+    }
+
+    for (int i = 0; i < keys; i++) {
+        ObjectHash hash = BloomFilterTestKey("absent", i);
+        if (filter.mayContain(hash))
+            falsePositives++;
+    }
+    // Expect roughly 1%
+    if (falsePositives > keys / 20) {
+        cout << "Error false positive rate too high (" << falsePositives
+             << " of " << keys << ")" << endl;
+        return -1;
+    }
+
+    return 0;
+}
+
@@ -0,0 +1,176 @@
+/*
+ * Copyright (c) 2012-2013 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <stdint.h>
+
+#include <map>
+#include <iostream>
+
+#include <oriutil/debug.h>
+#include <oriutil/extentmap.h>
+
+using namespace std;
+
+ExtentMap::ExtentMap()
+{
+}
+
+ExtentMap::~ExtentMap()
+{
+}
+
+void
+ExtentMap::add(uint64_t off, uint64_t len)
+{
+    map<uint64_t, uint64_t>::iterator it;
+    uint64_t start = off;
+    uint64_t end = off + len;
+
+    if (len == 0)
+        return;
+
+    // Merge with a preceding extent that overlaps or touches this one
+    it = extents.upper_bound(start);
+    if (it != extents.begin()) {
+        map<uint64_t, uint64_t>::iterator prev = it;
+        prev--;
+        if ((*prev).second >= start) {
+            start = (*prev).first;
+            it = prev;
+        }
+    }
+
+    // Absorb every following extent that starts before the end
+    while (it != extents.end() && (*it).first <= end) {
+        if ((*it).second > end)
+            end = (*it).second;
+        extents.erase(it++);
+    }
+
+    extents[start] = end;
+}
+
+void
+ExtentMap::truncate(uint64_t size)
+{
+    map<uint64_t, uint64_t>::iterator it;
+
+    it = extents.lower_bound(size);
+    extents.erase(it, extents.end());
+
+    if (!extents.empty()) {
+        it = extents.end();
+        it--;
+        if ((*it).second > size)
+            (*it).second = size;
+    }
+}
+
+void
+ExtentMap::clear()
+{
+    extents.clear();
+}
+
+bool
+ExtentMap::empty() const
+{
+    return extents.empty();
+}
+
+bool
+ExtentMap::find(uint64_t off, uint64_t *start, uint64_t *end) const
+{
+    map<uint64_t, uint64_t>::const_iterator it;
+
+    it = extents.upper_bound(off);
+    if (it != extents.begin()) {
+        map<uint64_t, uint64_t>::const_iterator prev = it;
+        prev--;
+        if ((*prev).second > off)
+            it = prev;
+    }
+
+    if (it == extents.end())
+        return false;
+
+    *start = (*it).first;
+    *end = (*it).second;
+    return true;
+}
+
+uint64_t
+ExtentMap::totalBytes() const
+{
+    map<uint64_t, uint64_t>::const_iterator it;
+    uint64_t total = 0;
+
+    for (it = extents.begin(); it != extents.end(); it++)
+        total += (*it).second - (*it).first;
+
+    return total;
+}
+
+int
+ExtentMap_selfTest(void)
+{
+    ExtentMap m;
+    uint64_t start, end;
+
+    cout << "Testing ExtentMap ..." << endl;
+
+    m.add(100, 100);
+    m.add(300, 100);
+    m.add(500, 100);
+    // Bridges the first two extents
+    m.add(150, 200);
+    // Adjacent to the last extent
+    m.add(600, 10);
+
+    if (m.totalBytes() != 300 + 110) {
+        cout << "Error merging extents!" << endl;
+        return -1;
+    }
+
+    if (!m.find(250, &start, &end) || start != 100 || end != 400) {
+        cout << "Error finding a containing extent!" << endl;
+        return -1;
+    }
+    if (!m.find(450, &start, &end) || start != 500 || end != 610) {
+        cout << "Error finding the next extent!" << endl;
+        return -1;
+    }
+    if (m.find(610, &start, &end)) {
+        cout << "Error found an extent past the end!" << endl;
+        return -1;
+    }
+
+    m.truncate(550);
+    if (!m.find(500, &start, &end) || end != 550 || m.totalBytes() != 350) {
+        cout << "Error truncating extents!" << endl;
+        return -1;
+    }
+
+    m.truncate(100);
+    if (!m.empty()) {
+        cout << "Error truncating all extents!" << endl;
+        return -1;
+    }
+
+    return 0;
+}
+
@@ -0,0 +1,182 @@
+/*
+ * Copyright (c) 2012-2013 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdint.h>
+#include <errno.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include <iostream>
+#include <vector>
+
+#include <oriutil/debug.h>
+#include <oriutil/thread.h>
+#include <oriutil/groupcommit.h>
+
+using namespace std;
+
+GroupCommit::GroupCommit(FlushCb cb, void *arg, uint64_t maxLatency)
+    : cb(cb), arg(arg), maxLatency(maxLatency), flushing(false),
+      requested(0), completed(0), flushes(0)
+{
+    pthread_mutex_init(&lock, NULL);
+    pthread_cond_init(&done, NULL);
+}
+
+GroupCommit::~GroupCommit()
+{
+    pthread_cond_destroy(&done);
+    pthread_mutex_destroy(&lock);
+}
+
+void
+GroupCommit::setMaxLatency(uint64_t usecs)
+{
+    pthread_mutex_lock(&lock);
+    maxLatency = usecs;
+    pthread_mutex_unlock(&lock);
+}
+
+uint64_t
+GroupCommit::getMaxLatency()
+{
+    uint64_t val;
+
+    pthread_mutex_lock(&lock);
+    val = maxLatency;
+    pthread_mutex_unlock(&lock);
+
+    return val;
+}
+
+/*
+ * Each caller takes a ticket.  A flush covers every ticket taken before it
+ * started, so a caller returns once a flush that began after it took its
+ * ticket has completed.
+ */
+void
+GroupCommit::sync()
+{
+    pthread_mutex_lock(&lock);
+
+    uint64_t ticket = ++requested;
+    while (completed < ticket) {
+        if (flushing) {
+            pthread_cond_wait(&done, &lock);
+            continue;
+        }
+
+        flushing = true;
+
+        // Give concurrent writers a chance to join this flush
+        if (maxLatency != 0) {
+            struct timeval now;
+            struct timespec deadline;
+
+            gettimeofday(&now, NULL);
+            uint64_t usecs = now.tv_usec + maxLatency;
+            deadline.tv_sec = now.tv_sec + usecs / 1000000;
+            deadline.tv_nsec = (usecs % 1000000) * 1000;
+            while (pthread_cond_timedwait(&done, &lock, &deadline) !=
+                    ETIMEDOUT) {
+                // Spurious or unrelated wakeup
+            }
+        }
+
+        uint64_t batch = requested;
+        pthread_mutex_unlock(&lock);
+
+        try {
+            cb(arg);
+        } catch (...) {
+            // Let the next caller retry the flush
+            pthread_mutex_lock(&lock);
+            flushing = false;
+            pthread_cond_broadcast(&done);
+            pthread_mutex_unlock(&lock);
+            throw;
+        }
+
+        pthread_mutex_lock(&lock);
+        completed = batch;
+        flushes++;
+        flushing = false;
+        pthread_cond_broadcast(&done);
+    }
+
+    pthread_mutex_unlock(&lock);
+}
+
+uint64_t
+GroupCommit::getFlushes()
+{
+    uint64_t val;
+
+    pthread_mutex_lock(&lock);
+    val = flushes;
+    pthread_mutex_unlock(&lock);
+
+    return val;
+}
+
+/*
+ * Self test
+ */
+
+static void
+GroupCommitTestCb(void *arg)
+{
+    // Simulate a slow fsync
+    usleep(1000);
+}
+
+class GroupCommitTestThread : public Thread
+{
+public:
+    GroupCommitTestThread(GroupCommit *gc) : gc(gc) { }
+    void run() {
+        for (int i = 0; i < 20; i++)
+            gc->sync();
+    }
+private:
+    GroupCommit *gc;
+};
+
+int
+GroupCommit_selfTest(void)
+{
+    GroupCommit gc(GroupCommitTestCb, NULL);
+    vector<GroupCommitTestThread *> threads;
+
+    cout << "Testing GroupCommit ..." << endl;
+
+    for (int i = 0; i < 8; i++) {
+        threads.push_back(new GroupCommitTestThread(&gc));
+        threads.back()->start();
+    }
+    for (size_t i = 0; i < threads.size(); i++) {
+        threads[i]->wait();
+        delete threads[i];
+    }
+
+    if (gc.getFlushes() == 0 || gc.getFlushes() >= 8 * 20) {
+        cout << "Error unexpected number of flushes!" << endl;
+        return -1;
+    }
+
+    return 0;
+}
+
@@ -0,0 +1,244 @@
+/*
+ * Copyright (c) 2012-2013 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <stdint.h>
+
+#include <string>
+#include <iostream>
+
+#include <oriutil/debug.h>
+#include <oriutil/monitor.h>
+#include <oriutil/oricrypt.h>
+#include <oriutil/objectcache.h>
+
+using namespace std;
+
+ObjectCache::ObjectCache(uint64_t budget)
+    : budget(budget)
+{
+    for (int i = 0; i < OBJECTCACHE_SHARDS; i++)
+        shards[i].limit = budget / OBJECTCACHE_SHARDS;
+}
+
+ObjectCache::~ObjectCache()
+{
+}
+
+void
+ObjectCache::setBudget(uint64_t newBudget)
+{
+    Monitor b(budgetLock);
+
+    budget = newBudget;
+    for (int i = 0; i < OBJECTCACHE_SHARDS; i++) {
+        Monitor m(shards[i].lock);
+        shards[i].limit = newBudget / OBJECTCACHE_SHARDS;
+        evict(shards[i], shards[i].limit);
+    }
+}
+
+uint64_t
+ObjectCache::getBudget()
+{
+    Monitor b(budgetLock);
+
+    return budget;
+}
+
+bool
+ObjectCache::get(const ObjectHash &hash, string &payload)
+{
+    Shard &s = getShard(hash);
+    Monitor m(s.lock);
+
+    EntryMap::iterator it = s.entries.find(hash);
+    if (it == s.entries.end()) {
+        s.misses++;
+        return false;
+    }
+
+    s.hits++;
+    s.lru.splice(s.lru.end(), s.lru, (*it).second.second);
+    payload = (*it).second.first;
+
+    return true;
+}
+
+void
+ObjectCache::put(const ObjectHash &hash, const string &payload)
+{
+    Shard &s = getShard(hash);
+    Monitor m(s.lock);
+
+    if (payload.size() > s.limit)
+        return;
+
+    EntryMap::iterator it = s.entries.find(hash);
+    if (it != s.entries.end()) {
+        // Objects are immutable so the cached payload is already correct
+        s.lru.splice(s.lru.end(), s.lru, (*it).second.second);
+        return;
+    }
+
+    evict(s, s.limit - payload.size());
+
+    LRUList::iterator p = s.lru.insert(s.lru.end(), hash);
+    s.entries[hash] = make_pair(payload, p);
+    s.bytes += payload.size();
+}
+
+void
+ObjectCache::invalidate(const ObjectHash &hash)
+{
+    Shard &s = getShard(hash);
+    Monitor m(s.lock);
+
+    EntryMap::iterator it = s.entries.find(hash);
+    if (it == s.entries.end())
+        return;
+
+    s.bytes -= (*it).second.first.size();
+    s.lru.erase((*it).second.second);
+    s.entries.erase(it);
+}
+
+void
+ObjectCache::clear()
+{
+    for (int i = 0; i < OBJECTCACHE_SHARDS; i++) {
+        Monitor m(shards[i].lock);
+        shards[i].lru.clear();
+        shards[i].entries.clear();
+        shards[i].bytes = 0;
+    }
+}
+
+ObjectCacheStats
+ObjectCache::getStats()
+{
+    ObjectCacheStats stats;
+
+    for (int i = 0; i < OBJECTCACHE_SHARDS; i++) {
+        Monitor m(shards[i].lock);
+        stats.hits += shards[i].hits;
+        stats.misses += shards[i].misses;
+        stats.evictions += shards[i].evictions;
+        stats.bytes += shards[i].bytes;
+        stats.entries += shards[i].entries.size();
+    }
+
+    return stats;
+}
+
+ObjectCache::Shard &
+ObjectCache::getShard(const ObjectHash &hash)
+{
+    // Object hashes are uniformly distributed so any byte will do
+    return shards[hash.hash[0] % OBJECTCACHE_SHARDS];
+}
+
+/*
+ * Evicts least recently used entries until the shard holds at most limit
+ * bytes.  The caller must hold the shard lock.
+ */
+void
+ObjectCache::evict(Shard &s, uint64_t limit)
+{
+    while (s.bytes > limit && !s.lru.empty()) {
+        EntryMap::iterator it = s.entries.find(s.lru.front());
+
+        ASSERT(it != s.entries.end());
+
+        s.bytes -= (*it).second.first.size();
+        s.entries.erase(it);
+        s.lru.pop_front();
+        s.evictions++;
+    }
+}
+
+int
+ObjectCache_selfTest(void)
+{
+    // Four 1 KB objects fit in each shard
+    ObjectCache cache(OBJECTCACHE_SHARDS * 4096);
+    string payload(1024, 'x');
+    string out;
+    ObjectHash keys[64];
+    int n = 0;
+
+    cout << "Testing ObjectCache ..." << endl;
+
+    // Collect five keys that land in the same shard
+    for (int i = 0; n < 5; i++) {
+        ObjectHash hash = OriCrypt_HashString(string(1, (char)i) + "key");
+        if (hash.hash[0] % OBJECTCACHE_SHARDS == 0)
+            keys[n++] = hash;
+    }
+
+    for (int i = 0; i < 4; i++)
+        cache.put(keys[i], payload);
+
+    if (!cache.get(keys[0], out) || out != payload) {
+        cout << "Error cached object missing!" << endl;
+        return -1;
+    }
+
+    // keys[1] is now least recently used
+    cache.put(keys[4], payload);
+    if (cache.get(keys[1], out) || !cache.get(keys[0], out)) {
+        cout << "Error LRU eviction order!" << endl;
+        return -1;
+    }
+
+    cache.invalidate(keys[0]);
+    if (cache.get(keys[0], out)) {
+        cout << "Error invalidated object returned!" << endl;
+        return -1;
+    }
+
+    // Objects larger than a shard's budget are never cached
+    cache.put(keys[0], string(8192, 'y'));
+    if (cache.get(keys[0], out)) {
+        cout << "Error oversized object cached!" << endl;
+        return -1;
+    }
+
+    ObjectCacheStats stats = cache.getStats();
+    if (stats.bytes != 3 * 1024 || stats.entries != 3 ||
+        stats.evictions != 1 || stats.hits != 2 || stats.misses != 3) {
+        cout << "Error statistics mismatch!" << endl;
+        return -1;
+    }
+
+    cache.setBudget(OBJECTCACHE_SHARDS * 1024);
+    stats = cache.getStats();
+    if (stats.bytes != 1024) {
+        cout << "Error shrinking the budget did not evict!" << endl;
+        return -1;
+    }
+
+    // Later puts are held to the new budget
+    cache.put(keys[1], string(2048, 'z'));
+    if (cache.get(keys[1], out) ||
+        cache.getBudget() != OBJECTCACHE_SHARDS * 1024) {
+        cout << "Error put ignored the new budget!" << endl;
+        return -1;
+    }
+
+    return 0;
+}
+
@@ -353,6 +353,39 @@ OriFile_Rename(const std::string &from, const std::string &to)
     return 0;
 }
 
+/*
+ * Makes the file contents durable along with the metadata needed to read
+ * them back (e.g. the file size) but not timestamps.
+ */
+int
+OriFile_DataSync(int fd)
+{
+#if defined(__linux__) || defined(__FreeBSD__) || defined(__NetBSD__)
+    if (fdatasync(fd) < 0)
+        return -errno;
+#else
+    if (fsync(fd) < 0)
+        return -errno;
+#endif
+
+    return 0;
+}
+
+/*
+ * Starts writeback of a range without waiting for it.  This only shortens a
+ * later OriFile_DataSync, it makes no durability guarantees of its own.
+ */
+int
+OriFile_StartWriteback(int fd, uint64_t off, uint64_t len)
+{
+#if defined(__linux__)
+    if (sync_file_range(fd, off, len, SYNC_FILE_RANGE_WRITE) < 0)
+        return -errno;
+#endif
+
+    return 0;
+}
+
 std::string
 OriFile_Basename(const std::string &path)
 {
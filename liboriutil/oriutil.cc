@@ -222,6 +222,31 @@ Util_IsPathRemote(const string &path) {
     return true;
 }
 
+/*
+ * Compares two "major.minor" version strings numerically, so "1.10" is
+ * newer than "1.9".  Missing or malformed parts count as zero.
+ */
+int
+Util_CompareVersion(const string &v1, const string &v2)
+{
+    const char *p1 = v1.c_str();
+    const char *p2 = v2.c_str();
+
+    for (int i = 0; i < 2; i++) {
+        char *end1, *end2;
+        unsigned long n1 = strtoul(p1, &end1, 10);
+        unsigned long n2 = strtoul(p2, &end2, 10);
+
+        if (n1 != n2)
+            return n1 < n2 ? -1 : 1;
+
+        p1 = (*end1 == '.') ? end1 + 1 : end1;
+        p2 = (*end2 == '.') ? end2 + 1 : end2;
+    }
+
+    return 0;
+}
+
 string
 Util_SystemError(int status)
 {
@@ -258,6 +283,14 @@ OriUtil_selfTest(void)
     ASSERT(pv[1] == "b.txt");
     ASSERT(pv[2] == "file");
 
+    // Tests for version comparison
+    ASSERT(Util_CompareVersion("1.2", "1.2") == 0);
+    ASSERT(Util_CompareVersion("1.10", "1.9") > 0);
+    ASSERT(Util_CompareVersion("1.9", "1.10") < 0);
+    ASSERT(Util_CompareVersion("2.0", "1.12") > 0);
+    ASSERT(Util_CompareVersion("1", "1.1") < 0);
+    ASSERT(Util_CompareVersion("", "1.1") < 0);
+
     // Test for serialization
     std::string testStr;
     uint64_t nums[] = {129, 76, 13892, 45, 16777217, 14877928, UINT32_MAX * 4,
@@ -27,9 +27,6 @@
 #include <fcntl.h>
 #endif
 
-#ifdef ORI_USE_FASTLZ
-#include "fastlz.h"
-#endif /* ORI_USE_FASTLZ */
 
 #include <string>
 
@@ -167,6 +164,23 @@ int bytestream::copyToFd(int dstFd)
 {
     size_t totalWritten = 0;
     uint8_t buf[COPYFILE_BUFSZ];
+    const uint8_t *view;
+    size_t viewLen;
+
+    if (takeView(&view, &viewLen)) {
+        while (totalWritten < viewLen) {
+            ssize_t bytesWritten = write(dstFd, view + totalWritten,
+                                         viewLen - totalWritten);
+            if (bytesWritten < 0) {
+                if (errno == EINTR)
+                    continue;
+                return -errno;
+            }
+            totalWritten += bytesWritten;
+        }
+        return totalWritten;
+    }
+
     while (!ended()) {
         size_t bytesRead = read(buf, COPYFILE_BUFSZ);
         if (error()) return -errnum();
@@ -436,6 +450,14 @@ size_t strstream::sizeHint() const
     return len;
 }
 
+bool strstream::takeView(const uint8_t **out, size_t *n)
+{
+    *out = (const uint8_t *)buf.data() + off;
+    *n = buf.size() - off;
+    off = buf.size();
+    return true;
+}
+
 /*
  * fdstream
  */
@@ -483,6 +505,80 @@ size_t fdstream::sizeHint() const {
     return 0;
 }
 
+/*
+ * preadstream
+ */
+
+preadstream::preadstream(int fd, off_t offset, size_t length)
+    : fd(fd), offset(offset), length(length), left(length)
+{
+}
+
+bool preadstream::ended() {
+    return left == 0 || error();
+}
+
+size_t preadstream::read(uint8_t *buf, size_t n) {
+    size_t final_size = MIN(n, left);
+retry_read:
+    ssize_t read_bytes = ::pread(fd, buf, final_size, offset);
+    if (read_bytes < 0) {
+        if (errno == EINTR)
+            goto retry_read;
+        setErrno("pread");
+        return 0;
+    }
+    else if (read_bytes == 0) {
+        left = 0;
+        return 0;
+    }
+    left -= read_bytes;
+    offset += read_bytes;
+
+    return read_bytes;
+}
+
+size_t preadstream::sizeHint() const {
+    if (length != (size_t)-1)
+        return length;
+    return 0;
+}
+
+/*
+ * memstream
+ */
+
+memstream::memstream(const uint8_t *buf, size_t len,
+                     std::shared_ptr<const void> owner)
+    : owner(owner), buf(buf), off(0), len(len)
+{
+}
+
+bool memstream::ended() {
+    return off >= len;
+}
+
+size_t memstream::read(uint8_t *out, size_t n)
+{
+    size_t to_read = MIN(n, len - off);
+    memcpy(out, buf + off, to_read);
+    off += to_read;
+    return to_read;
+}
+
+size_t memstream::sizeHint() const
+{
+    return len;
+}
+
+bool memstream::takeView(const uint8_t **out, size_t *n)
+{
+    *out = buf + off;
+    *n = len - off;
+    off = len;
+    return true;
+}
+
 /*
  * diskstream
  */
@@ -520,141 +616,24 @@ size_t diskstream::sizeHint() const {
     return source->sizeHint();
 }
 
-#ifdef ORI_USE_LZMA
-
-/*
- * LZMA zipstream
- */
-
-zipstream::zipstream(bytestream *source, bool compress, size_t size_hint)
-    : source(source), size_hint(size_hint), output_ended(false)
-{
-    assert(source != NULL);
-
-    lzma_stream strm2 = LZMA_STREAM_INIT;
-    memcpy(&strm, &strm2, sizeof(lzma_stream));
-
-    if (compress) {
-        lzma_ret ret = lzma_easy_encoder(&strm, 0, LZMA_CHECK_NONE);
-        if (ret != LZMA_OK)
-            setLzmaErr("lzma_easy_encoder", ret);
-    }
-    else {
-        lzma_ret ret = lzma_stream_decoder(&strm, UINT64_MAX, 0);
-        if (ret != LZMA_OK)
-            setLzmaErr("lzma_stream_decoder", ret);
-    }
-}
-
-zipstream::~zipstream() {
-    delete source;
-}
-
-bool zipstream::ended() {
-    return output_ended || error();
-}
-
-size_t zipstream::read(uint8_t *buf, size_t n) {
-    if (output_ended) return 0;
-
-    lzma_action action = source->ended() ? LZMA_FINISH : LZMA_RUN;
-    size_t begin_total = strm.total_out;
-
-    strm.next_out = buf;
-    strm.avail_out = n;
-    while (strm.avail_out > 0) {
-        if (output_ended) break;
-
-        if (strm.avail_in == 0) {
-            size_t read_bytes = source->read(in_buf, COMPFILE_BUFSZ);
-            if (inheritError(source)) return 0;
-            action = read_bytes == 0 ? LZMA_FINISH : LZMA_RUN;
-
-            strm.next_in = in_buf;
-            strm.avail_in = read_bytes;
-        }
-
-        lzma_ret ret = lzma_code(&strm, action);
-        if (ret == LZMA_STREAM_END) {
-            output_ended = true;
-            lzma_end(&strm);
-        }
-        else if (ret != LZMA_OK) {
-            setLzmaErr("lzma_code", ret);
-            return 0;
-        }
-    }
-
-    return strm.total_out - begin_total;
-}
-
-size_t zipstream::sizeHint() const {
-    return size_hint;
-}
-
-size_t zipstream::inputConsumed() const {
-    return strm.total_in;
-}
-
-const char *lzma_ret_str(lzma_ret ret) {
-    switch (ret) {
-    case LZMA_STREAM_END:
-        return "end of stream";
-    case LZMA_NO_CHECK:
-        return "input stream has no integrity check";
-    case LZMA_UNSUPPORTED_CHECK:
-        return "cannot calculate the integrity check";
-    case LZMA_GET_CHECK:
-        return "integrity check available";
-    case LZMA_MEM_ERROR:
-        return "cannot allocate memory";
-    case LZMA_MEMLIMIT_ERROR:
-        return "memory usage limit exceeded";
-    case LZMA_FORMAT_ERROR:
-        return "file format not recognized";
-    case LZMA_OPTIONS_ERROR:
-        return "invalid or unsupported options";
-    case LZMA_DATA_ERROR:
-        return "data is corrupt";
-    case LZMA_BUF_ERROR:
-        return "no progress is possible";
-    case LZMA_PROG_ERROR:
-        return "programming error";
-    default:
-        return "unknown";
-    }
-}
-
-void zipstream::setLzmaErr(const char *msg, lzma_ret ret)
-{
-    char buf[512];
-    snprintf(buf, 512, "lzmastream %s: %s (%d)\n", msg, lzma_ret_str(ret), ret);
-    last_error.assign(buf);
-    last_errnum = ret;
-}
-
-#endif /* ORI_USE_LZMA */
-
-#ifdef ORI_USE_FASTLZ
-
 /*
- * FastLZ zipstream
+ * zipstream
  */
 
-zipstream::zipstream(bytestream *source, bool compress, size_t size_hint)
+zipstream::zipstream(bytestream *source, bool compress, size_t size_hint,
+                     ObjectInfo::ZipAlgo algo)
     : source(source),
       size_hint(size_hint),
+      algo(algo),
 
       compress(compress),
       input_processed(false),
+      inputSize(0),
 
       offset(0),
       output_ended(false)
 {
     assert(source != NULL);
-    if (size_hint > 0) {
-        output.resize(size_hint);
-    }
 }
 
 zipstream::~zipstream() {
@@ -669,29 +648,36 @@ size_t zipstream::read(uint8_t *buf, size_t n) {
     if (output_ended) return 0;
 
     if (!input_processed) {
-        input = source->readAll();
-        if (output.size() == 0) {
-            NOT_IMPLEMENTED(compress);
-            output.resize(input.size() * 1.3);
+        ZipCodec *codec = ZipCodec_Get(algo);
+        if (codec == NULL) {
+            last_error = string("Unsupported codec ") + ZipCodec_AlgoName(algo);
+            return 0;
+        }
+
+        // Decompress in place when the source is in memory (e.g. mapped)
+        const uint8_t *view;
+        size_t viewLen;
+        bool inPlace = !compress && source->takeView(&view, &viewLen);
+        if (!inPlace) {
+            input = source->readAll();
+            if (inheritError(source)) return 0;
+            view = (const uint8_t *)input.data();
+            viewLen = input.size();
         }
+        inputSize = viewLen;
 
-        int finalSize = 0;
 	if (compress) {
-	    finalSize = fastlz_compress(&input[0], input.size(), &output[0]);
-	    if (finalSize == 0) {
-		last_error = "FastLZ couldn't compress";
+	    if (!codec->compress(input, output)) {
+		last_error = string(codec->getName()) + " couldn't compress";
                 return 0;
             }
 	} else {
-	    finalSize = fastlz_decompress(&input[0], input.size(), &output[0],
-                    output.size());
-	    if (finalSize == 0) {
-		last_error = "FastLZ couldn't decompress";
+	    if (!codec->decompress(view, viewLen, size_hint, output)) {
+		last_error = string(codec->getName()) + " couldn't decompress";
                 return 0;
             }
 	}
 
-        output.resize(finalSize);
 	input_processed = true;
     }
 
@@ -710,11 +696,11 @@ size_t zipstream::sizeHint() const {
 }
 
 size_t zipstream::inputConsumed() const {
-    return (size_t)((offset / (float)output.size()) * input.size());
+    if (output.size() == 0)
+        return 0;
+    return (size_t)((offset / (float)output.size()) * inputSize);
 }
 
-#endif /* ORI_USE_FASTLZ */
-
 /*
  * bytewstream
  */
@@ -737,6 +723,13 @@ void bytewstream::copyFrom(bytestream *bs)
 {
     size_t totalWritten = 0;
     uint8_t buf[COPYFILE_BUFSZ];
+    const uint8_t *view;
+    size_t viewLen;
+
+    if (bs->takeView(&view, &viewLen)) {
+        write(view, viewLen);
+        return;
+    }
     while (!bs->ended()) {
         size_t bytesRead = bs->read(buf, COPYFILE_BUFSZ);
         //if (bs->error()) return -bs->errnum();
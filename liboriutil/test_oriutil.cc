@@ -25,6 +25,11 @@ int LRUCache_selfTest(void);
 int KVSerializer_selfTest(void);
 int OriCrypt_selfTest(void);
 int Key_selfTest(void);
+int ZipCodec_selfTest(void);
+int GroupCommit_selfTest(void);
+int BloomFilter_selfTest(void);
+int ObjectCache_selfTest(void);
+int ExtentMap_selfTest(void);
 
 int
 main(int argc, const char *argv[])
@@ -36,6 +41,11 @@ main(int argc, const char *argv[])
     result += LRUCache_selfTest();
     result += KVSerializer_selfTest();
     result += OriCrypt_selfTest();
+    result += ZipCodec_selfTest();
+    result += GroupCommit_selfTest();
+    result += BloomFilter_selfTest();
+    result += ObjectCache_selfTest();
+    result += ExtentMap_selfTest();
     //result += Key_selfTest();
 
     if (result == 0) {
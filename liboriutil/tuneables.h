@@ -28,12 +28,11 @@
 #error "Please select one hash algorithm."
 #endif
 
-// Choose the compression algorithm (choose one)
+// Compression codecs (any combination, see zipcodec.h)
 //#define ORI_USE_LZMA
 //#define ORI_USE_FASTLZ
-#if defined(ORI_USE_COMPRESISON) && !defined(ORI_USE_LZMA) && !defined(ORI_USE_FASTLZ)
-#error "Please select one compression algorithm."
-#endif
+//#define ORI_USE_SNAPPY
+//#define ORI_DEFAULT_ZIPALGO ZIPALGO_FASTLZ
 
 #endif /* __TUNEABLES_H__ */
 
@@ -0,0 +1,323 @@
+/*
+ * Copyright (c) 2012-2013 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include <string>
+#include <iostream>
+
+#ifdef ORI_USE_FASTLZ
+#include "fastlz.h"
+#endif /* ORI_USE_FASTLZ */
+#ifdef ORI_USE_SNAPPY
+#include "snappy.h"
+#endif /* ORI_USE_SNAPPY */
+#ifdef ORI_USE_LZMA
+#include <lzma.h>
+#endif /* ORI_USE_LZMA */
+
+#include <oriutil/debug.h>
+#include <oriutil/runtimeexception.h>
+#include <oriutil/zipcodec.h>
+
+using namespace std;
+
+#ifndef ORI_DEFAULT_ZIPALGO
+#ifdef ORI_USE_FASTLZ
+#define ORI_DEFAULT_ZIPALGO ZIPALGO_FASTLZ
+#else
+#define ORI_DEFAULT_ZIPALGO ZIPALGO_NONE
+#endif
+#endif
+
+#ifdef ORI_USE_FASTLZ
+
+/*
+ * FastLZ
+ */
+
+class FastLZCodec : public ZipCodec
+{
+public:
+    ObjectInfo::ZipAlgo getAlgo() const { return ObjectInfo::ZIPALGO_FASTLZ; }
+    const char *getName() const { return "fastlz"; }
+
+    bool compress(const string &in, string &out)
+    {
+        // FastLZ requires at least 16 bytes of input
+        if (in.size() < 16)
+            return false;
+
+        // The output buffer must be at least 5% larger than the input
+        out.resize(in.size() * 1.3);
+        int len = fastlz_compress(in.data(), in.size(), &out[0]);
+        if (len == 0)
+            return false;
+
+        out.resize(len);
+        return true;
+    }
+
+    bool decompress(const uint8_t *in, size_t len, size_t size, string &out)
+    {
+        // FastLZ does not record the uncompressed size
+        if (size == 0)
+            return false;
+
+        out.resize(size);
+        int n = fastlz_decompress(in, len, &out[0], size);
+        if (n == 0)
+            return false;
+
+        out.resize(n);
+        return true;
+    }
+};
+
+static FastLZCodec fastlzCodec;
+
+#endif /* ORI_USE_FASTLZ */
+
+#ifdef ORI_USE_SNAPPY
+
+/*
+ * Snappy
+ */
+
+class SnappyCodec : public ZipCodec
+{
+public:
+    ObjectInfo::ZipAlgo getAlgo() const { return ObjectInfo::ZIPALGO_SNAPPY; }
+    const char *getName() const { return "snappy"; }
+
+    bool compress(const string &in, string &out)
+    {
+        snappy::Compress(in.data(), in.size(), &out);
+        return true;
+    }
+
+    bool decompress(const uint8_t *in, size_t len, size_t size, string &out)
+    {
+        return snappy::Uncompress((const char *)in, len, &out);
+    }
+};
+
+static SnappyCodec snappyCodec;
+
+#endif /* ORI_USE_SNAPPY */
+
+#ifdef ORI_USE_LZMA
+
+/*
+ * LZMA (xz container, compatible with the original LZMA zipstream)
+ */
+
+class LZMACodec : public ZipCodec
+{
+public:
+    ObjectInfo::ZipAlgo getAlgo() const { return ObjectInfo::ZIPALGO_LZMA; }
+    const char *getName() const { return "lzma"; }
+
+    bool compress(const string &in, string &out)
+    {
+        size_t pos = 0;
+
+        out.resize(lzma_stream_buffer_bound(in.size()));
+        lzma_ret ret = lzma_easy_buffer_encode(0, LZMA_CHECK_NONE, NULL,
+                                               (const uint8_t *)in.data(),
+                                               in.size(),
+                                               (uint8_t *)&out[0], &pos,
+                                               out.size());
+        if (ret != LZMA_OK) {
+            WARNING("lzma_easy_buffer_encode failed (%d)", ret);
+            return false;
+        }
+
+        out.resize(pos);
+        return true;
+    }
+
+    bool decompress(const uint8_t *in, size_t len, size_t size, string &out)
+    {
+        lzma_stream strm = LZMA_STREAM_INIT;
+        lzma_ret ret = lzma_stream_decoder(&strm, UINT64_MAX, 0);
+        if (ret != LZMA_OK)
+            return false;
+
+        out.resize(size > 0 ? size : len * 4 + 64);
+        strm.next_in = in;
+        strm.avail_in = len;
+        strm.next_out = (uint8_t *)&out[0];
+        strm.avail_out = out.size();
+
+        while (true) {
+            ret = lzma_code(&strm, LZMA_FINISH);
+            if (ret == LZMA_STREAM_END)
+                break;
+            if (ret != LZMA_OK && ret != LZMA_BUF_ERROR) {
+                WARNING("lzma_code failed (%d)", ret);
+                lzma_end(&strm);
+                return false;
+            }
+            if (strm.avail_out == 0) {
+                // Grow the output buffer when the size is unknown
+                size_t used = out.size();
+                out.resize(used * 2);
+                strm.next_out = (uint8_t *)&out[used];
+                strm.avail_out = out.size() - used;
+            } else if (ret == LZMA_BUF_ERROR) {
+                lzma_end(&strm);
+                return false;
+            }
+        }
+
+        out.resize(strm.total_out);
+        lzma_end(&strm);
+        return true;
+    }
+};
+
+static LZMACodec lzmaCodec;
+
+#endif /* ORI_USE_LZMA */
+
+ZipCodec *
+ZipCodec_Get(ObjectInfo::ZipAlgo algo)
+{
+    switch (algo) {
+#ifdef ORI_USE_FASTLZ
+        case ObjectInfo::ZIPALGO_FASTLZ:
+            return &fastlzCodec;
+#endif /* ORI_USE_FASTLZ */
+#ifdef ORI_USE_SNAPPY
+        case ObjectInfo::ZIPALGO_SNAPPY:
+            return &snappyCodec;
+#endif /* ORI_USE_SNAPPY */
+#ifdef ORI_USE_LZMA
+        case ObjectInfo::ZIPALGO_LZMA:
+            return &lzmaCodec;
+#endif /* ORI_USE_LZMA */
+        default:
+            return NULL;
+    }
+}
+
+ObjectInfo::ZipAlgo
+ZipCodec_AlgoFromName(const string &name)
+{
+    if (name == "none")
+        return ObjectInfo::ZIPALGO_NONE;
+    if (name == "fastlz")
+        return ObjectInfo::ZIPALGO_FASTLZ;
+    if (name == "lzma")
+        return ObjectInfo::ZIPALGO_LZMA;
+    if (name == "snappy")
+        return ObjectInfo::ZIPALGO_SNAPPY;
+
+    return ObjectInfo::ZIPALGO_UNKNOWN;
+}
+
+const char *
+ZipCodec_AlgoName(ObjectInfo::ZipAlgo algo)
+{
+    switch (algo) {
+        case ObjectInfo::ZIPALGO_NONE:
+            return "none";
+        case ObjectInfo::ZIPALGO_FASTLZ:
+            return "fastlz";
+        case ObjectInfo::ZIPALGO_LZMA:
+            return "lzma";
+        case ObjectInfo::ZIPALGO_SNAPPY:
+            return "snappy";
+        default:
+            return "unknown";
+    }
+}
+
+bool
+ZipCodec_IsSupported(ObjectInfo::ZipAlgo algo)
+{
+    return algo == ObjectInfo::ZIPALGO_NONE || ZipCodec_Get(algo) != NULL;
+}
+
+void
+ZipCodec_Check(ObjectInfo::ZipAlgo algo)
+{
+    if (!ZipCodec_IsSupported(algo))
+        throw RuntimeException(ORIEC_OBJECTCORRUPT,
+                               string("Unsupported compression ") +
+                               ZipCodec_AlgoName(algo));
+}
+
+/*
+ * FastLZ and Snappy are bundled with the source and always compiled in,
+ * LZMA depends on the system library.
+ */
+bool
+ZipCodec_IsPortable(ObjectInfo::ZipAlgo algo)
+{
+    return algo == ObjectInfo::ZIPALGO_NONE ||
+           algo == ObjectInfo::ZIPALGO_FASTLZ ||
+           algo == ObjectInfo::ZIPALGO_SNAPPY;
+}
+
+ObjectInfo::ZipAlgo
+ZipCodec_Default()
+{
+    return ObjectInfo::ORI_DEFAULT_ZIPALGO;
+}
+
+int
+ZipCodec_selfTest(void)
+{
+    ObjectInfo::ZipAlgo algos[] = {
+        ObjectInfo::ZIPALGO_FASTLZ,
+        ObjectInfo::ZIPALGO_SNAPPY,
+        ObjectInfo::ZIPALGO_LZMA,
+    };
+    string input;
+
+    cout << "Testing ZipCodec ..." << endl;
+
+    for (int i = 0; i < 4096; i++) {
+        input += "compressible text ";
+        input += (char)('a' + (i % 26));
+    }
+
+    for (size_t i = 0; i < sizeof(algos) / sizeof(algos[0]); i++) {
+        ZipCodec *codec = ZipCodec_Get(algos[i]);
+        string c, p;
+
+        if (codec == NULL)
+            continue;
+
+        if (ZipCodec_AlgoFromName(codec->getName()) != algos[i]) {
+            cout << "Error codec name mismatch!" << endl;
+            return -1;
+        }
+
+        if (!codec->compress(input, c) ||
+            !codec->decompress(c, input.size(), p) || p != input) {
+            cout << "Error " << codec->getName()
+                 << " round trip failed!" << endl;
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
@@ -30,6 +30,7 @@
 #include <oriutil/debug.h>
 #include <oriutil/oriutil.h>
 #include <oriutil/orifile.h>
+#include <oriutil/zipcodec.h>
 #include <ori/repostore.h>
 #include <ori/localrepo.h>
 
@@ -42,9 +43,14 @@ usage_newfs()
     cout << endl;
     cout << "Create a new repository, this is a bare repository stored" << endl;
     cout << "stored in your home directory under '.ori'." << endl;
-    //cout << endl;
-    //cout << "Options:" << endl;
+    cout << endl;
+    cout << "Options:" << endl;
     //cout << "    --autosync     Enable autosync" << endl;
+    cout << "    --compression=ALGO" << endl;
+    cout << "                   Compress objects with none, fastlz, snappy"
+         << endl;
+    cout << "                   or lzma (default: "
+         << ZipCodec_AlgoName(ZipCodec_Default()) << ")" << endl;
 }
 
 /*
@@ -60,17 +66,26 @@ cmd_newfs(int argc, char * const argv[])
     bool autosync = false;
     string fsName;
     string rootPath;
+    ObjectInfo::ZipAlgo algo = ObjectInfo::ZIPALGO_UNKNOWN;
 
     struct option longopts[] = {
-        { "autosync",   no_argument,    NULL,   'a' },
-        { NULL,         0,              NULL,   0   }
+        { "autosync",   no_argument,        NULL,   'a' },
+        { "compression", required_argument, NULL,   'c' },
+        { NULL,         0,                  NULL,   0   }
     };
 
-    while ((ch = getopt_long(argc, argv, "a", longopts, NULL)) != -1) {
+    while ((ch = getopt_long(argc, argv, "ac:", longopts, NULL)) != -1) {
         switch (ch) {
             case 'a':
                 autosync = true;
                 break;
+            case 'c':
+                algo = ZipCodec_AlgoFromName(optarg);
+                if (!ZipCodec_IsSupported(algo)) {
+                    printf("Unsupported compression '%s'\n", optarg);
+                    return 1;
+                }
+                break;
             default:
                 printf("Usage: ori newfs [OPTIONS] FSNAME\n");
                 return 1;
@@ -111,6 +126,15 @@ cmd_newfs(int argc, char * const argv[])
         return 1;
     }
 
+    if (algo != ObjectInfo::ZIPALGO_UNKNOWN) {
+        LocalRepo repo(rootPath);
+        repo.open(rootPath);
+        if (!repo.setZipAlgo(algo)) {
+            printf("Failed to set the compression!\n");
+            return 1;
+        }
+    }
+
     // register with autosync
     if (autosync) {
         // XXX: Add to autosync
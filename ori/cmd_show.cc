@@ -44,6 +44,25 @@ cmd_show(int argc, char * const argv[])
     cout << "UUID: " << repository.getUUID() << endl;
     cout << "Version: " << repository.getVersion() << endl;
     cout << "HEAD: " << repository.getHead().hex() << endl;
+
+    strwstream req;
+
+    req.writePStr("cachestats");
+
+    strstream resp = repository.callExt("FUSE", req.str());
+    if (!resp.ended()) {
+        uint32_t len = resp.readUInt32();
+
+        cout << "--- Metadata Cache ---" << endl;
+        for (size_t i = 0; i < len; i++) {
+            string name;
+            uint64_t value;
+
+            resp.readPStr(name);
+            value = resp.readUInt64();
+            cout << name << ": " << value << endl;
+        }
+    }
     //printf("Peers:\n");
     // for
     // printf("    %s\n", hostname);
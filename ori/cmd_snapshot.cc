@@ -45,6 +45,54 @@ usage_snapshot(void)
     cout << endl;
     cout << "Options:" << endl;
     cout << "    -m message     Add a message to the snapshot" << endl;
+    cout << "    -b             Return once the file system is frozen and"
+         << endl;
+    cout << "                   store the snapshot in the background" << endl;
+    cout << "    -w ticket      Wait for a background snapshot to finish"
+         << endl;
+}
+
+/*
+ * Prints the reply of the snapshot and snapshotwait commands.
+ */
+static int
+snapshot_result(strstream &resp)
+{
+    if (resp.ended()) {
+        cout << "status failed with an unknown error!" << endl;
+        return 1;
+    }
+
+    switch (resp.readUInt8())
+    {
+        case 0:
+            cout << "No changes" << endl;
+            return 0;
+        case 1:
+        {
+            ObjectHash hash;
+            resp.readHash(hash);
+            cout << "Committed " << hash.hex() << endl;
+            return 0;
+        }
+        case 2:
+        {
+            uint64_t ticket = resp.readUInt64();
+            cout << "Snapshot queued as " << ticket << endl;
+            return 0;
+        }
+        case 3:
+        {
+            string error;
+            resp.readPStr(error);
+            cout << "Snapshot failed: " << error << endl;
+            return 1;
+        }
+        default:
+            NOT_IMPLEMENTED(false);
+    }
+
+    return 0;
 }
 
 int
@@ -53,20 +101,34 @@ cmd_snapshot(int argc, char * const argv[])
     int ch;
     bool hasMsg = false;
     bool hasName = false;
+    bool background = false;
+    uint64_t ticket = 0;
     string msg;
     string name;
 
     struct option longopts[] = {
         { "message",    required_argument,  NULL,   'm' },
+        { "background", no_argument,        NULL,   'b' },
+        { "wait",       required_argument,  NULL,   'w' },
         { NULL,         0,                  NULL,   0   }
     };
 
-    while ((ch = getopt_long(argc, argv, "m:", longopts, NULL)) != -1) {
+    while ((ch = getopt_long(argc, argv, "m:bw:", longopts, NULL)) != -1) {
         switch (ch) {
             case 'm':
                 hasMsg = true;
                 msg = optarg;
                 break;
+            case 'b':
+                background = true;
+                break;
+            case 'w':
+                ticket = strtoull(optarg, NULL, 10);
+                if (ticket == 0) {
+                    cout << "Invalid snapshot ticket." << endl;
+                    return 1;
+                }
+                break;
             default:
                 printf("Usage: ori snapshot [OPTIONS] [SNAPSHOT NAME]\n");
                 return 1;
@@ -86,6 +148,16 @@ cmd_snapshot(int argc, char * const argv[])
         name = argv[0];
     }
 
+    if (ticket != 0) {
+        strwstream req;
+
+        req.writePStr("snapshotwait");
+        req.writeUInt64(ticket);
+
+        strstream resp = repository.callExt("FUSE", req.str());
+        return snapshot_result(resp);
+    }
+
     if (hasName && !hasMsg) {
         msg = "Created snapshot '" + name + "'";
         hasMsg = true;
@@ -100,29 +172,9 @@ cmd_snapshot(int argc, char * const argv[])
         req.writeLPStr(msg);
     if (hasName)
         req.writeLPStr(name);
+    req.writeUInt8(background ? ORICMD_SNAPSHOT_BACKGROUND : 0);
 
     strstream resp = repository.callExt("FUSE", req.str());
-    if (resp.ended()) {
-        cout << "status failed with an unknown error!" << endl;
-        return 1;
-    }
-
-    switch (resp.readUInt8())
-    {
-        case 0:
-            cout << "No changes" << endl;
-            return 0;
-        case 1:
-        {
-            ObjectHash hash;
-            resp.readHash(hash);
-            cout << "Committed " << hash.hex() << endl;
-            return 0;
-        }
-        default:
-            NOT_IMPLEMENTED(false);
-    }
-
-    return 0;
+    return snapshot_result(resp);
 }
 
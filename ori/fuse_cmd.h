@@ -19,6 +19,9 @@
 
 #define ORI_CONTROL_FILENAME ".ori_control"
 
+// Snapshot request flags (orifs/oricmd.h)
+#define ORICMD_SNAPSHOT_BACKGROUND 0x01
+
 bool OF_HasFuse();
 std::string OF_RootPath();
 std::string OF_ControlPath();
@@ -128,9 +128,18 @@ SshServer::serve() {
         else if (command == "list commits") {
             cmd_listCommits();
         }
+        else if (command == "list objs since") {
+            cmd_listObjsSince();
+        }
+        else if (command == "list commits since") {
+            cmd_listCommitsSince();
+        }
         else if (command == "readobjs") {
             cmd_readObjs();
         }
+        else if (command == "fetch") {
+            cmd_fetch();
+        }
         else if (command == "getobjinfo") {
             cmd_getObjInfo();
         }
@@ -190,6 +199,52 @@ SshServer::cmd_listCommits()
     }
 }
 
+/*
+ * Lists the objects added since a cursor, see Repo::listObjectsSince.
+ */
+void
+SshServer::cmd_listObjsSince()
+{
+    fdstream in(STDIN_FILENO, -1);
+    std::string cursor, next;
+    std::set<ObjectInfo> objects;
+
+    in.readPStr(cursor);
+    bool since = repo->listObjectsSince(cursor, objects, next);
+    DLOG("listObjsSince: %lu objects", objects.size());
+
+    fdwstream fs(STDOUT_FILENO);
+    fs.writeUInt8(OK);
+    fs.writeUInt8(since ? 1 : 0);
+    fs.writePStr(next);
+    fs.writeUInt64(objects.size());
+    for (auto &it : objects) {
+        fs.writeInfo(it);
+    }
+}
+
+void
+SshServer::cmd_listCommitsSince()
+{
+    fdstream in(STDIN_FILENO, -1);
+    std::string cursor, next;
+    std::vector<Commit> commits;
+
+    in.readPStr(cursor);
+    bool since = repo->listCommitsSince(cursor, commits, next);
+    DLOG("listCommitsSince: %lu commits", commits.size());
+
+    fdwstream fs(STDOUT_FILENO);
+    fs.writeUInt8(OK);
+    fs.writeUInt8(since ? 1 : 0);
+    fs.writePStr(next);
+    fs.writeUInt32(commits.size());
+    for (size_t i = 0; i < commits.size(); i++) {
+        std::string blob = commits[i].getBlob();
+        fs.writePStr(blob);
+    }
+}
+
 void
 SshServer::cmd_readObjs()
 {
@@ -210,6 +265,48 @@ SshServer::cmd_readObjs()
     repo->transmit(&fs, objs);
 }
 
+/*
+ * The repository may be a file system that cannot compute the objects, in
+ * which case the client falls back to walking the commits.
+ */
+void
+SshServer::cmd_fetch()
+{
+    fdstream in(STDIN_FILENO, -1);
+    ObjectHashVec wants, haves;
+
+    uint32_t numWants = in.readUInt32();
+    for (uint32_t i = 0; i < numWants; i++) {
+        ObjectHash hash;
+        in.readHash(hash);
+        wants.push_back(hash);
+    }
+    uint32_t numHaves = in.readUInt32();
+    for (uint32_t i = 0; i < numHaves; i++) {
+        ObjectHash hash;
+        in.readHash(hash);
+        haves.push_back(hash);
+    }
+    DLOG("fetch: %u wants %u haves", numWants, numHaves);
+
+    bytestream::ap bs(repo->getMissingObjects(wants, haves));
+    if (!bs.get()) {
+        printError("Fetch not supported");
+        return;
+    }
+
+    fdwstream fs(STDOUT_FILENO);
+    fs.writeUInt8(OK);
+    uint32_t numCommits = bs->readUInt32();
+    fs.writeUInt32(numCommits);
+    for (uint32_t i = 0; i < numCommits; i++) {
+        ObjectHash hash;
+        bs->readHash(hash);
+        fs.writeHash(hash);
+    }
+    Repo::copyObjects(bs.get(), &fs);
+}
+
 void
 SshServer::cmd_getObjInfo()
 {
@@ -58,6 +58,8 @@ usage()
     cout << "Usage: ori_httpd [OPTIONS] FSNAME" << endl << endl;
     cout << "Options:" << endl;
     cout << "    -p port    Set the HTTP port number (default: 8080)" << endl;
+    cout << "    -t threads Set the number of worker threads (default: 4)"
+         << endl;
 #if !defined(WITHOUT_MDNS)
     cout << "    -m         Enable mDNS (default)" << endl;
     cout << "    -n         Disable mDNS" << endl;
@@ -71,9 +73,10 @@ main(int argc, char *argv[])
     int ch;
     bool mDNS_flag = true;
     unsigned long port = 8080;
+    int threads = 0;
     string rootPath;
 
-    while ((ch = getopt(argc, argv, "p:mnh")) != -1) {
+    while ((ch = getopt(argc, argv, "p:t:mnh")) != -1) {
         switch (ch) {
             case 'p':
             {
@@ -86,6 +89,18 @@ main(int argc, char *argv[])
                 }
                 break;
             }
+            case 't':
+            {
+                char *p;
+                threads = strtol(optarg, &p, 10);
+                if (*p != '\0' || threads < 1) {
+                    cout << "Invalid number of threads '" << optarg << "'"
+                         << endl;
+                    usage();
+                    return 1;
+                }
+                break;
+            }
             case 'm':
                 mDNS_flag = true;
                 break;
@@ -124,7 +139,9 @@ main(int argc, char *argv[])
     ori_open_log(repository.getLogPath());
     LOG("libevent %s", event_get_version());
 
-    HTTPServer server = HTTPServer(repository, port);
+    HTTPServer server(repository, port);
+    if (threads != 0)
+        server.setThreads(threads);
     server.start(mDNS_flag);
 
     return 0;
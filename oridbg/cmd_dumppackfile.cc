@@ -38,7 +38,7 @@ cmd_dumppackfile(int argc, char * const argv[])
         return 1;
     }
 
-    repository.dumpPackfile(atoi(argv[1]));
+    repository.dumpPackfile(strtoull(argv[1], NULL, 10));
 
     return 0;
 }
@@ -0,0 +1,97 @@
+/*
+ * Copyright (c) 2012 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <set>
+#include <string>
+#include <iostream>
+
+#include <oriutil/debug.h>
+#include <ori/localrepo.h>
+
+using namespace std;
+
+extern LocalRepo repository;
+
+static const char *hexDigits = "0123456789abcdef";
+
+static string
+cursorToHex(const string &cursor)
+{
+    string hex;
+
+    for (size_t i = 0; i < cursor.size(); i++) {
+        hex += hexDigits[(uint8_t)cursor[i] >> 4];
+        hex += hexDigits[(uint8_t)cursor[i] & 0xf];
+    }
+
+    return hex;
+}
+
+static bool
+cursorFromHex(const string &hex, string &cursor)
+{
+    cursor.clear();
+    if (hex.size() % 2 != 0)
+        return false;
+
+    for (size_t i = 0; i < hex.size(); i += 2) {
+        string digits = hex.substr(i, 2);
+        char *end;
+        long val = strtol(digits.c_str(), &end, 16);
+
+        if (*end != '\0')
+            return false;
+        cursor += (char)val;
+    }
+
+    return true;
+}
+
+/*
+ * Lists the objects added since a cursor printed by an earlier call.  The
+ * first line holds the next cursor, the second whether the listing is
+ * incremental or full.
+ */
+int
+cmd_listsince(int argc, char * const argv[])
+{
+    string cursor, next;
+    set<ObjectInfo> objects;
+
+    if (argc > 2) {
+        cout << "Usage: oridbg listsince [CURSOR]" << endl;
+        return 1;
+    }
+    if (argc == 2 && !cursorFromHex(argv[1], cursor)) {
+        cout << "Invalid cursor '" << argv[1] << "'" << endl;
+        return 1;
+    }
+
+    bool since = repository.listObjectsSince(cursor, objects, next);
+
+    cout << "Cursor " << cursorToHex(next) << endl;
+    cout << (since ? "Incremental" : "Full") << " listing" << endl;
+    for (auto &it : objects) {
+        cout << it.hash.hex() << " # "
+             << ObjectInfo::getStrForType(it.type) << endl;
+    }
+
+    return 0;
+}
+
@@ -41,10 +41,14 @@ cmd_stats(int argc, char * const argv[])
     uint64_t blobRefs = 0;
     uint64_t largeBlobs = 0;
     uint64_t purgedBlobs = 0;
+    uint64_t deltas = 0;
 
     set<ObjectInfo> objs = repository.listObjects();
 
     for (auto &it : objs) {
+        if (it.isDelta())
+            deltas++;
+
         switch (it.type) {
         case ObjectInfo::Commit:
         {
@@ -95,6 +99,7 @@ cmd_stats(int argc, char * const argv[])
          << 100.0 * (float)blobs/(float)blobRefs << "%" << endl;
     cout << left << setw(40) << "Large Blobs" << largeBlobs << endl;
     cout << left << setw(40) << "Purged Blobs" << purgedBlobs << endl;
+    cout << left << setw(40) << "Deltas" << deltas << endl;
 
     return 0;
 }
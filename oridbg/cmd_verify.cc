@@ -15,35 +15,94 @@
  */
 
 #include <stdint.h>
+#include <cinttypes>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <getopt.h>
 
 #include <string>
 #include <iostream>
 
 #include <ori/localrepo.h>
+#include <ori/verifier.h>
 
 using namespace std;
 
 extern LocalRepo repository;
 
+void
+usage_verify()
+{
+    cout << "oridbg verify [OPTIONS]" << endl;
+    cout << endl;
+    cout << "Verify the objects in the repository and check that everything"
+         << endl;
+    cout << "reachable from a commit is present." << endl;
+    cout << endl;
+    cout << "Options:" << endl;
+    cout << "    -j threads     Worker threads (default: one per CPU)" << endl;
+    cout << "    -r rate        Limit reads to rate MB/s" << endl;
+    cout << "    -q             Do not report progress" << endl;
+}
+
+static void
+verifyErrorCb(const ObjectHash &hash, const string &msg, void *arg)
+{
+    cout << "Object " << hash.hex() << endl;
+    cout << msg << endl;
+}
+
+static void
+verifyProgressCb(const VerifierStats &pack, const VerifierStats &total,
+                 void *arg)
+{
+    double secs = total.elapsed / 1000000.0;
+    double rate = secs > 0 ? total.bytes / secs / (1024 * 1024) : 0;
+
+    printf("Packfile %" PRIu64 ": %" PRIu64 " objects (%" PRIu64
+           " dead), %" PRIu64 " errors, %" PRIu64 " bytes\n",
+           pack.packfile, pack.objects, pack.deadObjects, pack.errors,
+           pack.bytes);
+    printf("Total: %" PRIu64 " objects, %" PRIu64 " errors, %.1f MB/s\n",
+           total.objects, total.errors, rate);
+}
+
 /*
  * Verify the repository.
  */
 int
 cmd_verify(int argc, char * const argv[])
 {
-    int status = 0;
-    string error;
-    set<ObjectInfo> objects = repository.listObjects();
-
-    for (auto &it : objects) {
-	error = repository.verifyObject(it.hash);
-	if (error != "") {
-	    cout << "Object " << it.hash.hex() << endl;
-	    cout << error << endl;
-	    status = 1;
-	}
+    int ch;
+    Verifier v(&repository);
+
+    v.setErrorCb(verifyErrorCb, NULL);
+    v.setProgressCb(verifyProgressCb, NULL);
+
+    while ((ch = getopt(argc, argv, "j:r:q")) != -1) {
+        switch (ch) {
+            case 'j':
+                v.setThreads(atoi(optarg));
+                break;
+            case 'r':
+                v.setMaxRate(strtoull(optarg, NULL, 10) * 1024 * 1024);
+                break;
+            case 'q':
+                v.setProgressCb(NULL, NULL);
+                break;
+            default:
+                usage_verify();
+                return 1;
+        }
     }
 
-    return status;
+    uint64_t errors = v.verify();
+    const VerifierStats &total = v.getTotals();
+    printf("Verified %" PRIu64 " objects in %" PRIu64 " packfiles, %"
+           PRIu64 " errors\n", total.objects,
+           (uint64_t)v.getPackStats().size(), errors);
+
+    return errors == 0 ? 0 : 1;
 }
 
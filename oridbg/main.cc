@@ -63,6 +63,7 @@ int cmd_addkey(int argc, char * const argv[]);
 int cmd_branches(int argc, char * const argv[]);
 int cmd_filelog(int argc, char * const argv[]);
 int cmd_findheads(int argc, char * const argv[]);
+void usage_gc(void);
 int cmd_gc(int argc, char * const argv[]);
 int cmd_listkeys(int argc, char * const argv[]);
 int cmd_log(int argc, char * const argv[]);
@@ -75,6 +76,7 @@ int cmd_show(int argc, char * const argv[]);
 int cmd_snapshots(int argc, char * const argv[]);
 int cmd_tip(int argc, char * const argv[]);
 int cmd_verify(int argc, char * const argv[]);
+void usage_verify(void);
 
 // Debug Operations
 int cmd_catobj(int argc, char * const argv[]); // Debug
@@ -84,6 +86,7 @@ int cmd_dumpobj(int argc, char * const argv[]); // Debug
 int cmd_dumppackfile(int argc, char * const argv[]); // Debug
 int cmd_dumprefs(int argc, char * const argv[]); // Debug
 int cmd_listobj(int argc, char * const argv[]); // Debug
+int cmd_listsince(int argc, char * const argv[]); // Debug
 int cmd_refcount(int argc, char * const argv[]); // Debug
 int cmd_stats(int argc, char * const argv[]); // Debug
 int cmd_purgeobj(int argc, char * const argv[]); // Debug
@@ -134,7 +137,7 @@ static Cmd commands[] = {
         "gc",
         "Reclaim unused space",
         cmd_gc,
-        NULL,
+        usage_gc,
         CMD_NEED_REPO,
     },
     {
@@ -211,7 +214,7 @@ static Cmd commands[] = {
         "verify",
         "Verify the repository",
         cmd_verify,
-        NULL,
+        usage_verify,
         CMD_NEED_REPO,
     },
     {
@@ -263,6 +266,13 @@ static Cmd commands[] = {
         NULL,
         CMD_NEED_REPO,
     },
+    {
+        "listsince",
+        "List objects added since a cursor",
+        cmd_listsince,
+        NULL,
+        CMD_NEED_REPO,
+    },
     {
         "rebuildindex",
         "Rebuild index",
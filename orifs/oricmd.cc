@@ -29,6 +29,9 @@
 #include <map>
 #include <memory>
 
+#define FUSE_USE_VERSION 26
+#include <fuse.h>
+
 #include <oriutil/debug.h>
 #include <oriutil/oriutil.h>
 #include <oriutil/stopwatch.h>
@@ -41,6 +44,8 @@
 #include "logging.h"
 #include "oricmd.h"
 #include "oripriv.h"
+#include "orifuse.h"
+#include "orisnapshot.h"
 
 using namespace std;
 
@@ -70,6 +75,8 @@ OriCommand::process(const string &data)
         return cmd_fsck(str);
     if (cmd == "snapshot")
         return cmd_snapshot(str);
+    if (cmd == "snapshotwait")
+        return cmd_snapshotwait(str);
     if (cmd == "snapshots")
         return cmd_snapshots(str);
     if (cmd == "status")
@@ -90,6 +97,8 @@ OriCommand::process(const string &data)
         return cmd_version(str);
     if (cmd == "purgesnapshot")
 	return cmd_purgesnapshot(str);
+    if (cmd == "cachestats")
+        return cmd_cachestats(str);
 
     // Makes debugging easier when a bad request comes in
     return "UNSUPPORTED REQUEST";
@@ -116,8 +125,10 @@ OriCommand::cmd_snapshot(strstream &str)
     FUSE_PLOG("Command: snapshot");
 
     uint8_t hasMsg, hasName;
+    uint8_t flags = 0;
     string msg, name;
     Commit c;
+    uint64_t ticket;
     strwstream resp;
 
     // Parse Command
@@ -131,28 +142,79 @@ OriCommand::cmd_snapshot(strstream &str)
         str.readLPStr(name);
         c.setSnapshot(name);
     }
-
-    RWKey::sp lock = priv->nsLock.writeLock();
-    ObjectHash hash = priv->commit(c);
+    // Older clients do not send flags
+    if (!str.ended())
+        flags = str.readUInt8();
+
+    /*
+     * Only freezing the namespace holds nsLock, the contents are stored by
+     * the committer thread while file system operations continue.
+     */
+    RWKey::sp lock = priv->commitLock();
+    ticket = priv->backgroundCommit(c);
     lock.reset();
-    if (hash.isEmpty()) {
+
+#if defined(DEBUG) || defined(ORI_PERF)
+    FUSE_PLOG("snapshot frozen in %" PRIu64 "us", sw.getElapsedTime());
+#endif /* DEBUG */
+
+    if (ticket == 0) {
         resp.writeUInt8(0);
+    } else if (flags & ORICMD_SNAPSHOT_BACKGROUND) {
+        resp.writeUInt8(2);
+        resp.writeUInt64(ticket);
     } else {
-        resp.writeUInt8(1);
-        resp.writeHash(hash);
+        snapshotResult(ticket, resp);
     }
 
 #if defined(DEBUG) || defined(ORI_PERF)
     sw.stop();
-    if (hash.isEmpty())
+    if (ticket == 0)
         FUSE_PLOG("snapshot not taken");
-    FUSE_PLOG("snapshot result: %s", hash.hex().c_str());
+    FUSE_PLOG("snapshot ticket: %" PRIu64, ticket);
     FUSE_PLOG("snapshot elapsed %" PRIu64 "us", sw.getElapsedTime());
 #endif /* DEBUG */
 
     return resp.str();
 }
 
+string
+OriCommand::cmd_snapshotwait(strstream &str)
+{
+    FUSE_PLOG("Command: snapshotwait");
+
+    strwstream resp;
+    uint64_t ticket;
+
+    ticket = str.readUInt64();
+    snapshotResult(ticket, resp);
+
+    return resp.str();
+}
+
+/*
+ * Waits for a background snapshot and writes the reply of the snapshot
+ * command: 0 for no changes, 1 and the commit hash or 3 and an error.
+ */
+void
+OriCommand::snapshotResult(uint64_t ticket, strwstream &resp)
+{
+    OriCommitJob::sp job = priv->waitCommit(ticket);
+
+    if (!job) {
+        resp.writeUInt8(3);
+        resp.writePStr("Unknown snapshot");
+    } else if (job->status == OriCommitJob::Committed) {
+        resp.writeUInt8(1);
+        resp.writeHash(job->hash);
+    } else if (job->status == OriCommitJob::NoChanges) {
+        resp.writeUInt8(0);
+    } else {
+        resp.writeUInt8(3);
+        resp.writePStr(job->error);
+    }
+}
+
 string
 OriCommand::cmd_snapshots(strstream &str)
 {
@@ -171,6 +233,36 @@ OriCommand::cmd_snapshots(strstream &str)
     return resp.str();
 }
 
+/*
+ * Reports the metadata cache counters as name and value pairs.
+ */
+string
+OriCommand::cmd_cachestats(strstream &str)
+{
+    FUSE_LOG("Command: cachestats");
+
+    OriCacheStats stats = priv->getCacheStats();
+    strwstream resp;
+
+    resp.writeUInt32(7);
+    resp.writePStr("limit");
+    resp.writeUInt64(stats.limit);
+    resp.writePStr("bytes");
+    resp.writeUInt64(stats.bytes);
+    resp.writePStr("entries");
+    resp.writeUInt64(stats.entries);
+    resp.writePStr("directories");
+    resp.writeUInt64(stats.dirs);
+    resp.writePStr("loads");
+    resp.writeUInt64(stats.loads);
+    resp.writePStr("evictions");
+    resp.writeUInt64(stats.evictions);
+    resp.writePStr("evicted entries");
+    resp.writeUInt64(stats.evictedEntries);
+
+    return resp.str();
+}
+
 string
 OriCommand::cmd_status(strstream &str)
 {
@@ -255,10 +347,13 @@ OriCommand::cmd_pull(strstream &str)
         hash = srcRepo->getHead();
 
         // XXX: Change to a repo lock
-        RWKey::sp lock = priv->nsLock.writeLock();
+        RWKey::sp lock = priv->commitLock();
         priv->getRepo()->pull(srcRepo.get());
         // XXX: Refcounts need to be done incrementally or rebuilt after
         lock.reset();
+
+        // Pulled commits may carry new snapshots
+        ori_ll_invalidate_snapshots();
     } else {
         error = "Connection failed!";
     }
@@ -300,10 +395,13 @@ OriCommand::cmd_checkout(strstream &str)
     str.readHash(hash);
     force = str.readUInt8();
 
-    RWKey::sp lock = priv->nsLock.writeLock();
+    RWKey::sp lock = priv->commitLock();
     error = priv->checkout(hash, force);
     lock.reset();
 
+    // Every file has a new id, drop the kernel's view of the old tree
+    ori_ll_invalidate();
+
     if (error != "") {
         resp.writeUInt8(0);
         resp.writePStr(error);
@@ -337,10 +435,12 @@ OriCommand::cmd_merge(strstream &str)
     // Parse Command
     str.readHash(hash);
 
-    RWKey::sp lock = priv->nsLock.writeLock();
+    RWKey::sp lock = priv->commitLock();
     error = priv->merge(hash);
     lock.reset();
 
+    ori_ll_invalidate();
+
     if (error != "") {
         resp.writeUInt8(0);
         resp.writePStr(error);
@@ -541,9 +641,17 @@ OriCommand::cmd_purgesnapshot(strstream &str)
     uint8_t timeBased;
 
     timeBased = str.readUInt8();
+
+    // Purging rewrites metadata a background snapshot may still update
+    RWKey::sp lock = priv->commitLock();
     if (timeBased) {
         int64_t time = str.readInt64();
         repo->gcOrisyncCommit(time);
+        // Reclaim the space with a throttled background repack
+        repo->gc(false);
+        priv->getSnapshotView()->invalidate();
+        lock.reset();
+        ori_ll_invalidate_snapshots();
         resp.writeUInt8(0);
         return resp.str();
     }
@@ -562,6 +670,10 @@ OriCommand::cmd_purgesnapshot(strstream &str)
 	resp.writePStr("Error: Failed to purge object.");
 	return resp.str();
     }
+    repo->gc(false);
+    priv->getSnapshotView()->invalidate();
+    lock.reset();
+    ori_ll_invalidate_snapshots();
 
     resp.writeUInt8(0);
     return resp.str();
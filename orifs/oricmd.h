@@ -19,6 +19,9 @@
 
 class OriPriv;
 
+// Snapshot request flags
+#define ORICMD_SNAPSHOT_BACKGROUND 0x01
+
 class OriCommand
 {
 public:
@@ -28,6 +31,7 @@ public:
 private:
     std::string cmd_fsck(strstream &str);
     std::string cmd_snapshot(strstream &str);
+    std::string cmd_snapshotwait(strstream &str);
     std::string cmd_snapshots(strstream &str);
     std::string cmd_status(strstream &str);
     std::string cmd_pull(strstream &str);
@@ -38,6 +42,8 @@ private:
     std::string cmd_branch(strstream &str);
     std::string cmd_version(strstream &str);
     std::string cmd_purgesnapshot(strstream &str);
+    std::string cmd_cachestats(strstream &str);
+    void snapshotResult(uint64_t ticket, strwstream &resp);
     OriPriv *priv;
 };
 
@@ -0,0 +1,145 @@
+/*
+ * Copyright (c) 2012-2013 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+
+#include <deque>
+#include <map>
+#include <memory>
+#include <string>
+
+#define FUSE_USE_VERSION 26
+#include <fuse.h>
+
+#include <oriutil/debug.h>
+#include <ori/localrepo.h>
+
+#include "logging.h"
+#include "oripriv.h"
+#include "oricommit.h"
+#include "orifuse.h"
+
+using namespace std;
+
+OriCommitter::OriCommitter(OriPriv *priv)
+    : Thread("committer"), priv(priv), nextTicket(1), lastDone(0),
+      stopped(false)
+{
+    pthread_mutex_init(&lock, NULL);
+    pthread_cond_init(&changed, NULL);
+}
+
+OriCommitter::~OriCommitter()
+{
+    pthread_cond_destroy(&changed);
+    pthread_mutex_destroy(&lock);
+}
+
+uint64_t
+OriCommitter::enqueue(OriCommitJob::sp job)
+{
+    pthread_mutex_lock(&lock);
+    job->ticket = nextTicket++;
+    queue.push_back(job);
+    pthread_cond_broadcast(&changed);
+    pthread_mutex_unlock(&lock);
+
+    return job->ticket;
+}
+
+bool
+OriCommitter::waitFor(uint64_t ticket, OriCommitJob::sp *job)
+{
+    map<uint64_t, OriCommitJob::sp>::iterator it;
+    bool found = false;
+
+    pthread_mutex_lock(&lock);
+    if (ticket < nextTicket) {
+        while (lastDone < ticket) {
+            pthread_cond_wait(&changed, &lock);
+        }
+        it = results.find(ticket);
+        if (it != results.end()) {
+            *job = it->second;
+            found = true;
+        }
+    }
+    pthread_mutex_unlock(&lock);
+
+    return found;
+}
+
+void
+OriCommitter::waitIdle()
+{
+    pthread_mutex_lock(&lock);
+    while (!queue.empty()) {
+        pthread_cond_wait(&changed, &lock);
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+void
+OriCommitter::stop()
+{
+    pthread_mutex_lock(&lock);
+    stopped = true;
+    pthread_cond_broadcast(&changed);
+    pthread_mutex_unlock(&lock);
+
+    wait();
+}
+
+void
+OriCommitter::run()
+{
+    while (true) {
+        OriCommitJob::sp job;
+
+        pthread_mutex_lock(&lock);
+        while (queue.empty() && !stopped) {
+            pthread_cond_wait(&changed, &lock);
+        }
+        // The namespace is already frozen so queued commits always finish
+        if (queue.empty()) {
+            pthread_mutex_unlock(&lock);
+            return;
+        }
+        job = queue.front();
+        pthread_mutex_unlock(&lock);
+
+        priv->runCommit(job.get());
+
+        if (job->status == OriCommitJob::Failed) {
+            WARNING("Background commit %" PRIu64 " failed: %s",
+                    job->ticket, job->error.c_str());
+        } else if (job->status == OriCommitJob::Committed &&
+                   job->commit.getSnapshot() != "") {
+            ori_ll_invalidate_snapshots();
+        }
+
+        pthread_mutex_lock(&lock);
+        queue.pop_front();
+        lastDone = job->ticket;
+        results[job->ticket] = job;
+        if (results.size() > ORIFS_COMMIT_RESULTS)
+            results.erase(results.begin());
+        pthread_cond_broadcast(&changed);
+        pthread_mutex_unlock(&lock);
+    }
+}
@@ -0,0 +1,135 @@
+/*
+ * Copyright (c) 2012-2013 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef __ORICOMMIT_H__
+#define __ORICOMMIT_H__
+
+#include <pthread.h>
+#include <sys/types.h>
+
+#include <deque>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <oriutil/thread.h>
+#include <oriutil/objecthash.h>
+#include <oriutil/extentmap.h>
+#include <ori/commit.h>
+#include <ori/tree.h>
+
+class OriPriv;
+class OriFileInfo;
+
+// Results of finished background commits kept for waiters
+#define ORIFS_COMMIT_RESULTS 64
+
+/*
+ * An entry of a frozen directory that the commit has to store or update.
+ * The entry template holds the attributes at the time of the freeze, and
+ * for files path names the temporary file holding the frozen contents.
+ */
+struct OriCommitEntry {
+    OriCommitEntry()
+        : info(NULL), store(false), cow(false),
+          materialize(false), cowBase(0), subdir(-1) { }
+    std::string name;
+    OriFileInfo *info; // retained until the commit finishes
+    TreeEntry entry;
+    bool store; // contents need to be stored
+    std::string path; // temporary file, "" for unchanged contents
+    std::string link;
+    ObjectHash base; // delta base for small files
+    bool cow; // store the extents in dirty against the LargeBlob in entry
+    bool materialize; // fill in the unwritten ranges before storing
+    uint64_t cowBase;
+    ExtentMap dirty; // extents written since the base for cow files
+    ssize_t subdir; // index of the frozen subdirectory or -1
+};
+
+/*
+ * A dirty directory frozen for a commit.  The tree already holds the
+ * entries of clean children, the rest are filled in from entries.
+ */
+struct OriCommitDir {
+    OriCommitDir() : dirty(false) { }
+    std::string path;
+    ObjectHash oldTreeHash;
+    Tree tree;
+    std::vector<OriCommitEntry> entries;
+    bool dirty;
+    ObjectHash hash; // stored tree or empty if unchanged
+};
+
+/*
+ * A commit split into a cheap freeze of the dirty directories under nsLock
+ * and the storing of their contents, which the committer thread does in the
+ * background.  Directories are kept in post-order so children are stored
+ * before their parents and the root is last.
+ */
+class OriCommitJob
+{
+public:
+    typedef std::shared_ptr<OriCommitJob> sp;
+    enum Status {
+        Pending,
+        NoChanges,
+        Committed,
+        Failed,
+    };
+    OriCommitJob() : ticket(0), background(false), status(Pending) { }
+    uint64_t ticket;
+    bool background;
+    Commit commit;
+    std::vector<OriCommitDir> dirs;
+    Status status;
+    ObjectHash hash;
+    std::string error;
+};
+
+/*
+ * Stores frozen commits in the background one at a time, in the order
+ * they were frozen.  Callers get a ticket they can wait on.
+ */
+class OriCommitter : public Thread
+{
+public:
+    explicit OriCommitter(OriPriv *priv);
+    ~OriCommitter();
+    uint64_t enqueue(OriCommitJob::sp job);
+    /**
+     * Waits for a background commit to finish.
+     * @returns false if the ticket is unknown or its result was dropped
+     */
+    bool waitFor(uint64_t ticket, OriCommitJob::sp *job);
+    /// Waits until every queued commit has finished
+    void waitIdle();
+    /// Finishes the queued commits and waits for the thread to exit
+    void stop();
+    void run();
+private:
+    OriPriv *priv;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    std::deque<OriCommitJob::sp> queue;
+    std::map<uint64_t, OriCommitJob::sp> results;
+    uint64_t nextTicket;
+    uint64_t lastDone;
+    bool stopped;
+};
+
+#endif /* __ORICOMMIT_H__ */
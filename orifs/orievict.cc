@@ -0,0 +1,91 @@
+/*
+ * Copyright (c) 2012-2013 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <sched.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <string>
+#include <map>
+#include <memory>
+#include <unordered_map>
+
+#include <oriutil/debug.h>
+#include <oriutil/rwlock.h>
+#include <ori/localrepo.h>
+
+#include "oripriv.h"
+#include "orievict.h"
+
+OriEvictor::OriEvictor(OriPriv *priv)
+    : Thread("evictor"), priv(priv), pending(false), stopped(false)
+{
+    pthread_mutex_init(&lock, NULL);
+    pthread_cond_init(&kicked, NULL);
+}
+
+OriEvictor::~OriEvictor()
+{
+    pthread_cond_destroy(&kicked);
+    pthread_mutex_destroy(&lock);
+}
+
+void
+OriEvictor::kick()
+{
+    pthread_mutex_lock(&lock);
+    if (!pending) {
+        pending = true;
+        pthread_cond_signal(&kicked);
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+void
+OriEvictor::stop()
+{
+    pthread_mutex_lock(&lock);
+    stopped = true;
+    pthread_cond_signal(&kicked);
+    pthread_mutex_unlock(&lock);
+
+    wait();
+}
+
+void
+OriEvictor::run()
+{
+    while (true) {
+        pthread_mutex_lock(&lock);
+        while (!pending && !stopped) {
+            pthread_cond_wait(&kicked, &lock);
+        }
+        if (stopped) {
+            pthread_mutex_unlock(&lock);
+            return;
+        }
+        pending = false;
+        pthread_mutex_unlock(&lock);
+
+        // Each pass holds nsLock briefly so FUSE operations interleave
+        while (priv->evict()) {
+            sched_yield();
+        }
+    }
+}
@@ -0,0 +1,49 @@
+/*
+ * Copyright (c) 2012-2013 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef __ORIEVICT_H__
+#define __ORIEVICT_H__
+
+#include <pthread.h>
+
+#include <oriutil/thread.h>
+
+class OriPriv;
+
+/*
+ * Shrinks the metadata cache in the background.  Loading a directory only
+ * holds nsLock for reading, so it asks this thread to unload clean
+ * directories under the write lock instead of doing it inline.
+ */
+class OriEvictor : public Thread
+{
+public:
+    explicit OriEvictor(OriPriv *priv);
+    ~OriEvictor();
+    /// Schedules an eviction pass, cheap if one is already scheduled
+    void kick();
+    /// Waits for the thread to exit
+    void stop();
+    void run();
+private:
+    OriPriv *priv;
+    pthread_mutex_t lock;
+    pthread_cond_t kicked;
+    bool pending;
+    bool stopped;
+};
+
+#endif /* __ORIEVICT_H__ */
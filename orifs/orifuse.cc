@@ -43,6 +43,7 @@
 #include <oriutil/orifile.h>
 #include <oriutil/systemexception.h>
 #include <oriutil/rwlock.h>
+#include <oriutil/monitor.h>
 #include <ori/repostore.h>
 #include <ori/version.h>
 #include <ori/commit.h>
@@ -53,6 +54,8 @@
 #include "oricmd.h"
 #include "oripriv.h"
 #include "oriopt.h"
+#include "orifuse.h"
+#include "orisnapshot.h"
 
 #ifdef DEBUG
 #define FSCK_A_LOT
@@ -60,11 +63,6 @@
 
 using namespace std;
 
-#define ORI_CONTROL_FILENAME ".ori_control"
-#define ORI_CONTROL_FILEPATH "/" ORI_CONTROL_FILENAME
-#define ORI_SNAPSHOT_DIRNAME ".snapshot"
-#define ORI_SNAPSHOT_DIRPATH "/" ORI_SNAPSHOT_DIRNAME
-
 #define OPT_KEY_CLONE_PARAM 0
 
 mount_ori_config config;
@@ -73,7 +71,7 @@ OriPriv *priv;
 
 // Mount/Unmount
 
-static void *
+void *
 ori_init(struct fuse_conn_info *conn)
 {
     FUSE_LOG("Ori Filesystem starting ...");
@@ -86,13 +84,16 @@ ori_init(struct fuse_conn_info *conn)
     return priv;
 }
 
-static void
+void
 ori_destroy(void *userdata)
 {
     OriPriv *priv = GetOriPriv();
     Commit c;
     c.setMessage("FUSE snapshot on unmount");
+    // Excludes the prefetcher until cleanup stops it
+    RWKey::sp lock = priv->commitLock();
     priv->commit(c);
+    lock.reset();
     priv->cleanup();
     delete priv;
 
@@ -265,13 +266,6 @@ ori_rename(const char *from_path, const char *to_path)
             return -EISDIR;
         }
 
-        // XXX: Need to support renaming directories (nlink, OriPriv::Rename)
-        if (info->isDir()) {
-            FUSE_LOG("ori_rename: Directory rename attempted %s to %s",
-                     from_path, to_path);
-            return -EINVAL;
-        }
-
         priv->rename(from_path, to_path);
     } catch (SystemException &e) {
         return -e.getErrno();
@@ -355,14 +349,26 @@ ori_open(const char *path, struct fuse_file_info *fi)
     } else if (strncmp(path,
                        ORI_SNAPSHOT_DIRPATH,
                        strlen(ORI_SNAPSHOT_DIRPATH)) == 0) {
-        return writing ? -EPERM : 0;
+        if (writing)
+            return -EPERM;
+
+        RWKey::sp lock = priv->nsLock.readLock();
+        try {
+            fi->fh = priv->getSnapshotView()->open(ORI_SNAPSHOT_RELPATH(path));
+        } catch (SystemException &e) {
+            return -e.getErrno();
+        }
+
+        // Snapshot contents never change
+        fi->keep_cache = 1;
+        return 0;
     }
 
     parentPath = OriFile_Dirname(path);
     if (parentPath == "")
         parentPath = "/";
 
-    RWKey::sp lock = priv->nsLock.writeLock();
+    RWKey::sp lock = priv->nsLock.readLock();
     try {
         parentDir = priv->getDir(parentPath);
         info = priv->openFile(path, /*writing*/writing, /*trunc*/trunc);
@@ -371,7 +377,7 @@ ori_open(const char *path, struct fuse_file_info *fi)
     }
 
     if (writing)
-        parentDir->setDirty();
+        priv->setDirty(parentDir);
 
     // Set fh
     fi->fh = info.second;
@@ -379,7 +385,7 @@ ori_open(const char *path, struct fuse_file_info *fi)
     return 0;
 }
 
-static int
+int
 ori_read(const char *path, char *buf, size_t size, off_t offset,
          struct fuse_file_info *fi)
 {
@@ -400,40 +406,8 @@ ori_read(const char *path, char *buf, size_t size, off_t offset,
     } else if (strncmp(path,
                        ORI_SNAPSHOT_DIRPATH,
                        strlen(ORI_SNAPSHOT_DIRPATH)) == 0) {
-        string snapshot = path;
-        string parentPath, fileName;
-        size_t pos = 0;
-        Commit c;
-        Tree t;
-        
-        snapshot = snapshot.substr(strlen(ORI_SNAPSHOT_DIRPATH) + 1);
-        pos = snapshot.find('/', pos);
-
-        ASSERT(pos != snapshot.npos);
-
-        parentPath = snapshot.substr(pos);
-        snapshot = snapshot.substr(0, pos);
-        fileName = OriFile_Basename(parentPath);
-        parentPath = OriFile_Dirname(parentPath);
-        if (parentPath == "")
-            parentPath = "/";
-
-        // XXX: Enforce that this is a valid snapshot & directory path
-        c = priv->lookupSnapshot(snapshot);
-        t = priv->getTree(c, parentPath);
-
-        // lookup tree
-        Tree::iterator it = t.find(fileName);
-        if (it == t.end())
-            return -ENOENT;
-
-        // Read
-        OriFileInfo *tempInfo = new OriFileInfo();
-        tempInfo->type = FILETYPE_COMMITTED;
-        tempInfo->hash = it->second.hash;
-        status = priv->readFile(tempInfo, buf, size, offset);
-        tempInfo->release();
-        return status;
+        RWKey::sp lock = priv->nsLock.readLock();
+        return priv->getSnapshotView()->read(fi->fh, buf, size, offset);
     }
 
     RWKey::sp lock = priv->nsLock.readLock();
@@ -444,14 +418,23 @@ ori_read(const char *path, char *buf, size_t size, off_t offset,
         return -EISDIR;
     }
 
-    if (info->fd != -1) {
+    // Our handle keeps the descriptor open once it is set
+    priv->getInfoLock(info).lock();
+    int fd = info->fd;
+    bool cow = info->cow;
+    priv->getInfoLock(info).unlock();
+
+    if (cow) {
+        // Written ranges in the temporary file, the rest in the repository
+        return priv->readCow(fi->fh, info, buf, size, offset);
+    } else if (fd != -1) {
         // File in temporary directory
-        status = pread(info->fd, buf, size, offset);
+        status = pread(fd, buf, size, offset);
         if (status < 0)
             return -errno;
     } else {
         // File in repository
-        return priv->readFile(info, buf, size, offset);
+        return priv->readHandle(fi->fh, info, buf, size, offset);
     }
 
     return status;
@@ -464,6 +447,7 @@ ori_write(const char *path, const char *buf, size_t size, off_t offset,
     OriPriv *priv = GetOriPriv();
     OriFileInfo *info;
     int status;
+    int fd;
 
     // FUSE_LOG("FUSE ori_write(path=\"%s\", length=%ld)", path, size);
 
@@ -484,12 +468,30 @@ ori_write(const char *path, const char *buf, size_t size, off_t offset,
         return -EISDIR;
     }
 
-    info->type = FILETYPE_DIRTY;
-    status = pwrite(info->fd, buf, size, offset);
+    /*
+     * A file frozen by a pending commit gets its own copy first, its
+     * directory stayed dirty as the file was open.
+     */
+    try {
+        priv->thawFile(info);
+    } catch (SystemException &e) {
+        return -e.getErrno();
+    }
+
+    // Read under the info lock, thawFile switches the descriptor over
+    priv->getInfoLock(info).lock();
+    fd = info->fd;
+    priv->getInfoLock(info).unlock();
+
+    status = pwrite(fd, buf, size, offset);
     if (status < 0)
         return -errno;
 
     // Update size
+    Monitor m(priv->getInfoLock(info));
+    info->type = FILETYPE_DIRTY;
+    if (info->cow)
+        info->overlay.add(offset, status);
     if (info->statInfo.st_size < (off_t)size + offset) {
         info->statInfo.st_size = size + offset;
         info->statInfo.st_blocks = (size + offset + (512-1))/512;
@@ -514,8 +516,28 @@ ori_truncate(const char *path, off_t length)
         return -EACCES;
     }
 
-    RWKey::sp lock = priv->nsLock.writeLock();
-    info = priv->getFileInfo(path);
+    string parentPath = OriFile_Dirname(path);
+    if (parentPath == "")
+        parentPath = "/";
+
+    RWKey::sp lock = priv->nsLock.readLock();
+    OriDir *parentDir;
+    try {
+        parentDir = priv->getDir(parentPath);
+        info = priv->getFileInfo(path);
+    } catch (SystemException &e) {
+        return -e.getErrno();
+    }
+
+    // The directory of a frozen file may have been committed already
+    try {
+        if (priv->thawFile(info))
+            priv->setDirty(parentDir);
+    } catch (SystemException &e) {
+        return -e.getErrno();
+    }
+
+    Monitor m(priv->getInfoLock(info));
     if (info->type == FILETYPE_DIRTY) {
         int status;
 
@@ -523,6 +545,11 @@ ori_truncate(const char *path, off_t length)
         if (status < 0)
             return -errno;
 
+        if (info->cow) {
+            info->overlay.truncate(length);
+            info->cowBase = MIN(info->cowBase, (uint64_t)length);
+        }
+
         // Update size
         info->statInfo.st_size = length;
         info->statInfo.st_blocks = (length + (512-1))/512;
@@ -552,8 +579,17 @@ ori_ftruncate(const char *path, off_t length, struct fuse_file_info *fi)
         return -EIO;
     }
 
-    RWKey::sp lock = priv->nsLock.writeLock();
+    RWKey::sp lock = priv->nsLock.readLock();
     info = priv->getFileInfo(fi->fh);
+
+    // The directory stayed dirty as the file was open when frozen
+    try {
+        priv->thawFile(info);
+    } catch (SystemException &e) {
+        return -e.getErrno();
+    }
+
+    Monitor m(priv->getInfoLock(info));
     if (info->type == FILETYPE_DIRTY) {
         int status;
 
@@ -561,6 +597,11 @@ ori_ftruncate(const char *path, off_t length, struct fuse_file_info *fi)
         if (status < 0)
             return -errno;
 
+        if (info->cow) {
+            info->overlay.truncate(length);
+            info->cowBase = MIN(info->cowBase, (uint64_t)length);
+        }
+
         // Update size
         info->statInfo.st_size = length;
         info->statInfo.st_blocks = (length + (512-1))/512;
@@ -585,10 +626,11 @@ ori_release(const char *path, struct fuse_file_info *fi)
     } else if (strncmp(path,
                        ORI_SNAPSHOT_DIRPATH,
                        strlen(ORI_SNAPSHOT_DIRPATH)) == 0) {
+        priv->getSnapshotView()->close(fi->fh);
         return 0;
     }
 
-    RWKey::sp lock = priv->nsLock.writeLock();
+    RWKey::sp lock = priv->nsLock.readLock();
     // Decrement reference count (deletes temporary file for unlink)
     return priv->closeFH(fi->fh);
 }
@@ -669,7 +711,7 @@ ori_rmdir(const char *path)
     return 0;
 }
 
-static int
+int
 ori_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
                         off_t offset, struct fuse_file_info *fi)
 {
@@ -704,28 +746,20 @@ ori_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
     } else if (strncmp(path,
                        ORI_SNAPSHOT_DIRPATH,
                        strlen(ORI_SNAPSHOT_DIRPATH)) == 0) {
-        string snapshot = path;
-        string relPath;
-        size_t pos = 0;
-        Commit c;
-        Tree t;
-        
-        snapshot = snapshot.substr(strlen(ORI_SNAPSHOT_DIRPATH) + 1);
-        pos = snapshot.find('/', pos);
+        OriSnapshotNode::sp node;
 
-        if (pos == snapshot.npos) {
-            relPath = "/";
-        } else {
-            relPath = snapshot.substr(pos);
-            snapshot = snapshot.substr(0, pos);
+        RWKey::sp lock = priv->nsLock.readLock();
+        try {
+            node = priv->getSnapshotView()->lookup(ORI_SNAPSHOT_RELPATH(path));
+        } catch (SystemException &e) {
+            return -e.getErrno();
         }
+        if (!S_ISDIR(node->st.st_mode))
+            return -ENOTDIR;
 
-        // XXX: Enforce that this is a valid snapshot & directory path
-        c = priv->lookupSnapshot(snapshot);
-        t = priv->getTree(c, relPath);
-
-        for (map<string, TreeEntry>::iterator it = t.tree.begin();
-             it != t.tree.end();
+        for (map<string, TreeEntry>::const_iterator it =
+                node->tree.tree.begin();
+             it != node->tree.tree.end();
              it++) {
             filler(buf, (*it).first.c_str(), NULL, 0);
         }
@@ -733,7 +767,7 @@ ori_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
         return 0;
     }
 
-    RWKey::sp lock = priv->nsLock.writeLock();
+    RWKey::sp lock = priv->nsLock.readLock();
     try {
         dir = priv->getDir(path);
     } catch (SystemException e) {
@@ -742,10 +776,14 @@ ori_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
 
     for (it = dir->begin(); it != dir->end(); it++) {
         OriFileInfo *info;
+        struct stat st;
         
         try {
             info = priv->getFileInfo(dirPath + (*it).first);
-            filler(buf, (*it).first.c_str(), &info->statInfo, 0);
+            priv->getInfoLock(info).lock();
+            st = info->statInfo;
+            priv->getInfoLock(info).unlock();
+            filler(buf, (*it).first.c_str(), &st, 0);
         } catch (SystemException e) {
             FUSE_LOG("Unexpected %s", e.what());
             filler(buf, (*it).first.c_str(), NULL, 0);
@@ -758,7 +796,7 @@ ori_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
 
 // File Attributes
 
-static int
+int
 ori_getattr(const char *path, struct stat *stbuf)
 {
     OriPriv *priv = GetOriPriv();
@@ -789,71 +827,22 @@ ori_getattr(const char *path, struct stat *stbuf)
     } else if (strncmp(path,
                        ORI_SNAPSHOT_DIRPATH,
                        strlen(ORI_SNAPSHOT_DIRPATH)) == 0) {
-        string snapshot = path;
-        string parentPath, fileName;
-        size_t pos = 0;
-        Commit c;
-        Tree t;
-        
-        snapshot = snapshot.substr(strlen(ORI_SNAPSHOT_DIRPATH) + 1);
-        pos = snapshot.find('/', pos);
-
-        if (pos == snapshot.npos) {
-            c = priv->lookupSnapshot(snapshot);
-            stbuf->st_uid = geteuid();
-            stbuf->st_gid = getegid();
-            stbuf->st_mode = 0755 | S_IFDIR;
-            stbuf->st_nlink = 2;
-            stbuf->st_size = 512;
-            stbuf->st_blksize = 4096;
-            stbuf->st_blocks = 1;
-            stbuf->st_ctime = c.getTime();
-            stbuf->st_mtime = c.getTime();
-            return 0;
-        }
+        RWKey::sp lock = priv->nsLock.readLock();
+        try {
+            OriSnapshotView *view = priv->getSnapshotView();
 
-        parentPath = snapshot.substr(pos);
-        snapshot = snapshot.substr(0, pos);
-        fileName = OriFile_Basename(parentPath);
-        parentPath = OriFile_Dirname(parentPath);
-        if (parentPath == "")
-            parentPath = "/";
-
-        // XXX: Enforce that this is a valid snapshot & directory path
-        c = priv->lookupSnapshot(snapshot);
-        t = priv->getTree(c, parentPath);
-
-        // lookup tree
-        Tree::iterator it = t.find(fileName);
-        if (it == t.end())
-            return -ENOENT;
-
-        // Convert
-        AttrMap *attrs = &it->second.attrs;
-        struct passwd *pw = getpwnam(attrs->getAsStr(ATTR_USERNAME).c_str());
-
-        memset(stbuf, 0, sizeof(*stbuf));
-        if (it->second.type == TreeEntry::Tree) {
-            stbuf->st_mode = S_IFDIR;
-            stbuf->st_nlink = 2; // XXX: Correct this!
-        } else {
-            stbuf->st_mode = S_IFREG;
-            stbuf->st_nlink = 1;
+            *stbuf = view->lookup(ORI_SNAPSHOT_RELPATH(path))->st;
+        } catch (SystemException &e) {
+            return -e.getErrno();
         }
-        stbuf->st_mode |= attrs->getAs<mode_t>(ATTR_PERMS);
-        stbuf->st_uid = pw->pw_uid;
-        stbuf->st_gid = pw->pw_gid;
-        stbuf->st_size = attrs->getAs<size_t>(ATTR_FILESIZE);
-        stbuf->st_blocks = (stbuf->st_size + 511) / 512;
-        stbuf->st_mtime = attrs->getAs<time_t>(ATTR_MTIME);
-        stbuf->st_ctime = attrs->getAs<time_t>(ATTR_CTIME);
 
         return 0;
     }
 
-    RWKey::sp lock = priv->nsLock.writeLock();
+    RWKey::sp lock = priv->nsLock.readLock();
     try {
         OriFileInfo *info = priv->getFileInfo(path);
+        Monitor m(priv->getInfoLock(info));
         *stbuf = info->statInfo;
     } catch (SystemException e) {
         return -e.getErrno();
@@ -882,15 +871,17 @@ ori_chmod(const char *path, mode_t mode)
         return -EACCES;
     }
 
-    RWKey::sp lock = priv->nsLock.writeLock();
+    RWKey::sp lock = priv->nsLock.readLock();
     try {
         OriFileInfo *info = priv->getFileInfo(path);
 
+        priv->getInfoLock(info).lock();
         info->statInfo.st_mode = mode;
         info->type = FILETYPE_DIRTY;
+        priv->getInfoLock(info).unlock();
 
         OriDir *dir = priv->getDir(parentPath);
-        dir->setDirty();
+        priv->setDirty(dir);
     } catch (SystemException e) {
         return -e.getErrno();
     }
@@ -918,16 +909,18 @@ ori_chown(const char *path, uid_t uid, gid_t gid)
         return -EACCES;
     }
 
-    RWKey::sp lock = priv->nsLock.writeLock();
+    RWKey::sp lock = priv->nsLock.readLock();
     try {
         OriFileInfo *info = priv->getFileInfo(path);
 
+        priv->getInfoLock(info).lock();
         info->statInfo.st_uid = uid;
         info->statInfo.st_gid = gid;
         info->type = FILETYPE_DIRTY;
+        priv->getInfoLock(info).unlock();
 
         OriDir *dir = priv->getDir(parentPath);
-        dir->setDirty();
+        priv->setDirty(dir);
     } catch (SystemException e) {
         return -e.getErrno();
     }
@@ -955,16 +948,18 @@ ori_utimens(const char *path, const struct timespec tv[2])
         return -EACCES;
     }
 
-    RWKey::sp lock = priv->nsLock.writeLock();
+    RWKey::sp lock = priv->nsLock.readLock();
     try {
         OriFileInfo *info = priv->getFileInfo(path);
 
+        priv->getInfoLock(info).lock();
         // Ignore access times
         info->statInfo.st_mtime = tv[1].tv_sec;
         info->type = FILETYPE_DIRTY;
+        priv->getInfoLock(info).unlock();
 
         OriDir *dir = priv->getDir(parentPath);
-        dir->setDirty();
+        priv->setDirty(dir);
     } catch (SystemException e) {
         return -e.getErrno();
     }
@@ -991,7 +986,11 @@ ori_fsync(const char *path, int isdatasync, struct fuse_file_info *fi)
         if (info->fd == -1)
             return 0; // XXX: File is closed ignore
 
-        return fsync(info->fd);
+        if (isdatasync)
+            return OriFile_DataSync(info->fd);
+        if (fsync(info->fd) < 0)
+            return -errno;
+        return 0;
     } catch (SystemException &e) {
         // Fall through
     }
@@ -1061,6 +1060,16 @@ usage()
     printf("                                    or use a synchronous or\n");
     printf("                                    asynchronous journal. Default\n");
     printf("                                    is 'async'.\n");
+    printf("    -o lowlevel                     Use the inode based FUSE\n");
+    printf("                                    interface.\n");
+    printf("    -o metadata_cache=[MB]          Bound the memory used to cache\n");
+    printf("                                    committed files, 0 for no\n");
+    printf("                                    bound. Default is %d.\n",
+           ORIFS_METADATA_CACHE);
+    printf("    -o sync_latency=[USECS]         Let syncs wait this long for\n");
+    printf("                                    concurrent syncs to share a\n");
+    printf("                                    flush. Default is %d.\n",
+           ORIFS_SYNC_LATENCY);
     printf("\nOther mount options will be passed on to FUSE; see below.\n");
 
     printf("\nPlease report bugs to orifs-devel@stanford.edu\n");
@@ -1093,6 +1102,11 @@ const fuse_opt option_spec[] = {
   { "debug", offsetof(struct mount_ori_config, debug), 1 },
   { "no_debug", offsetof(struct mount_ori_config, debug), 0 },
 
+  { "lowlevel", offsetof(struct mount_ori_config, lowlevel), 1 },
+
+  { "metadata_cache=%u", offsetof(struct mount_ori_config, metadata_cache), 0 },
+  { "sync_latency=%u", offsetof(struct mount_ori_config, sync_latency), 0 },
+
   { "clone=", -1U, OPT_KEY_CLONE_PARAM },
 
   FUSE_OPT_END
@@ -1340,7 +1354,18 @@ main(int argc, char *argv[])
         cout << "Mount Point:   " << config.mountPoint << endl;
     }
 
-    int status = fuse_main(args.argc, args.argv, &ori_oper, NULL);
+    int status;
+    if (config.lowlevel) {
+        status = ori_ll_main(&args);
+    } else {
+        /*
+         * The path interface cannot invalidate the kernel's cache after a
+         * checkout and a file's size and modification time may not change
+         * with its contents, so only the immutable .snapshot tree is kept
+         * cached (see ori_open).
+         */
+        status = fuse_main(args.argc, args.argv, &ori_oper, NULL);
+    }
     if (status != 0) {
         priv->cleanup();
     }
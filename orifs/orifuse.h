@@ -0,0 +1,59 @@
+/*
+ * Copyright (c) 2012-2013 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef __ORIFUSE_H__
+#define __ORIFUSE_H__
+
+#define ORI_CONTROL_FILENAME ".ori_control"
+#define ORI_CONTROL_FILEPATH "/" ORI_CONTROL_FILENAME
+#define ORI_SNAPSHOT_DIRNAME ".snapshot"
+#define ORI_SNAPSHOT_DIRPATH "/" ORI_SNAPSHOT_DIRNAME
+// Path below the snapshot directory as used by OriSnapshotView
+#define ORI_SNAPSHOT_RELPATH(_path) \
+    ((_path) + strlen(ORI_SNAPSHOT_DIRPATH) + 1)
+
+/*
+ * Kernel attribute and entry cache timeouts in seconds.  Committed files only
+ * change on checkout or merge, which invalidate them explicitly, and
+ * snapshots never change, so both may be cached far longer than dirty files.
+ */
+#define ORI_TIMEOUT_DIRTY       1.0
+#define ORI_TIMEOUT_COMMITTED   60.0
+#define ORI_TIMEOUT_SNAPSHOT    3600.0
+
+/*
+ * Path operations (orifuse.cc).  The low-level interface reuses these for
+ * the control file and the read-only .snapshot namespace.
+ */
+void *ori_init(struct fuse_conn_info *conn);
+void ori_destroy(void *userdata);
+int ori_getattr(const char *path, struct stat *stbuf);
+int ori_read(const char *path, char *buf, size_t size, off_t offset,
+             struct fuse_file_info *fi);
+int ori_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+                off_t offset, struct fuse_file_info *fi);
+
+// Low-level (inode based) interface (orifuse_ll.cc)
+int ori_ll_main(struct fuse_args *args);
+/*
+ * Drop the kernel's cached entries, attributes and pages once the working
+ * tree or the snapshot list changes outside of FUSE.  These do nothing when
+ * mounted through the path interface.
+ */
+void ori_ll_invalidate();
+void ori_ll_invalidate_snapshots();
+
+#endif /* __ORIFUSE_H__ */
@@ -0,0 +1,1422 @@
+/*
+ * Copyright (c) 2012-2013 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Low-level (inode based) FUSE interface.  Inode numbers are OriPrivIds, so
+ * lookups walk the OriDir entries and the hot per-file operations (getattr,
+ * read, write) never build or parse a path.  Operations that change the
+ * namespace still go through the path based OriPriv calls.
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cinttypes>
+
+#include <errno.h>
+#include <fcntl.h>
+
+#include <unistd.h>
+#include <sys/param.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#define FUSE_USE_VERSION 26
+#include <fuse.h>
+#include <fuse_lowlevel.h>
+
+#include <string>
+#include <map>
+#include <vector>
+#include <memory>
+#include <unordered_map>
+
+#include <oriutil/debug.h>
+#include <oriutil/orifile.h>
+#include <oriutil/systemexception.h>
+#include <oriutil/rwlock.h>
+#include <oriutil/mutex.h>
+#include <oriutil/monitor.h>
+#include <ori/localrepo.h>
+
+#include "logging.h"
+#include "oripriv.h"
+#include "oriopt.h"
+#include "orifuse.h"
+#include "orisnapshot.h"
+
+#ifdef DEBUG
+#define FSCK_A_LOT
+#endif
+
+using namespace std;
+
+extern mount_ori_config config;
+extern OriPriv *priv;
+
+/*
+ * Inodes at or above ORI_LL_SPECIAL_INO name the control file and the
+ * .snapshot namespace, which are served by the path operations.
+ */
+#define ORI_LL_SPECIAL_INO ((fuse_ino_t)1 << (sizeof(fuse_ino_t) * 8 - 1))
+#define ORI_LL_CONTROL_INO ORI_LL_SPECIAL_INO
+#define ORI_LL_SNAPSHOT_INO (ORI_LL_SPECIAL_INO + 1)
+
+/*
+ * Files the kernel holds a lookup reference on.  Each holds a reference on
+ * its OriFileInfo, so an unlinked file keeps its attributes until the kernel
+ * forgets it.  The parent and name of the last lookup let us invalidate the
+ * kernel's entry when the tree is replaced underneath it.
+ *
+ * Lock order: nsLock, inodeLock, getInfoLock.
+ */
+struct OriLLInode {
+    OriFileInfo *info;
+    uint64_t nlookup;
+    fuse_ino_t parent;
+    string name;
+};
+
+static Mutex inodeLock;
+static unordered_map<fuse_ino_t, OriLLInode> inodes;
+static map<string, fuse_ino_t> specialInodes;
+static unordered_map<fuse_ino_t, string> specialPaths;
+static fuse_ino_t nextSpecialIno = ORI_LL_SNAPSHOT_INO + 1;
+static struct fuse_chan *oriChan;
+
+static bool
+ori_ll_isspecial(fuse_ino_t ino)
+{
+    return ino >= ORI_LL_SPECIAL_INO;
+}
+
+static string
+ori_ll_specialpath(fuse_ino_t ino)
+{
+    unordered_map<fuse_ino_t, string>::iterator it;
+    Monitor m(inodeLock);
+
+    if (ino == ORI_LL_CONTROL_INO)
+        return ORI_CONTROL_FILEPATH;
+    if (ino == ORI_LL_SNAPSHOT_INO)
+        return ORI_SNAPSHOT_DIRPATH;
+
+    it = specialPaths.find(ino);
+    if (it == specialPaths.end())
+        throw SystemException(ESTALE);
+
+    return it->second;
+}
+
+static fuse_ino_t
+ori_ll_specialino(const string &path)
+{
+    map<string, fuse_ino_t>::iterator it;
+    Monitor m(inodeLock);
+
+    it = specialInodes.find(path);
+    if (it != specialInodes.end())
+        return it->second;
+
+    fuse_ino_t ino = nextSpecialIno++;
+    specialInodes[path] = ino;
+    specialPaths[ino] = path;
+
+    return ino;
+}
+
+// Callers hold nsLock and not the info lock
+static void
+ori_ll_ref(fuse_ino_t parent, const char *name, OriFileInfo *info)
+{
+    unordered_map<fuse_ino_t, OriLLInode>::iterator it;
+    Monitor m(inodeLock);
+
+    it = inodes.find(info->id);
+    if (it != inodes.end()) {
+        it->second.nlookup++;
+        it->second.parent = parent;
+        it->second.name = name;
+        return;
+    }
+
+    Monitor im(priv->getInfoLock(info));
+    info->retain();
+
+    OriLLInode inode;
+    inode.info = info;
+    inode.nlookup = 1;
+    inode.parent = parent;
+    inode.name = name;
+    inodes[info->id] = inode;
+}
+
+static void
+ori_ll_unref(fuse_ino_t ino, uint64_t nlookup)
+{
+    unordered_map<fuse_ino_t, OriLLInode>::iterator it;
+    OriFileInfo *info;
+    Monitor m(inodeLock);
+
+    it = inodes.find(ino);
+    if (it == inodes.end())
+        return;
+
+    ASSERT(it->second.nlookup >= nlookup);
+    it->second.nlookup -= nlookup;
+    if (it->second.nlookup != 0)
+        return;
+
+    info = it->second.info;
+    inodes.erase(it);
+
+    Monitor im(priv->getInfoLock(info));
+    info->release();
+}
+
+/*
+ * Returns the file for an inode, falling back to the lookup references for
+ * files that have been unlinked.  Callers hold nsLock.
+ */
+static OriFileInfo *
+ori_ll_getinfo(fuse_ino_t ino)
+{
+    try {
+        return priv->getInfoById(ino);
+    } catch (SystemException &e) {
+        unordered_map<fuse_ino_t, OriLLInode>::iterator it;
+        Monitor m(inodeLock);
+
+        it = inodes.find(ino);
+        if (it == inodes.end())
+            throw;
+
+        return it->second.info;
+    }
+}
+
+static string
+ori_ll_childpath(fuse_ino_t parent, const char *name)
+{
+    string path = priv->getPathById(parent);
+
+    if (path != "/")
+        path += "/";
+
+    return path + name;
+}
+
+static string
+ori_ll_parentpath(const string &path)
+{
+    string parentPath = OriFile_Dirname(path);
+
+    if (parentPath == "")
+        parentPath = "/";
+
+    return parentPath;
+}
+
+/*
+ * Committed files only change through checkout or merge, which invalidate
+ * the kernel's copy, so their attributes are cached longer.  Callers hold
+ * the info lock.
+ */
+static double
+ori_ll_timeout(OriFileInfo *info)
+{
+    if (info->type == FILETYPE_COMMITTED && !info->cow)
+        return ORI_TIMEOUT_COMMITTED;
+
+    return ORI_TIMEOUT_DIRTY;
+}
+
+static double
+ori_ll_specialtimeout(fuse_ino_t ino)
+{
+    // The snapshot list changes with every commit, its contents never do
+    if (ino == ORI_LL_CONTROL_INO || ino == ORI_LL_SNAPSHOT_INO)
+        return ORI_TIMEOUT_DIRTY;
+
+    return ORI_TIMEOUT_SNAPSHOT;
+}
+
+static void
+ori_ll_fillentry(struct fuse_entry_param *e, fuse_ino_t ino,
+                 const struct stat &st, double timeout)
+{
+    memset(e, 0, sizeof(*e));
+    e->ino = ino;
+    e->attr = st;
+    e->attr.st_ino = ino;
+    e->attr_timeout = timeout;
+    e->entry_timeout = timeout;
+}
+
+// Replies with a new entry for a file and takes a lookup reference on it
+static void
+ori_ll_replyentry(fuse_req_t req, fuse_ino_t parent, const char *name,
+                  OriFileInfo *info)
+{
+    struct fuse_entry_param e;
+    struct stat st;
+    double timeout;
+
+    priv->getInfoLock(info).lock();
+    st = info->statInfo;
+    timeout = ori_ll_timeout(info);
+    priv->getInfoLock(info).unlock();
+
+    ori_ll_fillentry(&e, info->id, st, timeout);
+    ori_ll_ref(parent, name, info);
+    fuse_reply_entry(req, &e);
+}
+
+static bool
+ori_ll_isreserved(fuse_ino_t parent, const char *name)
+{
+    return parent == FUSE_ROOT_ID &&
+           (strcmp(name, ORI_CONTROL_FILENAME) == 0 ||
+            strcmp(name, ORI_SNAPSHOT_DIRNAME) == 0);
+}
+
+// Mount/Unmount
+
+static void
+ori_ll_init(void *userdata, struct fuse_conn_info *conn)
+{
+    ori_init(conn);
+
+    // The root directory is the first id allocated
+    ASSERT(priv->getInfoById(FUSE_ROOT_ID)->isDir());
+
+#ifdef FUSE_CAP_SPLICE_READ
+    // Move file data through pipes rather than copying it into our buffers
+    conn->want |= conn->capable & (FUSE_CAP_SPLICE_READ |
+                                   FUSE_CAP_SPLICE_WRITE |
+                                   FUSE_CAP_SPLICE_MOVE);
+#endif /* FUSE_CAP_SPLICE_READ */
+}
+
+static void
+ori_ll_destroy(void *userdata)
+{
+    ori_destroy(userdata);
+}
+
+// Lookups
+
+static void
+ori_ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+    struct fuse_entry_param e;
+    struct stat st;
+
+    FUSE_LOG("FUSE ori_ll_lookup(parent=%lu, name=\"%s\")", parent, name);
+
+    if (ori_ll_isreserved(parent, name) || ori_ll_isspecial(parent)) {
+        string path;
+        int status;
+
+        try {
+            if (parent == FUSE_ROOT_ID)
+                path = string("/") + name;
+            else
+                path = ori_ll_specialpath(parent) + "/" + name;
+            status = ori_getattr(path.c_str(), &st);
+        } catch (SystemException &e) {
+            status = -e.getErrno();
+        }
+        if (status < 0) {
+            fuse_reply_err(req, -status);
+            return;
+        }
+
+        fuse_ino_t ino;
+        if (path == ORI_CONTROL_FILEPATH)
+            ino = ORI_LL_CONTROL_INO;
+        else if (path == ORI_SNAPSHOT_DIRPATH)
+            ino = ORI_LL_SNAPSHOT_INO;
+        else
+            ino = ori_ll_specialino(path);
+        ori_ll_fillentry(&e, ino, st, ori_ll_specialtimeout(ino));
+        fuse_reply_entry(req, &e);
+        return;
+    }
+
+    RWKey::sp lock = priv->nsLock.readLock();
+    try {
+        OriFileInfo *info = priv->lookup(parent, name);
+
+        ori_ll_replyentry(req, parent, name, info);
+    } catch (SystemException &e) {
+        fuse_reply_err(req, e.getErrno());
+    }
+}
+
+static void
+ori_ll_forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup)
+{
+    if (!ori_ll_isspecial(ino)) {
+        RWKey::sp lock = priv->nsLock.readLock();
+        ori_ll_unref(ino, nlookup);
+    }
+
+    fuse_reply_none(req);
+}
+
+#if FUSE_VERSION >= 29
+static void
+ori_ll_forget_multi(fuse_req_t req, size_t count,
+                    struct fuse_forget_data *forgets)
+{
+    RWKey::sp lock = priv->nsLock.readLock();
+
+    for (size_t i = 0; i < count; i++) {
+        if (!ori_ll_isspecial(forgets[i].ino))
+            ori_ll_unref(forgets[i].ino, forgets[i].nlookup);
+    }
+
+    fuse_reply_none(req);
+}
+#endif /* FUSE_VERSION >= 29 */
+
+// File Attributes
+
+static void
+ori_ll_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    struct stat st;
+
+    if (ori_ll_isspecial(ino)) {
+        int status;
+
+        try {
+            status = ori_getattr(ori_ll_specialpath(ino).c_str(), &st);
+        } catch (SystemException &e) {
+            status = -e.getErrno();
+        }
+        if (status < 0) {
+            fuse_reply_err(req, -status);
+            return;
+        }
+
+        st.st_ino = ino;
+        fuse_reply_attr(req, &st, ori_ll_specialtimeout(ino));
+        return;
+    }
+
+    double timeout;
+    RWKey::sp lock = priv->nsLock.readLock();
+    try {
+        OriFileInfo *info = ori_ll_getinfo(ino);
+        Monitor m(priv->getInfoLock(info));
+        st = info->statInfo;
+        timeout = ori_ll_timeout(info);
+    } catch (SystemException &e) {
+        fuse_reply_err(req, e.getErrno());
+        return;
+    }
+
+    st.st_ino = ino;
+    fuse_reply_attr(req, &st, timeout);
+}
+
+static void
+ori_ll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
+               int to_set, struct fuse_file_info *fi)
+{
+    OriFileInfo *info;
+    struct stat st;
+    bool thawed = false;
+
+    FUSE_LOG("FUSE ori_ll_setattr(ino=%lu, to_set=%x)", ino, to_set);
+
+    if (ori_ll_isspecial(ino)) {
+        fuse_reply_err(req, EACCES);
+        return;
+    }
+
+    RWKey::sp lock = priv->nsLock.readLock();
+    try {
+        info = ori_ll_getinfo(ino);
+    } catch (SystemException &e) {
+        fuse_reply_err(req, e.getErrno());
+        return;
+    }
+
+    // The directory of a frozen file may have been committed already
+    if (to_set & FUSE_SET_ATTR_SIZE) {
+        try {
+            thawed = priv->thawFile(info);
+        } catch (SystemException &e) {
+            fuse_reply_err(req, e.getErrno());
+            return;
+        }
+    }
+
+    priv->getInfoLock(info).lock();
+    if (to_set & FUSE_SET_ATTR_SIZE) {
+        int status;
+
+        if (info->type != FILETYPE_DIRTY) {
+            // XXX: Not Implemented
+            priv->getInfoLock(info).unlock();
+            fuse_reply_err(req, EINVAL);
+            return;
+        }
+
+        if (fi != NULL && info->fd != -1)
+            status = ftruncate(info->fd, attr->st_size);
+        else
+            status = truncate(info->path.c_str(), attr->st_size);
+        if (status < 0) {
+            int error = errno;
+            priv->getInfoLock(info).unlock();
+            fuse_reply_err(req, error);
+            return;
+        }
+
+        if (info->cow) {
+            info->overlay.truncate(attr->st_size);
+            info->cowBase = MIN(info->cowBase, (uint64_t)attr->st_size);
+        }
+
+        info->statInfo.st_size = attr->st_size;
+        info->statInfo.st_blocks = (attr->st_size + (512-1))/512;
+    }
+    if (to_set & FUSE_SET_ATTR_MODE) {
+        info->statInfo.st_mode = (info->statInfo.st_mode & S_IFMT) |
+                                 (attr->st_mode & ~S_IFMT);
+    }
+    if (to_set & FUSE_SET_ATTR_UID)
+        info->statInfo.st_uid = attr->st_uid;
+    if (to_set & FUSE_SET_ATTR_GID)
+        info->statInfo.st_gid = attr->st_gid;
+    // Ignore access times
+    if (to_set & FUSE_SET_ATTR_MTIME_NOW)
+        info->statInfo.st_mtime = time(NULL);
+    else if (to_set & FUSE_SET_ATTR_MTIME)
+        info->statInfo.st_mtime = attr->st_mtime;
+    info->type = FILETYPE_DIRTY;
+    st = info->statInfo;
+    priv->getInfoLock(info).unlock();
+
+    // Attribute changes are committed through the parent directory
+    if ((to_set & ~FUSE_SET_ATTR_SIZE) || thawed) {
+        try {
+            string path = priv->getPathById(ino);
+            priv->setDirty(priv->getDir(ori_ll_parentpath(path)));
+        } catch (SystemException &e) {
+            // Unlinked files have no parent left to mark
+        }
+    }
+
+    st.st_ino = ino;
+    fuse_reply_attr(req, &st, ORI_TIMEOUT_DIRTY);
+}
+
+static void
+ori_ll_readlink(fuse_req_t req, fuse_ino_t ino)
+{
+    string link;
+
+    if (ori_ll_isspecial(ino)) {
+        fuse_reply_err(req, EINVAL);
+        return;
+    }
+
+    RWKey::sp lock = priv->nsLock.readLock();
+    try {
+        OriFileInfo *info = ori_ll_getinfo(ino);
+
+        if (!info->isSymlink()) {
+            fuse_reply_err(req, EINVAL);
+            return;
+        }
+        link = info->link;
+    } catch (SystemException &e) {
+        fuse_reply_err(req, e.getErrno());
+        return;
+    }
+
+    fuse_reply_readlink(req, link.c_str());
+}
+
+// File Manipulation
+
+static void
+ori_ll_mknod(fuse_req_t req, fuse_ino_t parent, const char *name,
+             mode_t mode, dev_t rdev)
+{
+    fuse_reply_err(req, EPERM);
+}
+
+static void
+ori_ll_unlink(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+    string path;
+
+#ifdef FSCK_A_LOT
+    priv->fsck();
+#endif /* FSCK_A_LOT */
+
+    FUSE_LOG("FUSE ori_ll_unlink(parent=%lu, name=\"%s\")", parent, name);
+
+    if (ori_ll_isreserved(parent, name) || ori_ll_isspecial(parent)) {
+        fuse_reply_err(req, EACCES);
+        return;
+    }
+
+    RWKey::sp lock = priv->nsLock.writeLock();
+    try {
+        OriFileInfo *info = priv->lookup(parent, name);
+
+        path = ori_ll_childpath(parent, name);
+
+        if (info->isDir()) {
+            fuse_reply_err(req, EPERM);
+            return;
+        }
+
+        // Remove temporary file
+        if (info->path != "")
+            unlink(info->path.c_str());
+
+        priv->unlink(path);
+    } catch (SystemException &e) {
+        fuse_reply_err(req, e.getErrno());
+        return;
+    }
+
+    priv->journal("unlink", path);
+
+    fuse_reply_err(req, 0);
+}
+
+static void
+ori_ll_symlink(fuse_req_t req, const char *link, fuse_ino_t parent,
+               const char *name)
+{
+    OriFileInfo *info;
+
+#ifdef FSCK_A_LOT
+    priv->fsck();
+#endif /* FSCK_A_LOT */
+
+    FUSE_LOG("FUSE ori_ll_symlink(parent=%lu, name=\"%s\")", parent, name);
+
+    if (ori_ll_isreserved(parent, name) || ori_ll_isspecial(parent)) {
+        fuse_reply_err(req, EACCES);
+        return;
+    }
+
+    RWKey::sp lock = priv->nsLock.writeLock();
+    try {
+        OriDir *parentDir = priv->getDirById(parent);
+        string path = ori_ll_childpath(parent, name);
+
+        info = priv->addSymlink(path);
+        info->statInfo.st_mode |= 0755;
+        info->link = link;
+        info->statInfo.st_size = info->link.length();
+        info->type = FILETYPE_DIRTY;
+
+        parentDir->add(name, info->id);
+    } catch (SystemException &e) {
+        fuse_reply_err(req, e.getErrno());
+        return;
+    }
+
+    ori_ll_replyentry(req, parent, name, info);
+}
+
+static void
+ori_ll_rename(fuse_req_t req, fuse_ino_t parent, const char *name,
+              fuse_ino_t newparent, const char *newname)
+{
+    string fromPath, toPath;
+
+#ifdef FSCK_A_LOT
+    priv->fsck();
+#endif /* FSCK_A_LOT */
+
+    FUSE_LOG("FUSE ori_ll_rename(parent=%lu, name=\"%s\", "
+             "newparent=%lu, newname=\"%s\")",
+             parent, name, newparent, newname);
+
+    if (ori_ll_isreserved(parent, name) || ori_ll_isspecial(parent) ||
+        ori_ll_isreserved(newparent, newname) || ori_ll_isspecial(newparent)) {
+        fuse_reply_err(req, EACCES);
+        return;
+    }
+
+    RWKey::sp lock = priv->nsLock.writeLock();
+    try {
+        OriFileInfo *info = priv->lookup(parent, name);
+        OriFileInfo *toFile = NULL;
+
+        fromPath = ori_ll_childpath(parent, name);
+        toPath = ori_ll_childpath(newparent, newname);
+
+        try {
+            toFile = priv->lookup(newparent, newname);
+        } catch (SystemException &e) {
+            // Fall through
+        }
+
+        if (toFile != NULL && toFile->isDir()) {
+            if (!priv->getDirById(toFile->id)->isEmpty()) {
+                fuse_reply_err(req, ENOTEMPTY);
+                return;
+            }
+        }
+        if (toFile != NULL && info->isDir() && !toFile->isDir()) {
+            fuse_reply_err(req, EISDIR);
+            return;
+        }
+
+        priv->rename(fromPath, toPath);
+
+        // The kernel moves its dentry, so follow it for invalidation
+        Monitor m(inodeLock);
+        unordered_map<fuse_ino_t, OriLLInode>::iterator it;
+        it = inodes.find(info->id);
+        if (it != inodes.end()) {
+            it->second.parent = newparent;
+            it->second.name = newname;
+        }
+    } catch (SystemException &e) {
+        fuse_reply_err(req, e.getErrno());
+        return;
+    }
+
+    priv->journal("rename", fromPath + ":" + toPath);
+
+    fuse_reply_err(req, 0);
+}
+
+// File IO
+
+static void
+ori_ll_create(fuse_req_t req, fuse_ino_t parent, const char *name,
+              mode_t mode, struct fuse_file_info *fi)
+{
+    pair<OriFileInfo *, uint64_t> info;
+    string path;
+
+#ifdef FSCK_A_LOT
+    priv->fsck();
+#endif /* FSCK_A_LOT */
+
+    FUSE_LOG("FUSE ori_ll_create(parent=%lu, name=\"%s\")", parent, name);
+
+    if (ori_ll_isreserved(parent, name) || ori_ll_isspecial(parent)) {
+        fuse_reply_err(req, EACCES);
+        return;
+    }
+
+    RWKey::sp lock = priv->nsLock.writeLock();
+    try {
+        OriDir *parentDir = priv->getDirById(parent);
+
+        path = ori_ll_childpath(parent, name);
+        info = priv->addFile(path);
+        info.first->statInfo.st_mode |= mode;
+        info.first->type = FILETYPE_DIRTY;
+
+        parentDir->add(name, info.first->id);
+    } catch (SystemException &e) {
+        fuse_reply_err(req, e.getErrno());
+        return;
+    }
+
+    priv->journal("create", path + ":" + info.first->path);
+
+    struct fuse_entry_param e;
+    ori_ll_fillentry(&e, info.first->id, info.first->statInfo,
+                     ORI_TIMEOUT_DIRTY);
+    ori_ll_ref(parent, name, info.first);
+
+    fi->fh = info.second;
+    fuse_reply_create(req, &e, fi);
+}
+
+static void
+ori_ll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    pair<OriFileInfo *, uint64_t> info;
+    bool writing = false;
+    bool trunc = false;
+
+    if (fi->flags & O_WRONLY || fi->flags & O_RDWR)
+        writing = true;
+    if (fi->flags & O_TRUNC)
+        trunc = true;
+
+    FUSE_LOG("FUSE ori_ll_open(ino=%lu)", ino);
+
+    if (ori_ll_isspecial(ino)) {
+        fi->fh = 0;
+        if (ino != ORI_LL_CONTROL_INO) {
+            if (writing) {
+                fuse_reply_err(req, EPERM);
+                return;
+            }
+
+            RWKey::sp lock = priv->nsLock.readLock();
+            try {
+                string path = ori_ll_specialpath(ino);
+                OriSnapshotView *view = priv->getSnapshotView();
+
+                fi->fh = view->open(ORI_SNAPSHOT_RELPATH(path.c_str()));
+            } catch (SystemException &e) {
+                fuse_reply_err(req, e.getErrno());
+                return;
+            }
+
+            // Snapshot contents never change
+            fi->keep_cache = 1;
+        }
+        fuse_reply_open(req, fi);
+        return;
+    }
+
+    RWKey::sp lock = priv->nsLock.readLock();
+    try {
+        info = priv->openFile(ori_ll_getinfo(ino), writing, trunc);
+
+        if (writing) {
+            string path = priv->getPathById(ino);
+            priv->setDirty(priv->getDir(ori_ll_parentpath(path)));
+        }
+    } catch (SystemException &e) {
+        fuse_reply_err(req, e.getErrno());
+        return;
+    }
+
+    /*
+     * Keep the page cache of committed files across opens.  All other
+     * changes pass through the kernel, and checkout and merge invalidate it.
+     */
+    if (!writing) {
+        Monitor m(priv->getInfoLock(info.first));
+        fi->keep_cache = (info.first->type == FILETYPE_COMMITTED &&
+                          !info.first->cow);
+    }
+
+    fi->fh = info.second;
+    fuse_reply_open(req, fi);
+}
+
+static void
+ori_ll_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+            struct fuse_file_info *fi)
+{
+    OriFileInfo *info;
+    vector<char> buf;
+    ssize_t status;
+
+    if (ori_ll_isspecial(ino)) {
+        buf.resize(size);
+        try {
+            status = ori_read(ori_ll_specialpath(ino).c_str(), &buf[0], size,
+                              off, fi);
+        } catch (SystemException &e) {
+            status = -e.getErrno();
+        }
+        if (status < 0)
+            fuse_reply_err(req, -status);
+        else
+            fuse_reply_buf(req, &buf[0], status);
+        return;
+    }
+
+    RWKey::sp lock = priv->nsLock.readLock();
+    info = priv->getFileInfo(fi->fh);
+
+    // Return an error when reading from a directory
+    if (info->isDir()) {
+        fuse_reply_err(req, EISDIR);
+        return;
+    }
+
+    // Our handle keeps the descriptor open once it is set
+    priv->getInfoLock(info).lock();
+    int fd = info->fd;
+    bool cow = info->cow;
+    priv->getInfoLock(info).unlock();
+
+    if (!cow && fd != -1) {
+        // File in temporary directory
+#if FUSE_VERSION >= 29
+        struct fuse_bufvec bv = FUSE_BUFVEC_INIT(size);
+
+        bv.buf[0].flags = (enum fuse_buf_flags)(FUSE_BUF_IS_FD |
+                                                FUSE_BUF_FD_SEEK);
+        bv.buf[0].fd = fd;
+        bv.buf[0].pos = off;
+
+        fuse_reply_data(req, &bv, FUSE_BUF_SPLICE_MOVE);
+        return;
+#else /* FUSE_VERSION >= 29 */
+        buf.resize(size);
+        status = pread(fd, &buf[0], size, off);
+        if (status < 0)
+            status = -errno;
+#endif /* FUSE_VERSION >= 29 */
+    } else {
+        buf.resize(size);
+        if (cow) {
+            // Written ranges in the temporary file, the rest in the repository
+            status = priv->readCow(fi->fh, info, &buf[0], size, off);
+        } else {
+            // File in repository
+            status = priv->readHandle(fi->fh, info, &buf[0], size, off);
+        }
+    }
+
+    if (status < 0)
+        fuse_reply_err(req, -status);
+    else
+        fuse_reply_buf(req, &buf[0], status);
+}
+
+/*
+ * Returns the descriptor a write goes to.  A file frozen by a pending
+ * commit gets its own copy first, its directory stayed dirty as the file
+ * was open.  Callers hold nsLock.
+ */
+static int
+ori_ll_writefd(OriFileInfo *info)
+{
+    priv->thawFile(info);
+
+    // Read under the info lock, thawFile switches the descriptor over
+    Monitor m(priv->getInfoLock(info));
+
+    return info->fd;
+}
+
+// Callers hold nsLock
+static void
+ori_ll_written(OriFileInfo *info, off_t off, size_t size)
+{
+    Monitor m(priv->getInfoLock(info));
+
+    info->type = FILETYPE_DIRTY;
+    if (info->cow)
+        info->overlay.add(off, size);
+    if (info->statInfo.st_size < (off_t)size + off) {
+        info->statInfo.st_size = size + off;
+        info->statInfo.st_blocks = (size + off + (512-1))/512;
+    }
+}
+
+static void
+ori_ll_write(fuse_req_t req, fuse_ino_t ino, const char *buf, size_t size,
+             off_t off, struct fuse_file_info *fi)
+{
+    OriFileInfo *info;
+    ssize_t status;
+    int fd;
+
+    if (ori_ll_isspecial(ino)) {
+        fuse_reply_err(req, ino == ORI_LL_CONTROL_INO ? EIO : EACCES);
+        return;
+    }
+
+    RWKey::sp lock = priv->nsLock.readLock();
+    info = priv->getFileInfo(fi->fh);
+
+    // Return an error on a directory write
+    if (info->isDir()) {
+        fuse_reply_err(req, EISDIR);
+        return;
+    }
+
+    try {
+        fd = ori_ll_writefd(info);
+    } catch (SystemException &e) {
+        fuse_reply_err(req, e.getErrno());
+        return;
+    }
+
+    status = pwrite(fd, buf, size, off);
+    if (status < 0) {
+        fuse_reply_err(req, errno);
+        return;
+    }
+
+    ori_ll_written(info, off, status);
+
+    fuse_reply_write(req, status);
+}
+
+#if FUSE_VERSION >= 29
+static void
+ori_ll_write_buf(fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec *in,
+                 off_t off, struct fuse_file_info *fi)
+{
+    OriFileInfo *info;
+    ssize_t status;
+    int fd;
+
+    if (ori_ll_isspecial(ino)) {
+        fuse_reply_err(req, ino == ORI_LL_CONTROL_INO ? EIO : EACCES);
+        return;
+    }
+
+    RWKey::sp lock = priv->nsLock.readLock();
+    info = priv->getFileInfo(fi->fh);
+
+    // Return an error on a directory write
+    if (info->isDir()) {
+        fuse_reply_err(req, EISDIR);
+        return;
+    }
+
+    try {
+        fd = ori_ll_writefd(info);
+    } catch (SystemException &e) {
+        fuse_reply_err(req, e.getErrno());
+        return;
+    }
+
+    // Splice the request straight into the temporary file
+    struct fuse_bufvec out = FUSE_BUFVEC_INIT(fuse_buf_size(in));
+
+    out.buf[0].flags = (enum fuse_buf_flags)(FUSE_BUF_IS_FD |
+                                             FUSE_BUF_FD_SEEK);
+    out.buf[0].fd = fd;
+    out.buf[0].pos = off;
+
+    status = fuse_buf_copy(&out, in, FUSE_BUF_SPLICE_NONBLOCK);
+    if (status < 0) {
+        fuse_reply_err(req, -status);
+        return;
+    }
+
+    ori_ll_written(info, off, status);
+
+    fuse_reply_write(req, status);
+}
+#endif /* FUSE_VERSION >= 29 */
+
+static void
+ori_ll_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    FUSE_LOG("FUSE ori_ll_release(ino=%lu): fh=%" PRIu64, ino, fi->fh);
+
+    if (ori_ll_isspecial(ino)) {
+        if (ino != ORI_LL_CONTROL_INO)
+            priv->getSnapshotView()->close(fi->fh);
+        fuse_reply_err(req, 0);
+        return;
+    }
+
+    RWKey::sp lock = priv->nsLock.readLock();
+    // Decrement reference count (deletes temporary file for unlink)
+    fuse_reply_err(req, -priv->closeFH(fi->fh));
+}
+
+static void
+ori_ll_fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
+             struct fuse_file_info *fi)
+{
+    OriFileInfo *info;
+    int status = 0;
+
+    if (ori_ll_isspecial(ino)) {
+        fuse_reply_err(req, ino == ORI_LL_CONTROL_INO ? 0 : EBADF);
+        return;
+    }
+
+    RWKey::sp lock = priv->nsLock.readLock();
+    info = priv->getFileInfo(fi->fh);
+    if (info->fd != -1) {
+        if (datasync)
+            status = OriFile_DataSync(info->fd);
+        else if (fsync(info->fd) < 0)
+            status = -errno;
+    }
+
+    fuse_reply_err(req, -status);
+}
+
+// Directory Operations
+
+static void
+ori_ll_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name,
+             mode_t mode)
+{
+    OriFileInfo *info;
+    string path;
+
+#ifdef FSCK_A_LOT
+    priv->fsck();
+#endif /* FSCK_A_LOT */
+
+    FUSE_LOG("FUSE ori_ll_mkdir(parent=%lu, name=\"%s\")", parent, name);
+
+    if (ori_ll_isreserved(parent, name) || ori_ll_isspecial(parent)) {
+        fuse_reply_err(req, EACCES);
+        return;
+    }
+
+    RWKey::sp lock = priv->nsLock.writeLock();
+    try {
+        path = ori_ll_childpath(parent, name);
+        info = priv->addDir(path);
+        info->statInfo.st_mode |= mode;
+    } catch (SystemException &e) {
+        fuse_reply_err(req, e.getErrno());
+        return;
+    }
+
+    priv->journal("mkdir", path);
+
+    ori_ll_replyentry(req, parent, name, info);
+}
+
+static void
+ori_ll_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+    string path;
+
+#ifdef FSCK_A_LOT
+    priv->fsck();
+#endif /* FSCK_A_LOT */
+
+    FUSE_LOG("FUSE ori_ll_rmdir(parent=%lu, name=\"%s\")", parent, name);
+
+    if (ori_ll_isreserved(parent, name) || ori_ll_isspecial(parent)) {
+        fuse_reply_err(req, EACCES);
+        return;
+    }
+
+    RWKey::sp lock = priv->nsLock.writeLock();
+    try {
+        OriFileInfo *info = priv->lookup(parent, name);
+
+        if (!priv->getDirById(info->id)->isEmpty()) {
+            fuse_reply_err(req, ENOTEMPTY);
+            return;
+        }
+
+        path = ori_ll_childpath(parent, name);
+        priv->rmDir(path);
+    } catch (SystemException &e) {
+        FUSE_LOG("ori_ll_rmdir: Caught exception %s", e.what());
+        fuse_reply_err(req, e.getErrno());
+        return;
+    }
+
+    priv->journal("rmdir", path);
+
+    fuse_reply_err(req, 0);
+}
+
+/*
+ * Directory listings are built on opendir and kept with the handle, so
+ * readdir only copies out the requested window.
+ */
+struct OriLLDirBuf {
+    fuse_req_t req;
+    string buf;
+};
+
+static void
+ori_ll_adddirentry(OriLLDirBuf *db, const char *name, const struct stat &st)
+{
+    size_t oldSize = db->buf.size();
+    size_t len = fuse_add_direntry(db->req, NULL, 0, name, NULL, 0);
+
+    db->buf.resize(oldSize + len);
+    fuse_add_direntry(db->req, &db->buf[oldSize], len, name, &st,
+                      oldSize + len);
+}
+
+static int
+ori_ll_snapshotfiller(void *buf, const char *name, const struct stat *stbuf,
+                      off_t off)
+{
+    vector<string> *names = (vector<string> *)buf;
+
+    names->push_back(name);
+
+    return 0;
+}
+
+static void
+ori_ll_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    OriLLDirBuf *db = new OriLLDirBuf();
+    struct stat st;
+
+    FUSE_LOG("FUSE ori_ll_opendir(ino=%lu)", ino);
+
+    db->req = req;
+    memset(&st, 0, sizeof(st));
+
+    st.st_ino = ino;
+    st.st_mode = S_IFDIR;
+    ori_ll_adddirentry(db, ".", st);
+    st.st_ino = FUSE_ROOT_ID;
+    ori_ll_adddirentry(db, "..", st);
+
+    if (ori_ll_isspecial(ino)) {
+        vector<string> names;
+        string path;
+        int status;
+
+        try {
+            path = ori_ll_specialpath(ino);
+            status = ori_readdir(path.c_str(), &names, ori_ll_snapshotfiller,
+                                 0, NULL);
+        } catch (SystemException &e) {
+            status = -e.getErrno();
+        }
+        if (status < 0) {
+            delete db;
+            fuse_reply_err(req, -status);
+            return;
+        }
+
+        // "." and ".." are already present
+        for (size_t i = 2; i < names.size(); i++) {
+            st.st_ino = ori_ll_specialino(path + "/" + names[i]);
+            st.st_mode = 0;
+            ori_ll_adddirentry(db, names[i].c_str(), st);
+        }
+    } else {
+        RWKey::sp lock = priv->nsLock.readLock();
+        try {
+            OriDir *dir = priv->getDirById(ino);
+            OriDir::iterator it;
+
+            if (ino == FUSE_ROOT_ID) {
+                st.st_ino = ORI_LL_CONTROL_INO;
+                st.st_mode = S_IFREG;
+                ori_ll_adddirentry(db, ORI_CONTROL_FILENAME, st);
+                st.st_ino = ORI_LL_SNAPSHOT_INO;
+                st.st_mode = S_IFDIR;
+                ori_ll_adddirentry(db, ORI_SNAPSHOT_DIRNAME, st);
+            }
+
+            for (it = dir->begin(); it != dir->end(); it++) {
+                OriFileInfo *info = priv->getInfoById(it->second);
+
+                priv->getInfoLock(info).lock();
+                st = info->statInfo;
+                priv->getInfoLock(info).unlock();
+
+                st.st_ino = it->second;
+                ori_ll_adddirentry(db, it->first.c_str(), st);
+            }
+        } catch (SystemException &e) {
+            delete db;
+            fuse_reply_err(req, e.getErrno());
+            return;
+        }
+    }
+
+    fi->fh = (uint64_t)db;
+    fuse_reply_open(req, fi);
+}
+
+static void
+ori_ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+               struct fuse_file_info *fi)
+{
+    OriLLDirBuf *db = (OriLLDirBuf *)fi->fh;
+
+    FUSE_LOG("FUSE ori_ll_readdir(ino=%lu, off=%" PRId64 ")", ino, off);
+
+    if ((size_t)off >= db->buf.size()) {
+        fuse_reply_buf(req, NULL, 0);
+        return;
+    }
+
+    fuse_reply_buf(req, db->buf.data() + off,
+                   MIN(db->buf.size() - off, size));
+}
+
+static void
+ori_ll_releasedir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    delete (OriLLDirBuf *)fi->fh;
+
+    fuse_reply_err(req, 0);
+}
+
+// Cache Invalidation
+
+/*
+ * Checkout and merge give every file a new id, so every entry the kernel
+ * holds is stale.  Invalidating the entries and inodes it has looked up also
+ * drops the cached pages of open files.  Callers must not hold nsLock, as
+ * the kernel may wait on requests that need it.
+ */
+void
+ori_ll_invalidate()
+{
+    unordered_map<fuse_ino_t, OriLLInode>::iterator it;
+    vector<pair<fuse_ino_t, string> > entries;
+    vector<fuse_ino_t> inos;
+
+    if (oriChan == NULL)
+        return;
+
+    inodeLock.lock();
+    for (it = inodes.begin(); it != inodes.end(); it++) {
+        entries.push_back(make_pair(it->second.parent, it->second.name));
+        inos.push_back(it->first);
+    }
+    inodeLock.unlock();
+
+    // Entries that are already gone return ENOENT, which we ignore
+    for (size_t i = 0; i < entries.size(); i++) {
+        fuse_lowlevel_notify_inval_entry(oriChan, entries[i].first,
+                                         entries[i].second.c_str(),
+                                         entries[i].second.size());
+    }
+    for (size_t i = 0; i < inos.size(); i++)
+        fuse_lowlevel_notify_inval_inode(oriChan, inos[i], 0, 0);
+    fuse_lowlevel_notify_inval_inode(oriChan, FUSE_ROOT_ID, 0, 0);
+}
+
+/*
+ * Called after snapshots are added or removed.  Snapshots that still exist
+ * keep their cached entries, only the listing and removed names are dropped.
+ */
+void
+ori_ll_invalidate_snapshots()
+{
+    map<string, fuse_ino_t>::iterator it;
+    map<string, ObjectHash> snapshots;
+    vector<string> names;
+    string prefix = ORI_SNAPSHOT_DIRPATH "/";
+
+    if (oriChan == NULL)
+        return;
+
+    snapshots = priv->listSnapshots();
+
+    inodeLock.lock();
+    for (it = specialInodes.lower_bound(prefix);
+         it != specialInodes.end() && it->first.compare(0, prefix.size(),
+                                                        prefix) == 0;
+         it++) {
+        string name = it->first.substr(prefix.size());
+
+        if (name.find('/') == string::npos &&
+            snapshots.find(name) == snapshots.end())
+            names.push_back(name);
+    }
+    inodeLock.unlock();
+
+    for (size_t i = 0; i < names.size(); i++) {
+        fuse_lowlevel_notify_inval_entry(oriChan, ORI_LL_SNAPSHOT_INO,
+                                         names[i].c_str(), names[i].size());
+    }
+    fuse_lowlevel_notify_inval_inode(oriChan, ORI_LL_SNAPSHOT_INO, 0, 0);
+}
+
+static struct fuse_lowlevel_ops ori_ll_oper;
+
+static void
+ori_setup_ori_ll_oper()
+{
+    memset(&ori_ll_oper, 0, sizeof(struct fuse_lowlevel_ops));
+
+    ori_ll_oper.init = ori_ll_init;
+    ori_ll_oper.destroy = ori_ll_destroy;
+
+    ori_ll_oper.lookup = ori_ll_lookup;
+    ori_ll_oper.forget = ori_ll_forget;
+#if FUSE_VERSION >= 29
+    ori_ll_oper.forget_multi = ori_ll_forget_multi;
+#endif /* FUSE_VERSION >= 29 */
+
+    ori_ll_oper.getattr = ori_ll_getattr;
+    ori_ll_oper.setattr = ori_ll_setattr;
+    ori_ll_oper.readlink = ori_ll_readlink;
+
+    ori_ll_oper.mknod = ori_ll_mknod;
+    ori_ll_oper.unlink = ori_ll_unlink;
+    ori_ll_oper.symlink = ori_ll_symlink;
+    ori_ll_oper.rename = ori_ll_rename;
+
+    ori_ll_oper.create = ori_ll_create;
+    ori_ll_oper.open = ori_ll_open;
+    ori_ll_oper.read = ori_ll_read;
+    ori_ll_oper.write = ori_ll_write;
+#if FUSE_VERSION >= 29
+    ori_ll_oper.write_buf = ori_ll_write_buf;
+#endif /* FUSE_VERSION >= 29 */
+    ori_ll_oper.release = ori_ll_release;
+    ori_ll_oper.fsync = ori_ll_fsync;
+
+    ori_ll_oper.mkdir = ori_ll_mkdir;
+    ori_ll_oper.rmdir = ori_ll_rmdir;
+    ori_ll_oper.opendir = ori_ll_opendir;
+    ori_ll_oper.readdir = ori_ll_readdir;
+    ori_ll_oper.releasedir = ori_ll_releasedir;
+}
+
+int
+ori_ll_main(struct fuse_args *args)
+{
+    struct fuse_session *se;
+    char *mountpoint;
+    int multithreaded;
+    int foreground;
+    int status = 1;
+
+    ori_setup_ori_ll_oper();
+
+    if (fuse_parse_cmdline(args, &mountpoint, &multithreaded,
+                           &foreground) == -1)
+        return 1;
+
+    oriChan = fuse_mount(mountpoint, args);
+    if (oriChan == NULL) {
+        free(mountpoint);
+        return 1;
+    }
+
+    se = fuse_lowlevel_new(args, &ori_ll_oper, sizeof(ori_ll_oper), NULL);
+    if (se != NULL) {
+        if (fuse_set_signal_handlers(se) != -1) {
+            fuse_session_add_chan(se, oriChan);
+            fuse_daemonize(foreground);
+            if (multithreaded)
+                status = fuse_session_loop_mt(se);
+            else
+                status = fuse_session_loop(se);
+            fuse_remove_signal_handlers(se);
+            fuse_session_remove_chan(oriChan);
+        }
+        fuse_session_destroy(se);
+    }
+
+    fuse_unmount(mountpoint, oriChan);
+    oriChan = NULL;
+    free(mountpoint);
+
+    return status == 0 ? 0 : 1;
+}
@@ -32,6 +32,9 @@ struct mount_ori_config {
     int journal;
     int single;
     int debug;
+    int lowlevel;
+    unsigned int metadata_cache; // megabytes
+    unsigned int sync_latency; // microseconds
     std::string repoPath;
     std::string clonePath;
     std::string mountPoint;
@@ -44,6 +47,9 @@ struct mount_ori_config {
       , journal(OriJournalMode::AsyncJournal)
       , single(0)
       , debug(0)
+      , lowlevel(0)
+      , metadata_cache(ORIFS_METADATA_CACHE)
+      , sync_latency(ORIFS_SYNC_LATENCY)
       , repoPath()
       , clonePath()
       , mountPoint()
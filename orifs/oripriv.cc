@@ -18,9 +18,11 @@
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <inttypes.h>
 #include <fstream>
 
 #include <unistd.h>
+#include <sched.h>
 #include <sys/types.h>
 #include <pwd.h>
 #include <grp.h>
@@ -31,7 +33,9 @@
 
 #include <string>
 #include <map>
+#include <vector>
 #include <algorithm>
+#include <functional>
 #include <memory>
 #include <unordered_map>
 
@@ -40,6 +44,7 @@
 #include <oriutil/scan.h>
 #include <oriutil/systemexception.h>
 #include <oriutil/rwlock.h>
+#include <oriutil/monitor.h>
 #include <oriutil/objecthash.h>
 #include <ori/commit.h>
 #include <ori/localrepo.h>
@@ -49,12 +54,14 @@
 #include "oricmd.h"
 #include "oripriv.h"
 #include "oriopt.h"
+#include "orisnapshot.h"
 #include "server.h"
 
 using namespace std;
 
 // XXX: Hacky remove dependence
 extern mount_ori_config config;
+extern OriPriv *priv;
 
 void
 OriFileInfo::loadAttr(const AttrMap &attrs)
@@ -120,16 +127,33 @@ OriFileInfo::storeAttr(AttrMap *attrs) const
     attrs->setAs<time_t>(ATTR_CTIME, statInfo.st_ctime);
 }
 
+void
+OriPriv_JournalFlushCb(void *arg)
+{
+    OriPriv *priv = (OriPriv *)arg;
+
+    if (OriFile_DataSync(priv->journalFd) < 0)
+        throw SystemException();
+}
+
 OriPriv::OriPriv(const std::string &repoPath,
                  const string &origin,
                  Repo *remoteRepo)
+    : journalSyncer(OriPriv_JournalFlushCb, this, config.sync_latency),
+      prefetcher(NULL),
+      evictor(NULL), cacheLimit((uint64_t)config.metadata_cache << 20),
+      cacheBytes(0), dirLoads(0), dirEvictions(0), entryEvictions(0),
+      evictHand(ORIPRIVID_INVALID), evictIdle(0), evictRetry(0),
+      committer(NULL), commitPending(false)
 {
     repo = new LocalRepo(repoPath);
+    snapshotView = new OriSnapshotView(this);
     nextId = ORIPRIVID_INVALID + 1;
     nextFH = 1;
 
     try {
         repo->open();
+        repo->setSyncLatency(config.sync_latency);
         if (ori_open_log(repo->getLogPath()) < 0)
             printf("Couldn't open log!\n");
     } catch (exception &e) {
@@ -174,7 +198,9 @@ OriPriv::OriPriv(const std::string &repoPath,
         dirInfo->statInfo.st_ctime = now;
         dirInfo->type = FILETYPE_DIRTY;
         dirInfo->dirLoaded = true;
-        dirs[dirInfo->id] = new OriDir();
+        dirs[dirInfo->id] = new OriDir(NULL);
+        // Nothing is committed yet, so the first commit stores the root
+        dirs[dirInfo->id]->setDirty();
     } else {
         dirInfo->statInfo.st_mtime = headCommit.getTime();
         dirInfo->statInfo.st_ctime = headCommit.getTime();
@@ -182,11 +208,12 @@ OriPriv::OriPriv(const std::string &repoPath,
         dirInfo->type = FILETYPE_COMMITTED;
     }
 
-    paths["/"] = dirInfo;
+    addPath("/", dirInfo);
 }
 
 OriPriv::~OriPriv()
 {
+    delete snapshotView;
 }
 
 void
@@ -252,6 +279,16 @@ void
 OriPriv::init()
 {
     UDSServerStart(repo);
+
+    // Started here as FUSE may fork after the constructor runs
+    prefetcher = new OriPrefetcher(this);
+    prefetcher->start();
+
+    committer = new OriCommitter(this);
+    committer->start();
+
+    evictor = new OriEvictor(this);
+    evictor->start();
 }
 
 int
@@ -265,6 +302,19 @@ cleanupHelper(OriPriv *priv, const string &path)
 void
 OriPriv::cleanup()
 {
+    if (evictor) {
+        evictor->stop();
+        delete evictor;
+        evictor = NULL;
+    }
+
+    // Queued commits still read their temporary files
+    if (committer) {
+        committer->stop();
+        delete committer;
+        committer = NULL;
+    }
+
     tmpDir = repo->getRootPath() + ORI_PATH_TMP + "fuse";
 
     // XXX: Delete all files on exit, but need support to delete only closed 
@@ -273,6 +323,12 @@ OriPriv::cleanup()
     DirIterate(tmpDir, this, cleanupHelper);
 
     UDSServerStop();
+
+    if (prefetcher) {
+        prefetcher->stop();
+        delete prefetcher;
+        prefetcher = NULL;
+    }
 }
 
 pair<string, int>
@@ -295,6 +351,7 @@ OriPriv::getTemp()
  * Current Change Operations
  */
 
+// Callers hold nsLock for writing or mapLock
 uint64_t
 OriPriv::generateFH()
 {
@@ -330,6 +387,7 @@ OriPriv::getFileInfo(const string &path)
     }
 
     // Check pending directories
+    Monitor m(mapLock);
     it = paths.find(path);
     if (it != paths.end()) {
         OriFileInfo *info = (*it).second;
@@ -349,6 +407,7 @@ OriFileInfo *
 OriPriv::getFileInfo(uint64_t fh)
 {
     unordered_map<uint64_t, OriFileInfo*>::iterator it;
+    Monitor m(mapLock);
 
     it = handles.find(fh);
     if (it != handles.end()) {
@@ -364,20 +423,27 @@ int
 OriPriv::closeFH(uint64_t fh)
 {
     int status = 0;
+    OriFileInfo *info;
 
+    mapLock.lock();
     ASSERT(handles.find(fh) != handles.end());
+    info = handles[fh];
+    handles.erase(fh);
+    readCtxs.erase(fh);
+    mapLock.unlock();
+
+    Monitor m(getInfoLock(info));
 
     // Manage open count
-    handles[fh]->releaseFd();
-    if (handles[fh]->openCount == 0 && handles[fh]->fd != -1) {
+    info->releaseFd();
+    if (info->openCount == 0 && info->fd != -1) {
         // Close file
-        status = close(handles[fh]->fd);
-        handles[fh]->fd = -1;
+        status = close(info->fd);
+        info->fd = -1;
     }
 
     // Manage reference count
-    handles[fh]->release();
-    handles.erase(fh);
+    info->release();
 
     return (status == 0) ? 0 : -errno;
 }
@@ -411,7 +477,7 @@ OriPriv::addSymlink(const string &path)
     info->statInfo.st_mode = S_IFLNK;
     // XXX: Adjust size properly
 
-    paths[path] = info;
+    addPath(path, info);
 
     return info;
 }
@@ -436,7 +502,7 @@ OriPriv::addFile(const string &path)
         it->second->release();
     }
 
-    paths[path] = info;
+    addPath(path, info);
     handles[handle] = info;
 
     info->retain();
@@ -448,76 +514,125 @@ OriPriv::addFile(const string &path)
 pair<OriFileInfo *, uint64_t>
 OriPriv::openFile(const string &path, bool writing, bool trunc)
 {
-    OriFileInfo *info = getFileInfo(path);
-    uint64_t handle = generateFH();
+    return openFile(getFileInfo(path), writing, trunc);
+}
 
-    // XXX: Need to release and remove the hanlde during a failure!
+/*
+ * Opens a file for a new handle.  Small committed files opened for writing
+ * are copied out of the repository before the info lock is taken, so other
+ * operations on the file do not wait for the copy.  If another opener
+ * published a temporary file in the meantime the copy is dropped.
+ */
+pair<OriFileInfo *, uint64_t>
+OriPriv::openFile(OriFileInfo *info, bool writing, bool trunc)
+{
+    uint64_t handle;
+    string copy;
 
-    info->retain();
-    info->retainFd();
-    handles[handle] = info;
+    // A pending commit keeps reading the frozen temporary file
+    if (writing)
+        thawFile(info);
 
-    // Handle opening directories
-    if (info->isDir()) {
-        // For directories just allow opening/closing
-        return make_pair(info, handle);
+    if (writing && !trunc) {
+        ObjectHash hash;
+
+        getInfoLock(info).lock();
+        if (!info->isDir() && info->largeHash.isEmpty() &&
+            (info->type == FILETYPE_COMMITTED ||
+             (info->type == FILETYPE_DIRTY && info->path == "")))
+            hash = info->hash;
+        getInfoLock(info).unlock();
+
+        if (!hash.isEmpty())
+            copy = copyBlob(hash);
     }
 
-    // Open temporary file if necessary
-    if (info->type == FILETYPE_DIRTY && info->path != "") {
-        if (info->fd != -1) {
-            // File is already open just return a new handle
-            return make_pair(info, handle);
-        }
-        int status = open(info->path.c_str(), O_RDWR);
-        if (status < 0) {
-            ASSERT(false); // XXX: Need to release the handle
-            throw SystemException(errno);
-        }
-        info->fd = status;
-    } else if (info->type == FILETYPE_COMMITTED ||
-               (info->type == FILETYPE_DIRTY && info->path == "")) {
-        ASSERT(!info->hash.isEmpty());
-        if (!writing) {
-            // Read-only
-            info->fd = -1;
-        } else if (writing && trunc) {
-            // Generate temporary file
-            pair<string, int> temp = getTemp();
-
-            info->statInfo.st_size = 0;
-            info->statInfo.st_blocks = 0;
-            info->type = FILETYPE_DIRTY;
-            info->path = temp.first;
-            info->fd = temp.second;
-        } else if (writing) {
-            // Copy file
-            int status;
-            pair<string, int> temp = getTemp();
-            close(temp.second);
-
-            if (!repo->copyObject(info->hash, temp.first)) {
-                ASSERT(false); // XXX: Need to release the handle
-                throw SystemException(EIO);
-            }
+    Monitor m(getInfoLock(info));
 
-            status = open(temp.first.c_str(), O_RDWR);
-            if (status < 0) {
-                ASSERT(false); // XXX: Need to release the handle
-                throw SystemException(errno);
+    try {
+        if (info->isDir()) {
+            // For directories just allow opening/closing
+        } else if (info->type == FILETYPE_DIRTY && info->path != "") {
+            // Open temporary file if necessary
+            if (info->fd == -1) {
+                int status = open(info->path.c_str(), O_RDWR);
+                if (status < 0)
+                    throw SystemException(errno);
+                info->fd = status;
             }
+        } else if (info->type == FILETYPE_COMMITTED ||
+                   (info->type == FILETYPE_DIRTY && info->path == "")) {
+            ASSERT(!info->hash.isEmpty());
+            if (!writing) {
+                // Read-only
+                info->fd = -1;
+            } else if (trunc) {
+                // Generate temporary file
+                pair<string, int> temp = getTemp();
+
+                info->statInfo.st_size = 0;
+                info->statInfo.st_blocks = 0;
+                info->type = FILETYPE_DIRTY;
+                info->path = temp.first;
+                info->fd = temp.second;
+            } else if (!info->largeHash.isEmpty()) {
+                /*
+                 * Copy-on-write: size a sparse temporary file and let reads
+                 * of unwritten ranges fall through to the committed chunks.
+                 */
+                pair<string, int> temp = getTemp();
 
-            info->type = FILETYPE_DIRTY;
-            info->path = temp.first;
-            info->fd = status;
+                if (ftruncate(temp.second, info->statInfo.st_size) < 0) {
+                    int error = errno;
+                    close(temp.second);
+                    OriFile_Delete(temp.first);
+                    throw SystemException(error);
+                }
+
+                info->type = FILETYPE_DIRTY;
+                info->path = temp.first;
+                info->fd = temp.second;
+                info->cow = true;
+                info->cowBase = info->statInfo.st_size;
+                info->overlay.clear();
+            } else {
+                int status;
+
+                // Copied above unless the file changed in between
+                if (copy == "")
+                    copy = copyBlob(info->hash);
+
+                status = open(copy.c_str(), O_RDWR);
+                if (status < 0)
+                    throw SystemException(errno);
+
+                info->type = FILETYPE_DIRTY;
+                info->path = copy;
+                info->fd = status;
+                copy = "";
+            }
         } else {
+            // XXX: Other types unsupported
             ASSERT(false);
         }
-    } else {
-        // XXX: Other types unsupported
-        ASSERT(false);
+    } catch (SystemException &e) {
+        if (copy != "")
+            OriFile_Delete(copy);
+        throw;
     }
 
+    // Another opener created the temporary file first
+    if (copy != "")
+        OriFile_Delete(copy);
+
+    info->retain();
+    info->retainFd();
+
+    mapLock.lock();
+    handle = generateFH();
+    handles[handle] = info;
+    mapLock.unlock();
+
     return make_pair(info, handle);
 }
 
@@ -526,40 +641,278 @@ OriPriv::readFile(OriFileInfo *info, char *buf, size_t size, off_t offset)
 {
     ASSERT(!info->hash.isEmpty());
 
-    ObjectType type = repo->getObjectType(info->hash);
-    if (type == ObjectInfo::Blob) {
-        string payload = repo->getPayload(info->hash);
-        // XXX: Cache
-
-        size_t left = payload.size() - offset;
-        if (left > payload.size())
-            left = 0;
-        size_t real_read = min(size, left);
-
-        memcpy(buf, payload.data() + offset, real_read);
-
-        return real_read;
-    } else if (type == ObjectInfo::LargeBlob) {
-        LargeBlob lb = LargeBlob(repo);
-        lb.fromBlob(repo->getPayload(info->hash));
-        // XXX: Cache
-
-        ssize_t total = 0;
-        while (total < size) {
-            ssize_t res = lb.read((uint8_t*)(buf + total),
-                                 size - total,
-                                 offset + total);
+    OriReadCtx ctx(this, info->hash);
+
+    return ctx.read(buf, size, offset);
+}
+
+/*
+ * Reads a committed file through the read context of its open handle, which
+ * is created on the first read and dropped when the handle is closed.
+ */
+ssize_t
+OriPriv::readHandle(uint64_t fh, OriFileInfo *info, char *buf, size_t size,
+                    off_t offset)
+{
+    OriReadCtx::sp ctx;
+
+    ASSERT(!info->hash.isEmpty());
+
+    mapLock.lock();
+    unordered_map<uint64_t, OriReadCtx::sp>::iterator it = readCtxs.find(fh);
+    // A checkout may change the file under an open handle
+    if (it == readCtxs.end() || (*it).second->getHash() != info->hash) {
+        ctx.reset(new OriReadCtx(this, info->hash));
+        readCtxs[fh] = ctx;
+    } else {
+        ctx = (*it).second;
+    }
+    mapLock.unlock();
+
+    return ctx->read(buf, size, offset);
+}
+
+/*
+ * Reads a copy-on-write file by splitting the request into runs served by
+ * the temporary file (written ranges and anything past cowBase) and runs
+ * served by the committed LargeBlob through the handle's read context.
+ */
+ssize_t
+OriPriv::readCow(uint64_t fh, OriFileInfo *info, char *buf, size_t size,
+                 off_t offset)
+{
+    ssize_t total = 0;
+
+    while ((size_t)total < size) {
+        uint64_t pos = offset + total;
+        uint64_t runEnd = offset + size;
+        uint64_t start, end;
+        bool fromBase = false;
+        ssize_t res;
+        int fd;
+
+        getInfoLock(info).lock();
+        if (pos >= (uint64_t)info->statInfo.st_size) {
+            getInfoLock(info).unlock();
+            break;
+        }
+        runEnd = MIN(runEnd, (uint64_t)info->statInfo.st_size);
+        fd = info->fd;
+        if (pos < info->cowBase) {
+            bool found = info->overlay.find(pos, &start, &end);
+            if (found && start <= pos) {
+                runEnd = MIN(runEnd, end);
+            } else {
+                fromBase = true;
+                runEnd = MIN(runEnd, info->cowBase);
+                if (found)
+                    runEnd = MIN(runEnd, start);
+            }
+        }
+        getInfoLock(info).unlock();
+
+        if (fromBase) {
+            res = readHandle(fh, info, buf + total, runEnd - pos, pos);
+        } else {
+            res = pread(fd, buf + total, runEnd - pos, pos);
+            if (res < 0)
+                return -errno;
+        }
+        if (res < 0)
+            return res;
+        if (res == 0)
+            break;
+        total += res;
+    }
+
+    return total;
+}
+
+/*
+ * Copies the committed contents into the unwritten ranges of a
+ * copy-on-write temporary file so it can be committed as a whole file.
+ */
+void
+OriPriv::materializeCow(const string &path, const ObjectHash &hash,
+                        uint64_t cowBase, const ExtentMap &overlay)
+{
+    OriReadCtx ctx(this, hash);
+    string buf;
+    uint64_t pos = 0;
+    int fd;
+
+    fd = open(path.c_str(), O_RDWR);
+    if (fd < 0)
+        throw SystemException(errno);
+
+    buf.resize(ORIFS_COW_BUFSZ);
+    while (pos < cowBase) {
+        uint64_t start, end;
+        uint64_t holeEnd = cowBase;
+
+        if (overlay.find(pos, &start, &end)) {
+            if (start <= pos) {
+                pos = end;
+                continue;
+            }
+            holeEnd = MIN(holeEnd, start);
+        }
+
+        while (pos < holeEnd) {
+            size_t len = MIN(holeEnd - pos, (uint64_t)buf.size());
+            ssize_t res = ctx.read(&buf[0], len, pos);
+            if (res <= 0) {
+                close(fd);
+                throw SystemException(res < 0 ? -res : EIO);
+            }
+            if (pwrite(fd, buf.data(), res, pos) != res) {
+                int error = errno;
+                close(fd);
+                throw SystemException(error);
+            }
+            pos += res;
+        }
+    }
+
+    close(fd);
+}
+
+/*
+ * Copies a committed Blob into a new temporary file and returns its path.
+ */
+string
+OriPriv::copyBlob(const ObjectHash &hash)
+{
+    pair<string, int> temp = getTemp();
+
+    close(temp.second);
+    if (!repo->copyObject(hash, temp.first)) {
+        OriFile_Delete(temp.first);
+        throw SystemException(EIO);
+    }
+
+    return temp.first;
+}
+
+/*
+ * Copies the extents of a temporary file of the given size into a new one,
+ * the rest of the copy is left sparse.
+ */
+pair<string, int>
+OriPriv::copyTemp(const string &path, uint64_t size, const ExtentMap &extents)
+{
+    pair<string, int> temp = getTemp();
+    string buf;
+    int error = 0;
+    int fd;
+
+    fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        error = errno;
+    } else if (ftruncate(temp.second, size) < 0) {
+        error = errno;
+    }
+
+    buf.resize(ORIFS_COW_BUFSZ);
+    for (ExtentMap::iterator it = extents.begin();
+         error == 0 && it != extents.end();
+         it++) {
+        uint64_t pos = it->first;
+
+        while (pos < it->second) {
+            size_t len = MIN(it->second - pos, (uint64_t)buf.size());
+            ssize_t res = pread(fd, &buf[0], len, pos);
+            if (res < 0) {
+                error = errno;
+                break;
+            }
+            // The file may be shorter than its size after a failed write
             if (res == 0)
-                return total;
-            else if (res < 0)
-                return res;
-            total += res;
+                break;
+            if (pwrite(temp.second, buf.data(), res, pos) != res) {
+                error = errno;
+                break;
+            }
+            pos += res;
+        }
+    }
+
+    if (fd >= 0)
+        close(fd);
+    if (error != 0) {
+        close(temp.second);
+        OriFile_Delete(temp.first);
+        throw SystemException(error);
+    }
+
+    return temp;
+}
+
+/*
+ * Gives a frozen file its own temporary file before it is written, leaving
+ * the old one to the pending commit.  The copy is made without the info
+ * lock, nothing writes the frozen file, and an open descriptor is switched
+ * over in place so handles sharing it see the copy.  Callers hold nsLock
+ * but not the info lock.
+ *
+ * @returns true if the file was frozen, in which case its directory may be
+ * clean and the caller has to mark it dirty.
+ */
+bool
+OriPriv::thawFile(OriFileInfo *info)
+{
+    ExtentMap extents;
+    string path;
+    uint64_t size;
+
+    {
+        Monitor m(getInfoLock(info));
+
+        if (!info->frozen || info->path == "")
+            return false;
+
+        // Copy-on-write files stay sparse, see OriFileInfo::cow
+        path = info->path;
+        size = info->statInfo.st_size;
+        if (info->cow) {
+            extents = info->overlay;
+            if (size > info->cowBase)
+                extents.add(info->cowBase, size - info->cowBase);
+        } else if (size > 0) {
+            extents.add(0, size);
         }
+    }
+
+    pair<string, int> temp = copyTemp(path, size, extents);
 
-        return total;
+    Monitor m(getInfoLock(info));
+
+    // Another writer thawed the file first
+    if (!info->frozen || info->path != path) {
+        close(temp.second);
+        OriFile_Delete(temp.first);
+        return false;
     }
 
-    return -EIO;
+    if (info->fd != -1 && dup2(temp.second, info->fd) < 0) {
+        int error = errno;
+        close(temp.second);
+        OriFile_Delete(temp.first);
+        throw SystemException(error);
+    }
+    close(temp.second);
+
+    info->path = temp.first;
+    info->frozen = false;
+
+    return true;
+}
+
+void
+OriPriv::prefetch(const vector<ObjectHash> &hashes)
+{
+    if (prefetcher)
+        prefetcher->enqueue(hashes);
 }
 
 void
@@ -578,7 +931,7 @@ OriPriv::unlink(const string &path)
     ASSERT(info->isSymlink() || info->isReg());
 
     parentDir->remove(OriFile_Basename(path));
-    paths.erase(path);
+    removePath(path);
 
     // Drop refcount only delete if zero (including temp file)
     info->release();
@@ -609,15 +962,17 @@ OriPriv::rename(const string &fromPath, const string &toPath)
         // Fall through
     }
 
-    // XXX: Need to rename all files under a directory
     if (info->isDir()) {
-        // XXX: Handle refcount movement then we can rename empty directories
-        NOT_IMPLEMENTED(!info->dirLoaded);
+        // A directory cannot move below itself
+        if (toPath.compare(0, fromPath.size() + 1, fromPath + "/") == 0)
+            throw SystemException(EINVAL);
+
+        renameDir(fromPath, toPath);
     }
 
     info->type = FILETYPE_DIRTY;
-    paths.erase(fromPath);
-    paths[toPath] = info;
+    removePath(fromPath);
+    addPath(toPath, info);
 
     string from = OriFile_Basename(fromPath);
     string to = OriFile_Basename(toPath);
@@ -625,8 +980,29 @@ OriPriv::rename(const string &fromPath, const string &toPath)
     fromDir->remove(from);
     toDir->add(to, info->id);
 
+    if (info->isDir()) {
+        OriFileInfo *fromParentInfo = getFileInfo(fromParent);
+        OriFileInfo *toParentInfo = getFileInfo(toParent);
+
+        reparentDir(info, toDir);
+        fromParentInfo->statInfo.st_nlink--;
+        fromParentInfo->type = FILETYPE_DIRTY;
+        toParentInfo->statInfo.st_nlink++;
+        toParentInfo->type = FILETYPE_DIRTY;
+    }
+
     // Delete previously present file
     if (toFile != NULL) {
+        if (toFile->isDir()) {
+            map<OriPrivId, OriDir*>::iterator dit = dirs.find(toFile->id);
+
+            // Only empty directories are replaced
+            if (dit != dirs.end()) {
+                delete dit->second;
+                dirs.erase(dit);
+            }
+            getFileInfo(toParent)->statInfo.st_nlink--;
+        }
         toFile->release();
     }
 
@@ -634,6 +1010,51 @@ OriPriv::rename(const string &fromPath, const string &toPath)
     ASSERT(paths.find(toPath) != paths.end());
 }
 
+/*
+ * Moves the paths below a directory that is being renamed.  The subtree is
+ * loaded first as it can no longer be found in the head commit by path, and
+ * everything in it is marked dirty so that it is not evicted and the next
+ * commit does not look it up in the trees of its old location.  Caller holds
+ * nsLock for writing.
+ */
+void
+OriPriv::renameDir(const string &fromPath, const string &toPath)
+{
+    OriDir *dir = getDir(fromPath);
+
+    for (OriDir::iterator it = dir->begin(); it != dir->end(); it++) {
+        string from = fromPath + "/" + it->first;
+        string to = toPath + "/" + it->first;
+        OriFileInfo *info = getFileInfo(from);
+
+        if (info->isDir())
+            renameDir(from, to);
+
+        info->type = FILETYPE_DIRTY;
+        removePath(from);
+        addPath(to, info);
+    }
+
+    dir->setDirty();
+}
+
+/*
+ * Points a loaded directory that moved at its new parent, so that changes
+ * below it mark the new ancestors dirty.  Caller holds nsLock for writing.
+ */
+void
+OriPriv::reparentDir(OriFileInfo *info, OriDir *parentDir)
+{
+    map<OriPrivId, OriDir*>::iterator dit;
+
+    if (!info->isDir())
+        return;
+
+    dit = dirs.find(info->id);
+    if (dit != dirs.end())
+        dit->second->setParent(parentDir);
+}
+
 OriFileInfo *
 OriPriv::addDir(const string &path)
 {
@@ -675,8 +1096,9 @@ OriPriv::addDir(const string &path)
     info->id = generateId();
     info->dirLoaded = true;
 
-    dirs[info->id] = new OriDir();
-    paths[path] = info;
+    dirs[info->id] = new OriDir(parentDir);
+    dirs[info->id]->setDirty();
+    addPath(path, info);
 
     parentDir->add(OriFile_Basename(path), info->id);
     parentInfo->statInfo.st_nlink++;
@@ -715,7 +1137,7 @@ OriPriv::rmDir(const string &path)
     ASSERT(parentInfo->statInfo.st_nlink >= 2);
 
     dirs.erase(info->id);
-    paths.erase(path);
+    removePath(path);
 
     delete dir;
     info->release();
@@ -726,70 +1148,402 @@ OriPriv::getDir(const string &path)
 {
     // Check pending directories
     map<string, OriFileInfo*>::iterator it;
+    map<OriPrivId, OriDir*>::iterator dit;
 
+    mapLock.lock();
     it = paths.find(path);
     if (it != paths.end()) {
-        map<OriPrivId, OriDir*>::iterator dit;
-        if (!(*it).second->isDir())
+        if (!(*it).second->isDir()) {
+            mapLock.unlock();
             throw SystemException(ENOTDIR);
-        if ((*it).second->type == FILETYPE_NULL)
+        }
+        if ((*it).second->type == FILETYPE_NULL) {
+            mapLock.unlock();
             throw SystemException(ENOENT);
+        }
         dit = dirs.find((*it).second->id);
-        if (dit == dirs.end())
-            goto loadDir;
-
-        return dit->second;
+        if (dit != dirs.end()) {
+            dit->second->touch();
+            mapLock.unlock();
+            return dit->second;
+        }
     }
+    mapLock.unlock();
+
+    return loadDir(path);
+}
+
+/*
+ * Loads a committed directory into the cache.  Loads of the same directory
+ * are serialized by a striped lock, while the repository is read without
+ * holding mapLock so lookups elsewhere in the namespace proceed.
+ */
+OriDir*
+OriPriv::loadDir(const string &path)
+{
+    OriFileInfo *dirInfo;
+    OriDir *parentDir = NULL;
+    map<OriPrivId, OriDir*>::iterator dit;
 
-loadDir:
     // Check repository
     ObjectHash hash = repo->lookup(headCommit, path);
-    if (!hash.isEmpty()) {
-        Tree t = repo->getTree(hash);
-        Tree::iterator it;
-        OriFileInfo *dirInfo;
-        OriDir *dir = new OriDir();
+    if (hash.isEmpty())
+        throw SystemException(ENOENT);
 
-        dirInfo = getFileInfo(path);
+    // Loads the parent directory so it must precede the stripe lock
+    dirInfo = getFileInfo(path);
+    if (path != "/") {
+        string parentPath = OriFile_Dirname(path);
 
-        for (it = t.begin(); it != t.end(); it++) {
-            OriFileInfo *info = new OriFileInfo();
-            AttrMap *attrs = &it->second.attrs;
-            bool isSymlink = false;
+        parentDir = getDir(parentPath == "" ? "/" : parentPath);
+    }
 
-            if (it->second.type == TreeEntry::Tree) {
-                info->statInfo.st_mode = S_IFDIR;
-                info->statInfo.st_nlink = 2;
-                // XXX: This is hacky but a directory gets the correct nlink 
-                // value once it is opened for the first time.
-                dirInfo->statInfo.st_nlink++;
-            }
-            if (attrs->has(ATTR_SYMLINK)) {
-                isSymlink = attrs->getAs<bool>(ATTR_SYMLINK);
-            }
-            info->loadAttr(*attrs);
-            info->type = FILETYPE_COMMITTED;
-            info->id = generateId();
-            info->hash = it->second.hash;
-            info->largeHash = it->second.largeHash;
-            if (isSymlink) {
-                ASSERT(info->largeHash.isEmpty());
-                info->link = repo->getPayload(info->hash);
-            }
+    Monitor load(dirLoadLocks[std::hash<string>()(path) % ORIPRIV_LOCKSTRIPES]);
 
-            dir->add(it->first, info->id);
-            if (path == "/")
-                paths["/" + it->first] = info;
-            else
-                paths[path + "/" + it->first] = info;
+    // Another thread may have loaded the directory while we waited
+    mapLock.lock();
+    dit = dirs.find(dirInfo->id);
+    if (dit != dirs.end()) {
+        mapLock.unlock();
+        return dit->second;
+    }
+    mapLock.unlock();
+
+    Tree t = repo->getTree(hash);
+    Tree::iterator it;
+    OriDir *dir = new OriDir(parentDir);
+    vector<pair<string, OriFileInfo *> > entries;
+    int subdirs = 0;
+
+    for (it = t.begin(); it != t.end(); it++) {
+        OriFileInfo *info = new OriFileInfo();
+        AttrMap *attrs = &it->second.attrs;
+        bool isSymlink = false;
+
+        if (it->second.type == TreeEntry::Tree) {
+            info->statInfo.st_mode = S_IFDIR;
+            info->statInfo.st_nlink = 2;
+            // XXX: This is hacky but a directory gets the correct nlink 
+            // value once it is opened for the first time.
+            subdirs++;
+        }
+        if (attrs->has(ATTR_SYMLINK)) {
+            isSymlink = attrs->getAs<bool>(ATTR_SYMLINK);
+        }
+        info->loadAttr(*attrs);
+        info->type = FILETYPE_COMMITTED;
+        info->hash = it->second.hash;
+        info->largeHash = it->second.largeHash;
+        if (isSymlink) {
+            ASSERT(info->largeHash.isEmpty());
+            info->link = repo->getPayload(info->hash);
         }
 
-        dirInfo->dirLoaded = true;
-        dirs[dirInfo->id] = dir;
-        return dir;
+        entries.push_back(make_pair(it->first, info));
     }
 
-    throw SystemException(ENOENT);
+    // Publish the directory and its entries
+    Monitor m(mapLock);
+    for (size_t i = 0; i < entries.size(); i++) {
+        entries[i].second->id = generateId();
+        dir->load(entries[i].first, entries[i].second->id);
+        if (path == "/")
+            addPath("/" + entries[i].first, entries[i].second);
+        else
+            addPath(path + "/" + entries[i].first, entries[i].second);
+    }
+    dirInfo->statInfo.st_nlink += subdirs;
+    dirInfo->dirLoaded = true;
+    dirs[dirInfo->id] = dir;
+    dirLoads++;
+    checkCache();
+
+    return dir;
+}
+
+void
+OriPriv::setDirty(OriDir *dir)
+{
+    Monitor m(mapLock);
+
+    dir->setDirty();
+}
+
+Mutex &
+OriPriv::getInfoLock(const OriFileInfo *info)
+{
+    return infoLocks[info->id % ORIPRIV_LOCKSTRIPES];
+}
+
+// Estimated memory of a cached file, whose name is also kept by its directory
+static uint64_t
+OriPrivEntryBytes(const string &path)
+{
+    return ORIFS_CACHE_ENTRYBYTES + 2 * path.size();
+}
+
+/*
+ * Keeps paths and the ids index in step.  A path that already names another
+ * file drops that file from the index.  Callers hold nsLock for writing or
+ * mapLock.
+ */
+void
+OriPriv::addPath(const string &path, OriFileInfo *info)
+{
+    pair<map<string, OriFileInfo*>::iterator, bool> ins;
+
+    ins = paths.insert(make_pair(path, info));
+    if (!ins.second) {
+        if (ins.first->second != info)
+            ids.erase(ins.first->second->id);
+        ins.first->second = info;
+    } else {
+        cacheBytes += OriPrivEntryBytes(path);
+    }
+    ids[info->id] = ins.first;
+}
+
+void
+OriPriv::removePath(const string &path)
+{
+    map<string, OriFileInfo*>::iterator it = paths.find(path);
+
+    if (it == paths.end())
+        return;
+
+    cacheBytes -= OriPrivEntryBytes(path);
+    ids.erase(it->second->id);
+    paths.erase(it);
+}
+
+// Wakes the evictor once the cache grows past its bound
+void
+OriPriv::checkCache()
+{
+    if (evictor && cacheLimit != 0 && cacheBytes > cacheLimit &&
+        cacheBytes > evictRetry)
+        evictor->kick();
+}
+
+/*
+ * Inode Operations
+ *
+ * The low-level FUSE interface names files by OriPrivId rather than by path.
+ * Ids are only valid until the next checkout, which reloads the namespace.
+ */
+
+OriFileInfo *
+OriPriv::getInfoById(OriPrivId id)
+{
+    unordered_map<OriPrivId, map<string, OriFileInfo*>::iterator>::iterator it;
+    Monitor m(mapLock);
+
+    it = ids.find(id);
+    if (it == ids.end())
+        throw SystemException(ESTALE);
+
+    return it->second->second;
+}
+
+string
+OriPriv::getPathById(OriPrivId id)
+{
+    unordered_map<OriPrivId, map<string, OriFileInfo*>::iterator>::iterator it;
+    Monitor m(mapLock);
+
+    it = ids.find(id);
+    if (it == ids.end())
+        throw SystemException(ESTALE);
+
+    return it->second->first;
+}
+
+OriDir *
+OriPriv::getDirById(OriPrivId id)
+{
+    unordered_map<OriPrivId, map<string, OriFileInfo*>::iterator>::iterator it;
+    map<OriPrivId, OriDir*>::iterator dit;
+    string path;
+
+    mapLock.lock();
+    dit = dirs.find(id);
+    if (dit != dirs.end()) {
+        dit->second->touch();
+        mapLock.unlock();
+        return dit->second;
+    }
+    it = ids.find(id);
+    if (it == ids.end()) {
+        mapLock.unlock();
+        throw SystemException(ESTALE);
+    }
+    if (!it->second->second->isDir()) {
+        mapLock.unlock();
+        throw SystemException(ENOTDIR);
+    }
+    path = it->second->first;
+    mapLock.unlock();
+
+    return loadDir(path);
+}
+
+OriFileInfo *
+OriPriv::lookup(OriPrivId parent, const string &name)
+{
+    OriDir *dir = getDirById(parent);
+    OriDir::iterator it;
+    unordered_map<OriPrivId, map<string, OriFileInfo*>::iterator>::iterator iit;
+    Monitor m(mapLock);
+
+    it = dir->find(name);
+    if (it == dir->end())
+        throw SystemException(ENOENT);
+
+    iit = ids.find(it->second);
+    if (iit == ids.end() || iit->second->second->type == FILETYPE_NULL)
+        throw SystemException(ENOENT);
+
+    return iit->second->second;
+}
+
+/*
+ * Metadata Cache
+ *
+ * Loaded directories and their entries stay in memory until the estimated
+ * size of the cache passes cacheLimit.  The evictor then sweeps the loaded
+ * directories with a clock: a directory used since the hand last passed gets
+ * another turn, otherwise it is unloaded if it is clean and none of its
+ * entries are dirty, open, frozen or referenced by the kernel.  Unloaded
+ * directories are read back from the head commit on the next lookup and
+ * their entries get new ids.
+ */
+
+/*
+ * Runs one bounded eviction pass under nsLock.
+ *
+ * @returns true if the cache is still above its target and another pass
+ * may make progress
+ */
+bool
+OriPriv::evict()
+{
+    RWKey::sp key = nsLock.writeLock();
+    map<OriPrivId, OriDir*>::iterator it;
+    uint64_t target = cacheLimit - cacheLimit / 8;
+
+    // Clean directories only match the head once a pending commit finishes
+    if (cacheLimit == 0 || commitPending)
+        return false;
+
+    it = dirs.upper_bound(evictHand);
+    for (int i = 0; i < ORIFS_EVICT_BATCH; i++) {
+        if (cacheBytes <= target) {
+            evictRetry = 0;
+            return false;
+        }
+        // Two turns of the clock without unloading anything
+        if (evictIdle > 2 * dirs.size()) {
+            evictIdle = 0;
+            evictRetry = cacheBytes + cacheLimit / 8;
+            return false;
+        }
+        if (it == dirs.end()) {
+            it = dirs.begin();
+            if (it == dirs.end())
+                return false;
+        }
+
+        OriPrivId id = it->first;
+        OriDir *dir = it->second;
+
+        it++;
+        evictHand = id;
+        evictIdle++;
+        if (dir->testAndClear())
+            continue;
+        if (unloadDir(id, dir))
+            evictIdle = 0;
+    }
+
+    return true;
+}
+
+/*
+ * Unloads a clean directory if all of its entries are unused committed files
+ * or directories that are not loaded.  Caller holds nsLock for writing.
+ */
+bool
+OriPriv::unloadDir(OriPrivId id, OriDir *dir)
+{
+    unordered_map<OriPrivId, map<string, OriFileInfo*>::iterator>::iterator it;
+    OriDir::iterator e;
+    OriFileInfo *dirInfo;
+    int subdirs = 0;
+
+    it = ids.find(id);
+    if (it == ids.end())
+        return false;
+
+    dirInfo = it->second->second;
+    if (dir->isDirty() || dirInfo->type != FILETYPE_COMMITTED)
+        return false;
+
+    for (e = dir->begin(); e != dir->end(); e++) {
+        OriFileInfo *info;
+
+        it = ids.find(e->second);
+        if (it == ids.end())
+            return false;
+
+        info = it->second->second;
+        if (info->isDir() && dirs.find(info->id) != dirs.end())
+            return false;
+
+        // Kernel lookups, open handles and commits hold references
+        Monitor m(getInfoLock(info));
+        if (info->type != FILETYPE_COMMITTED || info->frozen ||
+            info->refCount != 1 || info->openCount != 0)
+            return false;
+    }
+
+    Monitor m(mapLock);
+    for (e = dir->begin(); e != dir->end(); e++) {
+        OriFileInfo *info;
+
+        it = ids.find(e->second);
+        info = it->second->second;
+        if (info->isDir())
+            subdirs++;
+
+        removePath(it->second->first);
+        info->release();
+        entryEvictions++;
+    }
+
+    dirInfo->statInfo.st_nlink -= subdirs;
+    dirInfo->dirLoaded = false;
+    dirs.erase(id);
+    delete dir;
+    dirEvictions++;
+
+    return true;
+}
+
+OriCacheStats
+OriPriv::getCacheStats()
+{
+    OriCacheStats stats;
+    Monitor m(mapLock);
+
+    stats.limit = cacheLimit;
+    stats.bytes = cacheBytes;
+    stats.entries = paths.size();
+    stats.dirs = dirs.size();
+    stats.loads = dirLoads;
+    stats.evictions = dirEvictions;
+    stats.evictedEntries = entryEvictions;
+
+    return stats;
 }
 
 /*
@@ -818,6 +1572,12 @@ OriPriv::getTree(const Commit &c, const string &path)
     return repo->getTree(hash);
 }
 
+OriSnapshotView *
+OriPriv::getSnapshotView()
+{
+    return snapshotView;
+}
+
 /*
  * Command Operations
  */
@@ -828,80 +1588,96 @@ OriPriv::getTip()
     return head;
 }
 
-ObjectHash
-OriPriv::commitTreeHelper(const string &path)
+/*
+ * Freezes a dirty directory given its tree in the head commit, which is
+ * empty for new directories.  Entries of clean children are copied from the
+ * old tree, changed ones are recorded with their attributes and temporary
+ * file so they can be stored without holding nsLock.  Only dirty
+ * subdirectories are visited.  Directories that were fully frozen are
+ * appended to committed so the caller can mark them clean.
+ *
+ * @returns the index of the directory in the job
+ */
+ssize_t
+OriPriv::freezeTreeHelper(const string &path, const ObjectHash &oldTreeHash,
+                          OriCommitJob *job, vector<OriDir *> *committed)
 {
-    ObjectHash hash = ObjectHash();
     OriDir *dir = getDir(path == "" ? "/" : path);
+    OriCommitDir frozen;
+    map<string, size_t> entryIx;
     Tree oldTree = Tree();
-    Tree newTree;
-    bool dirty = false;
+    bool keepDirty = false;
+
+    frozen.path = path;
+    frozen.oldTreeHash = oldTreeHash;
 
     // Load repo directory
-    try {
-        /*
-         * XXX: This is unclean but lookup returns an empty hash or
-         * throws a runtime_error depending on a few corner cases when the 
-         * directory does not exist.
-         */
-        ObjectHash treeHash = repo->lookup(headCommit,
-                                           path == "" ? "/" : path);
-        if (!treeHash.isEmpty()) {
-            oldTree = repo->getTree(treeHash);
-        } else {
-            dirty = true;
-        }
-    } catch (runtime_error &e) {
-        // Directory does not exist
-        dirty = true;
+    if (!oldTreeHash.isEmpty()) {
+        oldTree = repo->getTree(oldTreeHash);
+    } else {
+        frozen.dirty = true;
     }
 
     // Check this directory
     for (OriDir::iterator it = dir->begin(); it != dir->end(); it++) {
         string objPath = path + "/" + it->first;
         OriFileInfo *info = getFileInfo(objPath);
+        bool open = !info->isDir() && info->fd != -1;
+
+        // Files open for writing may change again after this commit
+        if (open)
+            keepDirty = true;
 
         if (info->type == FILETYPE_DIRTY) {
-            dirty = true;
-        
             // Created or modified
-            TreeEntry e;
+            OriCommitEntry e;
 
-            if (info->isSymlink()) {
-                ObjectHash hash = repo->addBlob(ObjectInfo::Blob, info->link);
+            frozen.dirty = true;
 
-                // Copy hash back to info stgructure
-                info->hash = hash;
+            e.name = it->first;
+            e.info = info;
+            e.entry = TreeEntry(info->hash, info->largeHash);
+            e.path = info->path;
+            info->storeAttr(&e.entry.attrs);
+            info->retain();
+            info->frozen = true;
 
-                e = TreeEntry(hash, ObjectHash());
-            } else {
-                if (info->path != "") {
-                    pair<ObjectHash, ObjectHash> hashes;
-                    hashes = repo->addFile(info->path);
+            if (info->isDir()) {
+                e.entry.type = TreeEntry::Tree;
+            } else if (info->isSymlink()) {
+                e.store = true;
+                e.link = info->link;
+                e.entry.type = TreeEntry::Blob;
+            } else if (info->path != "") {
+                Tree::iterator oldEntry = oldTree.find(it->first);
 
-                    // Copy hashes back to info stgructure
-                    info->hash = hashes.first;
-                    info->largeHash = hashes.second;
-                }
-                e = TreeEntry(info->hash, info->largeHash);
-            }
+                e.store = true;
 
-            info->storeAttr(&e.attrs);
+                // Store modified files as deltas against the old version
+                if (oldEntry != oldTree.end() &&
+                    oldEntry->second.type == TreeEntry::Blob)
+                    e.base = oldEntry->second.hash;
 
-            if (info->isDir()) {
-                e.type = TreeEntry::Tree;
+                if (info->cow) {
+                    // Rechunk only around the extents written since open
+                    uint64_t size = info->statInfo.st_size;
+
+                    e.dirty = info->overlay;
+                    if (size > info->cowBase)
+                        e.dirty.add(info->cowBase, size - info->cowBase);
+                    e.cowBase = info->cowBase;
+                    e.cow = !info->largeHash.isEmpty();
+                    e.materialize = info->largeHash.isEmpty();
+                }
             } else {
-                if (e.largeHash.isEmpty())
-                    e.type = TreeEntry::Blob;
-                else
-                    e.type = TreeEntry::LargeBlob;
+                e.entry.type = info->largeHash.isEmpty() ? TreeEntry::Blob
+                                                         : TreeEntry::LargeBlob;
             }
 
-            ASSERT(e.hasBasicAttrs());
-
-            newTree.tree[it->first] = e;
+            ASSERT(e.entry.hasBasicAttrs());
 
-            info->type = FILETYPE_COMMITTED;
+            entryIx[e.name] = frozen.entries.size();
+            frozen.entries.push_back(e);
         } else {
             Tree::iterator oldEntry = oldTree.find(it->first);
 
@@ -910,14 +1686,12 @@ OriPriv::commitTreeHelper(const string &path)
             ASSERT(!oldEntry->second.hash.isEmpty());
 
             // Copy old entry
-            newTree.tree[it->first] = oldEntry->second;
+            frozen.tree.tree[it->first] = oldEntry->second;
         }
     }
     for (Tree::iterator it = oldTree.begin(); it != oldTree.end(); it++) {
-        string objPath = path + "/" + it->first;
-
         if (dir->find(it->first) == dir->end()) {
-            dirty = true;
+            frozen.dirty = true;
             // Deleted
         }
     }
@@ -927,55 +1701,358 @@ OriPriv::commitTreeHelper(const string &path)
         string objPath = path + "/" + it->first;
         OriFileInfo *info = getFileInfo(objPath);
 
-        if (info->isDir() && info->dirLoaded) {
-            ObjectHash subdir = commitTreeHelper(objPath);
+        if (info->isDir() && info->dirLoaded && getDir(objPath)->isDirty()) {
+            Tree::iterator oldEntry = oldTree.find(it->first);
+            ObjectHash oldSubdir = ObjectHash();
+            map<string, size_t>::iterator ix = entryIx.find(it->first);
 
-            if (!subdir.isEmpty()) {
-                dirty = true;
+            if (oldEntry != oldTree.end() &&
+                oldEntry->second.type == TreeEntry::Tree)
+                oldSubdir = oldEntry->second.hash;
 
-                // Save new hash
-                newTree.tree[it->first].hash = subdir;
-            } else if (newTree.tree[it->first].hash.isEmpty()) {
-                Tree::iterator oldEntry = oldTree.find(it->first);
-                ASSERT(oldEntry != oldTree.end());
-                newTree.tree[it->first].hash = oldEntry->second.hash;
+            ssize_t subdir = freezeTreeHelper(objPath, oldSubdir, job,
+                                              committed);
+
+            if (job->dirs[subdir].dirty)
+                frozen.dirty = true;
+
+            // Clean directories need an entry to receive their new hash
+            if (ix == entryIx.end()) {
+                OriCommitEntry e;
+
+                e.name = it->first;
+                e.info = info;
+                e.entry = frozen.tree.tree[it->first];
+                info->storeAttr(&e.entry.attrs);
+                info->retain();
+                info->frozen = true;
+
+                entryIx[e.name] = frozen.entries.size();
+                frozen.entries.push_back(e);
+                ix = entryIx.find(it->first);
             }
+            frozen.entries[ix->second].subdir = subdir;
+
+            // A committed subdirectory appends itself last
+            if (committed->empty() || committed->back() != getDir(objPath))
+                keepDirty = true;
         }
+    }
+
+    if (!keepDirty)
+        committed->push_back(dir);
+
+    job->dirs.push_back(frozen);
+
+    return job->dirs.size() - 1;
+}
+
+/*
+ * Freezes the dirty directories for a commit and marks them clean, so
+ * later changes start a new set.  Temporary files are shared with the
+ * commit until it finishes, the next write to a frozen file copies it
+ * first (see thawFile).  Caller holds nsLock for writing.
+ *
+ * @returns NULL if nothing changed
+ */
+OriCommitJob::sp
+OriPriv::freezeCommit(const Commit &cTemplate, bool background)
+{
+    OriCommitJob::sp job(new OriCommitJob());
+    vector<OriDir *> committed;
+
+    // Nothing changed since the last commit
+    if (!getDir("/")->isDirty())
+        return OriCommitJob::sp();
+
+    job->background = background;
+    job->commit.setMessage(cTemplate.getMessage());
+    job->commit.setSnapshot(cTemplate.getSnapshot());
+    freezeTreeHelper("", headCommit.getTree(), job.get(), &committed);
+
+    for (size_t i = 0; i < committed.size(); i++)
+        committed[i]->clrDirty();
 
-        ASSERT(!newTree.tree[it->first].hash.isEmpty());
+    if (!job->dirs.back().dirty) {
+        job->status = OriCommitJob::NoChanges;
+        finishCommit(job.get());
+        return OriCommitJob::sp();
     }
 
-    if (dirty) {
-        hash = repo->addTree(newTree);
+    return job;
+}
+
+/*
+ * Stores the contents of a frozen commit and commits its root tree.  Jobs
+ * in the background store the files and trees without nsLock, they only
+ * read the job and the frozen temporary files, and return with nsLock held
+ * for writing in key once the head is updated.  Otherwise key is NULL and
+ * the caller holds nsLock for writing throughout.
+ */
+void
+OriPriv::storeCommit(OriCommitJob *job, RWKey::sp *key)
+{
+    for (size_t i = 0; i < job->dirs.size(); i++) {
+        OriCommitDir &dir = job->dirs[i];
+
+        for (size_t j = 0; j < dir.entries.size(); j++) {
+            OriCommitEntry &e = dir.entries[j];
+
+            if (e.subdir != -1) {
+                ObjectHash subdir = job->dirs[e.subdir].hash;
+
+                if (!subdir.isEmpty())
+                    e.entry.hash = subdir;
+            } else if (e.store && e.path == "") {
+                // Symlinks store their target
+                e.entry.hash = repo->addBlob(ObjectInfo::Blob, e.link);
+                e.entry.largeHash = ObjectHash();
+            } else if (e.store) {
+                pair<ObjectHash, ObjectHash> hashes;
+
+                if (e.cow) {
+                    hashes = repo->addModifiedFile(e.path, e.entry.hash,
+                                                   e.dirty);
+                } else {
+                    if (e.materialize)
+                        materializeCow(e.path, e.entry.hash, e.cowBase,
+                                       e.dirty);
+
+                    hashes = repo->addFile(e.path, e.base);
+                }
+
+                e.entry.hash = hashes.first;
+                e.entry.largeHash = hashes.second;
+                if (e.entry.largeHash.isEmpty())
+                    e.entry.type = TreeEntry::Blob;
+                else
+                    e.entry.type = TreeEntry::LargeBlob;
+            }
+
+            ASSERT(!e.entry.hash.isEmpty());
+            dir.tree.tree[e.name] = e.entry;
+        }
+
+        if (dir.dirty)
+            dir.hash = repo->addTree(dir.tree, dir.oldTreeHash);
+    }
+
+    if (key != NULL)
+        *key = nsLock.writeLock();
+
+    ObjectHash root = job->dirs.back().hash;
+    if (!root.isEmpty() && root != headCommit.getTree()) {
+        Commit c;
+
+        c.setMessage(job->commit.getMessage());
+        c.setSnapshot(job->commit.getSnapshot());
+        job->hash = repo->commitFromTree(root, c);
+        job->status = OriCommitJob::Committed;
+
+        head = repo->getHead();
+        headCommit = repo->getCommit(head);
+
+        repo->sync();
+
+        journal("snapshot", job->hash.hex());
     } else {
-        ASSERT(hash.isEmpty());
+        job->status = OriCommitJob::NoChanges;
     }
+}
 
-    return hash;
+/*
+ * Copies the stored hashes back to the files of a commit.  A file only
+ * becomes committed if it still has the path, attributes and temporary
+ * file it was frozen with, otherwise whatever changed it also marked its
+ * directory dirty again.  Caller holds nsLock for writing.
+ */
+void
+OriPriv::finishCommit(OriCommitJob *job)
+{
+    for (size_t i = 0; i < job->dirs.size(); i++) {
+        OriCommitDir &dir = job->dirs[i];
+
+        for (size_t j = 0; j < dir.entries.size(); j++) {
+            OriCommitEntry &e = dir.entries[j];
+            OriFileInfo *info = e.info;
+            map<string, OriFileInfo *>::iterator it;
+            bool unchanged = false;
+            AttrMap attrs;
+
+            getInfoLock(info).lock();
+            if (info->path == e.path) {
+                it = paths.find(dir.path + "/" + e.name);
+                info->storeAttr(&attrs);
+                unchanged = (it != paths.end() && it->second == info &&
+                             attrs.attrs == e.entry.attrs.attrs);
+            }
+
+            if (unchanged) {
+                info->hash = e.entry.hash;
+                info->largeHash = e.entry.largeHash;
+                if (e.cow) {
+                    // The new version becomes the base for later reads
+                    info->overlay.clear();
+                    info->cowBase = info->statInfo.st_size;
+                } else if (e.materialize) {
+                    info->cow = false;
+                    info->overlay.clear();
+                } else if (!e.entry.largeHash.isEmpty()) {
+                    /*
+                     * Reads fall through to the stored LargeBlob from now
+                     * on, so thawing for a later commit only copies what is
+                     * written after this one.
+                     */
+                    info->cow = true;
+                    info->overlay.clear();
+                    info->cowBase = info->statInfo.st_size;
+                }
+                info->type = FILETYPE_COMMITTED;
+            }
+            info->frozen = false;
+            getInfoLock(info).unlock();
+
+            // Temporary files of files that were thawed belong to the job
+            if (e.path != "" && info->path != e.path)
+                OriFile_Delete(e.path);
+
+            info->release();
+        }
+    }
+}
+
+/*
+ * Drops a commit that failed to store.  Its directories are marked dirty
+ * again so the next commit picks up the changes.  Caller holds nsLock for
+ * writing.
+ */
+void
+OriPriv::abortCommit(OriCommitJob *job)
+{
+    job->status = OriCommitJob::Failed;
+
+    for (size_t i = 0; i < job->dirs.size(); i++) {
+        OriCommitDir &dir = job->dirs[i];
+
+        try {
+            setDirty(getDir(dir.path == "" ? "/" : dir.path));
+        } catch (SystemException &e) {
+            // Removed since the freeze
+        }
+
+        for (size_t j = 0; j < dir.entries.size(); j++) {
+            OriCommitEntry &e = dir.entries[j];
+            OriFileInfo *info = e.info;
+
+            getInfoLock(info).lock();
+            info->frozen = false;
+            getInfoLock(info).unlock();
+
+            if (e.path != "" && info->path != e.path)
+                OriFile_Delete(e.path);
+
+            info->release();
+        }
+    }
 }
 
 ObjectHash
 OriPriv::commit(const Commit &cTemplate, bool temporary)
 {
-    Commit c;
-    ObjectHash root = commitTreeHelper("");
-    ObjectHash commitHash = ObjectHash();
+    OriCommitJob::sp job = freezeCommit(cTemplate, false);
 
-    if (root.isEmpty() || root == headCommit.getTree())
-        return commitHash;
+    if (!job)
+        return ObjectHash();
 
-    c.setMessage(cTemplate.getMessage());
-    c.setSnapshot(cTemplate.getSnapshot());
-    commitHash = repo->commitFromTree(root, c);
+    try {
+        storeCommit(job.get(), NULL);
+    } catch (...) {
+        abortCommit(job.get());
+        throw;
+    }
+    finishCommit(job.get());
 
-    head = repo->getHead();
-    headCommit = repo->getCommit(head);
+    // Committed directories may be unloaded now
+    evictRetry = 0;
+    checkCache();
+
+    return job->hash;
+}
+
+/*
+ * Takes nsLock for writing once no background commit is pending.  Commits
+ * and operations that move the head use it so they apply on top of any
+ * earlier snapshot.
+ */
+RWKey::sp
+OriPriv::commitLock()
+{
+    while (true) {
+        RWKey::sp key = nsLock.writeLock();
+
+        if (!commitPending)
+            return key;
+
+        key.reset();
+        committer->waitIdle();
+    }
+}
+
+/*
+ * Freezes the namespace for a commit that the committer thread stores in
+ * the background.  Caller holds the lock returned by commitLock.
+ *
+ * @returns a ticket for waitCommit or 0 if nothing changed
+ */
+uint64_t
+OriPriv::backgroundCommit(const Commit &cTemplate)
+{
+    ASSERT(!commitPending);
 
-    repo->sync();
+    OriCommitJob::sp job = freezeCommit(cTemplate, true);
+    if (!job)
+        return 0;
 
-    journal("snapshot", commitHash.hex());
+    commitPending = true;
 
-    return commitHash;
+    return committer->enqueue(job);
+}
+
+/*
+ * Waits for a background commit, returning NULL if the ticket is unknown.
+ */
+OriCommitJob::sp
+OriPriv::waitCommit(uint64_t ticket)
+{
+    OriCommitJob::sp job;
+
+    if (!committer->waitFor(ticket, &job))
+        return OriCommitJob::sp();
+
+    return job;
+}
+
+/*
+ * Stores a background commit, called from the committer thread.
+ */
+void
+OriPriv::runCommit(OriCommitJob *job)
+{
+    RWKey::sp key;
+
+    try {
+        storeCommit(job, &key);
+        finishCommit(job);
+    } catch (exception &e) {
+        if (!key)
+            key = nsLock.writeLock();
+        job->error = e.what();
+        abortCommit(job);
+    }
+
+    commitPending = false;
+    evictRetry = 0;
+    checkCache();
 }
 
 void
@@ -1134,6 +2211,8 @@ OriPriv::checkout(ObjectHash hash, bool force)
             delete dirs[pit->second->id];
             dirs.erase(pit->second->id);
         }
+        cacheBytes -= OriPrivEntryBytes(pit->first);
+        ids.erase(pit->second->id);
         pit->second->release();
         paths.erase(pit);
     }
@@ -1186,13 +2265,14 @@ OriPriv::checkout(ObjectHash hash, bool force)
                 }
 
                 // Create the new file
-                paths[it->first] = info;
+                addPath(it->first, info);
                 parentDir->add(OriFile_Basename(filePath), info->id);
                 if (info->isDir()) {
                     OriFileInfo *parentInfo = getFileInfo(parentPath);
                     parentInfo->statInfo.st_nlink++;
 
-                    dirs[info->id] = new OriDir();
+                    dirs[info->id] = new OriDir(parentDir);
+                    dirs[info->id]->setDirty();
                 }
                 break;
             }
@@ -1221,10 +2301,12 @@ OriPriv::checkout(ObjectHash hash, bool force)
                     // Conflict
                     rename(filePath, filePath + ":conflict");
                     parentDir->add(OriFile_Basename(filePath), myInfo->id);
+                    reparentDir(myInfo, parentDir);
                 } else {
                     // No conflict
-                    paths[it->first] = myInfo;
+                    addPath(it->first, myInfo);
                     parentDir->add(OriFile_Basename(filePath), myInfo->id);
+                    reparentDir(myInfo, parentDir);
                     newInfo->release();
                 }
                 break;
@@ -1384,7 +2466,7 @@ OriPriv::merge(ObjectHash hash)
 
             OriDir *parentDir = getDir(OriFile_Dirname(e.filepath));
             parentDir->add(OriFile_Basename(e.filepath), info->id);
-            paths[e.filepath] = info;
+            addPath(e.filepath, info);
         } else if (e.type == TreeDiffEntry::NewDir) {
             DLOG("N       %s", e.filepath.c_str());
             OriFileInfo *info = addDir(e.filepath);
@@ -1402,7 +2484,8 @@ OriPriv::merge(ObjectHash hash)
         } else if (e.type == TreeDiffEntry::Modified) {
             DLOG("U       %s", e.filepath.c_str());
             // Calling getDir ensures that the fileinfo is loaded
-            getDir(OriFile_Dirname(e.filepath));
+            string parentPath = OriFile_Dirname(e.filepath);
+            OriDir *parentDir = getDir(parentPath == "" ? "/" : parentPath);
             OriFileInfo *info = getFileInfo(e.filepath);
 
             if (info->path != "") {
@@ -1413,12 +2496,15 @@ OriPriv::merge(ObjectHash hash)
                             info->path.c_str(), Util_SystemError(status).c_str());
                 }
                 info->path = "";
+                info->cow = false;
+                info->overlay.clear();
             }
 
             info->hash = e.hashes.first;
             info->largeHash = e.hashes.second;
             info->loadAttr(e.newAttrs);
             info->type = FILETYPE_DIRTY;
+            parentDir->setDirty();
         } else if (e.type == TreeDiffEntry::MergeConflict) {
             DLOG("X       %s (CONFLICT)", e.filepath.c_str());
             bool mergeSuccess = false;
@@ -1452,7 +2538,7 @@ OriPriv::merge(ObjectHash hash)
 
                 parentDir->add(OriFile_Basename(e.filepath) + ":conflict",
                                conflictInfo->id);
-                paths[e.filepath + ":conflict"] = conflictInfo;
+                addPath(e.filepath + ":conflict", conflictInfo);
 
                 /*
                  * Create '*:base' file if it exists.  It may not exist because 
@@ -1478,7 +2564,7 @@ OriPriv::merge(ObjectHash hash)
 
                     parentDir->add(OriFile_Basename(e.filepath) + ":base",
                                    baseInfo->id);
-                    paths[e.filepath + ":base"] = baseInfo;
+                    addPath(e.filepath + ":base", baseInfo);
                 }
             }
 
@@ -1554,8 +2640,9 @@ OriPriv::journal(const string &event, const string &arg)
     if (len < 0 || len != (int)buf.size())
         throw SystemException();
 
+    // Concurrent events share one flush
     if (journalMode == OriJournalMode::SyncJournal)
-        fsync(journalFd);
+        journalSyncer.sync();
 
     return;
 }
@@ -1626,6 +2713,7 @@ OriPriv::fsck()
     RWKey::sp lock;
     map<string, OriFileInfo *>::iterator it;
     OriDir *dir;
+    uint64_t bytes = 0;
 
     lock = nsLock.writeLock();
 
@@ -1638,6 +2726,12 @@ OriPriv::fsck()
         string parentPath = OriFile_Dirname(it->first);
         OriDir *dir = NULL;
 
+        if (ids.find(it->second->id) == ids.end() ||
+            ids[it->second->id] != it) {
+            FUSE_LOG("fsck: %s missing from the id index!", it->first.c_str());
+        }
+        bytes += OriPrivEntryBytes(it->first);
+
         if (it->first == "/")
             continue;
 
@@ -1654,6 +2748,17 @@ OriPriv::fsck()
         if (dir) {
             OriDir::iterator dirIt = dir->find(basename);
 
+            if (it->second->type == FILETYPE_DIRTY && !it->second->frozen &&
+                !dir->isDirty()) {
+                FUSE_LOG("fsck: %s is dirty in a clean directory!",
+                         it->first.c_str());
+            }
+            if (dir->isDirty() && dir->getParent() != NULL &&
+                !dir->getParent()->isDirty()) {
+                FUSE_LOG("fsck: %s is dirty below a clean directory!",
+                         parentPath.c_str());
+            }
+
             if (dirIt == dir->end()) {
                 FUSE_LOG("fsck: %s not present in directory!",
                          it->first.c_str());
@@ -1662,6 +2767,11 @@ OriPriv::fsck()
             }
         }
     }
+
+    if (bytes != cacheBytes) {
+        FUSE_LOG("fsck: cache size is %" PRIu64 " but should be %" PRIu64,
+                 cacheBytes, bytes);
+    }
 }
 
 LocalRepo *
@@ -1673,6 +2783,10 @@ OriPriv::getRepo()
 OriPriv *
 GetOriPriv()
 {
+    // The low-level interface has no per-request fuse_context
+    if (config.lowlevel)
+        return priv;
+
     return (OriPriv*)fuse_get_context()->private_data;
 }
 
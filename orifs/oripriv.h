@@ -18,6 +18,15 @@
 #define __ORIPRIV_H__
 
 #include <oriutil/orifile.h>
+#include <oriutil/groupcommit.h>
+#include <oriutil/mutex.h>
+#include <oriutil/extentmap.h>
+
+#include "orireadctx.h"
+#include "oricommit.h"
+#include "orievict.h"
+
+class OriSnapshotView;
 
 typedef enum OriFileType
 {
@@ -29,6 +38,18 @@ typedef enum OriFileType
 #define ORIPRIVID_INVALID 0
 typedef uint64_t OriPrivId;
 
+// Number of striped directory load and file info locks
+#define ORIPRIV_LOCKSTRIPES 64
+
+// Default bound on cached file metadata in megabytes, 0 for no bound
+#define ORIFS_METADATA_CACHE 256
+// Default time a sync waits for concurrent syncs to join it (microseconds)
+#define ORIFS_SYNC_LATENCY 0
+// Estimated bytes a cached file uses besides its path
+#define ORIFS_CACHE_ENTRYBYTES 384
+// Directories an eviction pass looks at before releasing nsLock
+#define ORIFS_EVICT_BATCH 256
+
 class OriFileInfo
 {
 public:
@@ -41,6 +62,9 @@ public:
         refCount = 1;
         openCount = 0;
         dirLoaded = false;
+        cow = false;
+        cowBase = 0;
+        frozen = false;
     }
     ~OriFileInfo() {
         ASSERT(refCount == 0);
@@ -92,19 +116,44 @@ public:
     int refCount;
     int openCount;
     bool dirLoaded;
+    /*
+     * Copy-on-write LargeBlobs: the temporary file starts out sparse and only
+     * the ranges in overlay hold data.  Other ranges below cowBase are read
+     * from the committed LargeBlob (hash), ranges above it are holes.
+     */
+    bool cow;
+    uint64_t cowBase;
+    ExtentMap overlay;
+    /*
+     * Part of a commit that is still being stored.  The commit reads the
+     * temporary file, so it is copied before the file is written again.
+     */
+    bool frozen;
 };
 
+/*
+ * A loaded directory.  A directory is dirty when it or anything below it
+ * changed since the last commit, and the parent links keep every ancestor of
+ * a dirty directory dirty so that commits only walk the changed spine.
+ * Clean directories may be unloaded again, see OriPriv::evict.
+ */
 class OriDir
 {
 public:
     typedef std::map<std::string, OriPrivId>::iterator iterator;
-    OriDir() { }
+    explicit OriDir(OriDir *parent)
+        : parent(parent), dirty(false), referenced(true) { }
     ~OriDir() { }
     void add(const std::string &name, OriPrivId id)
     {
         entries[name] = id;
         setDirty();
     }
+    /// Adds an entry read from the committed tree
+    void load(const std::string &name, OriPrivId id)
+    {
+        entries[name] = id;
+    }
     void remove(const std::string &name)
     {
         ASSERT(entries.find(name) != entries.end());
@@ -112,14 +161,38 @@ public:
         setDirty();
     }
     bool isEmpty() { return entries.size() == 0; }
-    void setDirty() { dirty = true; }
-    void clrDirty() { dirty = true; }
+    void setDirty()
+    {
+        // Ancestors of a dirty directory are already dirty
+        for (OriDir *d = this; d != NULL && !d->dirty; d = d->parent)
+            d->dirty = true;
+    }
+    void clrDirty() { dirty = false; }
     bool isDirty() { return dirty; }
+    OriDir *getParent() { return parent; }
+    /// Moves the directory, if it is dirty its new ancestors become dirty
+    void setParent(OriDir *newParent)
+    {
+        parent = newParent;
+        if (dirty && parent != NULL)
+            parent->setDirty();
+    }
+    /// Marks the directory as used for the eviction clock
+    void touch() { referenced = true; }
+    /// Returns whether the directory was used since the last call
+    bool testAndClear()
+    {
+        bool r = referenced;
+        referenced = false;
+        return r;
+    }
     iterator begin() { return entries.begin(); }
     iterator end() { return entries.end(); }
     iterator find(const std::string &name) { return entries.find(name); }
 private:
+    OriDir *parent;
     bool dirty;
+    bool referenced;
     std::map<std::string, OriPrivId> entries;
 };
 
@@ -155,6 +228,19 @@ public:
 };
 
 
+/*
+ * Metadata cache counters reported through the control file.
+ */
+struct OriCacheStats {
+    uint64_t limit; // bytes, 0 for no bound
+    uint64_t bytes; // estimated
+    uint64_t entries;
+    uint64_t dirs;
+    uint64_t loads;
+    uint64_t evictions; // directories unloaded
+    uint64_t evictedEntries;
+};
+
 class OriPriv
 {
 public:
@@ -178,26 +264,69 @@ public:
     std::pair<OriFileInfo*, uint64_t> addFile(const std::string &path);
     std::pair<OriFileInfo*, uint64_t> openFile(const std::string &path,
                                                bool writing, bool trunc);
+    std::pair<OriFileInfo*, uint64_t> openFile(OriFileInfo *info,
+                                               bool writing, bool trunc);
     size_t readFile(OriFileInfo *info, char *buf, size_t size, off_t offset);
+    ssize_t readHandle(uint64_t fh, OriFileInfo *info, char *buf, size_t size,
+                       off_t offset);
+    ssize_t readCow(uint64_t fh, OriFileInfo *info, char *buf, size_t size,
+                    off_t offset);
+    void prefetch(const std::vector<ObjectHash> &hashes);
     void unlink(const std::string &path);
     void rename(const std::string &fromPath, const std::string &toPath);
     OriFileInfo* addDir(const std::string &path);
     void rmDir(const std::string &path);
     OriDir* getDir(const std::string &path);
+    void setDirty(OriDir *dir);
+    Mutex &getInfoLock(const OriFileInfo *info);
+    // Inode Operations
+    OriFileInfo* getInfoById(OriPrivId id);
+    std::string getPathById(OriPrivId id);
+    OriDir* getDirById(OriPrivId id);
+    OriFileInfo* lookup(OriPrivId parent, const std::string &name);
+    // Metadata Cache
+    bool evict();
+    OriCacheStats getCacheStats();
     // Snapshot Operations
     std::map<std::string, ObjectHash> listSnapshots();
     Commit lookupSnapshot(const std::string &name);
     Tree getTree(const Commit &c, const std::string &path);
+    OriSnapshotView *getSnapshotView();
     ObjectHash getTip();
 private:
-    ObjectHash commitTreeHelper(const std::string &path);
+    OriDir* loadDir(const std::string &path);
+    void addPath(const std::string &path, OriFileInfo *info);
+    void removePath(const std::string &path);
+    bool unloadDir(OriPrivId id, OriDir *dir);
+    void renameDir(const std::string &fromPath, const std::string &toPath);
+    void reparentDir(OriFileInfo *info, OriDir *parentDir);
+    void checkCache();
+    std::string copyBlob(const ObjectHash &hash);
+    std::pair<std::string, int> copyTemp(const std::string &path,
+                                         uint64_t size,
+                                         const ExtentMap &extents);
+    void materializeCow(const std::string &path, const ObjectHash &hash,
+                        uint64_t cowBase, const ExtentMap &overlay);
+    ssize_t freezeTreeHelper(const std::string &path,
+                             const ObjectHash &oldTreeHash,
+                             OriCommitJob *job,
+                             std::vector<OriDir *> *committed);
+    OriCommitJob::sp freezeCommit(const Commit &cTemplate, bool background);
+    void storeCommit(OriCommitJob *job, RWKey::sp *key);
+    void finishCommit(OriCommitJob *job);
+    void abortCommit(OriCommitJob *job);
     void getDiffHelper(const std::string &path,
                     std::map<std::string, OriFileState::StateType> *diff);
     void getCheckoutHelper(const std::string &path,
                     std::map<std::string, OriFileInfo *> *diffInfo,
                     std::map<std::string, OriFileState::StateType> *diffState);
 public:
+    bool thawFile(OriFileInfo *info);
     ObjectHash commit(const Commit &cTemplate, bool temporary = false);
+    RWKey::sp commitLock();
+    uint64_t backgroundCommit(const Commit &cTemplate);
+    OriCommitJob::sp waitCommit(uint64_t ticket);
+    void runCommit(OriCommitJob *job);
     std::map<std::string, OriFileState::StateType> getDiff();
     std::string checkout(ObjectHash hash, bool force);
     std::string merge(ObjectHash hash);
@@ -206,7 +335,28 @@ public:
     // Debugging
     void fsck();
 
-    // Locks
+    /*
+     * Locks
+     *
+     * nsLock is held for writing by operations that change the shape of the
+     * namespace (create, unlink, rename, mkdir, rmdir, commit, checkout) and
+     * for reading by lookups and per-file operations.  Under a read lock the
+     * paths, ids, dirs, handles and readCtxs maps are guarded by mapLock,
+     * which is only held for short map operations.  Directory loads are serialized per path by
+     * dirLoadLocks and OriFileInfo fields changed under a read lock (open
+     * counts, file descriptors, attributes) are guarded by getInfoLock.
+     *
+     * The evictor unloads clean directories under nsLock for writing, so
+     * OriDir and OriFileInfo pointers stay valid while nsLock is held.
+     *
+     * Background commits store file contents and trees without nsLock, the
+     * frozen temporary files are left alone until the commit finishes, and
+     * only take it for writing to commit the root tree and move the head.
+     * commitLock waits for a pending one to finish before anything else
+     * commits or moves the head.
+     *
+     * Lock order: ioLock, nsLock, dirLoadLocks or getInfoLock, mapLock.
+     */
     RWLock ioLock; // File I/O lock to allow atomic commits
     RWLock nsLock; // Namespace lock
 
@@ -216,12 +366,41 @@ private:
     uint64_t nextFH;
     std::map<OriPrivId, OriDir*> dirs;
     std::map<std::string, OriFileInfo*> paths;
+    // Index of paths by id for the low-level FUSE interface
+    std::unordered_map<OriPrivId,
+                       std::map<std::string, OriFileInfo*>::iterator> ids;
     std::unordered_map<uint64_t, OriFileInfo*> handles;
+    std::unordered_map<uint64_t, OriReadCtx::sp> readCtxs;
+    Mutex mapLock;
+    Mutex dirLoadLocks[ORIPRIV_LOCKSTRIPES];
+    Mutex infoLocks[ORIPRIV_LOCKSTRIPES];
 
     // Journal
     OriJournalMode::JournalMode journalMode;
     std::string journalFile;
     int journalFd;
+    GroupCommit journalSyncer;
+
+    // Readahead
+    OriPrefetcher *prefetcher;
+
+    // Metadata cache, the counters are guarded by mapLock
+    OriEvictor *evictor;
+    uint64_t cacheLimit;
+    uint64_t cacheBytes;
+    uint64_t dirLoads;
+    uint64_t dirEvictions;
+    uint64_t entryEvictions;
+    OriPrivId evictHand;
+    size_t evictIdle; // directories swept since one was unloaded
+    uint64_t evictRetry; // size to try again at after a pass got stuck
+
+    // Background commits
+    OriCommitter *committer;
+    bool commitPending; // guarded by nsLock
+
+    // Snapshot namespace
+    OriSnapshotView *snapshotView;
 
     // Repository State
     LocalRepo *repo;
@@ -230,6 +409,7 @@ private:
     std::string tmpDir;
 
     friend class OriCommand;
+    friend void OriPriv_JournalFlushCb(void *arg);
 };
 
 OriPriv *GetOriPriv();
@@ -0,0 +1,267 @@
+/*
+ * Copyright (c) 2012-2013 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/param.h>
+
+#include <deque>
+#include <string>
+#include <vector>
+#include <map>
+#include <memory>
+#include <exception>
+#include <unordered_map>
+
+#include <oriutil/debug.h>
+#include <oriutil/monitor.h>
+#include <oriutil/rwlock.h>
+#include <ori/localrepo.h>
+#include <ori/largeblob.h>
+
+#include "oripriv.h"
+#include "orireadctx.h"
+
+using namespace std;
+
+/*
+ * OriPrefetcher
+ */
+
+OriPrefetcher::OriPrefetcher(OriPriv *priv)
+    : Thread("prefetcher"), priv(priv), stopped(false)
+{
+    pthread_mutex_init(&lock, NULL);
+    pthread_cond_init(&notEmpty, NULL);
+}
+
+OriPrefetcher::~OriPrefetcher()
+{
+    pthread_cond_destroy(&notEmpty);
+    pthread_mutex_destroy(&lock);
+}
+
+void
+OriPrefetcher::enqueue(const vector<ObjectHash> &hashes)
+{
+    pthread_mutex_lock(&lock);
+    for (size_t i = 0; i < hashes.size(); i++) {
+        if (queue.size() >= ORIFS_PREFETCH_MAXQUEUE)
+            break;
+        queue.push_back(hashes[i]);
+    }
+    pthread_cond_signal(&notEmpty);
+    pthread_mutex_unlock(&lock);
+}
+
+void
+OriPrefetcher::stop()
+{
+    pthread_mutex_lock(&lock);
+    stopped = true;
+    queue.clear();
+    pthread_cond_broadcast(&notEmpty);
+    pthread_mutex_unlock(&lock);
+
+    wait();
+}
+
+void
+OriPrefetcher::run()
+{
+    while (true) {
+        vector<ObjectHash> hashes;
+
+        pthread_mutex_lock(&lock);
+        while (queue.empty() && !stopped) {
+            pthread_cond_wait(&notEmpty, &lock);
+        }
+        if (stopped) {
+            pthread_mutex_unlock(&lock);
+            return;
+        }
+        while (!queue.empty() && hashes.size() < ORIFS_PREFETCH_BATCH) {
+            hashes.push_back(queue.front());
+            queue.pop_front();
+        }
+        pthread_mutex_unlock(&lock);
+
+        /*
+         * Reading the objects places them in the repository's object cache.
+         * Objects of an instaclone are fetched with a single request into
+         * memory without holding nsLock.  Storing them only takes the
+         * repository's transaction lock, so lookups and writes through the
+         * file system carry on while they are received.
+         */
+        LocalRepo *repo = priv->getRepo();
+        try {
+            ObjectHashVec missing;
+            {
+                RWKey::sp key = priv->nsLock.readLock();
+                missing = repo->prefetchObjects(hashes);
+            }
+
+            bytestream::ap bs(repo->fetchRemoteObjects(missing));
+            if (bs.get())
+                repo->receive(bs.get());
+        } catch (exception &e) {
+            DLOG("Prefetch of %lu objects failed: %s", hashes.size(),
+                 e.what());
+        }
+    }
+}
+
+/*
+ * OriReadCtx
+ */
+
+OriReadCtx::OriReadCtx(OriPriv *priv, const ObjectHash &hash)
+    : priv(priv), hash(hash), loaded(false), type(ObjectInfo::Null),
+      lb(NULL), haveChunk(false), chunkOff(0), nextOff(0), seqReads(0),
+      aheadOff(0)
+{
+}
+
+OriReadCtx::~OriReadCtx()
+{
+    delete lb;
+}
+
+void
+OriReadCtx::load()
+{
+    LocalRepo *repo = priv->getRepo();
+
+    type = repo->getObjectType(hash);
+    if (type == ObjectInfo::Blob) {
+        payload = repo->getPayload(hash);
+    } else if (type == ObjectInfo::LargeBlob) {
+        lb = new LargeBlob(repo);
+        lb->fromBlob(repo->getPayload(hash));
+    }
+
+    loaded = true;
+}
+
+ssize_t
+OriReadCtx::read(char *buf, size_t size, off_t offset)
+{
+    Monitor m(lock);
+
+    if (!loaded)
+        load();
+
+    if (type == ObjectInfo::Blob) {
+        size_t left = payload.size() - offset;
+        if (left > payload.size())
+            left = 0;
+        size_t real_read = MIN(size, left);
+
+        memcpy(buf, payload.data() + offset, real_read);
+
+        return real_read;
+    } else if (type != ObjectInfo::LargeBlob) {
+        return -EIO;
+    }
+
+    ssize_t total = 0;
+    while ((size_t)total < size) {
+        ssize_t res = readChunk(buf + total, size - total, offset + total);
+        if (res == 0)
+            break;
+        else if (res < 0)
+            return res;
+        total += res;
+    }
+
+    if (offset == nextOff) {
+        seqReads++;
+    } else {
+        seqReads = 0;
+        aheadOff = 0;
+    }
+    nextOff = offset + total;
+
+    if (seqReads >= ORIFS_READAHEAD_MINSEQ && haveChunk)
+        readahead(chunkOff);
+
+    return total;
+}
+
+/*
+ * Reads from the chunk containing offset, decoding it unless it is the
+ * chunk used by the previous read.  May read less than size bytes.
+ */
+ssize_t
+OriReadCtx::readChunk(char *buf, size_t size, off_t offset)
+{
+    map<uint64_t, LBlobEntry>::iterator it;
+
+    it = lb->parts.upper_bound(offset);
+    if (it == lb->parts.begin())
+        return 0;
+    it--;
+
+    uint64_t partOff = (*it).first;
+    uint64_t partLen = (*it).second.length;
+    if ((uint64_t)offset >= partOff + partLen)
+        return 0;
+
+    if (!haveChunk || chunkOff != partOff) {
+        chunk = priv->getRepo()->getPayload((*it).second.hash);
+        if (chunk.size() != partLen) {
+            haveChunk = false;
+            return -EIO;
+        }
+        chunkOff = partOff;
+        haveChunk = true;
+    }
+
+    size_t to_read = MIN(partOff + partLen - offset, size);
+    memcpy(buf, chunk.data() + (offset - partOff), to_read);
+
+    return to_read;
+}
+
+/*
+ * Keeps the ORIFS_READAHEAD_CHUNKS chunks following the current one queued
+ * for prefetching.  aheadOff remembers the last chunk queued so each chunk
+ * is requested once per sequential run.
+ */
+void
+OriReadCtx::readahead(uint64_t off)
+{
+    map<uint64_t, LBlobEntry>::iterator it;
+    vector<ObjectHash> hashes;
+
+    it = lb->parts.upper_bound(off);
+    for (int i = 0; i < ORIFS_READAHEAD_CHUNKS && it != lb->parts.end();
+         i++, it++) {
+        if ((*it).first <= aheadOff)
+            continue;
+        hashes.push_back((*it).second.hash);
+        aheadOff = (*it).first;
+    }
+
+    if (!hashes.empty())
+        priv->prefetch(hashes);
+}
+
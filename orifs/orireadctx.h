@@ -0,0 +1,105 @@
+/*
+ * Copyright (c) 2012-2013 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#ifndef __ORIREADCTX_H__
+#define __ORIREADCTX_H__
+
+#include <pthread.h>
+
+#include <deque>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <oriutil/mutex.h>
+#include <oriutil/thread.h>
+#include <oriutil/objecthash.h>
+#include <ori/largeblob.h>
+
+class OriPriv;
+
+// Chunks read ahead once a handle is read sequentially
+#define ORIFS_READAHEAD_CHUNKS 32
+// Sequential reads required before readahead starts
+#define ORIFS_READAHEAD_MINSEQ 2
+// Chunks waiting to be prefetched (further requests are dropped)
+#define ORIFS_PREFETCH_MAXQUEUE 1024
+// Chunks prefetched at a time, an instaclone fetches them in one request
+#define ORIFS_PREFETCH_BATCH 32
+// Copy buffer used when filling in a copy-on-write file (1 MB)
+#define ORIFS_COW_BUFSZ (1024*1024)
+
+/*
+ * Reads LargeBlob chunks into the repository's object cache in the
+ * background.  Readahead is only a hint so requests are dropped rather than
+ * blocking the reader when the queue is full.
+ */
+class OriPrefetcher : public Thread
+{
+public:
+    explicit OriPrefetcher(OriPriv *priv);
+    ~OriPrefetcher();
+    void enqueue(const std::vector<ObjectHash> &hashes);
+    /// Discards queued requests and waits for the thread to exit
+    void stop();
+    void run();
+private:
+    OriPriv *priv;
+    pthread_mutex_t lock;
+    pthread_cond_t notEmpty;
+    std::deque<ObjectHash> queue;
+    bool stopped;
+};
+
+/*
+ * Read state for an open file handle of a committed file.  A Blob payload is
+ * decoded once per handle, and for a LargeBlob the manifest is parsed once
+ * and the chunk under the read offset is kept decoded.  Sequential readers
+ * get the following chunks prefetched.
+ */
+class OriReadCtx
+{
+public:
+    typedef std::shared_ptr<OriReadCtx> sp;
+    OriReadCtx(OriPriv *priv, const ObjectHash &hash);
+    ~OriReadCtx();
+    const ObjectHash &getHash() const { return hash; }
+    /// Caller holds nsLock for reading
+    ssize_t read(char *buf, size_t size, off_t offset);
+private:
+    void load();
+    ssize_t readChunk(char *buf, size_t size, off_t offset);
+    void readahead(uint64_t chunkOff);
+    OriPriv *priv;
+    ObjectHash hash;
+    Mutex lock;
+    bool loaded;
+    ObjectType type;
+    std::string payload;
+    LargeBlob *lb;
+    // Decoded chunk under the last read
+    bool haveChunk;
+    uint64_t chunkOff;
+    std::string chunk;
+    // Sequential access detection
+    off_t nextOff;
+    int seqReads;
+    uint64_t aheadOff;
+};
+
+#endif /* __ORIREADCTX_H__ */
+
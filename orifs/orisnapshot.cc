@@ -0,0 +1,213 @@
+/*
+ * Copyright (c) 2012-2013 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pwd.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <string>
+#include <memory>
+#include <unordered_map>
+
+#include <oriutil/debug.h>
+#include <oriutil/monitor.h>
+#include <oriutil/systemexception.h>
+#include <ori/commit.h>
+#include <ori/localrepo.h>
+
+#include "oripriv.h"
+#include "orisnapshot.h"
+
+using namespace std;
+
+OriSnapshotView::OriSnapshotView(OriPriv *priv)
+    : priv(priv), nextFH(1)
+{
+}
+
+OriSnapshotView::~OriSnapshotView()
+{
+}
+
+/*
+ * Resolves a path relative to the snapshot directory, starting with the
+ * snapshot name.  Misses resolve the parent first, so a walk through a
+ * snapshot parses each tree once.
+ */
+OriSnapshotNode::sp
+OriSnapshotView::lookup(const string &path)
+{
+    OriSnapshotNode::sp node;
+    size_t pos;
+
+    if (nodes.get(path, node))
+        return node;
+
+    pos = path.rfind('/');
+    if (pos == string::npos) {
+        node = loadSnapshot(path);
+    } else {
+        OriSnapshotNode::sp parent = lookup(path.substr(0, pos));
+        map<string, TreeEntry>::const_iterator it;
+
+        if (!S_ISDIR(parent->st.st_mode))
+            throw SystemException(ENOTDIR);
+
+        it = parent->tree.tree.find(path.substr(pos + 1));
+        if (it == parent->tree.tree.end())
+            throw SystemException(ENOENT);
+
+        node = loadEntry(it->second);
+    }
+
+    nodes.put(path, node);
+
+    return node;
+}
+
+uint64_t
+OriSnapshotView::open(const string &path)
+{
+    OriSnapshotNode::sp node = lookup(path);
+    uint64_t fh;
+
+    if (S_ISDIR(node->st.st_mode))
+        throw SystemException(EISDIR);
+
+    OriReadCtx::sp ctx(new OriReadCtx(priv, node->hash));
+    Monitor m(lock);
+
+    fh = nextFH++;
+    handles[fh] = ctx;
+
+    return fh;
+}
+
+ssize_t
+OriSnapshotView::read(uint64_t fh, char *buf, size_t size, off_t offset)
+{
+    OriReadCtx::sp ctx;
+
+    lock.lock();
+    unordered_map<uint64_t, OriReadCtx::sp>::iterator it = handles.find(fh);
+    if (it == handles.end()) {
+        lock.unlock();
+        return -EBADF;
+    }
+    ctx = (*it).second;
+    lock.unlock();
+
+    return ctx->read(buf, size, offset);
+}
+
+void
+OriSnapshotView::close(uint64_t fh)
+{
+    Monitor m(lock);
+
+    handles.erase(fh);
+}
+
+void
+OriSnapshotView::invalidate()
+{
+    nodes.clear();
+}
+
+OriSnapshotNode::sp
+OriSnapshotView::loadSnapshot(const string &name)
+{
+    LocalRepo *repo = priv->getRepo();
+    ObjectHash hash = repo->lookupSnapshot(name);
+    OriSnapshotNode::sp node(new OriSnapshotNode());
+
+    if (hash.isEmpty())
+        throw SystemException(ENOENT);
+
+    Commit c = repo->getCommit(hash);
+
+    memset(&node->st, 0, sizeof(node->st));
+    node->st.st_uid = geteuid();
+    node->st.st_gid = getegid();
+    node->st.st_mode = 0755 | S_IFDIR;
+    node->st.st_nlink = 2;
+    node->st.st_size = 512;
+    node->st.st_blksize = 4096;
+    node->st.st_blocks = 1;
+    node->st.st_ctime = c.getTime();
+    node->st.st_mtime = c.getTime();
+    node->hash = c.getTree();
+    node->tree = repo->getTree(node->hash);
+
+    return node;
+}
+
+OriSnapshotNode::sp
+OriSnapshotView::loadEntry(const TreeEntry &entry)
+{
+    const AttrMap &attrs = entry.attrs;
+    OriSnapshotNode::sp node(new OriSnapshotNode());
+
+    memset(&node->st, 0, sizeof(node->st));
+    if (entry.type == TreeEntry::Tree) {
+        node->st.st_mode = S_IFDIR;
+        node->st.st_nlink = 2; // XXX: Correct this!
+        node->tree = priv->getRepo()->getTree(entry.hash);
+    } else {
+        node->st.st_mode = S_IFREG;
+        node->st.st_nlink = 1;
+    }
+    node->st.st_mode |= attrs.getAs<mode_t>(ATTR_PERMS);
+    getOwner(attrs.getAsStr(ATTR_USERNAME), &node->st.st_uid,
+             &node->st.st_gid);
+    node->st.st_size = attrs.getAs<size_t>(ATTR_FILESIZE);
+    node->st.st_blocks = (node->st.st_size + 511) / 512;
+    node->st.st_mtime = attrs.getAs<time_t>(ATTR_MTIME);
+    node->st.st_ctime = attrs.getAs<time_t>(ATTR_CTIME);
+    node->hash = entry.hash;
+
+    return node;
+}
+
+/*
+ * Maps a user name to its uid and gid.  Unknown users belong to whoever
+ * mounted the file system.
+ */
+void
+OriSnapshotView::getOwner(const string &user, uid_t *uid, gid_t *gid)
+{
+    unordered_map<string, pair<uid_t, gid_t> >::iterator it;
+    Monitor m(lock);
+
+    it = owners.find(user);
+    if (it == owners.end()) {
+        struct passwd *pw = getpwnam(user.c_str());
+        pair<uid_t, gid_t> owner(getuid(), getgid());
+
+        if (pw != NULL)
+            owner = make_pair(pw->pw_uid, pw->pw_gid);
+        it = owners.insert(make_pair(user, owner)).first;
+    }
+
+    *uid = it->second.first;
+    *gid = it->second.second;
+}
@@ -0,0 +1,84 @@
+/*
+ * Copyright (c) 2012-2013 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#ifndef __ORISNAPSHOT_H__
+#define __ORISNAPSHOT_H__
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <memory>
+#include <string>
+#include <unordered_map>
+
+#include <oriutil/mutex.h>
+#include <oriutil/lrucache.h>
+#include <oriutil/objecthash.h>
+#include <ori/tree.h>
+
+#include "orireadctx.h"
+
+class OriPriv;
+
+// Resolved snapshot files and directories kept in memory
+#define ORIFS_SNAPSHOT_CACHE_NODES 4096
+
+/*
+ * A resolved file or directory in a snapshot.  Nodes never change once they
+ * are built, and directories carry their parsed tree so that children are
+ * resolved without walking down from the snapshot root.
+ */
+struct OriSnapshotNode {
+    typedef std::shared_ptr<OriSnapshotNode> sp;
+    struct stat st;
+    ObjectHash hash;
+    Tree tree;
+};
+
+/*
+ * Read-only view of the .snapshot namespace.  Nodes are cached by their
+ * full path, which names both the snapshot and the path within it, and open
+ * files get a read context per handle like committed files in the live tree.
+ */
+class OriSnapshotView
+{
+public:
+    explicit OriSnapshotView(OriPriv *priv);
+    ~OriSnapshotView();
+    /// Resolves a path below ORI_SNAPSHOT_DIRPATH, callers hold nsLock
+    OriSnapshotNode::sp lookup(const std::string &path);
+    uint64_t open(const std::string &path);
+    /// Callers hold nsLock for reading
+    ssize_t read(uint64_t fh, char *buf, size_t size, off_t offset);
+    void close(uint64_t fh);
+    /// Drops all cached nodes after snapshots are removed
+    void invalidate();
+private:
+    OriSnapshotNode::sp loadSnapshot(const std::string &name);
+    OriSnapshotNode::sp loadEntry(const TreeEntry &entry);
+    void getOwner(const std::string &user, uid_t *uid, gid_t *gid);
+    OriPriv *priv;
+    LRUCache<std::string, OriSnapshotNode::sp,
+             ORIFS_SNAPSHOT_CACHE_NODES> nodes;
+    // Guards owners, handles and nextFH
+    Mutex lock;
+    std::unordered_map<std::string, std::pair<uid_t, gid_t> > owners;
+    std::unordered_map<uint64_t, OriReadCtx::sp> handles;
+    uint64_t nextFH;
+};
+
+#endif /* __ORISNAPSHOT_H__ */
@@ -15,24 +15,77 @@
  */
 
 #include <stdint.h>
+#include <stdio.h>
+
+#include <getopt.h>
 
 #include <string>
 #include <iostream>
 
+#include <oriutil/zipcodec.h>
 #include <ori/localrepo.h>
 
 using namespace std;
 
 extern LocalRepo repository;
 
+void
+usage_gc()
+{
+    cout << "ori gc [OPTIONS]" << endl;
+    cout << endl;
+    cout << "Reclaim unused space." << endl;
+    cout << endl;
+    cout << "Options:" << endl;
+    cout << "    --compression=ALGO" << endl;
+    cout << "                   Switch new objects to none, fastlz, snappy"
+         << endl;
+    cout << "                   or lzma and recompress the existing packs"
+         << endl;
+}
+
 /*
  * Reclaim unused space.
  */
 int
 cmd_gc(int argc, char * const argv[])
 {
+    int ch;
+    ObjectInfo::ZipAlgo algo = ObjectInfo::ZIPALGO_UNKNOWN;
+
+    struct option longopts[] = {
+        { "compression", required_argument, NULL,   'c' },
+        { NULL,         0,                  NULL,   0   }
+    };
+
+    while ((ch = getopt_long(argc, argv, "c:", longopts, NULL)) != -1) {
+        switch (ch) {
+            case 'c':
+                algo = ZipCodec_AlgoFromName(optarg);
+                if (!ZipCodec_IsSupported(algo)) {
+                    printf("Unsupported compression '%s'\n", optarg);
+                    return 1;
+                }
+                break;
+            default:
+                usage_gc();
+                return 1;
+        }
+    }
+
+    if (algo != ObjectInfo::ZIPALGO_UNKNOWN) {
+        if (!repository.setZipAlgo(algo)) {
+            printf("Failed to set the compression!\n");
+            return 1;
+        }
+    }
+
     repository.gc();
 
+    // Rewrite the cold packs that are still stored with another codec
+    if (algo != ObjectInfo::ZIPALGO_UNKNOWN)
+        repository.repack(0, algo);
+
     return 0;
 }
 
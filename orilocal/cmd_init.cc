@@ -25,9 +25,11 @@
 #include <getopt.h>
 
 #include <string>
+#include <iostream>
 
 #include <oriutil/debug.h>
 #include <oriutil/orifile.h>
+#include <oriutil/zipcodec.h>
 #include <ori/localrepo.h>
 
 using namespace std;
@@ -45,6 +47,11 @@ usage_init()
     cout << endl;
     cout << "Options:" << endl;
     cout << "    --non-bare     Non-bare repository" << endl;
+    cout << "    --compression=ALGO" << endl;
+    cout << "                   Compress objects with none, fastlz, snappy"
+         << endl;
+    cout << "                   or lzma (default: "
+         << ZipCodec_AlgoName(ZipCodec_Default()) << ")" << endl;
 }
 
 /*
@@ -56,19 +63,29 @@ int
 cmd_init(int argc, char * const argv[])
 {
     int ch;
+    int status;
     string rootPath;
     bool bareRepo = true;
+    ObjectInfo::ZipAlgo algo = ObjectInfo::ZIPALGO_UNKNOWN;
     
     struct option longopts[] = {
-        { "non-bare",   no_argument,    NULL,   'n' },
-        { NULL,         0,              NULL,   0   }
+        { "non-bare",   no_argument,        NULL,   'n' },
+        { "compression", required_argument, NULL,   'c' },
+        { NULL,         0,                  NULL,   0   }
     };
 
-    while ((ch = getopt_long(argc, argv, "n", longopts, NULL)) != -1) {
+    while ((ch = getopt_long(argc, argv, "nc:", longopts, NULL)) != -1) {
         switch (ch) {
             case 'n':
                 bareRepo = false;
                 break;
+            case 'c':
+                algo = ZipCodec_AlgoFromName(optarg);
+                if (!ZipCodec_IsSupported(algo)) {
+                    printf("Unsupported compression '%s'\n", optarg);
+                    return 1;
+                }
+                break;
             default:
                 printf("usage: ori init [OPTIONS] PATH\n");
                 return 1;
@@ -96,6 +113,18 @@ cmd_init(int argc, char * const argv[])
         return 1;
     }
 
-    return LocalRepo_Init(rootPath, bareRepo);
+    status = LocalRepo_Init(rootPath, bareRepo);
+    if (status != 0 || algo == ObjectInfo::ZIPALGO_UNKNOWN)
+        return status;
+
+    string repoPath = bareRepo ? rootPath : rootPath + ORI_PATH_DIR;
+    LocalRepo repo(repoPath);
+    repo.open(repoPath);
+    if (!repo.setZipAlgo(algo)) {
+        printf("Failed to set the compression!\n");
+        return 1;
+    }
+
+    return 0;
 }
 
@@ -67,6 +67,7 @@ int cmd_commit(int argc, char * const argv[]);
 int cmd_diff(int argc, char * const argv[]);
 int cmd_filelog(int argc, char * const argv[]);
 int cmd_findheads(int argc, char * const argv[]);
+void usage_gc(void);
 int cmd_gc(int argc, char * const argv[]);
 void usage_graft(void);
 int cmd_graft(int argc, char * const argv[]);
@@ -162,7 +163,7 @@ static Cmd commands[] = {
         "gc",
         "Reclaim unused space",
         cmd_gc,
-        NULL,
+        usage_gc,
         CMD_NEED_REPO,
     },
     {
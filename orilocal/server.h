@@ -1,7 +1,7 @@
 #ifndef __SERVER_H__
 #define __SERVER_H__
 
-#define ORI_PROTO_VERSION "1.0"
+#define ORI_PROTO_VERSION "1.2"
 
 class SshServer
 {
@@ -17,7 +17,10 @@ public:
     void cmd_hello();
     void cmd_listObjs();
     void cmd_listCommits();
+    void cmd_listObjsSince();
+    void cmd_listCommitsSince();
     void cmd_readObjs();
+    void cmd_fetch();
     void cmd_getObjInfo();
     void cmd_getHead();
     void cmd_getFSID();
@@ -18,6 +18,16 @@
 #define __HTTPCLIENT_H__
 
 #include <string>
+#include <vector>
+#include <functional>
+
+#include <event2/http.h>
+
+class bytestream;
+struct SyncRequest;
+
+/// Receives the response code, or -1 without a reply, and the body
+typedef std::function<void (int, const std::string &)> HttpClientCB;
 
 void HttpClient_requestDoneCB(struct evhttp_request *, void *);
 
@@ -31,7 +41,19 @@ public:
     void disconnect();
     bool connected();
 
-    // At the moment the protocol is synchronous
+    /**
+     * Requests are spread over a pool of persistent connections.  The
+     * callbacks of asynchronous requests run from the event loop, which runs
+     * in wait() and while any other request or stream waits for its reply.
+     * @returns -1 if the request could not be made and cb is not called
+     */
+    int getAsync(const std::string &url, HttpClientCB cb);
+    int postAsync(const std::string &url, const std::string &payload,
+                  HttpClientCB cb);
+    /// Waits for all asynchronous requests to complete
+    void wait();
+
+    /// @returns -1 unless the request was answered with success
     int getRequest(const std::string &command,
                    std::string &response);
     int postRequest(const std::string &url,
@@ -40,14 +62,27 @@ public:
     int putRequest(const std::string &command,
                    const std::string &payload,
                    std::string &response);
+    /**
+     * Posts a request whose response is read as it arrives.
+     * @returns NULL if the request failed or was not answered with success
+     */
+    bytestream *postStream(const std::string &url,
+                           const std::string &payload);
 
 private:
+    size_t pickConnection();
+    int request(enum evhttp_cmd_type type, const std::string &url,
+                const std::string *payload, HttpClientCB cb);
+    int waitRequest(SyncRequest *r);
     struct event_base *base;
     struct evdns_base *dnsBase;
-    struct evhttp_connection *con;
+    std::vector<struct evhttp_connection *> cons;
+    std::vector<int> pending; // requests and streams queued per connection
+    size_t outstanding; // asynchronous requests not yet completed
     std::string remoteHost, remotePort, remoteRepo;
     friend void HttpClient_requestDoneCB(struct evhttp_request *,
                                          void *);
+    friend class HttpClientStream;
 };
 
 #endif /* __HTTPCLIENT_H__ */
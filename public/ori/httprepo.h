@@ -21,6 +21,8 @@
 #include <vector>
 #include <unordered_set>
 
+#include <oriutil/stopwatch.h>
+
 #include "repo.h"
 
 class HttpObject;
@@ -41,11 +43,20 @@ public:
     ObjectInfo getObjectInfo(const ObjectHash &id);
     bool hasObject(const ObjectHash &id);
     std::vector<bool> hasObjects(const ObjectHashVec &objs);
+    bool getObjectFilter(BloomFilter &filter);
     bytestream *getObjects(const ObjectHashVec &objs);
+    bytestream *getMissingObjects(const ObjectHashVec &wants,
+                                  const ObjectHashVec &haves);
     std::set<ObjectInfo> listObjects();
     int addObject(ObjectType type, const ObjectHash &hash,
             const std::string &payload);
     std::vector<Commit> listCommits();
+    bool listObjectsSince(const std::string &cursor,
+                          std::set<ObjectInfo> &objs,
+                          std::string &next);
+    bool listCommitsSince(const std::string &cursor,
+                          std::vector<Commit> &commits,
+                          std::string &next);
 
 private:
     HttpClient *client;
@@ -57,6 +68,13 @@ private:
     std::map<ObjectHash, std::string> payloads;
 
     std::unordered_set<ObjectHash> *containedObjs;
+
+    // Filter advertised by the server, refetched when stale
+    void refreshFilter();
+    bool filterFetched;
+    Stopwatch filterAge;
+    ObjectHash filterHead;
+    BloomFilter remoteFilter;
 };
 
 class HttpObject : public Object
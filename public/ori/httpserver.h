@@ -24,33 +24,65 @@
 #include <event2/util.h>
 #include <event2/keyvalq_struct.h>
 
+struct HTTPJob;
+struct HTTPJobQueue;
+class HTTPWorker;
+
+/*
+ * The event loop accepts and parses requests and sends the replies.  Requests
+ * that read objects or scan the repository run on a pool of worker threads.
+ */
 class HTTPServer
 {
 public:
     HTTPServer(LocalRepo &repository, uint16_t port);
     ~HTTPServer();
+    void setThreads(int threads);
     void start(bool mDNSEnable);
     void stop();
 protected:
     void entry(struct evhttp_request *req);
 private:
     int authenticate(struct evhttp_request *req, struct evbuffer *buf);
-    // Handlers
+    // Handlers run by the event loop
     void stop(struct evhttp_request *req);
     void getId(struct evhttp_request *req);
     void getVersion(struct evhttp_request *req);
     void head(struct evhttp_request *req);
-    void getIndex(struct evhttp_request *req);
-    void getCommits(struct evhttp_request *req);
-    void contains(struct evhttp_request *req);
-    void getObjs(struct evhttp_request *req);
-    void getObjInfo(struct evhttp_request *req);
+    void getFilter(struct evhttp_request *req);
+    // Handlers run by the workers
+    void getIndex(HTTPJob *j);
+    void getCommits(HTTPJob *j);
+    void getIndexSince(HTTPJob *j);
+    void getCommitsSince(HTTPJob *j);
+    void contains(HTTPJob *j);
+    void getObjs(HTTPJob *j);
+    void fetch(HTTPJob *j);
+    void sendObjsStart(HTTPJob *j,
+                       const ObjectHashVec &objs,
+                       const std::string &header);
+    void sendObjs(HTTPJob *j);
+    void getObjInfo(HTTPJob *j);
+    // Worker pool
+    void queue(struct evhttp_request *req,
+               void (HTTPServer::*handler)(HTTPJob *));
+    void reply(HTTPJob *j);
+    void sendPart(HTTPJob *j);
     LocalRepo &repo;
     uint16_t port;
     struct evhttp *httpd;
     /* set if a test needs to call loopexit on a base */
     struct event_base *base;
+    int threads;
+    HTTPJobQueue *jobs;
+    struct event *doneEvent;
     friend void HTTPServerReqHandlerCB(struct evhttp_request *req, void *arg);
+    friend void HTTPServerDoneCB(evutil_socket_t fd, short what, void *arg);
+    friend void HTTPServerObjsChunkCB(struct evhttp_connection *evcon,
+                                      void *arg);
+    friend void HTTPServerCloseCB(struct evhttp_connection *evcon,
+                                  void *arg);
+    friend class HTTPWorker;
 };
 
 #endif
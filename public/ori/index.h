@@ -21,11 +21,58 @@
 
 #include <string>
 #include <set>
+#include <map>
+#include <vector>
 #include <unordered_map>
 
+#include <oriutil/mutex.h>
+#include <oriutil/bloomfilter.h>
 #include "object.h"
 #include "packfile.h"
 
+/*
+ * Index format versions.  Version 1 indices have no header and store
+ * 32-bit offsets, sizes and packfile ids.  Version 2 indices begin with
+ * INDEX_MAGIC followed by the version and store 64-bit values.
+ *
+ * The index file is an append-only journal of recent updates.  Journal
+ * entries are periodically merged into a sorted index (INDEX_SORTED_EXT)
+ * that begins with a 256-entry fanout table and is searched in place
+ * through a read-only mapping.  Version 2 sorted indices end with a Bloom
+ * filter over their entries, probed in the mapping as well, so most lookups
+ * of absent objects never search the entries.
+ *
+ * Journal entries are buffered in memory and only appended to the journal
+ * by sync(), which callers must invoke after the packfiles the entries
+ * refer to are durable.  An entry therefore never reaches the disk before
+ * its object does.  Callers that sync packfiles concurrently with writers
+ * take a mark first and only sync the entries before it.
+ *
+ * Version 3 journals begin with a generation that changes whenever the
+ * journal is merged.  A generation and a count of journal entries form a
+ * cursor from which the objects added later can be listed.
+ */
+#define INDEX_MAGIC             "ORIX"
+#define INDEX_VERSION_1         1
+#define INDEX_VERSION_2         2
+#define INDEX_VERSION_3         3
+#define INDEX_VERSION           INDEX_VERSION_3
+#define INDEX_HDRSIZE_V2        8
+#define INDEX_HDRSIZE           16
+
+/// Journal entries recording removed objects refer to this packfile
+#define INDEX_PACKFILE_REMOVED  UINT64_MAX
+
+#define INDEX_SORTED_EXT        ".idx"
+#define INDEX_SORTED_MAGIC      "ORIS"
+#define INDEX_SORTED_VERSION_1  1
+#define INDEX_SORTED_VERSION_2  2
+#define INDEX_SORTED_VERSION    INDEX_SORTED_VERSION_2
+#define INDEX_SORTED_HDRSIZE    (16 + 256 * 8)
+
+/// Per packfile counts of bytes the index no longer refers to
+#define INDEX_DEAD_EXT          ".dead"
+
 class Index
 {
 public:
@@ -33,20 +80,84 @@ public:
     ~Index();
     void open(const std::string &indexFile);
     void close();
+    /// Writes buffered journal entries and makes them durable
     void sync();
+    /// Position after the journal entries buffered so far
+    void getSyncMark(uint64_t &gen, uint64_t &pos) const;
+    /// Writes the buffered journal entries before a mark durably
+    void sync(uint64_t gen, uint64_t pos);
+    /// Merges the journal into the sorted index
     void rewrite();
     void dump();
     void updateEntry(const ObjectHash &objId, const IndexEntry &entry);
-    const IndexEntry &getEntry(const ObjectHash &objId) const;
-    const ObjectInfo &getInfo(const ObjectHash &objId) const;
+    void removeEntry(const ObjectHash &objId);
+    IndexEntry getEntry(const ObjectHash &objId) const;
+    ObjectInfo getInfo(const ObjectHash &objId) const;
     bool hasObject(const ObjectHash &objId) const;
+    /// Returns a filter that may contain every object in the index
+    BloomFilter getFilter() const;
     std::set<ObjectInfo> getList();
+    /// Objects as of the entries written so far and a cursor after them
+    std::set<ObjectInfo> getSyncedList(uint64_t &gen, uint64_t &pos) const;
+    /**
+     * Adds the objects written to the journal after a cursor to added and
+     * advances the cursor.
+     * @returns false if the cursor is from another generation
+     */
+    bool getAddedSince(uint64_t &gen, uint64_t &pos,
+                       std::set<ObjectInfo> &added) const;
+    /**
+     * Bytes of each packfile held by copies that were replaced or removed.
+     * The counts are updated with the entries and saved by sync(), a crash
+     * may lose recent counts which only delays repacking.
+     * @returns false if the counts were never computed
+     */
+    bool getDeadBytes(std::map<packid_t, uint64_t> &dead) const;
+    void setDeadBytes(const std::map<packid_t, uint64_t> &dead);
+    /// Forgets the counts of a deleted packfile
+    void clearDeadBytes(packid_t id);
 private:
     int fd;
+    uint32_t version;
     std::string fileName;
-    std::unordered_map<ObjectHash, IndexEntry> index;
+    mutable Mutex lock;
+
+    // Entries added since the last merge
+    std::unordered_map<ObjectHash, IndexEntry> journal;
+    // Encoded journal entries not yet written
+    std::string pending;
+    // Journal generation and hashes of its entries in order
+    uint64_t generation;
+    std::vector<ObjectHash> order;
+    // Entries of order that were written
+    uint64_t written;
+    // Written state of objects with entries not yet written
+    std::unordered_map<ObjectHash, IndexEntry> unsynced;
+
+    // Dead bytes per packfile
+    std::map<packid_t, uint64_t> deadBytes;
+    bool deadKnown;
+    bool deadDirty;
+    void _addDead(const IndexEntry &old);
+    void _loadDead();
+    void _saveDead();
+
+    // Sorted index mapping
+    const uint8_t *sorted;
+    size_t sortedLength;
+    uint64_t sortedCount;
+    uint32_t sortedVersion;
+    BloomFilter filter; // attached to the mapping
+
+    void _openSorted();
+    void _closeSorted();
+    const uint8_t *_findSorted(const ObjectHash &objId) const;
+    bool _lookup(const ObjectHash &objId, IndexEntry *entry) const;
+    void _merge();
 
+    void _writeHeader();
     void _writeEntry(const IndexEntry &e);
+    void _flushJournal(uint64_t upto);
 };
 
 #endif /* __INDEX_H__ */
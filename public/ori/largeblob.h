@@ -22,6 +22,8 @@
 #include <string>
 #include <map>
 
+#include <oriutil/extentmap.h>
+
 #include "repo.h"
 
 class LBlobEntry
@@ -42,6 +44,7 @@ public:
     explicit LargeBlob(Repo *r);
     ~LargeBlob();
     void chunkFile(const std::string &path);
+    void updateFile(const std::string &path, const ExtentMap &dirty);
     void extractFile(const std::string &path);
     /// May read less than s bytes
     ssize_t read(uint8_t *buf, size_t s, off_t off) const;
@@ -56,7 +59,21 @@ public:
      */
     ObjectHash totalHash;
     std::map<uint64_t, LBlobEntry> parts;
+    /*
+     * States of the totalHash computation at multiples of LARGEFILE_HASHMARK,
+     * so that a modified file is only hashed from the state before its first
+     * change.  They only depend on the contents.
+     */
+    std::map<uint64_t, std::string> hashMarks;
     Repo *repo;
+private:
+    friend class ModifiedChunkerCB;
+    void chunkModified(int fd, const ExtentMap &dirty,
+                       const std::map<uint64_t, LBlobEntry> &oldParts,
+                       uint64_t off, uint64_t len);
+    void readModified(int fd, const ExtentMap &dirty,
+                      const std::map<uint64_t, LBlobEntry> &oldParts,
+                      uint64_t off, uint64_t len, uint8_t *out);
 };
 
 #endif /* __LARGEBLOB_H__ */
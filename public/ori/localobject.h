@@ -35,6 +35,8 @@ public:
 
     LocalObject(PfTransaction::sp transaction, size_t ix);
     LocalObject(Packfile::sp packfile, const IndexEntry &entry);
+    /// An object reconstructed in memory (e.g. from a delta)
+    LocalObject(const ObjectInfo &info, const std::string &payload);
     ~LocalObject();
 
     // BaseObject implementation
@@ -46,6 +48,8 @@ private:
 
     Packfile::sp packfile;
     IndexEntry entry;
+
+    std::string payload;
     //void setupLzma(lzma_stream *strm, bool encode);
     //bool appendLzma(int dstFd, lzma_stream *strm, lzma_action action);
 };
@@ -18,9 +18,13 @@
 #define __LOCALREPO_H__
 
 #include <memory>
+#include <unordered_map>
 
 #include <oriutil/lrucache.h>
+#include <oriutil/rwlock.h>
 #include <oriutil/key.h>
+#include <oriutil/groupcommit.h>
+#include <oriutil/objectcache.h>
 #include "repo.h"
 #include "index.h"
 #include "snapshotindex.h"
@@ -55,6 +59,8 @@
 #define ORI_PATH_LOCK "/lock"
 #define ORI_PATH_UDSSOCK "/uds"
 #define ORI_PATH_BACKUP_CONF "/backup.conf"
+#define ORI_PATH_COMPRESSION "/compression"
+#define ORI_PATH_PURGED "/purged"
 
 int LocalRepo_Init(const std::string &path, bool barerepo,
                    const std::string &uuid = "");
@@ -66,6 +72,9 @@ public:
     virtual ObjectHash cb(const ObjectHash &commitId, Commit *c) = 0;
 };
 
+class RepackThread;
+struct RepackStruct;
+
 class LocalRepoLock
 {
     std::string lockFile;
@@ -75,6 +84,18 @@ public:
     typedef std::shared_ptr<LocalRepoLock> sp;
 };
 
+/*
+ * A transmit produced in parts, see LocalRepo::transmitPart.  Deltas whose
+ * base is part of the transfer are ordered after the other objects and are
+ * sent as is when their base goes out in the same part or an earlier one.
+ */
+struct TransmitState {
+    TransmitState() : next(0) { }
+    ObjectHashVec objs;
+    std::unordered_map<ObjectHash, size_t> basePos; // index of a delta's base
+    size_t next;
+};
+
 class LocalRepo : public Repo
 {
 public:
@@ -104,37 +125,63 @@ public:
      */
     bool hasRemote();
 
-    // Repo implementation
+    /*
+     * Repo implementation.  Reads may run on several threads at once and
+     * alongside adding or receiving objects, the index, packfiles and
+     * object cache lock internally and txnLock covers the current
+     * transaction.  Commits and metadata updates still need the caller to
+     * serialize them.
+     */
     int distance() { return 0; }
     Object::sp getObject(const ObjectHash &id);
+    ObjectHashVec prefetchObjects(const ObjectHashVec &objs);
+    bytestream *fetchRemoteObjects(const ObjectHashVec &objs);
     ObjectInfo getObjectInfo(const ObjectHash &objId);
     bool hasObject(const ObjectHash &objId);
     bool isObjectStored(const ObjectHash &objId);
+    bool getObjectFilter(BloomFilter &filter);
     //std::set<ObjectInfo> slowListObjects();
     std::set<ObjectInfo> listObjects();
     int addObject(ObjectType type, const ObjectHash &hash,
             const std::string &payload);
+    int addObject(ObjectType type, const ObjectHash &hash,
+            const std::string &payload, const ObjectHash &deltaBase);
 
     void sync(); /// sync all changes to disk
+    /// Time a sync may wait for concurrent syncs to join it (microseconds)
+    void setSyncLatency(uint64_t usecs);
+    /// Bytes of decompressed payloads kept in memory (zero disables)
+    void setCacheSize(uint64_t bytes);
+    ObjectCacheStats getCacheStats();
 
     // Index
     bool rebuildIndex();
     void dumpIndex();
     void dumpPackfile(packid_t packfileId);
 
-    LocalObject::sp getLocalObject(const ObjectHash &objId);
+    /// With cache false a miss streams from the packfile and is not cached
+    LocalObject::sp getLocalObject(const ObjectHash &objId, bool cache = true);
     
     std::vector<Commit> listCommits();
+    bool listObjectsSince(const std::string &cursor,
+                          std::set<ObjectInfo> &objs,
+                          std::string &next);
+    bool listCommitsSince(const std::string &cursor,
+                          std::vector<Commit> &commits,
+                          std::string &next);
     std::map<std::string, ObjectHash> listSnapshots();
     ObjectHash lookupSnapshot(const std::string &name);
 
-    ObjectHash addTree(const Tree &tree);
+    ObjectHash addTree(const Tree &tree,
+                       const ObjectHash &deltaBase = ObjectHash());
     ObjectHash addCommit(/* const */ Commit &commit);
     //std::string addBlob(const std::string &blob, ObjectType type);
     size_t getObjectLength(const ObjectHash &objId);
     ObjectType getObjectType(const ObjectHash &objId);
     std::string getPayload(const ObjectHash &objId);
     std::string verifyObject(const ObjectHash &objId);
+    std::string verifyPayload(const ObjectInfo &info,
+                              const std::string &payload);
     size_t sendObject(const char *objId);
 
     // Repository Operations
@@ -144,8 +191,16 @@ public:
     void pull(Repo *r);
     void multiPull(RemoteRepo::sp defaultRemote);
     void transmit(bytewstream *bs, const std::vector<ObjectHash> &objs);
+    void transmitBegin(TransmitState *state,
+                       const std::vector<ObjectHash> &objs);
+    bool transmitPart(bytewstream *bs, TransmitState *state, size_t maxSize);
     void receive(bytestream *bs);
     bytestream *getObjects(const std::vector<ObjectHash> &objs);
+    bytestream *getMissingObjects(const ObjectHashVec &wants,
+                                  const ObjectHashVec &haves);
+    ObjectHashVec listMissing(const ObjectHashVec &wants,
+                              const ObjectHashVec &haves,
+                              ObjectHashVec &commits);
 
     // Commit-related operations
     void addLargeBlobBackrefs(const LargeBlob &lb, MdTransaction::sp tr);
@@ -161,7 +216,25 @@ public:
     ObjectHash commitFromObjects(const ObjectHash &treeHash, Repo *objects,
             Commit &c, const std::string &status="normal");
 
-    void gc();
+    /**
+     * Compacts the metadata log if needed and repacks to reclaim the space
+     * of purged objects and sparse packfiles.
+     * \param wait Repack at full speed and return once done, otherwise the
+     *             repack is throttled and runs on a background thread
+     */
+    void gc(bool wait = true);
+    /**
+     * Repacks the packfiles that are no longer written to.  Purged objects
+     * stay pending (across restarts) until their packfile is repacked.
+     * @param maxRate bytes per second to copy or 0 for no limit
+     * @param algo recompresses objects stored with other codecs, unless it
+     *             is ZIPALGO_UNKNOWN
+     * @returns the number of packfiles that were repacked
+     */
+    size_t repack(uint64_t maxRate = 0,
+                  ObjectInfo::ZipAlgo algo = ObjectInfo::ZIPALGO_UNKNOWN);
+    /// Waits for a background repack started by gc to finish
+    void waitRepack();
 
     // Reference Counting Operations
     MetadataLog &getMetadata();
@@ -205,6 +278,9 @@ public:
     std::string getUDSPath();
     std::string getUUID();
     std::string getVersion();
+    /// Codec used for new objects (stored in ORI_PATH_COMPRESSION)
+    ObjectInfo::ZipAlgo getZipAlgo();
+    bool setZipAlgo(ObjectInfo::ZipAlgo algo);
 
     // Peer Management
     std::map<std::string, Peer> getPeers();
@@ -224,6 +300,21 @@ public:
 private:
     // Helper Functions
     void createObjDirs(const ObjectHash &objId);
+    void beginTransaction();
+    bool makeDelta(ObjectInfo &info, const std::string &payload,
+                   const ObjectHash &deltaBase, std::string *stored);
+    Packfile::sp getPackfile(const ObjectHash &objId, IndexEntry *ie);
+    LocalObject::sp getPackedObject(const ObjectHash &objId,
+                                    bool cache = true);
+    LocalObject::sp resolveDelta(LocalObject::sp o, bool packed = false);
+    ObjectHash getDeltaBase(const ObjectHash &objId);
+    void sealPackfile();
+    void startRepack();
+    bool repackStopped();
+    void expandDeltas(RepackStruct *rs);
+    void loadPurged();
+    void flush();
+    bool pullMissing(Repo *r, std::deque<ObjectHash> &toPull);
 public: // Hack to enable rebuild operations
     std::string objIdToPath(const ObjectHash &objId);
 private:
@@ -232,18 +323,31 @@ private:
     std::string rootPath;
     std::string id;
     std::string version;
+    ObjectInfo::ZipAlgo zipAlgo;
     Index index;
     SnapshotIndex snapshots;
     std::map<std::string, Peer> peers;
     MetadataLog metadata;
 
     // Packfiles
+    Mutex txnLock; // protects currPackfile and currTransaction
     Packfile::sp currPackfile;
     PfTransaction::sp currTransaction;
     PackfileManager::sp packfiles;
+    GroupCommit syncer;
+    ObjectCache objCache;
 
     // Purging
-    std::set<ObjectHash> purged;
+    Mutex purgeLock; // protects purged and purgedDirty
+    std::set<ObjectHash> purged; // pending until repacked (ORI_PATH_PURGED)
+    bool purgedDirty;
+
+    // Repacking
+    RWLock packLock; // held to look up or remove packfiles
+    Mutex repackMutex; // held by the one running repack
+    Mutex repackLock; // protects repacker and repackStop
+    RepackThread *repacker;
+    bool repackStop;
 
     // Repo lock
     LocalRepoLock::sp repoProcessLock;
@@ -256,6 +360,9 @@ private:
 
     // Friends
     friend int LocalRepo_PeerHelper(LocalRepo *l, const std::string &path);
+    friend void LocalRepo_FlushCb(void *arg);
+    friend class RepackThread;
+    friend class Verifier;
 };
 
 #endif
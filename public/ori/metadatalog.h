@@ -53,6 +53,8 @@ public:
     void sync();
     /// rewrites the log file, optionally with new counts
     void rewrite(const RefcountMap *refs = NULL, const MetadataMap *data = NULL);
+    /// True once the log is mostly superseded entries
+    bool needsRewrite() const;
 
     void addRef(const ObjectHash &hash, MdTransaction::sp trs =
             MdTransaction::sp());
@@ -68,6 +70,8 @@ public:
 private:
     friend class MdTransaction;
     int fd;
+    bool dirty;
+    uint64_t logSize; // bytes in the log file
     std::string filename;
     RefcountMap refcounts;
     MetadataMap metadata;
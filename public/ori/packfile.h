@@ -19,27 +19,41 @@
 
 #include <set>
 #include <deque>
+#include <map>
 #include <memory>
 #include <unordered_map>
 
 #include <oriutil/objecthash.h>
 #include <oriutil/stream.h>
+#include <oriutil/zipcodec.h>
 #include <oriutil/lrucache.h>
+#include <oriutil/mutex.h>
 #include "object.h"
 
-typedef uint32_t offset_t;
-typedef uint32_t packid_t;
+typedef uint64_t offset_t;
+typedef uint64_t packid_t;
 typedef uint32_t numobjs_t;
 
+/*
+ * Packfile format versions.  Version 1 packfiles have no header and store
+ * 32-bit sizes and offsets in each group header.  Version 2 packfiles begin
+ * with PACKFILE_MAGIC followed by the version and store 64-bit values.
+ */
+#define PACKFILE_MAGIC          "ORIP"
+#define PACKFILE_VERSION_1      1
+#define PACKFILE_VERSION_2      2
+#define PACKFILE_VERSION        PACKFILE_VERSION_2
+#define PACKFILE_HDRSIZE        8
+
 struct IndexEntry
 {
     ObjectInfo info;
     offset_t offset;
-    uint32_t packed_size;
+    uint64_t packed_size;
     packid_t packfile;
 
     const static size_t SIZE = ObjectInfo::SIZE + sizeof(offset_t) +
-        sizeof(uint32_t) + sizeof(packid_t);
+        sizeof(uint64_t) + sizeof(packid_t);
 };
 
 class Packfile;
@@ -49,11 +63,13 @@ class PfTransaction
 public:
     typedef std::shared_ptr<PfTransaction> sp;
 
-    PfTransaction(Packfile *pf, Index *idx);
+    PfTransaction(Packfile *pf, Index *idx, ObjectInfo::ZipAlgo algo);
     ~PfTransaction();
 
     bool full() const;
     void addPayload(ObjectInfo info, const std::string &payload);
+    /// Adds a payload that is already in its stored (compressed) form
+    void addStored(const ObjectInfo &info, const std::string &stored);
     bool has(const ObjectHash &hash) const;
     void commit();
 
@@ -67,7 +83,23 @@ public:
 private:
     Packfile *pf;
     Index *idx;
-    float _checkCompressionRatio(const std::string &payload);
+    ObjectInfo::ZipAlgo zipAlgo;
+    float _checkCompressionRatio(ZipCodec *codec, const std::string &payload);
+};
+
+/// Read-only mapping of part of a packfile, unmapped when the last reader
+/// drops it
+class PackfileMap
+{
+public:
+    typedef std::shared_ptr<PackfileMap> sp;
+
+    PackfileMap(const uint8_t *data, offset_t offset, size_t length);
+    ~PackfileMap();
+
+    const uint8_t *data; // file contents at offset
+    offset_t offset;
+    size_t length;
 };
 
 class Packfile
@@ -79,29 +111,56 @@ public:
     ~Packfile();
 
     packid_t getPackfileID() const;
+    uint32_t getVersion() const;
 
     bool full() const;
-    PfTransaction::sp begin(Index *idx);
+    /// @param algo is the codec used for new payloads
+    PfTransaction::sp begin(Index *idx,
+                            ObjectInfo::ZipAlgo algo = ZipCodec_Default());
     void commit(PfTransaction *t, Index *idx);
     //void addPayload(ObjectInfo info, const std::string &payload, Index *idx);
     bytestream *getPayload(const IndexEntry &entry);
-    /// @returns true when the packfile is empty
-    bool purge(const std::set<ObjectHash> &hset, Index *idx);
+    /// Returns the payload as stored in the packfile (not decompressed)
+    bytestream *getStoredPayload(offset_t off, uint64_t size);
+    offset_t getSize() const;
 
     typedef void (*ReadEntryCb)(const ObjectInfo &info, offset_t off,
-                                void *arg);
+                                uint64_t size, void *arg);
     void readEntries(ReadEntryCb cb, void *arg);
 
     void transmit(bytewstream *bs, std::vector<IndexEntry> objects);
+    /// Transmits payloads that are not read from a packfile
+    static void transmitPayloads(bytewstream *bs,
+                                 const std::vector<ObjectInfo> &infos,
+                                 const std::vector<std::string> &payloads);
     /// @returns false if nothing to receive
     bool receive(bytestream *bs, Index *idx);
+    /// Makes committed and received objects durable
+    void sync();
 
 private:
     int fd;
     std::string filename;
     packid_t packid;
+    uint32_t version;
     size_t numObjects;
-    size_t fileSize;
+    offset_t fileSize;
+    bool dirty;
+
+    // Read path (mmap windows with pread fallback)
+    Mutex mapLock;
+    std::map<offset_t, PackfileMap::sp> windows;
+    offset_t mapEnd; // file size last seen by _getMap
+    PackfileMap::sp _getMap(offset_t off, uint64_t len);
+    bytestream *_getStored(offset_t off, uint64_t len);
+
+    offset_t _dataStart() const;
+    size_t _entrySize() const;
+    void _writeHeader();
+    void _writeEntry(strwstream &ss, const ObjectInfo &info,
+                     uint64_t size, offset_t off) const;
+    void _readEntry(bytestream *bs, ObjectInfo &info,
+                    uint64_t &size, offset_t &off) const;
 };
 
 
@@ -118,17 +177,25 @@ public:
     Packfile::sp getPackfile(packid_t id);
     Packfile::sp newPackfile();
     bool hasPackfile(packid_t id);
+    /// True until the packfile is released by its writer and synced
+    bool isWriting(packid_t id);
+    /// Syncs the packfiles that were written to
+    void sync();
+    /// Deletes the packfile and returns its id to the free list
+    void removePackfile(packid_t id);
     std::vector<packid_t> getPackfileList();
 
 private:
     std::string rootPath;
+    Mutex lock; // protects freeList and writers
 
     std::deque<packid_t> freeList;
     void _recomputeFreeList();
     bool _loadFreeList();
     void _writeFreeList();
 
-    LRUCache<uint32_t, Packfile::sp, 96> _packfileCache;
+    LRUCache<packid_t, Packfile::sp, 96> _packfileCache;
+    std::map<packid_t, Packfile::sp> writers;
 
     std::string _getPackfileName(packid_t id);
 };
@@ -25,6 +25,8 @@
 
 #include <oriutil/dag.h>
 #include <oriutil/objecthash.h>
+#include <oriutil/bloomfilter.h>
+#include <oriutil/extentmap.h>
 #include "tree.h"
 #include "commit.h"
 #include "object.h"
@@ -56,29 +58,61 @@ public:
             ) = 0;
     virtual bool hasObject(const ObjectHash &id) = 0;
     virtual std::vector<bool> hasObjects(const ObjectHashVec &ids);
+    /// Filter over the objects present, returns false if unavailable
+    virtual bool getObjectFilter(BloomFilter &filter);
     virtual bytestream *getObjects(
             const ObjectHashVec &objs
             ) = 0;
+    /// Objects reachable from wants that a peer with the commits haves
+    /// lacks, returns NULL if the repository cannot compute them
+    virtual bytestream *getMissingObjects(const ObjectHashVec &wants,
+                                          const ObjectHashVec &haves);
 
     // Object queries
     virtual std::set<ObjectInfo> listObjects() = 0;
     virtual std::vector<Commit> listCommits() = 0;
+    /**
+     * Lists the objects added since cursor, a token next was set to by an
+     * earlier call, and sets next to the current cursor.  Every object is
+     * listed for an empty or unknown cursor.
+     * @returns true if only the objects added since cursor were listed
+     */
+    virtual bool listObjectsSince(const std::string &cursor,
+                                  std::set<ObjectInfo> &objs,
+                                  std::string &next);
+    /// Lists commits like listObjectsSince, ordered by time
+    virtual bool listCommitsSince(const std::string &cursor,
+                                  std::vector<Commit> &commits,
+                                  std::string &next);
 
     virtual int addObject(
             ObjectType type,
             const ObjectHash &hash,
             const std::string &payload
             ) = 0;
+    /// deltaBase is a similar object the payload may be stored against
+    virtual int addObject(
+            ObjectType type,
+            const ObjectHash &hash,
+            const std::string &payload,
+            const ObjectHash &deltaBase
+            );
 
     // Wrappers
-    virtual ObjectHash addBlob(ObjectType type, const std::string &blob);
+    virtual ObjectHash addBlob(ObjectType type, const std::string &blob,
+                               const ObjectHash &deltaBase = ObjectHash());
     bytestream *getObjects(const std::deque<ObjectHash> &objs);
 
-    ObjectHash addSmallFile(const std::string &path);
+    ObjectHash addSmallFile(const std::string &path,
+                            const ObjectHash &deltaBase = ObjectHash());
     std::pair<ObjectHash, ObjectHash>
         addLargeFile(const std::string &path);
     std::pair<ObjectHash, ObjectHash>
-        addFile(const std::string &path);
+        addFile(const std::string &path,
+                const ObjectHash &deltaBase = ObjectHash());
+    std::pair<ObjectHash, ObjectHash>
+        addModifiedFile(const std::string &path, const ObjectHash &lbBase,
+                        const ExtentMap &dirty);
 
     virtual Tree getTree(const ObjectHash &treeId);
     virtual Commit getCommit(const ObjectHash &commitId);
@@ -90,6 +124,7 @@ public:
     // Transport
     virtual void transmit(bytewstream *bs, const ObjectHashVec &objs);
     virtual void receive(bytestream *bs);
+    static void copyObjects(bytestream *in, bytewstream *out);
 
     // Extensions
     virtual std::set<std::string> listExt();
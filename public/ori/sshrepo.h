@@ -40,10 +40,18 @@ public:
     ObjectInfo getObjectInfo(const ObjectHash &id);
     bool hasObject(const ObjectHash &id);
     bytestream *getObjects(const ObjectHashVec &objs);
+    bytestream *getMissingObjects(const ObjectHashVec &wants,
+                                  const ObjectHashVec &haves);
     std::set<ObjectInfo> listObjects();
     int addObject(ObjectType type, const ObjectHash &hash,
             const std::string &payload);
     std::vector<Commit> listCommits();
+    bool listObjectsSince(const std::string &cursor,
+                          std::set<ObjectInfo> &objs,
+                          std::string &next);
+    bool listCommitsSince(const std::string &cursor,
+                          std::vector<Commit> &commits,
+                          std::string &next);
 
 private:
     SshClient *client;
@@ -55,6 +63,9 @@ private:
     std::map<ObjectHash, std::string> payloads;
 
     std::unordered_set<ObjectHash> *containedObjs;
+
+    bool hasProto(const std::string &version);
+    std::string protoVersion; // from hello, empty until asked
 };
 
 class SshObject : public Object
@@ -19,7 +19,7 @@
 
 #include <oriutil/mutex.h>
 
-#define ORI_UDS_PROTO_VERSION "1.0"
+#define ORI_UDS_PROTO_VERSION "1.2"
 
 class UDSSession;
 
@@ -61,7 +61,10 @@ public:
     void cmd_hello();
     void cmd_listObjs();
     void cmd_listCommits();
+    void cmd_listObjsSince();
+    void cmd_listCommitsSince();
     void cmd_readObjs();
+    void cmd_fetch();
     void cmd_getObjInfo();
     void cmd_getHead();
     void cmd_getFSID();
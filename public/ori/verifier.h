@@ -0,0 +1,105 @@
+/*
+ * Copyright (c) 2012-2013 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef __VERIFIER_H__
+#define __VERIFIER_H__
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+#include <unordered_set>
+
+#include <oriutil/objecthash.h>
+#include "packfile.h"
+#include "localobject.h"
+
+class LocalRepo;
+
+struct VerifierStats
+{
+    VerifierStats();
+
+    packid_t packfile;
+    uint64_t objects;
+    /// Objects the index does not refer to (superseded copies)
+    uint64_t deadObjects;
+    /// Bytes read as stored in the packfiles
+    uint64_t bytes;
+    uint64_t errors;
+    /// Microseconds spent
+    uint64_t elapsed;
+};
+
+/*
+ * Repository verifier.  Packfiles are read sequentially in offset order
+ * while a pool of worker threads decompresses, resolves deltas and hashes
+ * the objects.  The index is then checked against the objects found and
+ * every tree and large blob reachable from a commit is checked to exist.
+ *
+ * Reading can be limited to a maximum rate so that verification does not
+ * starve other users of the disk.
+ */
+class Verifier
+{
+public:
+    typedef void (*ErrorCb)(const ObjectHash &hash, const std::string &msg,
+                            void *arg);
+    /// Called after each packfile and periodically within large packfiles
+    typedef void (*ProgressCb)(const VerifierStats &pack,
+                               const VerifierStats &total, void *arg);
+
+    Verifier(LocalRepo *repo);
+    ~Verifier();
+
+    /// @param threads is the number of workers or zero for one per CPU
+    void setThreads(int threads);
+    /// @param maxRate in bytes per second or zero for no limit
+    void setMaxRate(uint64_t maxRate);
+    void setErrorCb(ErrorCb cb, void *arg);
+    void setProgressCb(ProgressCb cb, void *arg);
+
+    /// @returns the number of errors found
+    uint64_t verifyPackfiles();
+    /// Checks that objects referenced by commits, trees and large blobs
+    /// exist.  @returns the number of missing objects
+    uint64_t verifyReachability();
+    /// @returns the number of errors found by both passes
+    uint64_t verify();
+
+    const std::vector<VerifierStats> &getPackStats() const;
+    const VerifierStats &getTotals() const;
+
+private:
+    LocalRepo *repo;
+    int threads;
+    uint64_t maxRate;
+    ErrorCb errorCb;
+    void *errorArg;
+    ProgressCb progressCb;
+    void *progressArg;
+
+    std::vector<VerifierStats> packStats;
+    VerifierStats totals;
+
+    void error(const ObjectHash &hash, const std::string &msg);
+    LocalObject::sp resolveDelta(LocalObject::sp o);
+    friend class VerifierWorker;
+    friend struct VerifierQueue;
+};
+
+#endif /* __VERIFIER_H__ */
+
@@ -0,0 +1,71 @@
+/*
+ * Copyright (c) 2012-2013 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef __BLOOMFILTER_H__
+#define __BLOOMFILTER_H__
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+#include "objecthash.h"
+#include "serializationexception.h"
+
+/*
+ * Bloom filter over object hashes.  A negative answer from mayContain is
+ * exact, a positive answer is wrong with probability of roughly 1% at the
+ * default of 10 bits per key.  Object hashes are already uniformly
+ * distributed so the probe positions are derived from the hash itself.
+ *
+ * A filter that was never sized holds no information and reports every
+ * hash as possibly present.
+ */
+#define BLOOMFILTER_BITSPERKEY  10
+
+class BloomFilter
+{
+public:
+    BloomFilter();
+    explicit BloomFilter(uint64_t keys,
+                         uint32_t bitsPerKey = BLOOMFILTER_BITSPERKEY);
+    /// Copies own their bits even if the original is attached
+    BloomFilter(const BloomFilter &other);
+    BloomFilter &operator=(const BloomFilter &other);
+    /// Clears the filter and sizes it for the given number of keys
+    void reset(uint64_t keys, uint32_t bitsPerKey = BLOOMFILTER_BITSPERKEY);
+    void add(const ObjectHash &hash);
+    bool mayContain(const ObjectHash &hash) const;
+    /// @returns true if the filter was never sized
+    bool isEmpty() const;
+    void fromBlob(const std::string &blob);
+    /**
+     * Probes a serialized filter where it is (e.g. a mapped file) instead
+     * of copying it.  The blob must stay valid until the filter is reset
+     * or destroyed; add() copies the bits first.
+     */
+    void attach(const uint8_t *blob, size_t len);
+    std::string getBlob() const;
+private:
+    uint32_t numProbes;
+    uint64_t numBits;
+    std::vector<uint8_t> bits;
+    const uint8_t *extBits; // attached bits or NULL
+    const uint8_t *_bits() const;
+};
+
+#endif /* __BLOOMFILTER_H__ */
+
@@ -0,0 +1,55 @@
+/*
+ * Copyright (c) 2012-2013 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#ifndef __EXTENTMAP_H__
+#define __EXTENTMAP_H__
+
+#include <stdint.h>
+
+#include <map>
+
+/*
+ * Set of byte ranges within a file.  Ranges are kept as disjoint,
+ * non-adjacent [start, end) extents so overlapping writes coalesce.
+ */
+class ExtentMap
+{
+public:
+    typedef std::map<uint64_t, uint64_t>::const_iterator iterator;
+    ExtentMap();
+    ~ExtentMap();
+    /// Adds [off, off + len) merging overlapping and adjacent extents
+    void add(uint64_t off, uint64_t len);
+    /// Drops everything at or beyond size
+    void truncate(uint64_t size);
+    void clear();
+    bool empty() const;
+    /**
+     * Finds the extent containing off, or failing that the first extent
+     * after off.
+     * @returns false if there is no such extent
+     */
+    bool find(uint64_t off, uint64_t *start, uint64_t *end) const;
+    uint64_t totalBytes() const;
+    iterator begin() const { return extents.begin(); }
+    iterator end() const { return extents.end(); }
+private:
+    std::map<uint64_t, uint64_t> extents; // start -> end
+};
+
+#endif /* __EXTENTMAP_H__ */
+
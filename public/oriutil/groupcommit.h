@@ -0,0 +1,57 @@
+/*
+ * Copyright (c) 2012-2013 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef __GROUPCOMMIT_H__
+#define __GROUPCOMMIT_H__
+
+#include <stdint.h>
+#include <pthread.h>
+
+/*
+ * Group commit.  Callers of sync() wait until a flush that started after
+ * they called has completed.  One caller (the leader) runs the flush on
+ * behalf of everyone waiting, and callers arriving while a flush is running
+ * are batched into the next one.  The leader may wait up to maxLatency
+ * microseconds for more callers to join before flushing.
+ */
+class GroupCommit
+{
+public:
+    typedef void (*FlushCb)(void *arg);
+
+    GroupCommit(FlushCb cb, void *arg, uint64_t maxLatency = 0);
+    ~GroupCommit();
+    void setMaxLatency(uint64_t usecs);
+    uint64_t getMaxLatency();
+    /// Blocks until everything written before the call has been flushed
+    void sync();
+    /// Number of flushes performed so far
+    uint64_t getFlushes();
+private:
+    FlushCb cb;
+    void *arg;
+    uint64_t maxLatency;
+
+    pthread_mutex_t lock;
+    pthread_cond_t done;
+    bool flushing;
+    uint64_t requested;
+    uint64_t completed;
+    uint64_t flushes;
+};
+
+#endif /* __GROUPCOMMIT_H__ */
+
@@ -0,0 +1,91 @@
+/*
+ * Copyright (c) 2012-2013 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#ifndef __OBJECTCACHE_H__
+#define __OBJECTCACHE_H__
+
+#include <stdint.h>
+
+#include <list>
+#include <string>
+#include <utility>
+#include <unordered_map>
+
+#include "mutex.h"
+#include "objecthash.h"
+
+/*
+ * Cache of decompressed (and delta resolved) object payloads bounded by the
+ * total payload size rather than the number of entries.  The cache is split
+ * into shards selected by the object hash, each with its own lock and LRU
+ * list, so concurrent readers of different objects rarely contend.  Objects
+ * are immutable so entries never go stale; purged objects are invalidated
+ * only to release memory.
+ */
+#define OBJECTCACHE_SHARDS      16
+
+struct ObjectCacheStats
+{
+    ObjectCacheStats()
+        : hits(0), misses(0), evictions(0), bytes(0), entries(0) { }
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    uint64_t bytes;
+    uint64_t entries;
+};
+
+class ObjectCache
+{
+public:
+    explicit ObjectCache(uint64_t budget);
+    ~ObjectCache();
+    /// Shrinks the cache immediately if the new budget is smaller
+    void setBudget(uint64_t budget);
+    uint64_t getBudget();
+    /// @returns true and copies the payload if the object is cached
+    bool get(const ObjectHash &hash, std::string &payload);
+    /// Payloads larger than a shard's share of the budget are not cached
+    void put(const ObjectHash &hash, const std::string &payload);
+    void invalidate(const ObjectHash &hash);
+    void clear();
+    ObjectCacheStats getStats();
+private:
+    typedef std::list<ObjectHash> LRUList;
+    typedef std::unordered_map<ObjectHash,
+            std::pair<std::string, LRUList::iterator> > EntryMap;
+    struct Shard {
+        Shard() : limit(0), bytes(0), hits(0), misses(0), evictions(0) { }
+        Mutex lock;
+        LRUList lru;
+        EntryMap entries;
+        // The shard's share of the budget, read and written under lock
+        uint64_t limit;
+        uint64_t bytes;
+        uint64_t hits;
+        uint64_t misses;
+        uint64_t evictions;
+    };
+    Shard &getShard(const ObjectHash &hash);
+    void evict(Shard &s, uint64_t limit);
+    Mutex budgetLock;
+    uint64_t budget;
+    Shard shards[OBJECTCACHE_SHARDS];
+};
+
+#endif /* __OBJECTCACHE_H__ */
+
@@ -31,13 +31,23 @@
 #define ORI_FLAG_UNCOMPRESSED   0x0000
 #define ORI_FLAG_FASTLZ         0x0001
 #define ORI_FLAG_LZMA           0x0002
+#define ORI_FLAG_SNAPPY         0x0003
 #define ORI_FLAG_ZIPMASK        0x000F
+/*
+ * Delta objects store the base object hash followed by a delta against the
+ * base payload.  The delta chain depth (1 for a delta against a full object)
+ * is kept in the flags so bounding the chain needs no payload reads.
+ */
+#define ORI_FLAG_DELTAMASK      0x0F00
+#define ORI_FLAG_DELTASHIFT     8
+#define ORI_FLAG_DELTAMAXDEPTH  (ORI_FLAG_DELTAMASK >> ORI_FLAG_DELTASHIFT)
 
 #define ORI_FLAG_DEFAULT        0x0000
 
 struct ObjectInfo {
     enum Type { Null, Commit, Tree, Blob, LargeBlob, Purged };
-    enum ZipAlgo { ZIPALGO_UNKNOWN, ZIPALGO_NONE, ZIPALGO_FASTLZ, ZIPALGO_LZMA };
+    enum ZipAlgo { ZIPALGO_UNKNOWN, ZIPALGO_NONE, ZIPALGO_FASTLZ, ZIPALGO_LZMA,
+                   ZIPALGO_SNAPPY };
 
     ObjectInfo();
     explicit ObjectInfo(const ObjectHash &hash);
@@ -51,6 +61,9 @@ struct ObjectInfo {
     bool isCompressed() const;
     ZipAlgo getAlgo() const;
     void setAlgo(ZipAlgo algo);
+    bool isDelta() const;
+    uint32_t getDeltaDepth() const;
+    void setDeltaDepth(uint32_t depth);
     bool operator <(const ObjectInfo &) const;
 
     // Object type
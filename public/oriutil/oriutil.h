@@ -36,6 +36,7 @@ int Util_SetBlocking(int fd, bool block);
 
 std::string Util_NewUUID();
 bool Util_IsPathRemote(const std::string &path);
+int Util_CompareVersion(const std::string &v1, const std::string &v2);
 
 std::string Util_SystemError(int status);
 
@@ -31,6 +31,7 @@ enum OriErrorCode {
     ORIEC_UNSUPPORTEDVERSION,
     ORIEC_INDEXDIRTY,
     ORIEC_INDEXCORRUPT,
+    ORIEC_OBJECTCORRUPT,
 };
 
 class RuntimeException : public std::exception
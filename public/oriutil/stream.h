@@ -27,13 +27,10 @@
 #include <memory>
 #include <stdexcept>
 
-#ifdef ORI_USE_LZMA
-#include <lzma.h>
-#endif /* ORI_USE_LZMA */
-
 #include "oriutil.h"
 #include "objecthash.h"
 #include "objectinfo.h"
+#include "zipcodec.h"
 
 class basestream
 {
@@ -62,6 +59,12 @@ public:
     virtual bool ended() = 0;
     virtual size_t read(uint8_t *buf, size_t n) = 0;
     virtual size_t sizeHint() const = 0;
+    /**
+     * Consumes the rest of the stream without copying if it is held in
+     * memory.  The bytes stay valid while the stream exists.
+     * @returns false if the stream must be read instead
+     */
+    virtual bool takeView(const uint8_t **buf, size_t *len) { return false; }
 
     /// Enable typed stream
     void enableTypes();
@@ -106,6 +109,7 @@ public:
     bool ended();
     size_t read(uint8_t *, size_t);
     size_t sizeHint() const;
+    bool takeView(const uint8_t **buf, size_t *len);
 private:
     std::string buf;
     size_t off;
@@ -126,57 +130,67 @@ private:
     size_t left;
 };
 
-class diskstream : public bytestream
+/// Reads from an fd with pread, so it does not share the file offset
+class preadstream : public bytestream
 {
 public:
-    diskstream(const std::string &filename);
-    ~diskstream();
+    preadstream(int fd, off_t offset, size_t length=(size_t)-1);
     bool ended();
     size_t read(uint8_t *, size_t);
     size_t sizeHint() const;
 
 private:
     int fd;
-    bytestream::ap source;
+    off_t offset;
+    size_t length;
+    size_t left;
 };
 
-
-#define COMPRESS true
-#define DECOMPRESS false
-
-#ifdef ORI_USE_LZMA
-
-class zipstream : public bytestream
+/// Reads in place from memory kept alive by owner (e.g. an mmap region)
+class memstream : public bytestream
 {
 public:
-    /// Takes ownership of source. size_hint is total number of bytes output (from read) 
-    zipstream(bytestream *source, bool compress = false, size_t size_hint = 0);
-    ~zipstream();
+    memstream(const uint8_t *buf, size_t len,
+              std::shared_ptr<const void> owner = std::shared_ptr<const void>());
     bool ended();
     size_t read(uint8_t *, size_t);
     size_t sizeHint() const;
-    size_t inputConsumed() const;
+    bool takeView(const uint8_t **buf, size_t *len);
 
 private:
-    bytestream *source;
-    size_t size_hint;
+    std::shared_ptr<const void> owner;
+    const uint8_t *buf;
+    size_t off;
+    size_t len;
+};
 
-    bool output_ended;
-    lzma_stream strm;
-    uint8_t in_buf[COMPFILE_BUFSZ];
+class diskstream : public bytestream
+{
+public:
+    diskstream(const std::string &filename);
+    ~diskstream();
+    bool ended();
+    size_t read(uint8_t *, size_t);
+    size_t sizeHint() const;
 
-    void setLzmaErr(const char *msg, lzma_ret ret);
+private:
+    int fd;
+    bytestream::ap source;
 };
 
-#endif /* ORI_USE_LZMA */
 
-#ifdef ORI_USE_FASTLZ
+#define COMPRESS true
+#define DECOMPRESS false
 
+/*
+ * Compresses or decompresses a whole object with one of the ZipCodecs.
+ */
 class zipstream : public bytestream
 {
 public:
     /// Takes ownership of source. size_hint is total number of bytes output (from read) 
-    zipstream(bytestream *source, bool compress = false, size_t size_hint = 0);
+    zipstream(bytestream *source, bool compress = false, size_t size_hint = 0,
+              ObjectInfo::ZipAlgo algo = ZipCodec_Default());
     ~zipstream();
     bool ended();
     size_t read(uint8_t *, size_t);
@@ -186,18 +200,18 @@ public:
 private:
     bytestream *source;
     size_t size_hint;
+    ObjectInfo::ZipAlgo algo;
 
     bool compress;
     bool input_processed;
-    std::string input; // TODO
-    std::vector<uint8_t> output;
+    size_t inputSize;
+    std::string input;
+    std::string output;
 
     size_t offset;
     bool output_ended;
 };
 
-#endif /* ORI_USE_FASTLZ */
-
 ////////////////////////////////
 // Writable streams
 
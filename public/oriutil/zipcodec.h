@@ -0,0 +1,60 @@
+/*
+ * Copyright (c) 2012-2013 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef __ZIPCODEC_H__
+#define __ZIPCODEC_H__
+
+#include <string>
+
+#include "objectinfo.h"
+
+/*
+ * Compression codecs.  Each object records the codec it was stored with in
+ * its ObjectInfo flags, so packfiles may freely mix codecs.  Codecs are
+ * compiled in with ORI_USE_FASTLZ, ORI_USE_SNAPPY and ORI_USE_LZMA; the
+ * default codec is ORI_DEFAULT_ZIPALGO.
+ */
+class ZipCodec
+{
+public:
+    virtual ~ZipCodec() { }
+    virtual ObjectInfo::ZipAlgo getAlgo() const = 0;
+    virtual const char *getName() const = 0;
+    /// @returns false if the input could not be compressed
+    virtual bool compress(const std::string &in, std::string &out) = 0;
+    /// @param size is the uncompressed size if known or zero
+    virtual bool decompress(const uint8_t *in, size_t len, size_t size,
+                            std::string &out) = 0;
+    bool decompress(const std::string &in, size_t size, std::string &out)
+    {
+        return decompress((const uint8_t *)in.data(), in.size(), size, out);
+    }
+};
+
+/// @returns NULL if the codec is not compiled in
+ZipCodec *ZipCodec_Get(ObjectInfo::ZipAlgo algo);
+/// @returns ZIPALGO_UNKNOWN if the name is not recognized
+ObjectInfo::ZipAlgo ZipCodec_AlgoFromName(const std::string &name);
+const char *ZipCodec_AlgoName(ObjectInfo::ZipAlgo algo);
+bool ZipCodec_IsSupported(ObjectInfo::ZipAlgo algo);
+/// Throws RuntimeException(ORIEC_OBJECTCORRUPT) if the codec is unsupported
+void ZipCodec_Check(ObjectInfo::ZipAlgo algo);
+/// @returns true if every build can decompress the codec (not optional)
+bool ZipCodec_IsPortable(ObjectInfo::ZipAlgo algo);
+ObjectInfo::ZipAlgo ZipCodec_Default();
+
+#endif /* __ZIPCODEC_H__ */
+
@@ -0,0 +1,105 @@
+cd $TEMP_DIR
+
+$ORI_EXE newfs $TEST_FS
+$ORIFS_EXE $TEST_FS $TEST_FS
+sleep 1
+cd $TEST_FS
+seq 1 50000 > shared.txt
+echo "Hello World" > hello.txt
+$ORI_EXE snapshot
+cd ..
+$UMOUNT $TEST_FS
+
+$ORI_EXE replicate $TEST_FS $TEST_FS2
+
+# Both sides commit on their own from the shared history.  The upstream
+# file shares chunks with the common one, the two sides share nothing new.
+$ORIFS_EXE $TEST_FS $TEST_FS
+sleep 1
+cd $TEST_FS
+seq 1 60000 > upstream.txt
+echo "upstream" >> hello.txt
+UPSTREAM=`$ORI_EXE snapshot | awk '/^Committed/ { print $2 }'`
+test -n "$UPSTREAM"
+cd ..
+$UMOUNT $TEST_FS
+
+$ORIFS_EXE $TEST_FS2 $TEST_FS2
+sleep 1
+cd $TEST_FS2
+seq 1 70000 | sed 's/^/local /' > local.txt
+echo "local" >> hello.txt
+$ORI_EXE snapshot
+cd ..
+$UMOUNT $TEST_FS2
+
+# Objects upstream has that the replica lacks
+cd ~/.ori/$TEST_FS.ori
+$ORIDBG_EXE listobj | sort > $TEMP_DIR/upstream.lst
+cd ~/.ori/$TEST_FS2.ori
+$ORIDBG_EXE listobj | sort > $TEMP_DIR/local.lst
+MISSING=`comm -23 $TEMP_DIR/upstream.lst $TEMP_DIR/local.lst | wc -l`
+test $MISSING -gt 0
+BEFORE=`$ORIDBG_EXE verify -q | awk '/^Verified/ { print $2 }'`
+
+cd $TEMP_DIR
+$ORI_HTTPD $TEST_FS &
+sleep 1
+
+$ORIFS_EXE $TEST_FS2 $TEST_FS2
+sleep 1
+cd $TEST_FS2
+$ORI_EXE pull http://127.0.0.1:8080/
+cd ..
+$UMOUNT $TEST_FS2
+
+kill %1
+
+# Every object upstream is present and exactly the missing ones were sent
+cd ~/.ori/$TEST_FS2.ori
+$ORIDBG_EXE listobj | sort > $TEMP_DIR/local.lst
+test `comm -23 $TEMP_DIR/upstream.lst $TEMP_DIR/local.lst | wc -l` -eq 0
+AFTER=`$ORIDBG_EXE verify -q | awk '/^Verified/ { print $2 }'`
+test `expr $AFTER - $BEFORE` -eq $MISSING
+
+# The replica purges the pulled upstream commit, dropping upstream.txt,
+# and upstream builds on that commit.  The purged commit is no have, so the
+# next pull brings back what the new commit shares with it.
+$ORIDBG_EXE purgesnapshot $UPSTREAM
+$ORIDBG_EXE gc
+
+cd $TEMP_DIR
+$ORIFS_EXE $TEST_FS $TEST_FS
+sleep 1
+cd $TEST_FS
+seq 1 80000 > second.txt
+$ORI_EXE snapshot
+cd ..
+$UMOUNT $TEST_FS
+
+cd ~/.ori/$TEST_FS.ori
+$ORIDBG_EXE listobj | sort > $TEMP_DIR/upstream.lst
+
+cd $TEMP_DIR
+$ORI_HTTPD $TEST_FS &
+HTTPD=$!
+sleep 1
+
+$ORIFS_EXE $TEST_FS2 $TEST_FS2
+sleep 1
+cd $TEST_FS2
+$ORI_EXE pull http://127.0.0.1:8080/
+cd ..
+$UMOUNT $TEST_FS2
+
+kill $HTTPD
+
+cd ~/.ori/$TEST_FS2.ori
+$ORIDBG_EXE listobj | sort > $TEMP_DIR/local.lst
+test `comm -23 $TEMP_DIR/upstream.lst $TEMP_DIR/local.lst | wc -l` -eq 0
+$ORIDBG_EXE verify
+
+cd $TEMP_DIR
+rm $TEMP_DIR/upstream.lst $TEMP_DIR/local.lst
+$ORI_EXE removefs $TEST_FS
+$ORI_EXE removefs $TEST_FS2
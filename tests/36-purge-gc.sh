@@ -0,0 +1,33 @@
+cd $TEMP_DIR
+
+$ORI_EXE newfs $TEST_FS
+$ORIFS_EXE $TEST_FS $TEST_FS
+
+sleep 1
+
+# Only the first snapshot refers to the data
+cd $TEST_FS
+echo "Hello World" > hello.txt
+dd if=/dev/urandom of=data.bin bs=1024 count=8192
+FIRST=`$ORI_EXE snapshot first | awk '/^Committed/ { print $2 }'`
+rm data.bin
+$ORI_EXE snapshot second
+cd ..
+
+$UMOUNT $TEST_FS
+
+cd ~/.ori/$TEST_FS.ori
+$ORIDBG_EXE purgesnapshot $FIRST
+BEFORE=`du -sk objs | cut -f1`
+$ORIDBG_EXE gc
+AFTER=`du -sk objs | cut -f1`
+
+# Space was reclaimed and no purged object is left pending
+test $AFTER -lt $BEFORE
+test ! -f purged || test `wc -c < purged` -eq 8
+
+$ORIDBG_EXE verify
+$ORIDBG_EXE stats
+
+cd $TEMP_DIR
+$ORI_EXE removefs $TEST_FS
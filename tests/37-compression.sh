@@ -0,0 +1,33 @@
+cd $TEMP_DIR
+
+$ORI_EXE newfs --compression=lzma $TEST_FS
+$ORIFS_EXE $TEST_FS $TEST_FS
+
+sleep 1
+
+cd $TEST_FS
+seq 1 200000 > numbers.txt
+$ORI_EXE snapshot first
+cd ..
+
+$UMOUNT $TEST_FS
+
+cd ~/.ori/$TEST_FS.ori
+test `cat compression` = lzma
+LZMA=`du -sk objs | cut -f1`
+
+# Recompressing the existing packs without a codec makes them grow
+$ORIDBG_EXE gc --compression=none
+test `cat compression` = none
+NONE=`du -sk objs | cut -f1`
+test $NONE -gt $LZMA
+$ORIDBG_EXE verify
+
+# And switching back shrinks them again
+$ORIDBG_EXE gc --compression=lzma
+test `cat compression` = lzma
+test `du -sk objs | cut -f1` -lt $NONE
+$ORIDBG_EXE verify
+
+cd $TEMP_DIR
+$ORI_EXE removefs $TEST_FS
@@ -0,0 +1,37 @@
+cd $TEMP_DIR
+
+$ORI_EXE newfs $TEST_FS
+$ORIFS_EXE $TEST_FS $TEST_FS
+
+sleep 1
+
+# Each snapshot changes a single line so the file is stored as a delta
+cd $TEST_FS
+seq 1 20000 > numbers.txt
+cp numbers.txt $TEMP_DIR/numbers.0
+$ORI_EXE snapshot v0
+for i in 1 2 3 4 5; do
+    sed "$((i * 1000))s/.*/changed $i/" numbers.txt > $TEMP_DIR/numbers.$i
+    cp $TEMP_DIR/numbers.$i numbers.txt
+    $ORI_EXE snapshot v$i
+done
+cd ..
+
+$UMOUNT $TEST_FS
+
+cd ~/.ori/$TEST_FS.ori
+test `$ORIDBG_EXE stats | awk '/^Deltas/ { print $2 }'` -gt 0
+$ORIDBG_EXE verify
+
+# Every version reads back byte for byte
+cd $TEMP_DIR
+$ORIFS_EXE $TEST_FS $TEST_FS
+sleep 1
+for i in 0 1 2 3 4 5; do
+    cmp $TEMP_DIR/numbers.$i $TEST_FS/.snapshot/v$i/numbers.txt
+done
+cmp $TEMP_DIR/numbers.5 $TEST_FS/numbers.txt
+$UMOUNT $TEST_FS
+
+rm $TEMP_DIR/numbers.*
+$ORI_EXE removefs $TEST_FS
@@ -0,0 +1,67 @@
+cd $TEMP_DIR
+
+$ORI_EXE newfs --compression=lzma $TEST_FS
+$ORIFS_EXE $TEST_FS $TEST_FS
+sleep 1
+cd $TEST_FS
+seq 1 50000 > first.txt
+$ORI_EXE snapshot first
+cd ..
+$UMOUNT $TEST_FS
+
+# Without a cursor everything is listed
+cd ~/.ori/$TEST_FS.ori
+$ORIDBG_EXE listsince > $TEMP_DIR/since.out
+grep '^Full listing' $TEMP_DIR/since.out
+CURSOR=`awk '/^Cursor/ { print $2 }' $TEMP_DIR/since.out`
+$ORIDBG_EXE listobj | awk '{ print $1 }' | sort > $TEMP_DIR/before.lst
+
+cd $TEMP_DIR
+$ORIFS_EXE $TEST_FS $TEST_FS
+sleep 1
+cd $TEST_FS
+seq 1 60000 | sed 's/^/second /' > second.txt
+$ORI_EXE snapshot second
+cd ..
+$UMOUNT $TEST_FS
+
+# A valid cursor lists exactly the objects added after it
+cd ~/.ori/$TEST_FS.ori
+$ORIDBG_EXE listobj | awk '{ print $1 }' | sort > $TEMP_DIR/after.lst
+comm -13 $TEMP_DIR/before.lst $TEMP_DIR/after.lst > $TEMP_DIR/added.lst
+test `wc -l < $TEMP_DIR/added.lst` -gt 0
+$ORIDBG_EXE listsince $CURSOR > $TEMP_DIR/since.out
+grep '^Incremental listing' $TEMP_DIR/since.out
+grep '#' $TEMP_DIR/since.out | awk '{ print $1 }' | sort | \
+    cmp - $TEMP_DIR/added.lst
+CURSOR=`awk '/^Cursor/ { print $2 }' $TEMP_DIR/since.out`
+$ORIDBG_EXE listsince $CURSOR > $TEMP_DIR/since.out
+grep '^Incremental listing' $TEMP_DIR/since.out
+test `grep -c '#' $TEMP_DIR/since.out` -eq 0
+
+# A cursor taken before a repack stays valid, moved objects are listed
+# again
+$ORIDBG_EXE gc --compression=none
+$ORIDBG_EXE listsince $CURSOR > $TEMP_DIR/since.out
+grep '^Incremental listing' $TEMP_DIR/since.out
+grep '#' $TEMP_DIR/since.out | awk '{ print $1 }' | sort | \
+    cmp - $TEMP_DIR/after.lst
+CURSOR=`awk '/^Cursor/ { print $2 }' $TEMP_DIR/since.out`
+
+# Rebuilding the index starts a new journal generation, older cursors get
+# a full listing and a cursor into the new one
+$ORIDBG_EXE rebuildindex
+$ORIDBG_EXE listsince $CURSOR > $TEMP_DIR/since.out
+grep '^Full listing' $TEMP_DIR/since.out
+grep '#' $TEMP_DIR/since.out | awk '{ print $1 }' | sort | \
+    cmp - $TEMP_DIR/after.lst
+CURSOR=`awk '/^Cursor/ { print $2 }' $TEMP_DIR/since.out`
+$ORIDBG_EXE listsince $CURSOR > $TEMP_DIR/since.out
+grep '^Incremental listing' $TEMP_DIR/since.out
+test `grep -c '#' $TEMP_DIR/since.out` -eq 0
+$ORIDBG_EXE verify
+
+cd $TEMP_DIR
+rm $TEMP_DIR/since.out $TEMP_DIR/before.lst $TEMP_DIR/after.lst
+rm $TEMP_DIR/added.lst
+$ORI_EXE removefs $TEST_FS
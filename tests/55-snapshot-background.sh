@@ -0,0 +1,54 @@
+cd $TEMP_DIR
+
+$ORI_EXE newfs $TEST_FS
+$ORIFS_EXE $TEST_FS $TEST_FS
+
+sleep 1
+
+mkdir -p $TEMP_DIR/expected
+cd $TEST_FS
+for i in 1 2 3 4 5 6 7 8; do
+    seq $i 100000 > file$i.txt
+    cp file$i.txt $TEMP_DIR/expected/
+done
+
+# Keep appending to a log while the snapshot is taken and stored, it
+# exists before the freeze so the snapshot must hold a prefix of it
+echo "line 0" > log.txt
+(for i in `seq 1 5000`; do echo "line $i" >> log.txt; done) &
+WRITER=$!
+
+TICKET=`$ORI_EXE snapshot -b bg | awk '/^Snapshot queued as/ { print $4 }'`
+test -n "$TICKET"
+
+# Changes made after the freeze must not end up in the snapshot
+for i in 1 2 3 4 5 6 7 8; do
+    echo "after the freeze" >> file$i.txt
+done
+rm file1.txt
+echo "new" > file9.txt
+
+$ORI_EXE snapshot -w $TICKET | grep '^Committed'
+wait $WRITER
+cd ..
+
+for i in 1 2 3 4 5 6 7 8; do
+    cmp $TEMP_DIR/expected/file$i.txt $TEST_FS/.snapshot/bg/file$i.txt
+done
+test ! -e $TEST_FS/.snapshot/bg/file9.txt
+
+# The frozen log is a prefix of the one the writer finished
+SNAPLOG=$TEST_FS/.snapshot/bg/log.txt
+test -f $SNAPLOG
+test "`head -n 1 $SNAPLOG`" = "line 0"
+test `wc -l < $TEST_FS/log.txt` -eq 5001
+cmp -n `wc -c < $SNAPLOG` $SNAPLOG $TEST_FS/log.txt
+
+$UMOUNT $TEST_FS
+
+cd ~/.ori/$TEST_FS.ori
+$ORIDBG_EXE verify
+
+cd $TEMP_DIR
+rm -rf $TEMP_DIR/expected
+$ORI_EXE removefs $TEST_FS
@@ -0,0 +1,48 @@
+cd $TEMP_DIR
+
+$ORI_EXE newfs $TEST_FS
+$ORIFS_EXE $TEST_FS $TEST_FS
+
+sleep 1
+
+cd $TEST_FS
+mkdir -p a/sub b
+echo one > a/file.txt
+echo sub > a/sub/file.txt
+$ORI_EXE snapshot s1
+
+# Changes below a renamed directory reach later snapshots
+mv a b/a
+$ORI_EXE snapshot s2
+echo two > b/a/file.txt
+$ORI_EXE snapshot s3
+cd ..
+
+test "`cat $TEST_FS/.snapshot/s1/a/file.txt`" = one
+test ! -e $TEST_FS/.snapshot/s2/a
+test "`cat $TEST_FS/.snapshot/s2/b/a/file.txt`" = one
+test "`cat $TEST_FS/.snapshot/s3/b/a/file.txt`" = two
+test "`cat $TEST_FS/.snapshot/s3/b/a/sub/file.txt`" = sub
+
+$UMOUNT $TEST_FS
+
+# Renaming a directory that was never loaded
+$ORIFS_EXE $TEST_FS $TEST_FS
+sleep 1
+cd $TEST_FS
+mv b c
+echo three >> c/a/sub/file.txt
+$ORI_EXE snapshot s4
+cd ..
+
+test ! -e $TEST_FS/.snapshot/s4/b
+test "`cat $TEST_FS/.snapshot/s4/c/a/file.txt`" = two
+printf "sub\nthree\n" | cmp - $TEST_FS/.snapshot/s4/c/a/sub/file.txt
+
+$UMOUNT $TEST_FS
+
+cd ~/.ori/$TEST_FS.ori
+$ORIDBG_EXE verify
+
+cd $TEMP_DIR
+$ORI_EXE removefs $TEST_FS
@@ -0,0 +1,44 @@
+cd $TEMP_DIR
+
+$ORI_EXE newfs $TEST_FS
+$ORIFS_EXE $TEST_FS $TEST_FS
+
+sleep 1
+
+mkdir -p $TEMP_DIR/expected
+cd $TEST_FS
+dd if=/dev/urandom of=big.bin bs=1M count=16
+$ORI_EXE snapshot base
+
+# The committed large file is read through the stored blob, so writing to
+# it after the freeze must leave the snapshot with the frozen contents
+echo "before the freeze" | dd of=big.bin bs=1 seek=4096 conv=notrunc
+cp big.bin $TEMP_DIR/expected/frozen.bin
+
+TICKET=`$ORI_EXE snapshot -b bg | awk '/^Snapshot queued as/ { print $4 }'`
+test -n "$TICKET"
+
+echo "after the freeze" | dd of=big.bin bs=1 seek=8388608 conv=notrunc
+echo "appended" >> big.bin
+cp big.bin $TEMP_DIR/expected/current.bin
+
+$ORI_EXE snapshot -w $TICKET | grep '^Committed'
+cd ..
+
+cmp $TEMP_DIR/expected/frozen.bin $TEST_FS/.snapshot/bg/big.bin
+cmp $TEMP_DIR/expected/current.bin $TEST_FS/big.bin
+
+# A further snapshot picks up only the later writes
+cd $TEST_FS
+$ORI_EXE snapshot after
+cd ..
+cmp $TEMP_DIR/expected/current.bin $TEST_FS/.snapshot/after/big.bin
+
+$UMOUNT $TEST_FS
+
+cd ~/.ori/$TEST_FS.ori
+$ORIDBG_EXE verify
+
+cd $TEMP_DIR
+rm -rf $TEMP_DIR/expected
+$ORI_EXE removefs $TEST_FS